@@ -23,12 +23,20 @@
 #endif
 
 #include <map>
+#include <vector>
 
 #include "interface.h"
 #include "classentry.h"
 
 namespace apf {
 
+/**
+ * 类加载函数类型
+ * @see Class::SetClassLoader()
+ */
+// load the real class of a stub class, return whether loaded
+typedef bool (*ClassLoaderFunc)(const APFClassID&);
+
 /**
  * @brief APF 类管理
  * 类的注册、创建、销毁等
@@ -47,6 +55,36 @@ public:
     // ClassEntry will replace old ClassEntry with same classid when replace is true
     static bool RegisterClass(const ClassEntry& class_entry, bool replace=true);
 
+    /**
+     * 批量注册类信息
+     * @param[in] class_tables 类信息数组列表(每个数组以ClassEntry()结尾)
+     * @param[in] replace 是否替换已注册的的类（相同的类ID)
+     * @return 注册成功的类数量
+     * @note 只加锁一次，用于同时注册多个模块的类
+     */
+    // register class tables in one registry update
+    // every table is a array end with ClassEntry()
+    static int RegisterClasses(const std::vector<const ClassEntry*>& class_tables, bool replace=true);
+
+    /**
+     * 注册占位类信息
+     * @param[in] class_id 类ID
+     * @return 注册是否成功（已注册的类不会被替换)
+     * @note 占位类创建对象时将调用类加载函数加载真正的类
+     * @see SetClassLoader()
+     */
+    // register a stub class, the real class is loaded on first CreateObject()
+    // a registered class will not be replaced by the stub
+    static bool RegisterStubClass(const APFClassID& class_id);
+
+    /**
+     * 设置类加载函数
+     * @param[in] loader 类加载函数
+     * @note 创建占位类的对象时调用，加载函数应注册真正的类
+     */
+    // set the loader called by CreateObject() for stub classes
+    static void SetClassLoader(ClassLoaderFunc loader);
+
     /**
      * 注销类信息
      * @param[in] class_id 类ID
@@ -92,11 +130,35 @@ public:
      */
     // have registered the class id?
     static bool HasClass(const APFClassID& class_id);
+
+    /**
+     * 类是否已加载(已注册且不是占位类)
+     * @param[in] class_id 类ID
+     * @return 是否可以直接创建对象
+     */
+    // is the class registered and not a stub?
+    static bool IsClassLoaded(const APFClassID& class_id);
+
+    /**
+     * 获取静态链接模块的类数量
+     * @return 类数量
+     * @see APF_STATIC_PLUGINS
+     */
+    // number of classes linked statically (APF_STATIC_PLUGINS)
+    static int StaticClassCount();
 private:
     Class();
     virtual ~Class();
+    // find a statically linked class, call with the global mutex locked
+    // registered classes take precedence over static ones
+    static const StaticClassEntry* FindStaticClass(const APFClassID& class_id);
     // class entry map
     static std::map<const APFClassID, ClassEntry> class_map_;
+    // stub class loader
+    static ClassLoaderFunc class_loader_;
+    // static classes sorted by class id, built on first lookup
+    static std::vector<const StaticClassEntry*> static_classes_;
+    static bool static_classes_sorted_;
 };
 
 } // namespace
@@ -18,6 +18,7 @@
 #ifndef CLASSENTRY_H
 #define CLASSENTRY_H
 
+#include <stddef.h>
 #include <string>
 
 /** 类ID类型 */
@@ -37,8 +38,54 @@ typedef void (*ObjectDestroyerFunc)(void*);
 // query interface
 typedef bool (*QueryInterfaceFunc)(APFInterfaceID);
 
+/** @name 模块索引段 @{ */
+// module index sections, read by PluginManager::ReadModuleIndex() without loading the module
+/** 模块信息段: {APF_MODULE_MAGIC, 版本, 最低支持版本, 最高支持版本} */
+#define APF_MODULE_SECTION      "apf_module"
+/** 类映射段: APF_CLASSMAP_ENTRY中的类ID表达式 */
+#define APF_CLASSES_SECTION     "apf_classes"
+/** 类ID声明段: "类ID常量名=类ID" */
+#define APF_CLASSID_SECTION     "apf_clsid"
+/** 依赖段: APF_REQUIRE_CLASS中的类ID表达式 */
+#define APF_REQUIRES_SECTION    "apf_requires"
+/** 模块信息段标识 */
+#define APF_MODULE_MAGIC        0x41504631 // "APF1"
+/** 静态链接模块的类信息段(APF_STATIC_PLUGINS) */
+// class tables of statically linked modules, see APF_STATIC_PLUGINS
+#define APF_STATIC_CLASSES_SECTION "apf_static_classes"
+
+#if defined(__GNUC__) && !defined(WIN32)
+/** 将常量放入指定段 */
+#define APF_SECTION(name) __attribute__((section(name), used))
+/** 在类映射段中记录类ID表达式, 返回class_name */
+#define APF_CLASS_RECORD(clsid, class_name) \
+    ({ static const char apf_class_record[] APF_SECTION(APF_CLASSES_SECTION) = #clsid; class_name; })
+/** 在类ID声明段中记录类ID常量 */
+#define APF_CLASSID_RECORD(clsid, str) \
+    static const char clsid##_apf_record[] APF_SECTION(APF_CLASSID_SECTION) = #clsid "=" str;
+/** 在依赖段中记录类ID表达式, 返回clsid */
+#define APF_REQUIRE_RECORD(clsid) \
+    ({ static const char apf_require_record[] APF_SECTION(APF_REQUIRES_SECTION) = #clsid; clsid; })
+#else
+#define APF_CLASS_RECORD(clsid, class_name) class_name
+#define APF_CLASSID_RECORD(clsid, str)
+#define APF_REQUIRE_RECORD(clsid) clsid
+#endif
+/** @} */
+
 namespace apf {
 
+class ObjectCounter;
+
+/** 获取类ID字符串(APFClassID或字符串常量) */
+// class id as a C string, for APFClassID and string constants
+inline const char* APFClassIDName(const APFClassID& clsid) {
+    return clsid.c_str();
+}
+inline const char* APFClassIDName(const char* clsid) {
+    return clsid;
+}
+
 #if defined(WIN32) || defined(WINCE)
 #pragma pack(push, 8)
 #endif
@@ -57,6 +104,7 @@ public:
      * @param[in] create_object 创建对象函数
      * @param[in] destroy_object 销毁对象函数
      * @param[in] query_interface 查询接口函数
+     * @param[in] object_size 对象大小(字节)
      */
     // Used by APF_CLASSMAP_ENTRY, APF_CLASSMAP_ENTRY_SINGLETEN
     ClassEntry(
@@ -64,12 +112,15 @@ public:
         const APFClassID&       clsid,
         ObjectCreatorFunc       create_object,
         ObjectDestroyerFunc     destroy_object,
-        QueryInterfaceFunc      query_interface)
+        QueryInterfaceFunc      query_interface,
+        size_t                  object_size=0)
 
         : class_name(class_name), clsid(clsid)
         , create_object(create_object)
         , destroy_object(destroy_object)
-        , query_interface(query_interface) {
+        , query_interface(query_interface)
+        , object_size(object_size)
+        , counter(NULL) {
     }
 
     /**
@@ -83,6 +134,8 @@ public:
         this->create_object = entry.create_object;
         this->destroy_object = entry.destroy_object;
         this->query_interface = entry.query_interface;
+        this->object_size = entry.object_size;
+        this->counter = entry.counter;
     }
 
     /**
@@ -93,7 +146,9 @@ public:
         : class_name(""), clsid("")
         , create_object(NULL)
         , destroy_object(NULL)
-        , query_interface(NULL) {
+        , query_interface(NULL)
+        , object_size(0)
+        , counter(NULL) {
     }
 
     /**
@@ -123,6 +178,13 @@ public:
     /** 查询接口函数 */
     // query interface function
     QueryInterfaceFunc   query_interface;
+    /** 对象大小(单例类为0) */
+    // object size in bytes, 0 for single instance classes
+    size_t               object_size;
+    /** 对象计数(内部模块为NULL) */
+    // object counter set by PluginManager, NULL for internal modules
+    // see PluginManager::GetModuleStats(), PluginManager::Reload()
+    ObjectCounter*       counter;
 
 #if defined(WIN32) || defined(WINCE)
 };
@@ -131,6 +193,35 @@ public:
 }__attribute__ ((aligned(8)));
 #endif
 
+/**
+ * @brief 静态链接模块的类信息(常量初始化)
+ * APF_STATIC_PLUGINS模式下APF_CLASSMAP_ENTRY生成的类信息，
+ * 所有模块的类信息在链接时合并到APF_STATIC_CLASSES_SECTION段中
+ * @see Class::CreateObject()
+ */
+// constant initialized class entry of a statically linked module (APF_STATIC_PLUGINS)
+// the linker merges the entries of all modules into APF_STATIC_CLASSES_SECTION
+struct StaticClassEntry {
+    /** 实现类名 */
+    // implement class name
+    const char*          class_name;
+    /** 类ID */
+    // class id
+    const char*          clsid;
+    /** 创建对象函数 */
+    // class factory function
+    ObjectCreatorFunc    create_object;
+    /** 销毁对象函数 */
+    // object destroyer function
+    ObjectDestroyerFunc  destroy_object;
+    /** 查询接口函数 */
+    // query interface function
+    QueryInterfaceFunc   query_interface;
+    /** 对象大小(单例类为0) */
+    // object size in bytes, 0 for single instance classes
+    size_t               object_size;
+};
+
 } // namespace
 
 #endif // CLASSENTRY_H
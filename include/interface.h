@@ -21,13 +21,19 @@
 #include <string>
 #include "classentry.h"
 #include "class.h"
+#include "objectcounter.h"
 
 /** 声明一个类ID常量
  * @param[in] clsid 常量名称
  * @param[in] str  类ID值
  */
 // the macro to define classid
-#define APF_DECLARE_CLASSID(clsid, str)  static const APFClassID clsid(str);
+// a char array in APF_STATIC_PLUGINS mode, usable in constant initialized class tables
+#ifdef APF_STATIC_PLUGINS
+#define APF_DECLARE_CLASSID(clsid, str)  static const char clsid[] = str; APF_CLASSID_RECORD(clsid, str)
+#else
+#define APF_DECLARE_CLASSID(clsid, str)  static const APFClassID clsid(str); APF_CLASSID_RECORD(clsid, str)
+#endif
 
 
 /**
@@ -315,6 +321,9 @@ public:
             (*reference_count_)--;
             if (0 == *reference_count_) {
                 class_info_.destroy_object(interface_);
+                if (class_info_.counter) {
+                    class_info_.counter->Destroyed();
+                }
                 interface_ = NULL;
                 delete reference_count_;
                 reference_count_ = NULL;
@@ -18,6 +18,7 @@
 #ifndef MODULE_H
 #define MODULE_H
 
+#include <time.h>
 #include "classentry.h"
 #include "object.h"
 #include "singleobject.h"
@@ -34,8 +35,12 @@ namespace apf {
 /** 模块导出函数名称 */
 #define APF_GET_MODULE_INFO_NAME "APFGetModuleInfo"
 #define APF_SET_OBJECT_CREATOR_NAME "APFSetObjectCreator"
+#define APF_GET_MODULE_CTOR_BEGIN_NAME "APFGetModuleCtorBegin"
+#define APF_GET_MODULE_REQUIRES_NAME "APFGetModuleRequires"
 typedef unsigned long (*APF_GET_MODULE_INFO)(unsigned long, apf::ClassEntry**);
 typedef void (*APF_SET_OBJECT_CREATOR)(apf::APFCreateObjectFunc);
+typedef unsigned long long (*APF_GET_MODULE_CTOR_BEGIN)();
+typedef const char* const* (*APF_GET_MODULE_REQUIRES)();
 
 // Module macros defines ////////////////////////////////////////////////////
 // Define macros of class factory registry, such as APF_BEGIN_DEFINE_MODULE
@@ -54,6 +59,33 @@ typedef void (*APF_SET_OBJECT_CREATOR)(apf::APFCreateObjectFunc);
 // max module version
 #define APF_MAX_VERSION 0x0FFFFFFF
 
+// Module info record in APF_MODULE_SECTION, see PluginManager::ReadModuleIndex()
+#if defined(__GNUC__) && !defined(WIN32)
+#define APF_MODULE_RECORD(module_version, min_support_version, max_support_version) \
+    static const unsigned int apf_module_record[4] APF_SECTION(APF_MODULE_SECTION) = {\
+        APF_MODULE_MAGIC, (unsigned int)(module_version),\
+        (unsigned int)(min_support_version), (unsigned int)(max_support_version)};
+#else
+#define APF_MODULE_RECORD(module_version, min_support_version, max_support_version)
+#endif
+
+// Time (clock_tick_us()) the static constructors of the module started,
+// the first constructor of the module records it. See PluginManager::EnableProfiler()
+#if defined(__GNUC__) && defined(__linux__)
+#define APF_MODULE_CTOR_RECORD() \
+static unsigned long long apf_module_ctor_begin = 0;\
+__attribute__((constructor(101))) static void APFModuleCtorBegin() {\
+    struct timespec ts;\
+    clock_gettime(CLOCK_MONOTONIC, &ts);\
+    apf_module_ctor_begin = (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;\
+}\
+APF_API unsigned long long APFGetModuleCtorBegin() {\
+    return apf_module_ctor_begin;\
+}
+#else
+#define APF_MODULE_CTOR_RECORD()
+#endif
+
 /**
  * 开始模块的定义
  * @see APF_END_MODULE()
@@ -80,6 +112,7 @@ APF_API unsigned long APFGetModuleInfo(unsigned long app_version, apf::ClassEntr
     const unsigned long version = module_version;\
     const unsigned long min_support = min_support_version;\
     const unsigned long max_support = max_support_version;\
+    APF_MODULE_RECORD(module_version, min_support_version, max_support_version)\
     static apf::ClassEntry classes[] = {\
 
 /**
@@ -96,6 +129,46 @@ APF_API unsigned long APFGetModuleInfo(unsigned long app_version, apf::ClassEntr
 APF_API void APFSetObjectCreator(apf::APFCreateObjectFunc objcreator) {\
     apf::Module::Instance()->object_creator = objcreator;\
 }\
+APF_MODULE_CTOR_RECORD()\
+
+/**
+ * 开始模块依赖的定义(可选)
+ * PluginManager::LoadAll()在提供这些类的模块加载之后再加载本模块，
+ * PluginManager::UnLoadAll()在卸载这些模块之前卸载本模块
+ * @see APF_REQUIRE_CLASS(clsid)
+ * @see APF_END_MODULE_REQUIRES()
+ *
+ * @example 模块依赖的定义示例
+ * @code
+ APF_BEGIN_MODULE_REQUIRES()
+     // 依赖日志类
+     APF_REQUIRE_CLASS(CLSID_Log)
+ APF_END_MODULE_REQUIRES()
+ * @endcode
+ */
+// Begin group of required classes (optional).
+#define APF_BEGIN_MODULE_REQUIRES() \
+APF_API const char* const* APFGetModuleRequires() {\
+    static const char* const required_classes[] = {\
+
+/**
+ * 定义模块依赖的类
+ * @param[in] clsid 类ID
+ */
+// Require a class provided by another module.
+#define APF_REQUIRE_CLASS(clsid) \
+        apf::APFClassIDName(APF_REQUIRE_RECORD(clsid)),
+
+/**
+ * 结束模块依赖的定义
+ * @see APF_BEGIN_MODULE_REQUIRES()
+ */
+// End group of required classes.
+#define APF_END_MODULE_REQUIRES() \
+        NULL \
+    };\
+    return required_classes;\
+}\
 
 /**
  * 加载内部所有模块
@@ -157,10 +230,10 @@ int APFLoadInternalModules() {\
  */
 // Register a regular class.
 #define APF_CLASSMAP_ENTRY(clsid, cls)      \
-    apf::ClassEntry("Object<" #cls ">", clsid,  \
+    apf::ClassEntry(APF_CLASS_RECORD(clsid, "Object<" #cls ">"), clsid,  \
         reinterpret_cast<ObjectCreatorFunc>(&apf::Object<cls>::CreateObject), \
         reinterpret_cast<ObjectDestroyerFunc>(&apf::Object<cls>::DestroyObject),  \
-        reinterpret_cast<QueryInterfaceFunc>(&apf::Object<cls>::QueryInterface)),
+        reinterpret_cast<QueryInterfaceFunc>(&apf::Object<cls>::QueryInterface), sizeof(cls)),
 
 /**
  * 定义一个类与ID的映射（单例类)
@@ -169,11 +242,73 @@ int APFLoadInternalModules() {\
  */
 // Register a single instance class.
 #define APF_CLASSMAP_ENTRY_SINGLETEN(clsid, cls)    \
-    apf::ClassEntry("SingleObject<" #cls ">", clsid,  \
+    apf::ClassEntry(APF_CLASS_RECORD(clsid, "SingleObject<" #cls ">"), clsid,  \
         reinterpret_cast<ObjectCreatorFunc>(&apf::SingleObject<cls>::CreateObject),    \
         reinterpret_cast<ObjectDestroyerFunc>(&apf::SingleObject<cls>::DestroyObject), \
         reinterpret_cast<QueryInterfaceFunc>(&apf::SingleObject<cls>::QueryInterface)),
 
+/**
+ * @name 静态链接模式(APF_STATIC_PLUGINS)
+ * 定义APF_STATIC_PLUGINS后编译模块源文件，可将模块直接链接到程序中:
+ * 类信息为常量初始化的StaticClassEntry数组，链接时合并到APF_STATIC_CLASSES_SECTION段，
+ * 启动时不需要注册，创建对象时直接查找(首次查找时排序)。
+ * 模块与程序需使用相同的APF_STATIC_PLUGINS定义编译，模块目标文件需直接链接
+ * (静态库需使用--whole-archive)，开启LTO时可跨模块内联。
+ * @note 需要GCC/Clang，类ID需为字符串常量或APF_DECLARE_CLASSID声明的常量
+ * @{
+ */
+// Static plugin mode: build the module sources with APF_STATIC_PLUGINS and link them into the host.
+// Class tables are constant initialized and merged by the linker into APF_STATIC_CLASSES_SECTION,
+// nothing is registered at startup. Link module objects directly (--whole-archive for archives).
+#ifdef APF_STATIC_PLUGINS
+#if !defined(__GNUC__) || defined(WIN32)
+#error "APF_STATIC_PLUGINS needs GCC or Clang on ELF platforms"
+#endif
+
+// entries of all modules must be contiguous, keep the compiler from padding the arrays
+#define APF_STATIC_CLASSES APF_SECTION(APF_STATIC_CLASSES_SECTION) __attribute__((aligned(sizeof(void*))))
+
+#undef APF_BEGIN_MODULE
+#define APF_BEGIN_MODULE(module_version, min_support_version, max_support_version)  \
+static const apf::StaticClassEntry apf_static_classes[] APF_STATIC_CLASSES = {\
+
+#undef APF_END_MODULE
+#define APF_END_MODULE() \
+};\
+
+#undef APF_BEGIN_INTERNAL_MODULE
+#define APF_BEGIN_INTERNAL_MODULE()  \
+static const apf::StaticClassEntry apf_static_classes[] APF_STATIC_CLASSES = {\
+
+#undef APF_END_INTERNAL_MODULE
+#define APF_END_INTERNAL_MODULE() \
+};\
+int APFLoadInternalModules() {\
+    return sizeof(apf_static_classes) / sizeof(apf_static_classes[0]);\
+}\
+
+// modules are linked in, their dependencies are not exported
+#undef APF_BEGIN_MODULE_REQUIRES
+#define APF_BEGIN_MODULE_REQUIRES() \
+static __attribute__((unused)) const char* const* APFGetModuleRequires() {\
+    static const char* const required_classes[] = {\
+
+#undef APF_CLASSMAP_ENTRY
+#define APF_CLASSMAP_ENTRY(clsid, cls)      \
+    { "Object<" #cls ">", clsid,  \
+        reinterpret_cast<ObjectCreatorFunc>(&apf::Object<cls>::CreateObject), \
+        reinterpret_cast<ObjectDestroyerFunc>(&apf::Object<cls>::DestroyObject),  \
+        reinterpret_cast<QueryInterfaceFunc>(&apf::Object<cls>::QueryInterface), sizeof(cls) },
+
+#undef APF_CLASSMAP_ENTRY_SINGLETEN
+#define APF_CLASSMAP_ENTRY_SINGLETEN(clsid, cls)    \
+    { "SingleObject<" #cls ">", clsid,  \
+        reinterpret_cast<ObjectCreatorFunc>(&apf::SingleObject<cls>::CreateObject),    \
+        reinterpret_cast<ObjectDestroyerFunc>(&apf::SingleObject<cls>::DestroyObject), \
+        reinterpret_cast<QueryInterfaceFunc>(&apf::SingleObject<cls>::QueryInterface), 0 },
+#endif
+/** @} */
+
 /**
  * @brief 模块类
  */
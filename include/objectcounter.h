@@ -0,0 +1,110 @@
+/*!**************************************************************************
+ * @file
+ * @brief 对象计数
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef OBJECTCOUNTER_H
+#define OBJECTCOUNTER_H
+
+#include <string.h>
+#include "oscore.h"
+
+namespace apf {
+
+/** 计数分片数量(2的幂) */
+// number of counter stripes, power of 2
+#define APF_COUNTER_STRIPES 16
+
+/**
+ * @brief 类的对象计数(创建次数、销毁次数)
+ * 每个线程固定使用一个计数分片，读取时合并所有分片，
+ * 创建/销毁对象时各线程之间不会竞争同一缓存行
+ * @see PluginManager::GetModuleStats()
+ */
+// object counter of a class
+// every thread updates its own cache line sized stripe, reads merge all stripes
+class ObjectCounter {
+public:
+    ObjectCounter() {
+        memset(stripes_, 0, sizeof(stripes_));
+    }
+
+    /**
+     * 对象已创建
+     */
+    // an object was created
+    inline void Created() {
+        atomic_inc(&stripes_[StripeIndex()].creations);
+    }
+
+    /**
+     * 对象已销毁
+     */
+    // an object was destroyed
+    inline void Destroyed() {
+        atomic_inc(&stripes_[StripeIndex()].destructions);
+    }
+
+    /**
+     * 获取创建对象总数
+     * @return 创建对象总数
+     */
+    // total creations
+    long creations() const {
+        long count = 0;
+        for (int i = 0; i < APF_COUNTER_STRIPES; i++) {
+            count += stripes_[i].creations;
+        }
+        return count;
+    }
+
+    /**
+     * 获取存活对象数量
+     * @return 存活对象数量
+     * @note 并发时可能偏大，但不会偏小(先读取销毁次数)
+     */
+    // live objects
+    // note: may be too large but never too small while objects are created concurrently
+    long live() const {
+        long destructions = 0;
+        for (int i = 0; i < APF_COUNTER_STRIPES; i++) {
+            destructions += stripes_[i].destructions;
+        }
+        return creations() - destructions;
+    }
+
+private:
+    // stripe of the calling thread
+    static inline int StripeIndex() {
+        static volatile long next_stripe = 0;
+        static APF_THREAD_LOCAL int stripe = -1;
+        if (stripe < 0) {
+            stripe = (int)(atomic_inc(&next_stripe) & (APF_COUNTER_STRIPES - 1));
+        }
+        return stripe;
+    }
+
+    // one cache line per stripe
+    struct Stripe {
+        volatile long creations;
+        volatile long destructions;
+        char padding[64 - 2 * sizeof(long)];
+    };
+    Stripe stripes_[APF_COUNTER_STRIPES];
+};
+
+} // namespace
+
+#endif // OBJECTCOUNTER_H
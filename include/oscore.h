@@ -99,6 +99,44 @@ extern UEndianTest g_endianTest;
  */
 typedef void* (*THREAD_FUNC)(void*);
 
+/**
+ * 原子操作
+ * @note 返回操作后的值
+ */
+#if defined(WIN32) || defined(WINCE)
+inline long atomic_add(volatile long *value, long delta) {
+    return InterlockedExchangeAdd(value, delta) + delta;
+}
+inline bool atomic_cas(volatile long *value, long old_value, long new_value) {
+    return InterlockedCompareExchange(value, new_value, old_value) == old_value;
+}
+inline bool atomic_cas_ptr(void* volatile *value, void* old_value, void* new_value) {
+    return InterlockedCompareExchangePointer(value, new_value, old_value) == old_value;
+}
+#else
+inline long atomic_add(volatile long *value, long delta) {
+    return __sync_add_and_fetch(value, delta);
+}
+inline bool atomic_cas(volatile long *value, long old_value, long new_value) {
+    return __sync_bool_compare_and_swap(value, old_value, new_value);
+}
+inline bool atomic_cas_ptr(void* volatile *value, void* old_value, void* new_value) {
+    return __sync_bool_compare_and_swap(value, old_value, new_value);
+}
+#endif
+#define atomic_inc(value) atomic_add(value, 1)
+#define atomic_dec(value) atomic_add(value, -1)
+
+/**
+ * 线程局部存储
+ */
+// thread local storage
+#if defined(WIN32) || defined(WINCE)
+#define APF_THREAD_LOCAL __declspec(thread)
+#else
+#define APF_THREAD_LOCAL __thread
+#endif
+
 ////functions//////
 /**
  * 初始化互斥锁
@@ -186,6 +224,25 @@ int random_int();
  */
 unsigned long clock_tick();
 
+/**
+ * 获取单调时钟时间(微秒)
+ * @return 单调时钟时间
+ * @note 用于计算耗时，不受系统时间调整影响
+ */
+uint64_t clock_tick_us();
+
+/**
+ * 获取CPU核心数
+ * @return CPU核心数(至少为1)
+ */
+int cpu_count();
+
+/**
+ * 获取当前线程ID
+ * @return 线程ID
+ */
+unsigned long thread_id();
+
 /**
  * 释放CPU使用权
  */
@@ -20,6 +20,9 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <deque>
+#include "oscore.h"
 
 #ifdef WIN32
 #include <windows.h>
@@ -32,12 +35,15 @@
 namespace apf {
 
 class ClassEntry;
+class ObjectCounter;
 
 /**
  * @brief 插件管理类(单例)
  * 插件（模块）的加载、卸载等操作
+ * @note 所有方法都是线程安全的，模块文件的打开和初始化在锁外进行
  */
 // plugin manager
+// all methods are thread-safe, modules are opened and initialized outside the lock
 class PluginManager
 {
 public:
@@ -61,6 +67,304 @@ public:
          */
         // module class entries
         const ClassEntry* classes;
+        /**
+         * 模块提供的类数量
+         */
+        // number of classes
+        int class_count;
+        /**
+         * 每个类的对象计数(class_count个)
+         */
+        // object counter of every class
+        ObjectCounter* counters;
+        /**
+         * 模块依赖的类ID
+         * @see APF_BEGIN_MODULE_REQUIRES()
+         */
+        // class ids required by the module
+        std::vector<std::string> required_class_ids;
+    };
+
+    /**
+     * @brief 类的对象统计
+     */
+    // object statistics of a class
+    struct ClassStats {
+        /**
+         * 类ID
+         */
+        // class id
+        std::string class_id;
+        /**
+         * 实现类名
+         */
+        // implement class name
+        const char* class_name;
+        /**
+         * 存活对象数量
+         */
+        // live objects
+        long live;
+        /**
+         * 创建对象总数
+         */
+        // total creations
+        long creations;
+        /**
+         * 存活对象占用内存(字节, 对象大小x存活对象数量)
+         */
+        // bytes of live objects (object size x live objects)
+        size_t bytes;
+    };
+
+    /**
+     * @brief 模块的对象统计
+     */
+    // object statistics of a module
+    struct ModuleStats {
+        /**
+         * 模块文件路径
+         */
+        // module path
+        std::string path;
+        /**
+         * 是否已卸载(等待对象释放)
+         */
+        // unloaded or replaced, waiting for live objects
+        bool retired;
+        /**
+         * 存活对象数量
+         */
+        // live objects
+        long live;
+        /**
+         * 创建对象总数
+         */
+        // total creations
+        long creations;
+        /**
+         * 存活对象占用内存(字节)
+         */
+        // bytes of live objects
+        size_t bytes;
+        /**
+         * 每个类的对象统计
+         */
+        // statistics of every class
+        std::vector<ClassStats> classes;
+    };
+
+    /**
+     * @brief 模块加载结果(用于批量加载)
+     */
+    // plugin load result, see LoadAll()/LoadDirectory()
+    struct LoadResult {
+        /**
+         * 模块文件路径
+         */
+        // module path
+        std::string path;
+        /**
+         * 是否加载成功
+         */
+        // loaded
+        bool loaded;
+        /**
+         * 打开模块文件耗时(微秒)
+         */
+        // dlopen/LoadLibrary time (us)
+        unsigned long open_time;
+        /**
+         * 初始化模块耗时(微秒)
+         */
+        // APFGetModuleInfo/APFSetObjectCreator time (us)
+        unsigned long init_time;
+        /**
+         * 模块提供的类数量
+         */
+        // number of classes in the module
+        int class_count;
+    };
+
+    /**
+     * @brief 模块加载的性能分析事件
+     * @see EnableProfiler()
+     */
+    // startup profiler event of a module load phase
+    struct ProfileEvent {
+        /**
+         * 阶段名称(dlopen, map_relocate, static_ctors, get_module_info, set_object_creator, register)
+         */
+        // phase
+        // dlopen: dlopen/LoadLibrary, contains map_relocate and static_ctors (linux only)
+        // map_relocate: map and relocate the module and its new dependencies
+        // static_ctors: static constructors of the module
+        const char* name;
+        /**
+         * 模块文件路径(批量注册时为空)
+         */
+        // module path, empty for the batch registration of LoadAll()
+        std::string path;
+        /**
+         * 线程ID
+         */
+        // thread id
+        unsigned long thread_id;
+        /**
+         * 开始时间(微秒，从开启性能分析时开始计算)
+         */
+        // begin time (us since EnableProfiler(true))
+        unsigned long begin;
+        /**
+         * 耗时(微秒)
+         */
+        // duration (us)
+        unsigned long duration;
+        /**
+         * 重定位数量(仅dlopen)
+         */
+        // relocations of the module (dlopen only)
+        long relocations;
+        /**
+         * 相对重定位数量(仅dlopen)
+         */
+        // relative relocations of the module (dlopen only)
+        long relative_relocations;
+        /**
+         * 加载的共享库数量(包括依赖库，仅dlopen)
+         */
+        // shared objects loaded by dlopen, module and its new dependencies (dlopen only)
+        int objects;
+        /**
+         * 注册的类数量(仅register)
+         */
+        // registered classes (register only)
+        int classes;
+
+        ProfileEvent() : name(""), thread_id(0), begin(0), duration(0),
+            relocations(0), relative_relocations(0), objects(0), classes(0) {}
+    };
+
+    /**
+     * @brief 模块索引(从模块文件中读取，不加载模块)
+     * @see ReadModuleIndex()
+     */
+    // module index read from the module file without loading it
+    struct ModuleIndex {
+        /**
+         * 模块版本号
+         */
+        // module version
+        unsigned long version;
+        /**
+         * 最低支持的程序版本
+         */
+        // min support version
+        unsigned long min_support;
+        /**
+         * 最高支持的程序版本
+         */
+        // max support version
+        unsigned long max_support;
+        /**
+         * 模块提供的类ID
+         */
+        // class ids of the module
+        std::vector<std::string> class_ids;
+        /**
+         * 模块依赖的类ID
+         */
+        // class ids required by the module
+        std::vector<std::string> required_class_ids;
+    };
+
+    /**
+     * @brief 模块遍历回调
+     * @see VisitModules()
+     */
+    // module visitor (callback)
+    class ModuleVisitor {
+    public:
+        virtual ~ModuleVisitor(){}
+        /**
+         * 访问已加载的模块
+         * @param[in] path 模块文件路径
+         * @param[in] item 模块信息
+         * @return 是否继续遍历
+         * @note 在插件管理类的锁内调用，不能加载或卸载模块
+         */
+        // visit a loaded module, return false to stop
+        // note: called under the plugin manager lock, do not load or unload modules
+        virtual bool Visit(const std::string& path, const ModuleItem& item)=0;
+    };
+
+    /**
+     * @brief 异步加载完成回调
+     * @see LoadAsync()
+     */
+    // asynchronous load callback
+    class LoadCallback {
+    public:
+        virtual ~LoadCallback(){}
+        /**
+         * 模块加载完成(成功或失败)
+         * @param[in] result 加载结果
+         * @note 在加载线程中调用
+         */
+        // module load finished (loaded or failed), called on the loader thread
+        virtual void OnLoaded(const LoadResult& result)=0;
+    };
+
+    /**
+     * @brief 异步加载结果
+     * 由LoadAsync()返回，使用完毕后需调用Release()
+     * @see LoadAsync()
+     */
+    // result of LoadAsync(), call Release() when done with it
+    class LoadFuture {
+    public:
+        /**
+         * 等待加载完成
+         * @param[in] wait_time 等待时间(毫秒)
+         * @return 是否已完成
+         */
+        // wait until the load finished, return false on timeout
+        bool Wait(unsigned long wait_time=INFINITE);
+        /**
+         * 是否已完成
+         */
+        // load finished
+        bool done() const { return done_; }
+        /**
+         * 加载结果(完成后有效)
+         */
+        // load result, valid when done
+        const LoadResult& result() const { return result_; }
+        /**
+         * 增加引用计数
+         */
+        void AddRef();
+        /**
+         * 释放
+         */
+        void Release();
+    private:
+        friend class PluginManager;
+        LoadFuture(const char* path, LoadCallback* callback);
+        ~LoadFuture();
+        // set result, run callback and wake up waiters
+        void Complete(const LoadResult& result);
+
+        // reference count (caller and loader thread)
+        volatile long ref_;
+        // load finished
+        volatile bool done_;
+        // posted when finished
+        sem_t sem_;
+        // load result
+        LoadResult result_;
+        // completion callback (can be NULL)
+        LoadCallback* callback_;
     };
 public:
     /**
@@ -81,28 +385,224 @@ public:
     // load plugin
     bool Load(const char* path);
 
+    /**
+     * @brief 异步加载模块
+     * 在后台加载线程中加载模块，不阻塞调用线程
+     * @param[in] path 模块文件路径
+     * @param[in] callback 加载完成回调(可为NULL)
+     * @return 异步加载结果，使用完毕后需调用Release()
+     * @see WaitForClass()
+     */
+    // load module on a background loader thread
+    // callback (can be NULL) is called on the loader thread when finished
+    // note: call Release() of the returned future when done with it
+    LoadFuture* LoadAsync(const char* path, LoadCallback* callback=NULL);
+
+    /**
+     * @brief 等待类可用
+     * @param[in] class_id 类ID
+     * @param[in] wait_time 等待时间(毫秒)
+     * @return 类是否可用
+     */
+    // wait until a module providing the class is loaded, return false on timeout
+    bool WaitForClass(const std::string& class_id, unsigned long wait_time=INFINITE);
+
+    /**
+     * @brief 并行加载多个模块
+     * 在线程池中同时打开并初始化模块，然后一次性注册所有模块的类。
+     * 模块定义了依赖(APF_BEGIN_MODULE_REQUIRES)时按依赖关系图加载:
+     * 提供依赖类的模块加载并注册之后再加载依赖它的模块，没有依赖关系的模块并行加载
+     * @param[in] paths 模块文件路径列表
+     * @param[out] results 每个模块的加载结果及耗时（可为NULL)
+     * @return 加载成功的模块数量
+     * @note 循环依赖的模块不会被加载
+     */
+    // load plugins concurrently, then register all classes in one batch
+    // when modules declare required classes (APF_BEGIN_MODULE_REQUIRES), a module is opened
+    // after the modules providing its required classes are registered, independent branches
+    // of the dependency graph load in parallel. Modules in a dependency cycle are not loaded.
+    int LoadAll(const std::vector<std::string>& paths, std::vector<LoadResult>* results=NULL);
+
+    /**
+     * @brief 并行加载目录下的所有模块
+     * @param[in] dir 模块目录
+     * @param[out] results 每个模块的加载结果及耗时（可为NULL)
+     * @return 加载成功的模块数量
+     * @see LoadAll()
+     */
+    // load all plugins (*.so / *.dll) in dir, see LoadAll()
+    int LoadDirectory(const char* dir, std::vector<LoadResult>* results=NULL);
+
+    /**
+     * @brief 从类清单中延迟加载模块
+     * 只注册清单中的占位类，第一次创建某个类的对象时才加载其模块
+     * @param[in] file 清单文件路径
+     * @return 注册的占位类数量
+     * @see SaveManifest()
+     */
+    // register stub classes from a manifest (class id -> module path),
+    // the module is loaded on the first Class::CreateObject() of its classes
+    int LoadManifest(const char* file);
+
+    /**
+     * @brief 生成类清单
+     * 将已加载模块提供的类ID及模块路径保存到清单文件中
+     * @param[in] file 清单文件路径
+     * @return 保存是否成功
+     * @see LoadManifest()
+     */
+    // save class ids of loaded modules to a manifest
+    // eg. LoadDirectory("plugins"); SaveManifest("plugins.manifest");
+    bool SaveManifest(const char* file);
+
+    /**
+     * @brief 索引目录下的所有模块
+     * 从模块文件中读取类ID并注册占位类(不加载模块，不执行模块中的代码)，
+     * 第一次创建某个类的对象时才加载其模块
+     * @param[in] dir 模块目录
+     * @return 注册的占位类数量
+     * @see ReadModuleIndex()
+     * @see LoadManifest()
+     */
+    // register stub classes of all plugins in dir from their index sections,
+    // the module is loaded on the first Class::CreateObject() of its classes
+    int IndexDirectory(const char* dir);
+
+    /**
+     * @brief 读取模块索引
+     * 读取APF_BEGIN_MODULE写入模块文件(ELF)索引段中的版本及类ID
+     * @param[in] path 模块文件路径
+     * @param[out] index 模块索引
+     * @return 是否读取成功(非ELF文件或没有索引段的模块返回false)
+     */
+    // read module version and class ids from the index sections (ELF only)
+    static bool ReadModuleIndex(const char* path, ModuleIndex* index);
+
     /**
      * @brief 卸载模块
      * @param[in] path 模块文件路径
      * @return 卸载是否成功
+     * @note 模块仍有存活对象时将在对象释放后才被关闭
      */
     // unload plugin
-    // note: please release the plugin's object before unload.
+    // note: the module is closed after its objects are released (see ReleaseRetired())
     bool UnLoad(const char* path);
 
+    /**
+     * @brief 热更新模块
+     * 加载新版本模块并一次性替换已注册的类，替换过程中创建对象不会失败或等待，
+     * 旧版本模块在其所有对象释放后才被卸载
+     * @param[in] path 已加载的模块文件路径
+     * @param[in] new_path 新版本模块文件路径(NULL表示使用path)
+     * @param[in] wait_time 等待旧版本对象释放的时间(毫秒)
+     * @return 更新是否成功
+     * @see ReleaseRetired()
+     */
+    // load the new version side by side and switch registered classes atomically,
+    // the old image is closed after its live objects are released
+    // (waits wait_time ms here, see ReleaseRetired())
+    bool Reload(const char* path, const char* new_path=NULL, unsigned long wait_time=0);
+
+    /**
+     * @brief 卸载已无存活对象的旧模块
+     * @return 仍有存活对象的旧模块数量
+     * @see Reload()
+     * @see UnLoad()
+     */
+    // close retired modules whose live objects are all released
+    // return the number of retired modules still in use
+    int ReleaseRetired();
+
+    /**
+     * @brief 获取模块的对象统计
+     * @param[in] path 模块文件路径
+     * @param[out] stats 模块的对象统计
+     * @return 是否找到模块
+     */
+    // get object statistics of a loaded module
+    bool GetModuleStats(const char* path, ModuleStats* stats) const;
+
+    /**
+     * @brief 获取所有模块(包括已卸载但仍有存活对象的模块)的对象统计
+     * @param[out] stats 模块的对象统计
+     */
+    // get object statistics of all loaded and retired modules
+    void GetModuleStats(std::vector<ModuleStats>* stats) const;
+
     /**
      * @brief 卸载所有模块
+     * 按依赖关系的逆序卸载: 先卸载依赖其它模块的模块
      */
-    // unload all plugins
+    // unload all plugins in reverse dependency order, dependents before their providers
     void UnLoadAll();
 
     /**
      * @brief 获取加载的所有模块信息
      * @return 所有模块信息
+     * @note 返回模块列表的副本，只需遍历时使用VisitModules()
      */
     // get modules
+    // note: returns a copy, use VisitModules() to iterate without copying
     const std::map<std::string, ModuleItem> modules() const;
 
+    /**
+     * @brief 遍历已加载的模块(不复制模块列表)
+     * @param[in] visitor 模块遍历回调
+     * @return 访问的模块数量
+     */
+    // visit loaded modules in path order without copying them
+    int VisitModules(ModuleVisitor* visitor) const;
+
+    /**
+     * @brief 获取已加载的模块数量
+     * @return 模块数量
+     */
+    // number of loaded modules
+    int module_count() const;
+
+    /**
+     * @brief 模块是否已加载
+     * @param[in] path 模块文件路径
+     * @return 是否已加载
+     */
+    // is the module loaded
+    bool IsLoaded(const char* path) const;
+
+    /**
+     * @brief 开启/关闭模块加载性能分析
+     * 记录dlopen(重定位数量)、静态构造、APFGetModuleInfo、APFSetObjectCreator及类注册的耗时
+     * @param[in] enable 是否开启(开启时清除之前的记录)
+     * @note 关闭时加载模块没有额外开销
+     */
+    // enable or disable the startup profiler, enabling clears recorded events
+    // note: no extra cost when disabled
+    void EnableProfiler(bool enable);
+
+    /**
+     * @brief 获取性能分析事件
+     * @param[out] events 性能分析事件
+     */
+    // get recorded profiler events
+    void GetProfile(std::vector<ProfileEvent>* events) const;
+
+    /**
+     * @brief 保存性能分析报告
+     * 每行一个事件，以tab分隔
+     * @param[in] path 报告文件路径
+     * @return 是否成功
+     */
+    // save profiler events, one tab separated line per event
+    bool SaveProfile(const char* path) const;
+
+    /**
+     * @brief 保存性能分析报告(Chrome trace格式)
+     * 可在chrome://tracing或Perfetto中查看
+     * @param[in] path 报告文件路径
+     * @return 是否成功
+     */
+    // save profiler events as Chrome trace JSON (chrome://tracing, Perfetto)
+    bool SaveProfileTrace(const char* path) const;
+
     /**
      * @brief 获取插件管理类单实例
      * @return 插件管理类单实例
@@ -122,6 +622,202 @@ protected:
      */
     virtual ~PluginManager();
 
+    /**
+     * 打开模块文件并获取模块信息
+     * @param[in] path 模块文件路径
+     * @param[out] item 模块信息
+     * @param[out] result 加载耗时（可为NULL)
+     * @return 是否成功
+     * @note 不注册类信息，不修改已加载模块列表，可在多个线程中同时调用
+     */
+    // open module and get module info, doesn't register classes
+    bool OpenModule(const char* path, ModuleItem* item, LoadResult* result=NULL);
+
+    /**
+     * 加载模块
+     * @param[in] path 模块文件路径
+     * @param[out] result 加载结果（可为NULL)
+     * @return 是否成功
+     */
+    // open module and register its classes, used by Load() and LoadAsync()
+    bool LoadModule(const char* path, LoadResult* result);
+
+    /**
+     * 异步加载线程函数
+     * @see LoadAsync()
+     */
+    // LoadAsync() worker thread
+    static void* AsyncLoadThread(void* arg);
+
+    /**
+     * 记录性能分析事件
+     * @param[in] event 性能分析事件(不包括时间)
+     * @param[in] begin 开始时间(clock_tick_us())
+     * @param[in] end 结束时间(clock_tick_us())
+     */
+    // record profiler event of [begin, end] (clock_tick_us() time)
+    void AddProfileEvent(ProfileEvent event, uint64_t begin, uint64_t end);
+
+    /**
+     * 唤醒等待已可用类的线程(需加锁调用)
+     * @see WaitForClass()
+     */
+    // wake up WaitForClass() callers whose class is available, call with mutex_ locked
+    void NotifyClassWaiters();
+
+    /**
+     * 关闭模块文件
+     * @param[in] hmodule 模块句柄
+     */
+    // close module handle
+    static void CloseModule(HMODULE hmodule);
+
+    /**
+     * 放弃已打开但不加载的模块
+     * @param[in] item 模块信息
+     * @param[in,out] result 加载结果(置为失败)
+     */
+    // close a module opened but not added, result fails
+    static void DiscardModule(ModuleItem* item, LoadResult* result);
+
+    /**
+     * 并行打开模块(不注册)
+     * @param[in] paths 模块文件路径列表
+     * @param[in] order 要打开的模块(paths的下标)
+     * @param[out] items 模块信息
+     * @param[out] results 加载结果
+     * @see LoadAll()
+     */
+    // open and initialize the modules of order on a thread pool, without adding them
+    void OpenModules(const std::vector<std::string>& paths, const std::vector<size_t>& order,
+                     std::vector<ModuleItem>* items, std::vector<LoadResult>* results);
+
+    /**
+     * 并行加载模块的线程函数
+     * @see LoadAll()
+     */
+    // LoadAll() worker thread
+    static void* LoadThread(void* arg);
+
+    /**
+     * 按依赖关系图加载模块的线程函数
+     * @see LoadAll()
+     */
+    // LoadAll() worker thread for modules with dependencies
+    static void* GraphLoadThread(void* arg);
+
+    /**
+     * 建立模块依赖关系图
+     * @param[in] paths 模块文件路径列表
+     * @param[in] indexes 每个模块的索引(提供及依赖的类)
+     * @param[out] dependents 每个模块的依赖模块(下标)
+     * @param[out] waiting 每个模块依赖的未加载模块数量(-1: 循环依赖)
+     * @return 是否有模块定义了依赖
+     */
+    // build the dependency graph of modules from their index
+    // waiting is -1 for modules in (or behind) a dependency cycle
+    static bool BuildLoadGraph(const std::vector<std::string>& paths, const std::vector<ModuleIndex>& indexes,
+                               std::vector<std::vector<size_t> >* dependents, std::vector<int>* waiting);
+
+    /**
+     * 按依赖关系图加载模块
+     * @see LoadAll()
+     */
+    // load modules in dependency order, independent branches in parallel,
+    // opened modules (no index) are only added. dependents of a failed module fail
+    int LoadGraph(const std::vector<std::string>& paths, const std::vector<std::vector<size_t> >& dependents,
+                  const std::vector<int>& waiting, const std::vector<bool>& opened,
+                  std::vector<ModuleItem>* items, std::vector<LoadResult>* results);
+
+    /**
+     * 获取已加载模块的卸载顺序(需加锁调用)
+     * @param[out] paths 模块文件路径(依赖其它模块的模块在前)
+     */
+    // unload order of loaded modules, dependents first, call with mutex_ locked
+    void GetUnloadOrder(std::vector<std::string>* paths) const;
+
+    /**
+     * 加入已打开的模块并注册其类
+     * @param[in] path 模块文件路径
+     * @param[in] item 模块信息
+     * @return 是否成功(模块已被其它线程加载时关闭模块并返回false)
+     */
+    // add an opened module and register its classes
+    // closes the module and returns false when another thread loaded it meanwhile
+    bool AddModule(const std::string& path, const ModuleItem& item);
+
+    /**
+     * 关闭模块(无存活对象时)或将其加入待卸载列表
+     * @param[in] path 模块文件路径
+     * @param[in] item 模块信息
+     */
+    // close the module or retire it until its live objects are released
+    void RetireModule(const std::string& path, const ModuleItem& item);
+
+    /**
+     * 复制模块文件
+     * @param[in] src 源文件路径
+     * @param[in] dst 目标文件路径
+     * @return 是否成功
+     */
+    // copy module file, used by Reload()
+    static bool CopyModuleFile(const char* src, const char* dst);
+
+    /**
+     * 将模块的类指向其对象计数
+     * @param[in] item 模块信息
+     * @note 需持有mutex_，模块加入已加载模块列表后、注册类之前调用
+     *       (同一模块映像被多个线程打开时共享同一个类表)
+     */
+    // point the classes of a module at its object counters, mutex_ must be held
+    // called once the module is added, before its classes are registered
+    // (threads opening the same image share its class table)
+    void AttachCounters(const ModuleItem& item);
+
+    /**
+     * 统计模块的对象
+     * @param[in] path 模块文件路径
+     * @param[in] item 模块信息
+     * @param[in] retired 是否已卸载
+     * @param[out] stats 模块的对象统计
+     */
+    // merge object counters of a module
+    static void MergeModuleStats(const std::string& path, const ModuleItem& item, bool retired, ModuleStats* stats);
+
+    /**
+     * 获取模块的存活对象数量
+     * @param[in] item 模块信息
+     * @return 存活对象数量
+     */
+    // live objects of a module
+    static long LiveObjects(const ModuleItem& item);
+
+    /**
+     * 加载占位类所在的模块
+     * @param[in] class_id 类ID
+     * @return 是否加载成功
+     * @see LoadManifest()
+     */
+    // class loader of manifest stub classes
+    static bool LoadClass(const std::string& class_id);
+
+    /**
+     * 注册延迟加载的类
+     * @param[in] class_id 类ID
+     * @param[in] path 模块文件路径
+     * @return 是否注册了占位类
+     */
+    // register a stub class loaded from path by LoadClass()
+    bool AddLazyClass(const std::string& class_id, const std::string& path);
+
+    /**
+     * 获取目录下的所有模块文件
+     * @param[in] dir 模块目录
+     * @param[out] paths 模块文件路径(已排序)
+     */
+    // list *.so / *.dll in dir
+    static void ListModules(const char* dir, std::vector<std::string>* paths);
+
     /**
      * 注册类信息
      * @param[in] classes 类信息数组
@@ -138,13 +834,37 @@ protected:
     // classes is a array end with ClassEntry()
     void UnRegisterClasses(const ClassEntry* classes);
 private:
+    // mutex (modules, retired modules, lazy classes, version)
+    mutable pthread_mutex_t mutex_;
     // loaded plugin <path, ModuleItem>
     std::map<std::string, ModuleItem> modules_;
+    // unloaded or replaced modules which still have live objects <path, ModuleItem>
+    std::vector<std::pair<std::string, ModuleItem> > retired_modules_;
+    // manifest classes <class id, module path>
+    std::map<std::string, std::string> lazy_classes_;
+    // WaitForClass() callers <class id, semaphore>
+    std::vector<std::pair<std::string, sem_t*> > class_waiters_;
+    // LoadAsync() queue
+    std::deque<LoadFuture*> async_queue_;
+    // posted for every queued load (and to stop the loader threads)
+    sem_t async_sem_;
+    // LoadAsync() loader threads
+    std::vector<pthread_t> async_threads_;
+    // loader threads waiting for work
+    int async_idle_;
+    // loader threads are stopping
+    bool async_stop_;
+    // startup profiler is enabled
+    volatile bool profiling_;
+    // clock_tick_us() when the profiler was enabled
+    uint64_t profile_begin_;
+    // profiler events
+    std::vector<ProfileEvent> profile_events_;
     // plugin manager version
     unsigned short major_version_;
     unsigned short sub_version_;
     // single instance
-    static PluginManager* instance_;
+    static PluginManager* volatile instance_;
 };
 
 } // namespace
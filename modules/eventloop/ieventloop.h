@@ -0,0 +1,90 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef IEVENTLOOP_H_INCLUDED
+#define IEVENTLOOP_H_INCLUDED
+
+// fd is readable
+#define EVENT_READ      0x01
+// fd is writable
+#define EVENT_WRITE     0x02
+// error or hang up on fd
+#define EVENT_ERROR     0x04
+
+// declare event loop class id
+APF_DECLARE_CLASSID(CLSID_EventLoop, "EventLoop")
+
+// task function run by IEventLoop::Post
+typedef void (*EVENT_TASK_FUNC)(void*);
+
+// fd event handler (callback)
+class IEventHandler {
+public:
+    virtual ~IEventHandler(){}
+    // fd is ready, events is EVENT_READ | EVENT_WRITE | EVENT_ERROR
+    // note: watchers are edge triggered, read/write until EAGAIN
+    virtual void OnEvent(int fd, int events)=0;
+};
+
+// timer handler (callback)
+class ITimerHandler {
+public:
+    virtual ~ITimerHandler(){}
+    // timer expired
+    virtual void OnTimer(long timer_id)=0;
+};
+
+// event loop interface (epoll)
+// every CLSID_EventLoop object is an independent loop, create one per core
+// and Start(cpu) each of them to pin the loop thread.
+class IEventLoop {
+APF_DECLARE_INTERFACE(IEventLoop)
+public:
+    virtual ~IEventLoop(){}
+    // create epoll and wakeup fd
+    virtual bool Init()=0;
+    // stop loop and release all watchers, timers and pending tasks
+    virtual void Uninit()=0;
+    // run loop on the calling thread until Stop()
+    virtual void Run()=0;
+    // run loop on a new thread, bind the thread to cpu if cpu >= 0
+    virtual bool Start(int cpu=-1)=0;
+    // stop loop, wait until Run() returns (on another thread)
+    virtual void Stop()=0;
+    // watch fd (edge triggered), events is EVENT_READ | EVENT_WRITE
+    // note: fd should be non-blocking
+    virtual bool AddWatcher(int fd, int events, IEventHandler* handler)=0;
+    // change watched events of fd
+    virtual bool ModifyWatcher(int fd, int events)=0;
+    // stop watching fd, events of fd pending in the loop are dropped
+    // called from another thread it waits for a running OnEvent of fd,
+    // the handler can be deleted when it returns
+    virtual void RemoveWatcher(int fd)=0;
+    // add timer, fire after delay ms and then every interval ms (0: once)
+    // return timer id, 0 when failed
+    virtual long AddTimer(unsigned long delay, unsigned long interval, ITimerHandler* handler)=0;
+    // cancel timer
+    // called from another thread it waits for a running OnTimer of the timer,
+    // the handler can be deleted when it returns
+    virtual void CancelTimer(long timer_id)=0;
+    // run func(arg) on the loop thread, can be called from any thread
+    virtual void Post(EVENT_TASK_FUNC func, void* arg)=0;
+    // is the calling thread the loop thread
+    virtual bool IsInLoopThread()=0;
+};
+
+#endif // IEVENTLOOP_H_INCLUDED
@@ -0,0 +1,123 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <map>
+#include <set>
+#include <vector>
+#include "oscore.h"
+#include "interface.h"
+#include "ieventloop.h"
+
+#define MAX_EPOLL_EVENTS 256
+
+class EventLoop : public IEventLoop {
+APF_BEGIN_CLASS()
+APF_INTERFACE_ENTRY(IEventLoop)
+APF_END_CLASS()
+public:
+    EventLoop();
+    virtual ~EventLoop();
+
+    // create epoll and wakeup fd
+    virtual bool Init();
+    // stop loop and release all watchers, timers and pending tasks
+    virtual void Uninit();
+    // run loop on the calling thread until Stop()
+    virtual void Run();
+    // run loop on a new thread, bind the thread to cpu if cpu >= 0
+    virtual bool Start(int cpu=-1);
+    // stop loop, wait until Run() returns
+    virtual void Stop();
+    // watch fd (edge triggered)
+    virtual bool AddWatcher(int fd, int events, IEventHandler* handler);
+    // change watched events of fd
+    virtual bool ModifyWatcher(int fd, int events);
+    // stop watching fd, wait for a running OnEvent of fd
+    virtual void RemoveWatcher(int fd);
+    // add timer
+    virtual long AddTimer(unsigned long delay, unsigned long interval, ITimerHandler* handler);
+    // cancel timer, wait for a running OnTimer of the timer
+    virtual void CancelTimer(long timer_id);
+    // run func(arg) on the loop thread
+    virtual void Post(EVENT_TASK_FUNC func, void* arg);
+    // is the calling thread the loop thread
+    virtual bool IsInLoopThread();
+protected:
+    struct Watcher {
+        IEventHandler* handler;
+        // AddWatcher count when added, tells events of a reused fd apart
+        uint32_t       generation;
+    };
+    struct Timer {
+        ITimerHandler* handler;
+        unsigned long  interval;
+        uint64_t       expire;
+    };
+    struct Task {
+        EVENT_TASK_FUNC func;
+        void*           arg;
+    };
+    // loop thread entry
+    static void* LoopThread(void* arg);
+    // write wakeup fd
+    void Wakeup();
+    // run expired timers, return ms to next timer (-1: no timer)
+    int  RunTimers();
+    // run posted tasks
+    void RunTasks();
+    // dispatch fd events
+    void DispatchEvents(int count);
+private:
+    // epoll fd
+    int epoll_fd_;
+    // eventfd used to wakeup epoll_wait
+    int wakeup_fd_;
+    // loop is running
+    volatile bool running_;
+    // Run() has not returned yet
+    volatile bool in_run_;
+    // loop thread
+    pthread_t thread_;
+    // loop thread was created by Start()
+    bool own_thread_;
+    // cpu the loop thread is bound to (-1: none)
+    int cpu_;
+    // mutex (watchers, timers, tasks)
+    pthread_mutex_t mutex_;
+    // watched fds <fd, watcher>
+    std::map<int, Watcher> watchers_;
+    // generation of the last watcher added
+    uint32_t last_generation_;
+    // fd and timer whose handler is running on the loop thread (-1, 0: none)
+    volatile int  dispatch_fd_;
+    volatile long dispatch_timer_;
+    // timers <timer id, timer>
+    std::map<long, Timer> timers_;
+    // timer queue ordered by <expire, timer id>
+    std::set<std::pair<uint64_t, long> > timer_queue_;
+    // last timer id
+    long last_timer_id_;
+    // posted tasks
+    std::vector<Task> tasks_;
+    // epoll_wait result
+    struct epoll_event* events_;
+};
+
+#endif // EVENTLOOP_H
@@ -0,0 +1,6 @@
+#include "eventloop.h"
+#include "module.h"
+
+APF_BEGIN_MODULE(APF_VERSION(1,0), 0, APF_MAX_VERSION)
+APF_CLASSMAP_ENTRY(CLSID_EventLoop, EventLoop)
+APF_END_MODULE()
@@ -0,0 +1,417 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "eventloop.h"
+
+// monotonic time in ms
+static uint64_t MonotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// EVENT_* to EPOLL* (edge triggered)
+static unsigned int ToEpollEvents(int events) {
+    unsigned int ep_events = EPOLLET;
+    if (EVENT_READ & events) {
+        ep_events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (EVENT_WRITE & events) {
+        ep_events |= EPOLLOUT;
+    }
+    return ep_events;
+}
+
+EventLoop::EventLoop() {
+    epoll_fd_ = -1;
+    wakeup_fd_ = -1;
+    running_ = false;
+    in_run_ = false;
+    own_thread_ = false;
+    cpu_ = -1;
+    last_timer_id_ = 0;
+    last_generation_ = 0;
+    dispatch_fd_ = -1;
+    dispatch_timer_ = 0;
+    memset(&thread_, 0, sizeof(thread_));
+    events_ = new struct epoll_event[MAX_EPOLL_EVENTS];
+
+    init_mutex(&mutex_);
+}
+
+EventLoop::~EventLoop() {
+    Uninit();
+    delete[] events_;
+    uninit_mutex(&mutex_);
+}
+
+bool EventLoop::Init() {
+    if (-1 != epoll_fd_) {
+        return true;
+    }
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == epoll_fd_) {
+        fprintf(stderr, "create epoll failed (%d)\n", errno);
+        return false;
+    }
+    wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == wakeup_fd_) {
+        fprintf(stderr, "create eventfd failed (%d)\n", errno);
+        close(epoll_fd_);
+        epoll_fd_ = -1;
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = wakeup_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &ev);
+
+    return true;
+}
+
+void EventLoop::Uninit() {
+    // Run() is out of epoll_wait before the fds are closed
+    Stop();
+
+    lock_mutex(&mutex_);
+    watchers_.clear();
+    timers_.clear();
+    timer_queue_.clear();
+    tasks_.clear();
+    unlock_mutex(&mutex_);
+
+    if (-1 != wakeup_fd_) {
+        close(wakeup_fd_);
+        wakeup_fd_ = -1;
+    }
+    if (-1 != epoll_fd_) {
+        close(epoll_fd_);
+        epoll_fd_ = -1;
+    }
+}
+
+void EventLoop::Run() {
+    if (-1 == epoll_fd_ && !Init()) {
+        return;
+    }
+    // Start() has set them already
+    if (!own_thread_) {
+        thread_ = pthread_self();
+        running_ = true;
+    }
+    in_run_ = true;
+    while (running_) {
+        int timeout = RunTimers();
+        int count = epoll_wait(epoll_fd_, events_, MAX_EPOLL_EVENTS, timeout);
+        if (count < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            fprintf(stderr, "epoll_wait failed (%d)\n", errno);
+            break;
+        }
+        DispatchEvents(count);
+        RunTasks();
+    }
+    running_ = false;
+    in_run_ = false;
+}
+
+void* EventLoop::LoopThread(void* arg) {
+    EventLoop* loop = static_cast<EventLoop*>(arg);
+    if (loop->cpu_ >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(loop->cpu_, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+    loop->Run();
+    return NULL;
+}
+
+bool EventLoop::Start(int cpu) {
+    if (own_thread_ || running_) {
+        return false;
+    }
+    if (!Init()) {
+        return false;
+    }
+    cpu_ = cpu;
+    running_ = true;
+    own_thread_ = true;
+    if (0 != begin_thread(&thread_, LoopThread, this)) {
+        running_ = false;
+        own_thread_ = false;
+        return false;
+    }
+    return true;
+}
+
+void EventLoop::Stop() {
+    running_ = false;
+    Wakeup();
+    // stopped by a handler on the loop thread itself
+    bool in_loop = pthread_equal(thread_, pthread_self());
+    if (own_thread_) {
+        if (in_loop) {
+            pthread_detach(thread_);
+        } else {
+            wait_thread(&thread_);
+        }
+        own_thread_ = false;
+    } else if (!in_loop) {
+        // Run() on a thread of the caller
+        while (in_run_) {
+            yield();
+        }
+    }
+}
+
+bool EventLoop::AddWatcher(int fd, int events, IEventHandler* handler) {
+    if (-1 == epoll_fd_ || NULL == handler) {
+        return false;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ToEpollEvents(events);
+    ev.data.fd = fd;
+
+    lock_mutex(&mutex_);
+    Watcher watcher;
+    watcher.handler = handler;
+    watcher.generation = ++last_generation_;
+    // 0 is the wakeup fd
+    if (0 == watcher.generation) {
+        watcher.generation = ++last_generation_;
+    }
+    // events carry the generation of the watcher with the fd
+    ev.data.u64 = ((uint64_t)watcher.generation << 32) | (uint32_t)fd;
+    bool ret = (0 == epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev));
+    if (ret) {
+        watchers_[fd] = watcher;
+    }
+    unlock_mutex(&mutex_);
+
+    return ret;
+}
+
+bool EventLoop::ModifyWatcher(int fd, int events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ToEpollEvents(events);
+
+    lock_mutex(&mutex_);
+    std::map<int, Watcher>::iterator it = watchers_.find(fd);
+    bool ret = (watchers_.end() != it) && (-1 != epoll_fd_);
+    if (ret) {
+        ev.data.u64 = ((uint64_t)it->second.generation << 32) | (uint32_t)fd;
+        ret = (0 == epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev));
+    }
+    unlock_mutex(&mutex_);
+    return ret;
+}
+
+void EventLoop::RemoveWatcher(int fd) {
+    lock_mutex(&mutex_);
+    if (watchers_.erase(fd) > 0 && -1 != epoll_fd_) {
+        struct epoll_event ev;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, &ev);
+    }
+    unlock_mutex(&mutex_);
+    // the handler may be deleted by the caller after return
+    if (!IsInLoopThread()) {
+        while (fd == dispatch_fd_) {
+            yield();
+        }
+    }
+}
+
+long EventLoop::AddTimer(unsigned long delay, unsigned long interval, ITimerHandler* handler) {
+    if (NULL == handler) {
+        return 0;
+    }
+    Timer timer;
+    timer.handler = handler;
+    timer.interval = interval;
+    timer.expire = MonotonicMs() + delay;
+
+    lock_mutex(&mutex_);
+    long timer_id = ++last_timer_id_;
+    timers_[timer_id] = timer;
+    bool first = timer_queue_.empty() || timer.expire < timer_queue_.begin()->first;
+    timer_queue_.insert(std::make_pair(timer.expire, timer_id));
+    unlock_mutex(&mutex_);
+
+    // loop is sleeping for a later timer
+    if (first && !IsInLoopThread()) {
+        Wakeup();
+    }
+    return timer_id;
+}
+
+void EventLoop::CancelTimer(long timer_id) {
+    lock_mutex(&mutex_);
+    std::map<long, Timer>::iterator it = timers_.find(timer_id);
+    if (timers_.end() != it) {
+        timer_queue_.erase(std::make_pair(it->second.expire, timer_id));
+        timers_.erase(it);
+    }
+    unlock_mutex(&mutex_);
+    // the handler may be deleted by the caller after return
+    if (!IsInLoopThread()) {
+        while (timer_id == dispatch_timer_) {
+            yield();
+        }
+    }
+}
+
+void EventLoop::Post(EVENT_TASK_FUNC func, void* arg) {
+    if (NULL == func) {
+        return;
+    }
+    Task task;
+    task.func = func;
+    task.arg = arg;
+
+    lock_mutex(&mutex_);
+    bool first = tasks_.empty();
+    tasks_.push_back(task);
+    unlock_mutex(&mutex_);
+
+    // only the first task needs to wake the loop up
+    if (first) {
+        Wakeup();
+    }
+}
+
+bool EventLoop::IsInLoopThread() {
+    // in_run_, not running_: a handler that called Stop() is still on the loop thread
+    return in_run_ && pthread_equal(thread_, pthread_self());
+}
+
+void EventLoop::Wakeup() {
+    if (-1 != wakeup_fd_) {
+        uint64_t one = 1;
+        ssize_t ret = write(wakeup_fd_, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+int EventLoop::RunTimers() {
+    uint64_t now = MonotonicMs();
+    int timeout = -1;
+
+    lock_mutex(&mutex_);
+    while (!timer_queue_.empty()) {
+        std::set<std::pair<uint64_t, long> >::iterator first = timer_queue_.begin();
+        if (first->first > now) {
+            timeout = (int)(first->first - now);
+            break;
+        }
+        long timer_id = first->second;
+        timer_queue_.erase(first);
+
+        std::map<long, Timer>::iterator it = timers_.find(timer_id);
+        if (timers_.end() == it) {
+            continue;
+        }
+        ITimerHandler* handler = it->second.handler;
+        if (it->second.interval > 0) {
+            it->second.expire = now + it->second.interval;
+            timer_queue_.insert(std::make_pair(it->second.expire, timer_id));
+        } else {
+            timers_.erase(it);
+        }
+
+        // handler may add or cancel timers, CancelTimer waits for it
+        dispatch_timer_ = timer_id;
+        unlock_mutex(&mutex_);
+        handler->OnTimer(timer_id);
+        lock_mutex(&mutex_);
+        dispatch_timer_ = 0;
+    }
+    // tasks posted by timer handlers must not wait for the next event
+    if (!tasks_.empty()) {
+        timeout = 0;
+    }
+    unlock_mutex(&mutex_);
+
+    return timeout;
+}
+
+void EventLoop::RunTasks() {
+    std::vector<Task> tasks;
+    lock_mutex(&mutex_);
+    tasks.swap(tasks_);
+    unlock_mutex(&mutex_);
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        tasks[i].func(tasks[i].arg);
+    }
+}
+
+void EventLoop::DispatchEvents(int count) {
+    for (int i = 0; i < count; i++) {
+        // watchers: generation << 32 | fd, wakeup fd: fd
+        int fd = (int)(uint32_t)events_[i].data.u64;
+        uint32_t generation = (uint32_t)(events_[i].data.u64 >> 32);
+        if (0 == generation && fd == wakeup_fd_) {
+            uint64_t value;
+            while (read(wakeup_fd_, &value, sizeof(value)) > 0) {
+            }
+            continue;
+        }
+
+        // a watcher removed by an earlier handler of the batch (or its fd
+        // reused by a new watcher) gets no more events of the batch
+        IEventHandler* handler = NULL;
+        lock_mutex(&mutex_);
+        std::map<int, Watcher>::iterator it = watchers_.find(fd);
+        if (watchers_.end() != it && generation == it->second.generation) {
+            handler = it->second.handler;
+            // RemoveWatcher waits for it
+            dispatch_fd_ = fd;
+        }
+        unlock_mutex(&mutex_);
+        if (NULL == handler) {
+            continue;
+        }
+
+        int events = 0;
+        if (events_[i].events & (EPOLLIN | EPOLLRDHUP)) {
+            events |= EVENT_READ;
+        }
+        if (events_[i].events & EPOLLOUT) {
+            events |= EVENT_WRITE;
+        }
+        if (events_[i].events & (EPOLLERR | EPOLLHUP)) {
+            events |= EVENT_ERROR;
+        }
+        handler->OnEvent(fd, events);
+        dispatch_fd_ = -1;
+    }
+}
@@ -18,24 +18,190 @@
 #ifndef ILOG_H_INCLUDED
 #define ILOG_H_INCLUDED
 
+#include "logfields.h"
+
 // show log on console
 #define LOG_TARGET_CONSOLE  0x01
 // send log to udp port
 #define LOG_TARGET_NET      0x02
 // write log to file
 #define LOG_TARGET_FILE     0x04
+// first target of sinks added by ILog::AddSink
+#define LOG_TARGET_USER     0x100
 
 // declare log class id
 APF_DECLARE_CLASSID(CLSID_Log, "Log")
 
 // log file type
 enum LogBackupStrategy {
-    // log on single file, if file size exceed max size, the file will be backup to {name}.log.bk
+    // log on single file, if file size exceed max size, the file will be backup to {name}_bk.log
     LOG_BACKUP_ONE_FILE,
     // write a file with {name}-{date}.log every day.
     LOG_BACKUP_DATE_FILE
 };
 
+// log level, from lowest to highest
+enum LogLevel {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    // level threshold only, no line is logged
+    LOG_LEVEL_OFF
+};
+
+// level of the threshold cells of a destroyed log (see ILog::GetTagLevel)
+#define LOG_LEVEL_STALE (-1)
+
+// APF_LOG_* below this level are removed at compile time
+// 0: Debug, 1: Info, 2: Warn, 3: Error, 4: none
+// eg. -DLOG_COMPILE_LEVEL=1 removes all APF_LOG_DEBUG
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 0
+#endif
+
+// fraction of second in the log time
+enum LogTimePrecision {
+    // YYYY-MM-DD HH:MI:SS
+    LOG_TIME_SECOND,
+    // YYYY-MM-DD HH:MI:SS.mmm
+    LOG_TIME_MILLISECOND,
+    // YYYY-MM-DD HH:MI:SS.uuuuuu
+    LOG_TIME_MICROSECOND
+};
+
+// how lines are written to targets
+enum LogEncoding {
+    // formatted text lines
+    LOG_ENCODING_TEXT,
+    // format id and raw arguments (see logbinary.h), formatted by logviewer
+    // (file and net) or by the writer (console), the file suffix is .blog
+    // note: format should be a string literal, every format address gets an id.
+    // a different format at an address used before is written as a text record
+    LOG_ENCODING_BINARY,
+    // a JSON object per line: time, level, tag, msg and the fields of WriteFields
+    LOG_ENCODING_JSON,
+    // a logfmt line: time, level, tag, msg and the fields of WriteFields
+    LOG_ENCODING_LOGFMT
+};
+
+// how the file target writes
+enum LogFileWriter {
+    // fwrite to a FILE
+    LOG_FILE_STDIO,
+    // memcpy to mmapped windows of the file, windows and the next file
+    // are preallocated by a helper thread (stdio on WIN32)
+    LOG_FILE_MMAP
+};
+
+// when lines of the file target reach the disk
+enum LogDurability {
+    // the stdio buffer is written when it is full or the log flushes a batch
+    LOG_DURABILITY_NONE,
+    // the stdio buffer is written after every write of the file sink
+    // (every line in sync mode): lines survive a crash of the process
+    LOG_DURABILITY_FLUSH,
+    // as LOG_DURABILITY_FLUSH and the file is synced (fdatasync) in the
+    // background every sync window: lines survive a crash of the system
+    // but the last window
+    LOG_DURABILITY_SYNC
+};
+
+// what async logging does when the ring buffer is full
+enum LogOverflowPolicy {
+    // caller waits until the writer thread frees a slot
+    LOG_OVERFLOW_BLOCK,
+    // line is dropped
+    LOG_OVERFLOW_DROP,
+    // Debug/Info lines are dropped once the ring is 7/8 full,
+    // Warn/Error lines use the rest of the ring and wait when it is full
+    LOG_OVERFLOW_DROP_LOWEST
+};
+
+// when the flight recorder is dumped to the file target (see ILog::SetRecorder)
+enum LogRecorderDump {
+    // only by ILog::DumpRecorder and ILog::DumpRecorderOnCrash
+    LOG_DUMP_ON_DEMAND,
+    // an Error dumps the lines recorded by its thread
+    LOG_DUMP_THREAD,
+    // an Error dumps the lines recorded by all threads
+    LOG_DUMP_ALL_THREADS
+};
+
+// log counters (see ILog::GetStats)
+struct LogStats {
+    // lines written to targets
+    long written;
+    // lines dropped by async logging, indexed by LogLevel
+    long dropped[LOG_LEVEL_ERROR + 1];
+    // times a caller waited for a full ring
+    long blocked;
+    // lines waiting in the ring
+    long queued;
+    // lines suppressed by rate limits and sampling (see ILog::SetTagLimit)
+    long suppressed;
+};
+
+// rate limit and sampling of the lines of a tag or a call site in a log
+// (see ILog::SetTagLimit and ILog::GetLimit), checked without locks
+struct LogLimit {
+    // lines per second (0: no rate limit), a token bucket of burst lines
+    long rate;
+    long burst;
+    // one of every sample lines is logged (0, 1: every line)
+    long sample;
+    // state below is zero at first and owned by the log
+    // time the bucket is full again (us, clock_tick_us)
+    volatile long full_at;
+    // lines seen by sampling
+    volatile long seen;
+    // lines suppressed since the last summary
+    volatile long suppressed;
+    // tag of the lines, NULL until the limit is added to its log
+    const char* volatile tag;
+    // format of a call site, NULL for a tag
+    const char* format;
+    // next limit of the log
+    LogLimit* volatile next;
+};
+
+
+// sink counters (see ILog::GetSinkStats)
+struct LogSinkStats {
+    // lines waiting in the sink queue
+    long queued;
+    // lines written by the sink
+    long written;
+    // lines dropped by the sink queue
+    long dropped;
+    // times a full sink queue made the logging thread wait
+    long blocked;
+    // calls of ILogSink::Write
+    long batches;
+    // total and max time of an ILogSink::Write + Flush (us)
+    uint64_t write_us;
+    uint64_t max_write_us;
+};
+
+// a line handed to a sink
+struct LogLine {
+    // text line ('\0' terminated), or a record of logbinary.h in LOG_ENCODING_BINARY
+    const char* data;
+    int len;
+    // LogLevel
+    int level;
+};
+
+// log sink (callback), writes lines to a target
+class ILogSink {
+public:
+    virtual ~ILogSink(){}
+    // write lines, called by one thread at a time
+    // (the sink thread if the sink has a queue, see ILog::SetSinkQueue)
+    virtual void Write(const LogLine* lines, int count)=0;
+    // write out buffered lines, called after a batch of lines and by ILog::Flush
+    virtual void Flush()=0;
+};
 
 // log interface
 class ILog {
@@ -54,6 +220,104 @@ public:
     virtual void SetFile(const char* path, const char* name, LogBackupStrategy type, long max_size)=0;
     // set net log addr (UDP)
     virtual void SetAddr(const char* host, unsigned short port)=0;
+    // set fraction of second in the log time (default LOG_TIME_SECOND)
+    virtual void SetTimePrecision(LogTimePrecision precision)=0;
+    // set encoding of lines (default LOG_ENCODING_TEXT), reopens the log file
+    virtual void SetEncoding(LogEncoding encoding)=0;
+    // set writer of the file target (default LOG_FILE_STDIO), reopens the log file
+    // window_size: bytes mapped at a time by LOG_FILE_MMAP (0: 4MB)
+    virtual void SetFileWriter(LogFileWriter writer, long window_size)=0;
+    // set retention of rotated log files (default: all kept, not compressed)
+    // max_files: rotated files kept, max_bytes: bytes of rotated files kept (0: no limit)
+    // compress_command: run with the rotated file name appended, eg. "gzip -f" (NULL: none)
+    // note: files are compressed and removed by a background thread
+    virtual void SetFileRetention(int max_files, long max_bytes, const char* compress_command)=0;
+    // set durability of the file target (default LOG_DURABILITY_NONE)
+    // sync_interval_ms, sync_bytes: sync window of LOG_DURABILITY_SYNC (0: no limit)
+    // sync_errors: Error returns when its line is synced, Error calls at the
+    // same time share one sync (async: it waits for the writer thread too)
+    virtual void SetFileDurability(LogDurability durability, int sync_interval_ms, long sync_bytes, bool sync_errors)=0;
+    // enable or disable async logging
+    // callers format lines into a lock-free ring of capacity lines (rounded up to a power of 2)
+    // and a writer thread writes them to the targets in batches.
+    // note: switch mode while no other thread is logging
+    virtual void SetAsync(bool enable, long capacity, LogOverflowPolicy policy)=0;
+    // give every thread logging asynchronously a buffer of thread_bytes of its own
+    // (0, default: all threads share the ring of SetAsync), restarts async logging
+    // the writer thread merges the lines of all threads by time, a line is written
+    // merge_window_us after it was logged at the earliest: lines reaching the writer
+    // within the window are written in time order.
+    // threads beyond LOG_STAGING_MAX_THREADS use the ring, a full buffer drops
+    // or waits according to the policy of SetAsync.
+    virtual void SetThreadBuffers(long thread_bytes, int merge_window_us)=0;
+    // wait until all lines logged before the call are written
+    virtual void Flush()=0;
+    // get log counters
+    virtual void GetStats(LogStats* stats)=0;
+    // set level threshold of tags without own level (default LOG_LEVEL_DEBUG)
+    virtual void SetLevel(LogLevel level)=0;
+    // set level threshold of tag
+    virtual void SetTagLevel(const char* tag, LogLevel level)=0;
+    // tag uses the level set by SetLevel again
+    virtual void ClearTagLevel(const char* tag)=0;
+    // get level threshold cell of tag, lines below *cell are dropped
+    // the cell is updated when levels change. it outlives the log: a destroyed
+    // log leaves its cells at LOG_LEVEL_STALE, APF_LOG_* resolve the cell of
+    // a call site once and again when it is stale.
+    virtual volatile long* GetTagLevel(const char* tag)=0;
+    // would a line of level and tag be logged
+    virtual bool IsLevelEnabled(LogLevel level, const char* tag)=0;
+    // add sink as target, target is a bit >= LOG_TARGET_USER, enable it with SetTargets
+    // note: the sink must live until RemoveSink or the end of the log
+    virtual bool AddSink(int target, ILogSink* sink)=0;
+    // remove a sink added by AddSink after its queued lines are written
+    virtual void RemoveSink(int target)=0;
+    // give target (one LOG_TARGET_*) its own queue of capacity lines and a thread,
+    // the thread writes batches of up to batch lines, a full queue drops or waits
+    // according to policy without stalling other targets.
+    // capacity 0 (default): lines are written by the logging thread (or the async writer)
+    virtual void SetSinkQueue(int target, long capacity, int batch, LogOverflowPolicy policy)=0;
+    // get counters of target
+    virtual bool GetSinkStats(int target, LogSinkStats* stats)=0;
+    // keep the lines of level and above of every thread (including the lines
+    // below the level threshold) in a ring of thread_bytes per thread (0: disabled)
+    // lines are recorded compactly (binary records) without locks, and written
+    // to the file target in the encoding of the log when dumped. a dump has
+    // the newest dump_lines lines (0: all) not dumped before, merged by time.
+    // an Error dump follows the Error line: async, it is written by the writer
+    // thread once per thread and batch of lines, up to the last Error line.
+    // note: formats should be string literals as in LOG_ENCODING_BINARY, a
+    // different format at an address used before is recorded as text
+    virtual void SetRecorder(LogLevel level, long thread_bytes, int dump_lines, LogRecorderDump dump)=0;
+    // dump the lines recorded by all threads to the file target
+    virtual void DumpRecorder()=0;
+    // write the lines recorded by all threads to {path}/{name}-crash.blog
+    // without locks, allocation or formatting, call it from a fatal signal handler
+    // (best effort). it is a binary log whatever the encoding, read it with logviewer
+    virtual void DumpRecorderOnCrash()=0;
+    // log a line of level without checking the level threshold again
+    // (used by APF_LOG_* after the call site check)
+    virtual void Write(LogLevel level, const char* tag, const char* format, ...)=0;
+    // limit the lines of tag to rate lines per second with bursts of burst lines
+    // (token bucket, rate 0: no rate limit) and log one of every sample lines
+    // (0, 1: every line). lines over the limit are dropped before they are
+    // formatted (the flight recorder still gets them), a Warn line
+    // "suppressed N lines" is logged for the tag every second while lines are dropped.
+    // rate 0 and sample 0 remove the limit, false when LOG_MAX_TAG_LIMITS tags have limits
+    virtual bool SetTagLimit(const char* tag, long rate, long burst, long sample)=0;
+    // get the limit of the lines of tag of a call site (site: any address of
+    // the call site), added with rate, burst and sample (see SetTagLimit) at
+    // first. like the cells of GetTagLevel it outlives the log, the call site
+    // gets it again when its cell is stale (used by APF_LOG_LIMIT_AT)
+    virtual LogLimit* GetLimit(const void* site, const char* tag, long rate, long burst, long sample)=0;
+    // log a line of level through limit (see GetLimit), without checking
+    // the level threshold again (used by APF_LOG_LIMIT_AT)
+    virtual void WriteLimited(LogLimit* limit, LogLevel level, const char* tag, const char* format, ...)=0;
+    // log a structured line: message and typed fields (see LogFields), fields
+    // are written as key=value in LOG_ENCODING_TEXT and LOG_ENCODING_LOGFMT,
+    // as keys of the object in LOG_ENCODING_JSON and as a fields record in
+    // LOG_ENCODING_BINARY (logviewer can filter on them)
+    virtual void WriteFields(LogLevel level, const char* tag, const char* message, const LogFields& fields)=0;
     // log info
     virtual void Info(const char* tag, const char* format, ...)=0;
     // log warning
@@ -64,4 +328,70 @@ public:
     virtual void Debug(const char* tag, const char* format, ...)=0;
 };
 
+// log a line if level passes the threshold of tag, the threshold cell is resolved
+// once per call site (again after its log is destroyed), a filtered line costs
+// a load and a compare
+// note: tag must be the same string at a call site, and a call site logs to one log
+#define APF_LOG_AT(log, level, tag, ...) \
+    do { \
+        static volatile long* apf_tag_level_ = NULL; \
+        if (NULL == apf_tag_level_) { \
+            apf_tag_level_ = (log)->GetTagLevel(tag); \
+        } \
+        if ((level) >= *apf_tag_level_) { \
+            if (LOG_LEVEL_STALE == *apf_tag_level_) { \
+                apf_tag_level_ = (log)->GetTagLevel(tag); \
+            } \
+            if ((level) >= *apf_tag_level_) { \
+                (log)->Write(level, tag, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+// as APF_LOG_AT, the call site logs at most rate lines per second with bursts
+// of burst lines and one of every sample lines (see LogLimit), the other lines
+// are dropped before they are formatted and counted in "suppressed N lines".
+// the limit belongs to the log, it is resolved with the threshold cell
+// note: rate, burst and sample are constants
+// eg. APF_LOG_LIMIT_AT(log, LOG_LEVEL_ERROR, "db", 10, 20, 0, "query failed: %s", err);
+#define APF_LOG_LIMIT_AT(log, level, tag, rate, burst, sample, ...) \
+    do { \
+        static volatile long* apf_tag_level_ = NULL; \
+        static LogLimit* volatile apf_limit_ = NULL; \
+        if (NULL == apf_tag_level_) { \
+            apf_tag_level_ = (log)->GetTagLevel(tag); \
+        } \
+        if ((level) >= *apf_tag_level_) { \
+            if (LOG_LEVEL_STALE == *apf_tag_level_ || NULL == apf_limit_) { \
+                apf_tag_level_ = (log)->GetTagLevel(tag); \
+                apf_limit_ = (log)->GetLimit((const void*)&apf_limit_, tag, rate, burst, sample); \
+            } \
+            if ((level) >= *apf_tag_level_) { \
+                (log)->WriteLimited(apf_limit_, level, tag, __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+// eg. APF_LOG_DEBUG(log, "net", "recv %d bytes", len);
+#if LOG_COMPILE_LEVEL <= 0
+#define APF_LOG_DEBUG(log, tag, ...) APF_LOG_AT(log, LOG_LEVEL_DEBUG, tag, __VA_ARGS__)
+#else
+#define APF_LOG_DEBUG(log, tag, ...) do {} while (0)
+#endif
+#if LOG_COMPILE_LEVEL <= 1
+#define APF_LOG_INFO(log, tag, ...) APF_LOG_AT(log, LOG_LEVEL_INFO, tag, __VA_ARGS__)
+#else
+#define APF_LOG_INFO(log, tag, ...) do {} while (0)
+#endif
+#if LOG_COMPILE_LEVEL <= 2
+#define APF_LOG_WARN(log, tag, ...) APF_LOG_AT(log, LOG_LEVEL_WARN, tag, __VA_ARGS__)
+#else
+#define APF_LOG_WARN(log, tag, ...) do {} while (0)
+#endif
+#if LOG_COMPILE_LEVEL <= 3
+#define APF_LOG_ERROR(log, tag, ...) APF_LOG_AT(log, LOG_LEVEL_ERROR, tag, __VA_ARGS__)
+#else
+#define APF_LOG_ERROR(log, tag, ...) do {} while (0)
+#endif
+
 #endif // ILOG_H_INCLUDED
@@ -19,15 +19,33 @@
 #define LOG_H
 
 #include <string>
+#include <map>
+#include <vector>
+#include <stdarg.h>
 #include "oscore.h"
 #include "interface.h"
 #include "ilog.h"
+#include "logbinary.h"
+#include "logsink.h"
+#include "logrecorder.h"
+#include "logstaging.h"
 
 #define DEFAULT_SUFFIX ".log"
+#define BINARY_SUFFIX  ".blog"
 #define DEFAULT_FILE_SIZE 10*1024*1024 //10MB
 #define DEFAULT_PORT   4096
 #define DEFAULT_TARGETS LOG_TARGET_FILE
 #define DEFAULT_BACKUP_STRATEGY LOG_BACKUP_ONE_FILE
+#define DEFAULT_ASYNC_CAPACITY 4096
+#define LOG_LEVEL_COUNT (LOG_LEVEL_ERROR + 1)
+// max lines the writer thread writes per lock
+#define LOG_WRITE_BATCH 256
+// max tags with a limit (power of 2)
+#define LOG_MAX_TAG_LIMITS 64
+// max tags with their own level found without a lock (power of 2)
+#define LOG_MAX_TAG_LEVELS 64
+// time between summaries of suppressed lines (ms)
+#define LOG_LIMIT_REPORT_MS 1000
 
 class Log : public ILog {
 APF_BEGIN_CLASS()
@@ -49,6 +67,58 @@ public:
     virtual void SetFile(const char* path, const char* name, LogBackupStrategy type, long max_size);
     // set net log addr (UDP)
     virtual void SetAddr(const char* host, unsigned short port);
+    // set fraction of second in the log time
+    virtual void SetTimePrecision(LogTimePrecision precision);
+    // set encoding of lines
+    virtual void SetEncoding(LogEncoding encoding);
+    // set writer of the file target
+    virtual void SetFileWriter(LogFileWriter writer, long window_size);
+    // set retention of rotated log files
+    virtual void SetFileRetention(int max_files, long max_bytes, const char* compress_command);
+    // set durability of the file target
+    virtual void SetFileDurability(LogDurability durability, int sync_interval_ms, long sync_bytes, bool sync_errors);
+    // enable or disable async logging
+    virtual void SetAsync(bool enable, long capacity, LogOverflowPolicy policy);
+    // give every thread logging asynchronously its own buffer
+    virtual void SetThreadBuffers(long thread_bytes, int merge_window_us);
+    // wait until all lines logged before the call are written
+    virtual void Flush();
+    // get log counters
+    virtual void GetStats(LogStats* stats);
+    // set level threshold of tags without own level
+    virtual void SetLevel(LogLevel level);
+    // set level threshold of tag
+    virtual void SetTagLevel(const char* tag, LogLevel level);
+    // tag uses the level set by SetLevel again
+    virtual void ClearTagLevel(const char* tag);
+    // get level threshold cell of tag
+    virtual volatile long* GetTagLevel(const char* tag);
+    // would a line of level and tag be logged
+    virtual bool IsLevelEnabled(LogLevel level, const char* tag);
+    // add sink as target
+    virtual bool AddSink(int target, ILogSink* sink);
+    // remove a sink added by AddSink
+    virtual void RemoveSink(int target);
+    // give target its own queue and thread
+    virtual void SetSinkQueue(int target, long capacity, int batch, LogOverflowPolicy policy);
+    // get counters of target
+    virtual bool GetSinkStats(int target, LogSinkStats* stats);
+    // keep recent lines of every thread in a flight recorder
+    virtual void SetRecorder(LogLevel level, long thread_bytes, int dump_lines, LogRecorderDump dump);
+    // dump the flight recorder to the file target
+    virtual void DumpRecorder();
+    // write the flight recorder to the crash file (signal handler)
+    virtual void DumpRecorderOnCrash();
+    // log a line of level without checking the level threshold again
+    virtual void Write(LogLevel level, const char* tag, const char* format, ...);
+    // limit the lines of tag
+    virtual bool SetTagLimit(const char* tag, long rate, long burst, long sample);
+    // get the limit of a call site
+    virtual LogLimit* GetLimit(const void* site, const char* tag, long rate, long burst, long sample);
+    // log a line through the limit of its call site
+    virtual void WriteLimited(LogLimit* limit, LogLevel level, const char* tag, const char* format, ...);
+    // log a structured line
+    virtual void WriteFields(LogLevel level, const char* tag, const char* message, const LogFields& fields);
     // log info
     virtual void Info(const char* tag, const char* format, ...);
     // log warning
@@ -57,32 +127,231 @@ public:
     virtual void Error(const char* tag, const char* format, ...);
     // log debug
     virtual void Debug(const char* tag, const char* format, ...);
+
+    // encoding of lines (used by sinks)
+    LogEncoding encoding() const { return encoding_; }
+    // format string of a binary format id (used by sinks)
+    const char* GetFormat(uint32_t id) const { return formats_[id].text; }
+    // style of text lines of the encoding
+    LogLineStyle LineStyle() const {
+        return (LOG_ENCODING_JSON == encoding_) ? LOG_LINE_JSON
+                : (LOG_ENCODING_LOGFMT == encoding_) ? LOG_LINE_LOGFMT : LOG_LINE_TEXT;
+    }
+    // format a record (see logbinary.h) in style, return length of the text
+    int  FormatRecord(LogLineStyle style, const char* record, int len, char* out, int size) const;
 protected:
-    void LogCheck();
+    // ring slot, free when sequence == pos, filled when sequence == pos + 1
+    // (bounded queue of Dmitry Vyukov)
+    struct LogSlot {
+        volatile long sequence;
+        int  level;
+        int  len;
+        // chunk of a line longer than data, NULL: in data
+        char* chunk;
+        // an Error line dumping the flight recorder: its position in the recorder
+        // (-1: no dump), thread of the line
+        long dump;
+        unsigned long thread;
+        char data[MAX_LOG_LEN+1];
+    };
+    // binary format of a call site
+    struct LogFormat {
+        // address of the format string, NULL when the entry is free
+        const char* volatile format;
+        // copy of the format string, the address may hold another one later
+        char* text;
+        // 0: parsing, 1: ready, -1: can not be encoded
+        volatile long state;
+        // value kinds of the arguments ('*' included)
+        unsigned char kinds[LOG_MAX_FORMAT_ARGS];
+        int  kind_count;
+    };
+    // level threshold of a tag
+    struct TagLevel {
+        // call site cell: lowest level logged or recorded, LogLevel
+        volatile long level;
+        // threshold of lines logged, LogLevel
+        volatile long threshold;
+        // set by SetTagLevel, otherwise follows SetLevel
+        bool own;
+        // the tag (key in tag_levels_)
+        const char* tag;
+    };
+    // find (add) the level of tag, level_mutex_ must be held
+    TagLevel* FindTagLevel(const char* tag);
+    // update min_level_, max_level_ and the call site cells, level_mutex_ must be held
+    void UpdateLevelBounds();
+    // would a line pass the limit of tag (no limit: true)
+    bool PassTagLimit(const char* tag);
+    // would a line pass limit, counts the line suppressed otherwise
+    bool PassLimit(LogLimit* limit);
+    // add limit to the limits reported, once
+    void AddLimit(LogLimit* limit, const char* tag, const char* format);
+    // log the lines suppressed by every limit since the last summary
+    // (force: now, otherwise when LOG_LIMIT_REPORT_MS passed)
+    void ReportSuppressed(bool force);
+    // log a summary line of tag
+    void WriteSummary(const char* tag, const char* format, ...);
+    // find the sink of target, mutex_ must be held
+    LogSinkQueue* FindSink(int target);
+    // get (add) binary format id, -1 when the format can not be encoded
+    int  FindFormat(const char* format);
+    // encode a line record, return 0 when the format can not be encoded
+    // return the size it needs (> size) when strings were cut to size
+    int  EncodeLine(char* buf, int size, int level, const char* tag, const char* format, va_list ap);
+    // encode text records (several for a text longer than a record), return their length
+    int  EncodeText(char* buf, int size, int level, const char* text, int len);
     void WriteLog(char* data, int len);
+    // hand a line to the sinks of targets, mutex_ must be held
+    void WriteTargets(const char* data, int len, int level);
+    // format a text line in the style of the encoding into size bytes of buf and '\0'
+    // return its length, or the size it needs (> size) when it was cut to size
+    int  FormatText(char* buf, int size, int level, const char* tag, const char* format, va_list ap);
+    // format a structured line in the style of the encoding, return as FormatText
+    int  FormatFields(char* buf, int size, int level, const char* tag, const char* message, const LogFields& fields);
+    // buffer to format a line into: stack_buf, a ring slot or the staging buffer (async)
+    // NULL when the line is dropped
+    char* ReserveLine(int level, char* stack_buf, LogSlot** slot, LogStaging::Buffer** buffer);
+    // chunk of size bytes for a line longer than the buffer reserved, held by slot or
+    // buffer until the line is written (async), otherwise freed by the caller
+    char* SpillLine(int size, LogSlot* slot, LogStaging::Buffer* buffer);
+    // format and write (or queue) a line (output), record it (level >= recorder_level_)
+    void LogV(int level, const char* tag, const char* format, va_list ap, bool output);
+    // append a line to the flight recorder
+    void RecordLine(int level, const char* tag, const char* format, va_list ap);
+    // write the lines recorded by thread (0: all threads) to the file target, the
+    // lines of mark_thread up to position mark (-1: all)
+    // locked: mutex_ is held by the caller (writer thread)
+    void Dump(unsigned long thread, unsigned long mark_thread, long mark, const char* reason, bool locked);
+    // queue the dump of an Error line of thread at recorder position mark
+    void AddDump(unsigned long thread, long mark);
+    // write the dumps queued by AddDump, mutex_ must be held
+    void WriteDumps();
+    // write a line (slot and buffer are NULL), publish its slot or staged line
+    void CommitLine(LogSlot* slot, LogStaging::Buffer* buffer, char* buf, int len, int level);
+    // reserve a ring slot, NULL when the line is dropped
+    LogSlot* ReserveSlot(int level);
+    // publish a reserved slot
+    void CommitSlot(LogSlot* slot, int level);
+    // reserve a line in the staging buffer, NULL when the line is dropped
+    char* ReserveStaged(LogStaging::Buffer* buffer, int level);
+    // wake the writer thread up if it is waiting
+    void WakeWriter();
+    // write all filled slots, return lines written
+    int  DrainRing();
+    // write the staged lines older than the merge window by time, return lines written
+    int  DrainStaging();
+    // wait until the lines logged before are handed to the targets by the writer thread
+    void WaitWriter();
+    // writer thread entry
+    static void* WriterThread(void* arg);
+    // stop writer thread after the ring is drained
+    void StopAsync();
+    // wait until the lines logged are synced to the log file
+    void SyncFile();
 private:
-    // log file's path
-    std::string path_;
-    // log file name (exclude path and suffix)
-    std::string name_;
-    // log file suffix
-    std::string suffix_;
-    // max file size
-    long max_file_size_;
-    // log file backup strategy
-    LogBackupStrategy log_backup_strategy_;
-    // mutex
+    // mutex (targets and sinks)
     pthread_mutex_t mutex_;
     // log targets
     int targets_;
-    // file
-    FILE*  file_;
-    // UDP socket use to send log to net
-    SOCKET log_socket_;
-    // target sockaddr
-    sockaddr_in target_addr_;
-    // current log file day
-    unsigned long current_log_file_day_;
+    // sinks of built-in and user targets
+    std::vector<LogSinkQueue*> sinks_;
+    // LOG_TARGET_FILE
+    FileSink* file_sink_;
+    // LOG_TARGET_NET
+    NetSink* net_sink_;
+    // Error waits until its line is synced
+    volatile bool sync_errors_;
+    // level threshold of tags without own level
+    volatile long level_;
+    // lowest and highest threshold of all tags, lines are checked
+    // against them first, tags are looked up only between them
+    volatile long min_level_;
+    volatile long max_level_;
+    // tag levels, call sites keep the cells: they are left stale, not freed,
+    // by the destructor
+    std::map<std::string, TagLevel*> tag_levels_;
+    // tags ever given their own level (hashed by tag), IsLevelEnabled finds
+    // them without the lock, the other tags follow level_
+    TagLevel* volatile tag_table_[LOG_MAX_TAG_LEVELS];
+    // a tag did not fit in tag_table_, the others are looked up in tag_levels_
+    volatile long tag_table_full_;
+    // mutex (tag levels and tag limits)
+    pthread_mutex_t level_mutex_;
+    // limits of tags (hashed by tag), NULL before the first SetTagLimit
+    LogLimit* volatile tag_limits_;
+    // limits of call sites by site, call sites keep them: they are not freed
+    // by the destructor
+    std::map<const void*, LogLimit*> site_limits_;
+    // limits of tags and call sites, linked by LogLimit::next
+    LogLimit* volatile limits_;
+    // time of the next summary of suppressed lines (ms, clock_tick_us)
+    volatile long report_at_;
+    // lines suppressed by limits
+    volatile long suppressed_;
+    // flight recorder
+    LogRecorder recorder_;
+    // lowest level recorded, LOG_LEVEL_COUNT: disabled
+    volatile long recorder_level_;
+    // max lines of a dump
+    int dump_lines_;
+    LogRecorderDump dump_;
+    // {path}/{name}-crash.blog
+    char crash_file_[512];
+    // encoding of lines
+    LogEncoding encoding_;
+    // binary formats, indexed by id
+    LogFormat* formats_;
+    // chunks of long lines (direct and ring)
+    LogChunkPool chunks_;
+    // fraction of second in the log time
+    LogTimePrecision time_precision_;
+    // async logging enabled
+    volatile bool async_;
+    // async overflow policy
+    LogOverflowPolicy overflow_policy_;
+    // ring capacity asked for
+    long async_capacity_;
+    // async ring
+    LogSlot* ring_;
+    // ring capacity - 1
+    long ring_mask_;
+    // next position to reserve (callers), own cache line
+    char enqueue_pad_[64];
+    volatile long enqueue_pos_;
+    // next position to write (writer thread), own cache line
+    char dequeue_pad_[64 - sizeof(long)];
+    volatile long dequeue_pos_;
+    char stats_pad_[64 - sizeof(long)];
+    // staging buffers of threads (async)
+    LogStaging staging_;
+    long staging_size_;
+    int  merge_window_us_;
+    // > 0: staged lines are written without waiting for the merge window
+    volatile long staging_force_;
+    // lines collected by the writer thread
+    std::vector<LogStagedLine> staged_lines_;
+    // dumps asked by the Error lines of a batch of the writer thread, one per
+    // thread up to its last Error line, written after the batch
+    struct DumpRequest {
+        unsigned long thread;
+        long mark;
+    };
+    std::vector<DumpRequest> dumps_;
+    // writer thread
+    pthread_t writer_thread_;
+    // writer thread waits on it while the ring is empty
+    sem_t writer_sem_;
+    // 1 while writer thread is waiting on writer_sem_
+    volatile long writer_idle_;
+    // writer thread should exit after the ring is drained
+    volatile bool writer_stop_;
+    // lines handed to targets
+    volatile long written_;
+    // lines dropped per level
+    volatile long dropped_[LOG_LEVEL_COUNT];
+    // times a caller waited for a full ring
+    volatile long blocked_;
 };
 
 #endif // LOG_H
@@ -0,0 +1,50 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef LOGCHUNK_H
+#define LOGCHUNK_H
+
+#include <vector>
+#include "oscore.h"
+
+// size classes of chunks: LOG_CHUNK_MIN << 0 .. LOG_CHUNK_CLASSES - 1,
+// bigger chunks are allocated and freed every time
+#define LOG_CHUNK_MIN     (4*1024)
+#define LOG_CHUNK_CLASSES 9
+// bytes of free chunks kept per size class (one chunk at least)
+#define LOG_CHUNK_KEEP    (256*1024)
+
+// chunks of lines longer than the fixed line buffers (MAX_LOG_LEN)
+// a chunk is taken by the thread formatting a long line and given back by
+// the one writing it, freed chunks are kept for the next long lines
+class LogChunkPool {
+public:
+    LogChunkPool();
+    ~LogChunkPool();
+
+    // chunk of at least size bytes
+    char* Alloc(int size);
+    // give back a chunk of Alloc
+    void  Free(char* chunk);
+private:
+    // free chunks per size class
+    std::vector<char*> free_[LOG_CHUNK_CLASSES];
+    // mutex (free chunks), long lines are rare
+    pthread_mutex_t mutex_;
+};
+
+#endif // LOGCHUNK_H
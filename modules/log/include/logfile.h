@@ -0,0 +1,232 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef LOGFILE_H
+#define LOGFILE_H
+
+#include <stdio.h>
+#include <string>
+#include <deque>
+#include "oscore.h"
+
+// default size of a mapped window of a log file
+#define LOG_MMAP_WINDOW (4*1024*1024)
+
+class LogArchiver;
+
+// log file written by fwrite (LOG_FILE_STDIO) or by memcpy into mmapped
+// windows (LOG_FILE_MMAP).
+// a helper thread prepares the next file (and the next window of the file),
+// and closes and renames a rotated file, so the writer never waits on the
+// filesystem: it switches to a window or file which is ready already.
+// a mmapped file is longer than its lines while it is open (preallocated zeros),
+// it is truncated to its lines when it is closed or rotated.
+// syncs (fdatasync) run on the helper thread too: positions in the bytes
+// written are committed by the writer, WaitSynced waits for a position
+// and all callers waiting meanwhile share the next sync (group commit).
+// note: not thread safe, the caller serializes the calls (except WaitSynced)
+class LogFile {
+public:
+    LogFile();
+    ~LogFile();
+
+    // open file_name to append, the next file is prepared as next_name.
+    // window_size: bytes of a mapped window, 0: stdio
+    // binary: records of logbinary.h, otherwise text lines ending with "\n\0"
+    // (the end of the data of a mapped file that was not closed)
+    // archiver: rotated files are handed to it (may be NULL)
+    bool Open(const char* file_name, const char* next_name, long window_size, bool binary,
+              LogArchiver* archiver);
+    // close the file (truncate it if mapped)
+    void Close();
+    bool is_open() const { return NULL != window_ || NULL != stdio_; }
+    // name of the file
+    const std::string& file_name() const { return file_name_; }
+    // bytes written to the file
+    long size() const { return size_; }
+    // append data
+    void Write(const char* data, long len);
+    // flush stdio buffer (mapped windows are in the page cache already)
+    void Flush();
+    // continue in the prepared next file, it is renamed to file_name,
+    // the current file is renamed to backup_name first (if not empty).
+    // return false (the current file is kept) if the next file could not be created
+    bool Rotate(const char* file_name, const char* backup_name);
+    // times the writer waited for a window or file not ready yet
+    long stalls() const { return stalls_; }
+    // sync every interval_ms or bytes committed in the background (0: never),
+    // enable: WaitSynced can be used and rotated or closed files are synced
+    void SetSync(int interval_ms, long bytes, bool enable);
+    // bytes written are in the OS now (stdio flushed), return their position
+    int64_t Commit();
+    // wait until position is synced
+    void WaitSynced(int64_t position);
+    // syncs done
+    long syncs() const { return syncs_; }
+protected:
+    // a mapped window
+    struct Window {
+        int   fd;
+        char* base;
+        long  offset;
+    };
+    // helper thread jobs
+    enum JobType {
+        // map the window of fd at offset
+        JOB_WINDOW,
+        // create (and map) the next file
+        JOB_FILE,
+        // unmap base
+        JOB_UNMAP,
+        // close stdio or truncate and close fd (sync it first if enabled),
+        // rename from to backup, rename next to to, archive the rotated file
+        JOB_FINISH,
+        // sync the current file
+        JOB_SYNC,
+        JOB_STOP
+    };
+    struct Job {
+        Job() : type(JOB_STOP), fd(-1), offset(0), position(0), base(NULL), stdio(NULL) {}
+        JobType type;
+        int   fd;
+        long  offset;
+        // position of the end of a rotated file
+        int64_t position;
+        char* base;
+        FILE* stdio;
+        std::string from;
+        std::string backup;
+        std::string to;
+    };
+    // preallocate and map a window, base is NULL if it failed
+    Window MapWindow(int fd, long offset);
+    // queue a job, mutex_ must be held
+    void PushJob(const Job& job);
+    // the next file is prepared, mutex_ must be held
+    bool NextFileReady() const;
+    // queue a JOB_SYNC if none is queued, mutex_ must be held
+    void RequestSync();
+    // a sync is done, synced is the position synced (-1: none), wake WaitSynced
+    void SyncDone(int64_t synced);
+    // switch to the next window of the file, false if it can not be mapped
+    bool NextWindow();
+    // run a job on the helper thread
+    void RunJob(const Job& job);
+    // helper thread entry
+    static void* HelperThread(void* arg);
+private:
+    std::string file_name_;
+    std::string next_name_;
+    // 0: stdio
+    long window_size_;
+    LogArchiver* archiver_;
+    // current file (stdio)
+    FILE* stdio_;
+    // current window (mmap)
+    int   fd_;
+    char* window_;
+    long  window_offset_;
+    long  window_pos_;
+    // bytes in the file
+    long  size_;
+    // prepared by the helper thread, NULL until it is ready
+    Window next_window_;
+    Window next_file_;
+    FILE* next_stdio_;
+    // the helper thread failed to prepare them
+    bool window_failed_;
+    bool file_failed_;
+    volatile long stalls_;
+    // sync settings
+    bool sync_;
+    int  sync_interval_;
+    long sync_bytes_;
+    // bytes written to all files (writer)
+    int64_t total_;
+    // positions committed by the writer, requested to sync and synced
+    int64_t committed_;
+    int64_t sync_requested_;
+    int64_t synced_;
+    // a JOB_SYNC is queued
+    bool sync_pending_;
+    // rotated files not finished by the helper thread yet
+    int  finishing_;
+    // time of the last sync (us)
+    uint64_t last_sync_;
+    // callers waiting in WaitSynced
+    int  sync_waiters_;
+    sem_t sync_sem_;
+    volatile long syncs_;
+    // jobs of the helper thread
+    std::deque<Job> jobs_;
+    pthread_mutex_t mutex_;
+    sem_t sem_;
+    pthread_t thread_;
+};
+
+// compresses rotated log files and removes the oldest ones on its own thread,
+// so neither the writer nor the helper thread of a LogFile waits on it.
+// rotated files of path/name are the files named name-YYYY-MM-DD{suffix}
+// (LOG_BACKUP_DATE_FILE) or name_bk{suffix} (LOG_BACKUP_ONE_FILE), with an
+// extension of the compressor or not (eg. .gz), the current file is never removed.
+class LogArchiver {
+public:
+    LogArchiver();
+    ~LogArchiver();
+
+    // set files to archive
+    void SetFiles(const char* path, const char* name, const char* suffix);
+    // set the current file
+    void SetCurrent(const std::string& file_name);
+    // keep at most max_files rotated files of at most max_bytes in total (0: no limit),
+    // compress_command is run with a rotated file name appended (NULL or "": no compression)
+    void SetRetention(int max_files, long max_bytes, const char* compress_command);
+    // compress a rotated file and apply the retention
+    void Archive(const std::string& file_name);
+    // apply the retention
+    void Clean();
+    // finish queued jobs and stop the thread
+    void Stop();
+protected:
+    // queue a job ("": retention only), start the thread if needed
+    void PushJob(const std::string& file_name);
+    // run compress_command on a file
+    void Compress(const std::string& command, const std::string& file_name);
+    // remove the oldest rotated files
+    void Retain(const std::string& path, const std::string& name, const std::string& suffix,
+                const std::string& current, int max_files, long max_bytes);
+    // archiver thread entry
+    static void* ArchiverThread(void* arg);
+private:
+    std::string path_;
+    std::string name_;
+    std::string suffix_;
+    // current file name (exclude path)
+    std::string current_;
+    int  max_files_;
+    long max_bytes_;
+    std::string command_;
+    // rotated files to compress
+    std::deque<std::string> jobs_;
+    bool running_;
+    bool stop_;
+    pthread_mutex_t mutex_;
+    sem_t sem_;
+    pthread_t thread_;
+};
+
+#endif // LOGFILE_H
@@ -0,0 +1,98 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef LOGRECORDER_H
+#define LOGRECORDER_H
+
+#include <vector>
+#include "oscore.h"
+
+// max threads recorded by a flight recorder
+#define LOG_RECORDER_MAX_THREADS 256
+// max bytes of a record, longer ones are not recorded
+#define LOG_RECORDER_MAX_RECORD  4096
+
+// a record collected from a flight recorder
+struct LogRecorderEntry {
+    // time of the record (us since epoch)
+    int64_t time;
+    unsigned long thread;
+    // record in the collected data
+    size_t offset;
+    int len;
+};
+
+// flight recorder: every thread appends line records to its own ring of
+// recent records, without locks. a full ring drops its oldest records.
+// records are collected (dumped) by another thread while the rings are written:
+// a ring is copied, records overwritten during the copy are skipped.
+// ring entry: int64 time, record (starts with its uint16 size)
+class LogRecorder {
+public:
+    LogRecorder();
+    ~LogRecorder();
+
+    // size of the ring of each thread (0: disabled)
+    // rings of the old size are freed with the recorder
+    void SetSize(long thread_bytes);
+    bool enabled() const { return ring_size_ > 0; }
+    // append a record to the ring of the calling thread
+    void Record(int64_t time, const char* record, int len);
+    // position after the newest record of the calling thread (0: no ring)
+    long Mark();
+    // collect records of thread (0: all threads) not collected before, merged by time,
+    // the newest max_records of them (0: all). records of mark_thread after position
+    // mark (-1: none) are left to a later collect
+    void Collect(unsigned long thread, int max_records, unsigned long mark_thread, long mark,
+                 std::vector<LogRecorderEntry>* entries, std::vector<char>* data);
+    // call visit for the records of every ring without locks and allocation (crash)
+    // return records visited
+    int  Visit(void (*visit)(unsigned long thread, const char* record, int len, void* arg), void* arg);
+protected:
+    // ring of a thread
+    struct Ring {
+        char* data;
+        unsigned long thread;
+        // bytes written (end of the newest entry), written by the thread
+        volatile long head;
+        // start of the oldest entry, moved before its bytes are overwritten
+        volatile long tail;
+        // entries before are collected
+        long collected;
+    };
+    // ring of the calling thread, NULL if there are too many threads
+    Ring* ThreadRing();
+    // copy ring to buf, return first and end position of the entries intact in buf
+    void Snapshot(Ring* ring, char* buf, long* begin, long* end);
+    // copy len bytes at position pos of a ring buffer of ring_size_ bytes
+    void ReadRing(const char* data, long pos, void* out, long len);
+private:
+    long ring_size_;
+    // changed by SetSize, thread caches of rings of an old size are stale
+    volatile long generation_;
+    // rings of the current size
+    Ring* rings_[LOG_RECORDER_MAX_THREADS];
+    volatile long ring_count_;
+    // rings of old sizes
+    std::vector<Ring*> retired_;
+    // copy of a ring for Visit
+    char* crash_buf_;
+    // mutex (rings)
+    pthread_mutex_t mutex_;
+};
+
+#endif // LOGRECORDER_H
@@ -0,0 +1,258 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef LOGSINK_H
+#define LOGSINK_H
+
+#include <string>
+#include <vector>
+#include "oscore.h"
+#include "interface.h"
+#include "ilog.h"
+#include "logbinary.h"
+#include "logfile.h"
+#include "logchunk.h"
+
+// bytes of the line buffers (stack, ring and queue slots), longer lines are moved to chunks
+#define MAX_LOG_LEN     1024
+// default lines per batch of a sink queue
+#define DEFAULT_SINK_BATCH 256
+// queued lines to wake the idle sink thread up
+#define LOG_WAKE_LINES  64
+// max time an idle writer/sink thread waits for lines (ms)
+#define LOG_WRITER_INTERVAL 10
+// interval to resend a binary format to net (s)
+#define LOG_FORMAT_RESEND_INTERVAL 10
+// max binary formats (call sites) per log, power of 2
+#define LOG_MAX_FORMATS 4096
+// max datagrams of a net sink per send (sendmmsg)
+#define LOG_NET_MAX_DATAGRAMS 64
+
+class Log;
+
+// runs a sink: writes lines directly, or queues them for its own thread
+class LogSinkQueue {
+public:
+    // own: delete sink with the queue
+    LogSinkQueue(int target, ILogSink* sink, bool own);
+    ~LogSinkQueue();
+
+    int target() const { return target_; }
+    ILogSink* sink() const { return sink_; }
+    // use a queue of capacity lines and a thread (0: write directly)
+    // note: Push must not be called at the same time
+    void SetQueue(long capacity, int batch, LogOverflowPolicy policy);
+    // lines pushed until EndBatch are written by one ILogSink::Write
+    // note: a direct sink keeps data of the lines until EndBatch
+    void BeginBatch();
+    // write or queue a line, calls are serialized by the log
+    void Push(const char* data, int len, int level);
+    // end of a batch of Push, write and flush the lines of a direct sink
+    void EndBatch();
+    // wait until pushed lines are written and flush the sink
+    void Flush();
+    // get counters
+    void GetStats(LogSinkStats* stats);
+protected:
+    // queued line
+    struct Slot {
+        int  level;
+        int  len;
+        // chunk of a line longer than data, NULL: in data
+        char* chunk;
+        char data[MAX_LOG_LEN+1];
+    };
+    // write lines with the sink (flush it after them) and count them
+    void WriteLines(const LogLine* lines, int count, bool flush);
+    // write a batch of queued lines, return lines written
+    int  Drain();
+    // wake the sink thread up if it is waiting
+    void Wake();
+    // drain the queue and stop the sink thread
+    void StopQueue();
+    // sink thread entry
+    static void* SinkThread(void* arg);
+private:
+    // target bit
+    int target_;
+    ILogSink* sink_;
+    bool own_;
+    // queue (single producer: the log, single consumer: sink thread)
+    Slot* slots_;
+    // chunks of long lines queued
+    LogChunkPool chunks_;
+    // capacity - 1
+    long mask_;
+    int  batch_;
+    LogOverflowPolicy policy_;
+    // next slot to push
+    volatile long head_;
+    // next slot to write
+    volatile long tail_;
+    // lines of a batch (sink thread)
+    std::vector<LogLine> lines_;
+    // lines between BeginBatch and EndBatch (direct)
+    std::vector<LogLine> batch_lines_;
+    bool batching_;
+    // sink thread
+    pthread_t thread_;
+    bool running_;
+    // sink thread waits on it while the queue is empty
+    sem_t sem_;
+    // 1 while sink thread is waiting on sem_
+    volatile long idle_;
+    // sink thread should exit after the queue is drained
+    volatile bool stop_;
+    // counters
+    volatile long written_;
+    volatile long dropped_;
+    volatile long blocked_;
+    volatile long batches_;
+    uint64_t write_us_;
+    uint64_t max_write_us_;
+};
+
+// LOG_TARGET_FILE
+class FileSink : public ILogSink {
+public:
+    FileSink(Log* log);
+    virtual ~FileSink();
+
+    // set log file, reopen it if it is open
+    void SetFile(const char* path, const char* name, LogBackupStrategy strategy, long max_size);
+    // set file suffix, reopen the file if it is open
+    void SetSuffix(const char* suffix);
+    // write with stdio or mmap, reopen the file if it is open
+    void SetWriter(LogFileWriter writer, long window_size);
+    // set retention and compression of rotated files
+    void SetRetention(int max_files, long max_bytes, const char* compress_command);
+    // set durability of lines
+    void SetDurability(LogDurability durability, int sync_interval_ms, long sync_bytes, bool sync_errors);
+    // flush and wait until the lines written are synced (sync_errors)
+    void Sync();
+    // open log file if it is not open
+    void Open();
+    // close log file
+    void Close();
+    bool is_open();
+
+    virtual void Write(const LogLine* lines, int count);
+    virtual void Flush();
+protected:
+    // backup or switch log file, mutex_ must be held
+    // only compares the size and the time: the file is renamed and the next
+    // one opened by the helper thread of file_
+    void LogCheck();
+    // bytes in the log file
+    long FileSize();
+    // continue in file_name, the current file is renamed to backup_file_name first (if not empty)
+    void SwitchFile(const std::string& file_name, const std::string& backup_file_name);
+    // open file_name with the writer
+    void OpenFile(const char* file_name);
+    // a file was opened, write binary file header if needed
+    void FileOpened();
+    void CloseFile();
+    // append to the log file
+    void WriteBytes(const char* data, int len);
+    // name of the current log file
+    std::string FileName();
+private:
+    Log* log_;
+    // log file's path
+    std::string path_;
+    // log file name (exclude path and suffix)
+    std::string name_;
+    // log file suffix
+    std::string suffix_;
+    // max file size
+    long max_file_size_;
+    // log file backup strategy
+    LogBackupStrategy log_backup_strategy_;
+    // next local midnight (LOG_BACKUP_DATE_FILE)
+    time_t rotate_time_;
+    // compresses and removes rotated files (destroyed after file_)
+    LogArchiver archiver_;
+    // current log file
+    LogFile file_;
+    LogDurability durability_;
+    // window size of LOG_FILE_MMAP, 0: LOG_FILE_STDIO
+    long mmap_window_;
+    // binary formats written to the current file, indexed by id
+    std::vector<bool> formats_written_;
+    // mutex (file)
+    pthread_mutex_t mutex_;
+};
+
+// LOG_TARGET_NET
+class NetSink : public ILogSink {
+public:
+    NetSink(Log* log);
+    virtual ~NetSink();
+
+    // set net log addr (UDP)
+    void SetAddr(const char* host, unsigned short port);
+    // create socket
+    void Open();
+    // close socket
+    void Close();
+
+    // lines are packed into datagrams of up to LOG_NET_DATAGRAM_SIZE
+    // bytes, all datagrams of a call are sent with a few sendmmsg
+    virtual void Write(const LogLine* lines, int count);
+    virtual void Flush() {}
+protected:
+    // room of len bytes in the current datagram, a new one is started if it is full
+    char* Reserve(int len);
+    // add text as TEXT records, split to fit datagrams
+    void AddText(const char* text, int len, int level);
+    // add a binary record (and its format), a record too long for a datagram is sent as text
+    void AddRecord(const char* record, int len, int level);
+    // send the datagrams, mutex_ must be held
+    void Send();
+private:
+    Log* log_;
+    // UDP socket use to send log to net
+    SOCKET log_socket_;
+    // random id of the sender
+    uint32_t sender_;
+    // sequence of the next datagram
+    uint32_t sequence_;
+    // LOG_NET_MAX_DATAGRAMS datagrams of LOG_NET_DATAGRAM_SIZE bytes
+    std::vector<char> datagrams_;
+    int  lens_[LOG_NET_MAX_DATAGRAMS];
+    // datagrams filled, the last one is open
+    int  count_;
+    // target sockaddr
+    sockaddr_in target_addr_;
+    // last time a binary format was sent, indexed by id
+    std::vector<time_t> formats_sent_;
+    // mutex (socket)
+    pthread_mutex_t mutex_;
+};
+
+// LOG_TARGET_CONSOLE
+class ConsoleSink : public ILogSink {
+public:
+    ConsoleSink(Log* log) : log_(log) {}
+
+    virtual void Write(const LogLine* lines, int count);
+    virtual void Flush();
+private:
+    Log* log_;
+};
+
+#endif // LOGSINK_H
@@ -0,0 +1,100 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef LOGSTAGING_H
+#define LOGSTAGING_H
+
+#include <vector>
+#include "oscore.h"
+#include "interface.h"
+#include "ilog.h"
+#include "logchunk.h"
+
+// max threads with a staging buffer, other threads use the shared ring
+#define LOG_STAGING_MAX_THREADS 256
+// bytes a thread publishes before it signals the writer thread
+#define LOG_STAGING_CHUNK       (16*1024)
+
+// a line collected from the staging buffers
+struct LogStagedLine {
+    // time of the line (us since epoch)
+    int64_t time;
+    LogLine line;
+    // an Error line dumping the flight recorder: its position in the recorder
+    // (-1: no dump), thread of the line
+    long dump;
+    unsigned long thread;
+};
+
+// staging buffers of async logging: every thread formats its lines into
+// a buffer of its own (single producer: the thread, single consumer: the
+// writer thread), logging threads share no memory.
+// the writer collects the lines of all buffers up to a time and merges them by time.
+// buffer entry: int64 time, int32 level, int32 len, line and '\0', 8 bytes aligned
+// a line too long for its entry is in a chunk, the entry holds its address
+class LogStaging {
+public:
+    // buffer of a thread
+    struct Buffer;
+
+    LogStaging();
+    ~LogStaging();
+
+    // size of the buffer of each thread (0: disabled, at least 4 chunks), frees the buffers
+    // note: no thread may use the buffers (async logging is stopped)
+    void SetSize(long thread_bytes);
+    bool enabled() const { return size_ > 0; }
+    long size() const { return size_; }
+    // buffer of the calling thread, NULL if there are too many threads
+    Buffer* ThreadBuffer();
+    // room for a line of up to max_len bytes and its '\0', NULL when more than
+    // limit bytes of the buffer would be used
+    char* Reserve(Buffer* buffer, int max_len, long limit);
+    // move the line reserved (of at least 8 bytes) to a chunk of size bytes
+    char* Spill(Buffer* buffer, int size);
+    // publish the line reserved (dump: position of an Error line dumping the flight
+    // recorder in it, -1: no dump)
+    // return true when the writer should be signalled
+    bool Commit(Buffer* buffer, int64_t time, int level, int len, long dump);
+
+    // collect the lines of all buffers up to time cutoff, merged by time
+    // the lines stay in the buffers until Release
+    int  Collect(int64_t cutoff, std::vector<LogStagedLine>* lines);
+    // free the lines collected
+    void Release();
+    // lines published and not released
+    long queued();
+    // get the end of the lines published to every buffer
+    void Mark(std::vector<long>* marks);
+    // are the lines before marks released
+    bool Released(const std::vector<long>& marks);
+private:
+    long size_;
+    // changed by SetSize, thread caches of freed buffers are stale
+    volatile long generation_;
+    Buffer* buffers_[LOG_STAGING_MAX_THREADS];
+    volatile long buffer_count_;
+    // buffers collected by the last Collect
+    long collected_count_;
+    // chunks of long lines, those collected by the last Collect
+    LogChunkPool chunks_;
+    std::vector<char*> collected_chunks_;
+    // mutex (buffers)
+    pthread_mutex_t mutex_;
+};
+
+#endif // LOGSTAGING_H
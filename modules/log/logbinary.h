@@ -0,0 +1,638 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef LOGBINARY_H_INCLUDED
+#define LOGBINARY_H_INCLUDED
+
+// binary log format (LOG_ENCODING_BINARY), shared by the log module and logviewer
+//
+// file:     LOG_BINARY_MAGIC, uint32 LOG_BINARY_BYTE_ORDER, records...
+// datagram: LOG_NET_MAGIC, uint32 sender, uint32 sequence, records...
+//           (LOG_TARGET_NET, text lines are sent as LOG_RECORD_TEXT)
+//           sender is random per log, sequence counts its datagrams,
+//           a gap in sequence is a lost datagram
+// record:   uint16 size (whole record), uint8 type, uint8 level, body
+//   LOG_RECORD_FORMAT: uint32 id, format string (size - header bytes, no '\0')
+//   LOG_RECORD_LINE:   uint32 id, int64 time (us since epoch), uint8 tag length, tag,
+//                      one value per conversion of the format:
+//                      integers, pointers: int64, floats: double,
+//                      strings: uint16 length + bytes, %% and %n: nothing
+//   LOG_RECORD_TEXT:   formatted line (size - header bytes)
+//   LOG_RECORD_FIELDS: int64 time, uint8 tag length, tag, uint16 message length, message,
+//                      uint8 field count, fields: uint8 LogFieldType, uint8 key length, key,
+//                      value: int64, double, uint8 bool or uint16 length + bytes
+// a line is one record, a text longer than a record is split into TEXT records
+// (only the last one ends with '\n', their texts are printed one after another)
+// numbers are in the byte order of the writer, the file header tells which.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include "logfields.h"
+
+#define LOG_BINARY_MAGIC         "APFBLOG1"
+#define LOG_BINARY_MAGIC_LEN     8
+#define LOG_BINARY_BYTE_ORDER    0x01020304
+#define LOG_BINARY_HEADER_LEN    (LOG_BINARY_MAGIC_LEN + 4)
+#define LOG_NET_MAGIC            "APFN"
+#define LOG_NET_MAGIC_LEN        4
+// magic + sender + sequence
+#define LOG_NET_HEADER_LEN       (LOG_NET_MAGIC_LEN + 4 + 4)
+// max datagram, ethernet MTU - IP and UDP headers
+#define LOG_NET_DATAGRAM_SIZE    1472
+
+// record header: size, type, level
+#define LOG_RECORD_HEADER_LEN    4
+// record header + id + time + tag length
+#define LOG_RECORD_LINE_LEN      (LOG_RECORD_HEADER_LEN + 4 + 8 + 1)
+// max size of a record
+#define LOG_RECORD_MAX_LEN       0xffff
+
+#define LOG_RECORD_FORMAT        1
+#define LOG_RECORD_LINE          2
+#define LOG_RECORD_TEXT          3
+#define LOG_RECORD_FIELDS        4
+
+// max conversions in a binary format
+#define LOG_MAX_FORMAT_ARGS      32
+
+// value kind of a printf conversion
+enum LogArgKind {
+    // %% or %n, no value
+    LOG_ARG_NONE,
+    // int, also the value of '*'
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_CHAR,
+    LOG_ARG_UCHAR,
+    LOG_ARG_SHORT,
+    LOG_ARG_USHORT,
+    LOG_ARG_LONG,
+    LOG_ARG_ULONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_ULLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER,
+    // %n, a pointer which is skipped
+    LOG_ARG_SKIP_POINTER
+};
+
+// a printf conversion
+struct LogSpec {
+    // '%'
+    const char* begin;
+    // flags, width and precision (without length), after '%'
+    const char* options;
+    int  options_len;
+    // '*' in width and precision
+    int  stars;
+    // conversion character
+    char conversion;
+    LogArgKind kind;
+};
+
+// level names, indexed by LogLevel
+inline const char* LogLevelName(int level) {
+    static const char* names[] = {"Debug", "Info", "Warn", "Error"};
+    return (level >= 0 && level < 4) ? names[level] : "?";
+}
+
+// find the next conversion from p
+// return the end of the conversion, NULL when there is no more conversion,
+// spec->kind is LOG_ARG_NONE and spec->conversion is 0 when it is not supported
+inline const char* LogNextSpec(const char* p, LogSpec* spec) {
+    p = strchr(p, '%');
+    if (NULL == p) {
+        return NULL;
+    }
+    spec->begin = p++;
+    spec->options = p;
+    spec->stars = 0;
+    spec->kind = LOG_ARG_NONE;
+    spec->conversion = 0;
+    if ('%' == *p) {
+        spec->options_len = 0;
+        spec->conversion = '%';
+        return p + 1;
+    }
+    while (*p && strchr("-+ #0", *p)) {
+        p++;
+    }
+    if ('*' == *p) {
+        spec->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if ('.' == *p) {
+        p++;
+        if ('*' == *p) {
+            spec->stars++;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    spec->options_len = (int)(p - spec->options);
+
+    // length: hh h l ll L q j z t
+    int length = 0;
+    if ('h' == p[0]) {
+        length = ('h' == p[1]) ? 'H' : 'h';
+    } else if ('l' == p[0]) {
+        length = ('l' == p[1]) ? 'q' : 'l';
+    } else if (p[0] && strchr("Lqjzt", p[0])) {
+        length = p[0];
+    }
+    if ('H' == length || 'q' == length) {
+        p += ('q' == *p) ? 1 : 2;
+    } else if (length) {
+        p++;
+    }
+
+    char conversion = *p;
+    if (0 == conversion) {
+        return p;
+    }
+    p++;
+    switch (conversion) {
+    case 'd': case 'i':
+    case 'u': case 'o': case 'x': case 'X': {
+        bool is_signed = ('d' == conversion || 'i' == conversion);
+        switch (length) {
+        case 'H': spec->kind = is_signed ? LOG_ARG_CHAR : LOG_ARG_UCHAR; break;
+        case 'h': spec->kind = is_signed ? LOG_ARG_SHORT : LOG_ARG_USHORT; break;
+        case 'l': spec->kind = is_signed ? LOG_ARG_LONG : LOG_ARG_ULONG; break;
+        case 'q': case 'j': spec->kind = is_signed ? LOG_ARG_LLONG : LOG_ARG_ULLONG; break;
+        case 'z': case 't': spec->kind = LOG_ARG_SIZE; break;
+        case 0: spec->kind = is_signed ? LOG_ARG_INT : LOG_ARG_UINT; break;
+        default: return p;
+        }
+        break;
+    }
+    case 'c':
+        if (0 != length) {
+            return p;
+        }
+        spec->kind = LOG_ARG_INT;
+        break;
+    case 'f': case 'F': case 'e': case 'E':
+    case 'g': case 'G': case 'a': case 'A':
+        spec->kind = ('L' == length) ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        if (0 != length) {
+            return p;
+        }
+        spec->kind = LOG_ARG_STRING;
+        break;
+    case 'p':
+        spec->kind = LOG_ARG_POINTER;
+        break;
+    case 'n':
+        spec->kind = LOG_ARG_SKIP_POINTER;
+        break;
+    default:
+        return p;
+    }
+    spec->conversion = conversion;
+    return p;
+}
+
+// encode a format record, format is truncated to size
+// return record length
+inline int LogEncodeFormat(uint32_t id, const char* format, char* out, int size) {
+    int len = (int)strlen(format);
+    if (len > size - LOG_RECORD_HEADER_LEN - 4) {
+        len = size - LOG_RECORD_HEADER_LEN - 4;
+    }
+    uint16_t record_len = (uint16_t)(LOG_RECORD_HEADER_LEN + 4 + len);
+    memcpy(out, &record_len, sizeof(record_len));
+    out[2] = LOG_RECORD_FORMAT;
+    out[3] = 0;
+    memcpy(out + LOG_RECORD_HEADER_LEN, &id, sizeof(id));
+    memcpy(out + LOG_RECORD_HEADER_LEN + 4, format, len);
+    return record_len;
+}
+
+// read a value of a line record, return false when the record is too short
+template <typename T>
+inline bool LogReadValue(const char*& p, const char* end, T* value) {
+    if (p + sizeof(T) > end) {
+        return false;
+    }
+    memcpy(value, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+// format the values of a line record with format
+// return length of the text written to out (always '\0' terminated)
+inline int LogFormatValues(const char* format, const char* values, int values_len, char* out, int size) {
+    const char* p = format;
+    const char* end = values + values_len;
+    int len = 0;
+    LogSpec spec;
+    const char* next;
+    while (len < size - 1) {
+        next = LogNextSpec(p, &spec);
+        // text before the conversion
+        int text_len = next ? (int)(spec.begin - p) : (int)strlen(p);
+        if (text_len > size - 1 - len) {
+            text_len = size - 1 - len;
+        }
+        memcpy(out + len, p, text_len);
+        len += text_len;
+        if (NULL == next || len >= size - 1) {
+            break;
+        }
+        p = next;
+        if ('%' == spec.conversion) {
+            out[len++] = '%';
+            continue;
+        }
+        if (0 == spec.conversion) {
+            continue;
+        }
+
+        int stars[2] = {0, 0};
+        bool ok = true;
+        for (int i = 0; i < spec.stars && ok; i++) {
+            int64_t star = 0;
+            ok = LogReadValue(values, end, &star);
+            stars[i] = (int)star;
+        }
+        // rebuild the conversion with a portable length
+        char conv[64];
+        int conv_len = 0;
+        conv[conv_len++] = '%';
+        if (spec.options_len > (int)sizeof(conv) - 4) {
+            break;
+        }
+        memcpy(conv + conv_len, spec.options, spec.options_len);
+        conv_len += spec.options_len;
+
+        int n = 0;
+        int room = size - len;
+#define LOG_FORMAT_VALUE(value) \
+        if (0 == spec.stars) { n = snprintf(out + len, room, conv, value); } \
+        else if (1 == spec.stars) { n = snprintf(out + len, room, conv, stars[0], value); } \
+        else { n = snprintf(out + len, room, conv, stars[0], stars[1], value); }
+
+        switch (spec.kind) {
+        case LOG_ARG_DOUBLE:
+        case LOG_ARG_LDOUBLE: {
+            double value = 0;
+            ok = ok && LogReadValue(values, end, &value);
+            conv[conv_len++] = spec.conversion;
+            conv[conv_len] = '\0';
+            if (ok) {
+                LOG_FORMAT_VALUE(value);
+            }
+            break;
+        }
+        case LOG_ARG_STRING: {
+            uint16_t str_len = 0;
+            ok = ok && LogReadValue(values, end, &str_len) && values + str_len <= end;
+            if (ok) {
+                // precision limits the string, it is not '\0' terminated
+                char  stack_str[1024];
+                char* str = (str_len < sizeof(stack_str)) ? stack_str : new char[str_len + 1];
+                memcpy(str, values, str_len);
+                str[str_len] = '\0';
+                values += str_len;
+                conv[conv_len++] = 's';
+                conv[conv_len] = '\0';
+                LOG_FORMAT_VALUE(str);
+                if (str != stack_str) {
+                    delete[] str;
+                }
+            }
+            break;
+        }
+        case LOG_ARG_POINTER: {
+            int64_t value = 0;
+            ok = ok && LogReadValue(values, end, &value);
+            conv[conv_len++] = 'l';
+            conv[conv_len++] = 'l';
+            conv[conv_len++] = 'x';
+            conv[conv_len] = '\0';
+            if (ok) {
+                n = snprintf(out + len, room, "0x");
+                len += (n < room) ? n : room - 1;
+                room = size - len;
+                LOG_FORMAT_VALUE((unsigned long long)value);
+            }
+            break;
+        }
+        case LOG_ARG_SKIP_POINTER:
+            break;
+        default: {
+            int64_t value = 0;
+            ok = ok && LogReadValue(values, end, &value);
+            if ('c' != spec.conversion) {
+                conv[conv_len++] = 'l';
+                conv[conv_len++] = 'l';
+            }
+            conv[conv_len++] = spec.conversion;
+            conv[conv_len] = '\0';
+            if (!ok) {
+                break;
+            }
+            if ('c' == spec.conversion) {
+                LOG_FORMAT_VALUE((int)value);
+            } else if ('d' == spec.conversion || 'i' == spec.conversion) {
+                LOG_FORMAT_VALUE((long long)value);
+            } else {
+                LOG_FORMAT_VALUE((unsigned long long)value);
+            }
+            break;
+        }
+        }
+#undef LOG_FORMAT_VALUE
+        if (!ok) {
+            break;
+        }
+        if (n > 0) {
+            len += (n < room) ? n : room - 1;
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// format time_us as "YYYY-MM-DD HH:MI:SS.uuuuuu", return length of the text
+inline int LogFormatTime(int64_t time_us, char* out, int size) {
+    time_t now_t = (time_t)(time_us / 1000000);
+    struct tm tm_now;
+#ifdef WIN32
+    localtime_s(&tm_now, &now_t);
+#else
+    localtime_r(&now_t, &tm_now);
+#endif
+    // fields are clamped to their width: the time fits in 27 bytes
+    int len = snprintf(out, size, "%4u-%02u-%02u %02u:%02u:%02u.%06u",
+            (unsigned)(tm_now.tm_year + 1900) % 10000, (unsigned)(tm_now.tm_mon + 1) % 100,
+            (unsigned)tm_now.tm_mday % 100, (unsigned)tm_now.tm_hour % 100,
+            (unsigned)tm_now.tm_min % 100, (unsigned)tm_now.tm_sec % 100,
+            (unsigned)(time_us % 1000000 + 1000000) % 1000000);
+    return (len < 0 || len >= size) ? 0 : len;
+}
+
+// format a line record to text "YYYY-MM-DD HH:MI:SS.uuuuuu Level: [tag] text\n"
+// return length of the text, 0 when the record is not valid
+inline int LogFormatLine(const char* format, const char* record, int record_len, char* out, int size) {
+    if (record_len < LOG_RECORD_LINE_LEN || size < 64) {
+        return 0;
+    }
+    int level = (unsigned char)record[3];
+    int64_t time_us;
+    memcpy(&time_us, record + LOG_RECORD_HEADER_LEN + 4, sizeof(time_us));
+    int tag_len = (unsigned char)record[LOG_RECORD_LINE_LEN - 1];
+    if (LOG_RECORD_LINE_LEN + tag_len > record_len) {
+        return 0;
+    }
+
+    int len = LogFormatTime(time_us, out, size);
+    int n = snprintf(out + len, size - len, " %s: [%.*s] ",
+            LogLevelName(level), tag_len, record + LOG_RECORD_LINE_LEN);
+    if (0 == len || n < 0 || len + n >= size - 1) {
+        return 0;
+    }
+    len += n;
+    const char* values = record + LOG_RECORD_LINE_LEN + tag_len;
+    len += LogFormatValues(format, values, record_len - LOG_RECORD_LINE_LEN - tag_len, out + len, size - len - 1);
+    out[len++] = '\n';
+    out[len] = '\0';
+    return len;
+}
+
+// size of a fields record with nothing cut
+inline int LogFieldsRecordLen(const char* tag, int message_len, const LogField* fields, int count) {
+    int tag_len = (int)strlen(tag);
+    int len = LOG_RECORD_HEADER_LEN + 8 + 1 + (tag_len > 255 ? 255 : tag_len) + 2 + message_len + 1;
+    for (int i = 0; i < count; i++) {
+        len += 2 + (fields[i].key_len > 255 ? 255 : fields[i].key_len);
+        if (LOG_FIELD_STRING == fields[i].type) {
+            len += 2 + fields[i].str_len;
+        } else {
+            len += (LOG_FIELD_BOOL == fields[i].type) ? 1 : 8;
+        }
+    }
+    return len;
+}
+
+// encode a fields record of up to size bytes, the message is cut and the
+// fields which do not fit are dropped, return record length
+inline int LogEncodeFields(char* out, int size, int level, int64_t time_us, const char* tag,
+                           const char* message, const LogField* fields, int count) {
+    int tag_len = (int)strlen(tag);
+    if (tag_len > 255) {
+        tag_len = 255;
+    }
+    int message_len = (int)strlen(message);
+    // header, time, tag, message length and field count at least
+    int room = size - (LOG_RECORD_HEADER_LEN + 8 + 1 + tag_len + 2 + 1);
+    if (room < 0) {
+        return 0;
+    }
+    if (message_len > room) {
+        message_len = room;
+    }
+    char* p = out + LOG_RECORD_HEADER_LEN;
+    memcpy(p, &time_us, sizeof(time_us));
+    p += sizeof(time_us);
+    *p++ = (char)tag_len;
+    memcpy(p, tag, tag_len);
+    p += tag_len;
+    uint16_t len16 = (uint16_t)message_len;
+    memcpy(p, &len16, sizeof(len16));
+    p += sizeof(len16);
+    memcpy(p, message, message_len);
+    p += message_len;
+    char* field_count = p++;
+    int encoded = 0;
+    for (int i = 0; i < count; i++) {
+        const LogField& field = fields[i];
+        int key_len = (field.key_len > 255) ? 255 : field.key_len;
+        int value_len = 8;
+        if (LOG_FIELD_BOOL == field.type) {
+            value_len = 1;
+        } else if (LOG_FIELD_STRING == field.type) {
+            value_len = 2 + field.str_len;
+        }
+        if ((p - out) + 2 + key_len + value_len > size) {
+            continue;
+        }
+        *p++ = (char)field.type;
+        *p++ = (char)key_len;
+        memcpy(p, field.key, key_len);
+        p += key_len;
+        if (LOG_FIELD_INT == field.type) {
+            memcpy(p, &field.int_value, 8);
+        } else if (LOG_FIELD_DOUBLE == field.type) {
+            memcpy(p, &field.double_value, 8);
+        } else if (LOG_FIELD_BOOL == field.type) {
+            *p = (char)(field.int_value ? 1 : 0);
+        } else {
+            len16 = (uint16_t)field.str_len;
+            memcpy(p, &len16, sizeof(len16));
+            memcpy(p + 2, field.str, field.str_len);
+        }
+        p += value_len;
+        encoded++;
+    }
+    *field_count = (char)encoded;
+
+    uint16_t record_len = (uint16_t)(p - out);
+    memcpy(out, &record_len, sizeof(record_len));
+    out[2] = LOG_RECORD_FIELDS;
+    out[3] = (char)level;
+    return record_len;
+}
+
+// a decoded fields record, strings point into the record
+struct LogFieldsRecord {
+    int  level;
+    int64_t time;
+    const char* tag;
+    int  tag_len;
+    const char* message;
+    int  message_len;
+    LogField fields[LOG_MAX_FIELDS];
+    int  count;
+};
+
+// decode a fields record, return false when it is not valid
+inline bool LogDecodeFields(const char* record, int record_len, LogFieldsRecord* out) {
+    const char* p = record + LOG_RECORD_HEADER_LEN;
+    const char* end = record + record_len;
+    uint8_t tag_len = 0;
+    uint16_t message_len = 0;
+    uint8_t count = 0;
+    if (record_len < LOG_RECORD_HEADER_LEN || !LogReadValue(p, end, &out->time)
+            || !LogReadValue(p, end, &tag_len) || p + tag_len > end) {
+        return false;
+    }
+    out->level = (unsigned char)record[3];
+    out->tag = p;
+    out->tag_len = tag_len;
+    p += tag_len;
+    if (!LogReadValue(p, end, &message_len) || p + message_len > end) {
+        return false;
+    }
+    out->message = p;
+    out->message_len = message_len;
+    p += message_len;
+    if (!LogReadValue(p, end, &count)) {
+        return false;
+    }
+    out->count = 0;
+    for (int i = 0; i < count && i < LOG_MAX_FIELDS; i++) {
+        LogField* field = &out->fields[i];
+        uint8_t type = 0;
+        uint8_t key_len = 0;
+        if (!LogReadValue(p, end, &type) || !LogReadValue(p, end, &key_len) || p + key_len > end) {
+            return false;
+        }
+        field->type = type;
+        field->key = p;
+        field->key_len = key_len;
+        p += key_len;
+        bool ok = false;
+        if (LOG_FIELD_INT == type) {
+            ok = LogReadValue(p, end, &field->int_value);
+        } else if (LOG_FIELD_DOUBLE == type) {
+            ok = LogReadValue(p, end, &field->double_value);
+        } else if (LOG_FIELD_BOOL == type) {
+            uint8_t value = 0;
+            ok = LogReadValue(p, end, &value);
+            field->int_value = value;
+        } else if (LOG_FIELD_STRING == type) {
+            uint16_t str_len = 0;
+            ok = LogReadValue(p, end, &str_len) && p + str_len <= end;
+            if (ok) {
+                field->str = p;
+                field->str_len = str_len;
+                p += str_len;
+            }
+        }
+        if (!ok) {
+            return false;
+        }
+        out->count++;
+    }
+    return true;
+}
+
+// format a line, fields or text record in style (format: format of a line record)
+// return length of the text, 0 when the record is not valid
+inline int LogFormatRecord(LogLineStyle style, const char* format, const char* record, int record_len,
+                           char* out, int size) {
+    if (record_len < LOG_RECORD_HEADER_LEN || size < 64) {
+        return 0;
+    }
+    int level = (unsigned char)record[3];
+    char time[32];
+    if (LOG_RECORD_TEXT == record[2]) {
+        int len = record_len - LOG_RECORD_HEADER_LEN;
+        if (len > size - 1) {
+            len = size - 1;
+        }
+        memcpy(out, record + LOG_RECORD_HEADER_LEN, len);
+        out[len] = '\0';
+        return len;
+    } else if (LOG_RECORD_FIELDS == record[2]) {
+        LogFieldsRecord fields;
+        if (!LogDecodeFields(record, record_len, &fields)) {
+            return 0;
+        }
+        LogFormatTime(fields.time, time, sizeof(time));
+        return LogFormatFieldsLine(style, time, LogLevelName(level), fields.tag, fields.tag_len,
+                fields.message, fields.message_len, fields.fields, fields.count, out, size);
+    } else if (LOG_RECORD_LINE != record[2] || NULL == format) {
+        return 0;
+    }
+    if (LOG_LINE_TEXT == style) {
+        return LogFormatLine(format, record, record_len, out, size);
+    }
+    // the message of a line record in another style
+    if (record_len < LOG_RECORD_LINE_LEN) {
+        return 0;
+    }
+    int64_t time_us;
+    memcpy(&time_us, record + LOG_RECORD_HEADER_LEN + 4, sizeof(time_us));
+    int tag_len = (unsigned char)record[LOG_RECORD_LINE_LEN - 1];
+    if (LOG_RECORD_LINE_LEN + tag_len > record_len) {
+        return 0;
+    }
+    char message[1024];
+    const char* values = record + LOG_RECORD_LINE_LEN + tag_len;
+    int message_len = LogFormatValues(format, values, record_len - LOG_RECORD_LINE_LEN - tag_len,
+            message, sizeof(message));
+    LogFormatTime(time_us, time, sizeof(time));
+    return LogFormatFieldsLine(style, time, LogLevelName(level), record + LOG_RECORD_LINE_LEN, tag_len,
+            message, message_len, NULL, 0, out, size);
+}
+
+#endif // LOGBINARY_H_INCLUDED
@@ -0,0 +1,307 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef LOGFIELDS_H_INCLUDED
+#define LOGFIELDS_H_INCLUDED
+
+// typed key-value fields of structured lines (see ILog::WriteFields) and
+// their text encoders, shared by the log module and logviewer
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// max fields of a line
+#define LOG_MAX_FIELDS 16
+
+// value type of a field
+enum LogFieldType {
+    LOG_FIELD_INT = 1,
+    LOG_FIELD_DOUBLE,
+    LOG_FIELD_STRING,
+    LOG_FIELD_BOOL
+};
+
+// a field, strings are not copied
+struct LogField {
+    const char* key;
+    int  key_len;
+    int  type;
+    int64_t int_value;
+    double  double_value;
+    const char* str;
+    int  str_len;
+};
+
+// fields of a line, built on the stack without allocation
+// eg. LogFields fields;
+//     fields.Int("bytes", len).Str("peer", host).Bool("retry", false);
+//     log->WriteFields(LOG_LEVEL_INFO, "net", "recv", fields);
+// note: keys and strings must live until the line is logged (they are views),
+// fields after LOG_MAX_FIELDS are dropped
+class LogFields {
+public:
+    LogFields() : count_(0) {}
+
+    LogFields& Int(const char* key, int64_t value) {
+        LogField* field = Add(key, LOG_FIELD_INT);
+        if (field) {
+            field->int_value = value;
+        }
+        return *this;
+    }
+    LogFields& Double(const char* key, double value) {
+        LogField* field = Add(key, LOG_FIELD_DOUBLE);
+        if (field) {
+            field->double_value = value;
+        }
+        return *this;
+    }
+    // len bytes of value (-1: '\0' terminated)
+    LogFields& Str(const char* key, const char* value, int len = -1) {
+        LogField* field = Add(key, LOG_FIELD_STRING);
+        if (field) {
+            field->str = value ? value : "";
+            field->str_len = (len >= 0 && value) ? len : (int)strlen(field->str);
+        }
+        return *this;
+    }
+    LogFields& Bool(const char* key, bool value) {
+        LogField* field = Add(key, LOG_FIELD_BOOL);
+        if (field) {
+            field->int_value = value ? 1 : 0;
+        }
+        return *this;
+    }
+
+    int count() const { return count_; }
+    const LogField* fields() const { return fields_; }
+private:
+    LogField* Add(const char* key, int type) {
+        if (count_ >= LOG_MAX_FIELDS) {
+            return NULL;
+        }
+        LogField* field = &fields_[count_++];
+        field->key = key;
+        field->key_len = (int)strlen(key);
+        field->type = type;
+        return field;
+    }
+
+    LogField fields_[LOG_MAX_FIELDS];
+    int count_;
+};
+
+// how a structured line is written as text
+enum LogLineStyle {
+    // {time} {Level}: [{tag}] {message} key=value ...
+    LOG_LINE_TEXT,
+    // {"time":"{time}","level":"{Level}","tag":"{tag}","msg":"{message}","key":value,...}
+    LOG_LINE_JSON,
+    // time="{time}" level={level} tag={tag} msg="{message}" key=value ...
+    LOG_LINE_LOGFMT
+};
+
+// appends to a fixed buffer, the text is cut at its end
+struct LogTextOut {
+    char* out;
+    int  size;
+    int  len;
+    // text was cut
+    bool cut;
+
+    void Append(const char* text, int text_len) {
+        if (text_len > size - 1 - len) {
+            text_len = size - 1 - len;
+            cut = true;
+        }
+        if (text_len > 0) {
+            memcpy(out + len, text, text_len);
+            len += text_len;
+        }
+    }
+    void Append(const char* text) { Append(text, (int)strlen(text)); }
+    void Append(char c) { Append(&c, 1); }
+    // append all of text or nothing (an escape sequence is never cut)
+    void AppendWhole(const char* text, int text_len) {
+        if (text_len > size - 1 - len) {
+            cut = true;
+            return;
+        }
+        Append(text, text_len);
+    }
+};
+
+// append str as a JSON string, a cut string is still closed
+inline void LogAppendJson(LogTextOut* out, const char* str, int len) {
+    out->AppendWhole("\"", 1);
+    if (out->cut) {
+        return;
+    }
+    // room for the closing quote
+    out->size--;
+    for (int i = 0; i < len && !out->cut; i++) {
+        unsigned char c = (unsigned char)str[i];
+        char escaped[8] = {'\\', (char)c};
+        if ('\n' == c) {
+            escaped[1] = 'n';
+        } else if ('\t' == c) {
+            escaped[1] = 't';
+        } else if ('\r' == c) {
+            escaped[1] = 'r';
+        } else if (c < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out->AppendWhole(escaped, 6);
+            continue;
+        } else if ('"' != c && '\\' != c) {
+            out->Append((char)c);
+            continue;
+        }
+        out->AppendWhole(escaped, 2);
+    }
+    out->size++;
+    out->Append('"');
+}
+
+// append str as a logfmt value, quoted when it is empty or has spaces, quotes or '='
+inline void LogAppendLogfmt(LogTextOut* out, const char* str, int len) {
+    bool quote = (0 == len);
+    for (int i = 0; i < len && !quote; i++) {
+        unsigned char c = (unsigned char)str[i];
+        quote = (c <= ' ' || '"' == c || '=' == c || '\\' == c);
+    }
+    if (!quote) {
+        out->Append(str, len);
+        return;
+    }
+    // the JSON escapes are valid in a quoted logfmt value
+    LogAppendJson(out, str, len);
+}
+
+// append the value of a field
+inline void LogAppendValue(LogTextOut* out, const LogField& field, LogLineStyle style) {
+    char number[32];
+    switch (field.type) {
+    case LOG_FIELD_INT:
+        snprintf(number, sizeof(number), "%lld", (long long)field.int_value);
+        out->Append(number);
+        break;
+    case LOG_FIELD_DOUBLE:
+        // NaN and infinity are not JSON numbers
+        if (LOG_LINE_JSON == style && (field.double_value != field.double_value
+                || field.double_value - field.double_value != 0)) {
+            out->Append("null");
+        } else {
+            snprintf(number, sizeof(number), "%.15g", field.double_value);
+            out->Append(number);
+        }
+        break;
+    case LOG_FIELD_BOOL:
+        out->Append(field.int_value ? "true" : "false");
+        break;
+    default:
+        if (LOG_LINE_JSON == style) {
+            LogAppendJson(out, field.str, field.str_len);
+        } else {
+            LogAppendLogfmt(out, field.str, field.str_len);
+        }
+        break;
+    }
+}
+
+// bytes a line with fields takes at most in any style, escapes included
+inline int LogFieldsLineBound(int tag_len, int message_len, const LogField* fields, int count) {
+    // time, level, member names, '\n' and '\0'
+    int bound = 128 + 6 * (tag_len + message_len);
+    for (int i = 0; i < count; i++) {
+        // separators and a number
+        bound += 6 * fields[i].key_len + 40;
+        if (LOG_FIELD_STRING == fields[i].type) {
+            bound += 6 * fields[i].str_len;
+        }
+    }
+    return bound;
+}
+
+// write a line with fields in style to out ('\0' terminated, ends with '\n')
+// return length of the line, cut (if not NULL) tells if it was cut to size
+inline int LogFormatFieldsLine(LogLineStyle style, const char* time, const char* level,
+                               const char* tag, int tag_len, const char* message, int message_len,
+                               const LogField* fields, int count, char* out, int size, bool* cut = NULL) {
+    LogTextOut text = {out, size - 1, 0, false};
+    if (LOG_LINE_JSON == style) {
+        // room for the closing '}'
+        text.size--;
+        text.Append("{\"time\":\"");
+        text.Append(time);
+        text.Append("\",\"level\":\"");
+        text.Append(level);
+        text.Append("\",\"tag\":");
+        LogAppendJson(&text, tag, tag_len);
+        text.Append(",\"msg\":");
+        LogAppendJson(&text, message, message_len);
+    } else if (LOG_LINE_LOGFMT == style) {
+        text.Append("time=\"");
+        text.Append(time);
+        text.Append("\" level=");
+        for (const char* p = level; *p; p++) {
+            text.Append((char)((*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p));
+        }
+        text.Append(" tag=");
+        LogAppendLogfmt(&text, tag, tag_len);
+        text.Append(" msg=");
+        LogAppendLogfmt(&text, message, message_len);
+    } else {
+        text.Append(time);
+        text.Append(' ');
+        text.Append(level);
+        text.Append(": [");
+        text.Append(tag, tag_len);
+        text.Append("] ");
+        text.Append(message, message_len);
+    }
+    // a field is written whole or not at all
+    for (int i = 0; i < count && !text.cut; i++) {
+        int field_start = text.len;
+        if (LOG_LINE_JSON == style) {
+            text.Append(',');
+            LogAppendJson(&text, fields[i].key, fields[i].key_len);
+            text.Append(':');
+        } else {
+            text.Append(' ');
+            text.Append(fields[i].key, fields[i].key_len);
+            text.Append('=');
+        }
+        LogAppendValue(&text, fields[i], style);
+        if (text.cut) {
+            text.len = field_start;
+        }
+    }
+    if (LOG_LINE_JSON == style) {
+        text.size++;
+        text.Append('}');
+    }
+    // room for '\n' was kept
+    out[text.len++] = '\n';
+    out[text.len] = '\0';
+    if (cut) {
+        *cut = text.cut;
+    }
+    return text.len;
+}
+
+#endif // LOGFIELDS_H_INCLUDED
@@ -18,121 +18,1449 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
-#ifndef WIN32
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <sys/socket.h>
-#else
-
-#endif
 #include "log.h"
 
-#define DAY_OF_SECONDS 86400 // 60*60*24
-#define MAX_LOG_LEN     1024
-
 #ifdef WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #define getpid GetCurrentProcessId
 #define snprintf _snprintf
 #endif
 
-// Get Time String [YYYY-MM-DD HH:MI:SS]
-static int GetTimeStr(char *out_timestr, int size) {
-    time_t  now_t = time(NULL);
-    struct  tm  *pTm = localtime(&now_t);
+#ifndef va_copy
+#define va_copy(dst, src) ((dst) = (src))
+#endif
 
+// formatted second of the calling thread
+struct TimeCache {
+    // wall clock - monotonic clock (us)
+    int64_t offset;
+    // second the offset was synced in, 0 before the first call
+    int64_t synced;
+    // second of prefix, 0 before the first call
+    int64_t second;
+    // time of the last line of the thread
+    int64_t now;
     // YYYY-MM-DD HH:MI:SS
-    return snprintf(out_timestr, size-1, "%4d-%02d-%02d %02d:%02d:%02d",
-            pTm->tm_year + 1900, pTm->tm_mon + 1, pTm->tm_mday,
-            pTm->tm_hour, pTm->tm_min, pTm->tm_sec);
+    char prefix[32];
+    int  prefix_len;
+};
+static APF_THREAD_LOCAL TimeCache time_cache;
+
+// wall clock (us)
+static int64_t WallClockUs() {
+#ifdef WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    // 100ns since 1601-01-01
+    int64_t t = ((int64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return t / 10 - 11644473600000000LL;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+// vsnprintf returning the length of the whole text (C99) when it is cut,
+// _vsnprintf of WIN32 returns -1 then
+static int FormatV(char* buf, int size, const char* format, va_list ap) {
+#ifdef WIN32
+    va_list count_ap;
+    va_copy(count_ap, ap);
+    int n = _vsnprintf(buf, size, format, ap);
+    if (n < 0 || n >= size) {
+        n = _vscprintf(format, count_ap);
+        buf[size - 1] = '\0';
+    }
+    va_end(count_ap);
+    return n;
+#else
+    return vsnprintf(buf, size, format, ap);
+#endif
+}
+
+// hash of a tag in the tag limits (FNV-1a)
+static uint32_t TagHash(const char* tag) {
+    uint32_t hash = 2166136261u;
+    for (const char* p = tag; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    return hash;
+}
+
+// log time (us since epoch)
+// monotonic clock + wall clock offset, the offset is synced once per second per thread
+static int64_t LogClockUs() {
+    TimeCache* cache = &time_cache;
+    int64_t now = (int64_t)clock_tick_us() + cache->offset;
+    if (now / 1000000 != cache->synced) {
+        int64_t mono = (int64_t)clock_tick_us();
+        cache->offset = WallClockUs() - mono;
+        now = mono + cache->offset;
+        cache->synced = now / 1000000;
+    }
+    cache->now = now;
+    return now;
+}
+
+// Get Time String [YYYY-MM-DD HH:MI:SS(.mmm|.uuuuuu)]
+// the date is formatted once per second per thread
+static int GetTimeStr(char *out_timestr, int size, LogTimePrecision precision) {
+    int64_t now = LogClockUs();
+    TimeCache* cache = &time_cache;
+    if (now / 1000000 != cache->second) {
+        time_t now_t = (time_t)(now / 1000000);
+        struct tm tm_now;
+#ifdef WIN32
+        localtime_s(&tm_now, &now_t);
+#else
+        localtime_r(&now_t, &tm_now);
+#endif
+        // YYYY-MM-DD HH:MI:SS
+        cache->prefix_len = snprintf(cache->prefix, sizeof(cache->prefix), "%4d-%02d-%02d %02d:%02d:%02d",
+                tm_now.tm_year + 1900, tm_now.tm_mon + 1, tm_now.tm_mday,
+                tm_now.tm_hour, tm_now.tm_min, tm_now.tm_sec);
+        cache->second = now / 1000000;
+    }
+
+    int digits = 0;
+    int fraction = (int)(now % 1000000);
+    if (LOG_TIME_MILLISECOND == precision) {
+        digits = 3;
+        fraction /= 1000;
+    } else if (LOG_TIME_MICROSECOND == precision) {
+        digits = 6;
+    }
+    int len = cache->prefix_len;
+    if (len + digits + 2 > size) {
+        return 0;
+    }
+    memcpy(out_timestr, cache->prefix, len);
+    if (digits > 0) {
+        out_timestr[len] = '.';
+        for (int i = digits; i > 0; i--) {
+            out_timestr[len + i] = (char)('0' + fraction % 10);
+            fraction /= 10;
+        }
+        len += digits + 1;
+    }
+    out_timestr[len] = '\0';
+    return len;
 }
 
 Log::Log() {
-   file_ = NULL;
-   log_socket_ = INVALID_SOCKET;
-   max_file_size_ = DEFAULT_FILE_SIZE;
-   current_log_file_day_ = 0;
-   target_addr_.sin_family = AF_INET;
-   target_addr_.sin_addr.s_addr = inet_addr("127.0.1");
-   target_addr_.sin_port = ntohs(DEFAULT_PORT);
+   targets_ = DEFAULT_TARGETS;
+   level_ = LOG_LEVEL_DEBUG;
+   min_level_ = LOG_LEVEL_DEBUG;
+   max_level_ = LOG_LEVEL_DEBUG;
+   recorder_level_ = LOG_LEVEL_COUNT;
+   dump_lines_ = 0;
+   dump_ = LOG_DUMP_ON_DEMAND;
+   strcpy(crash_file_, "log-crash.blog");
+   encoding_ = LOG_ENCODING_TEXT;
+   formats_ = NULL;
+   time_precision_ = LOG_TIME_SECOND;
+   async_ = false;
+   overflow_policy_ = LOG_OVERFLOW_BLOCK;
+   async_capacity_ = DEFAULT_ASYNC_CAPACITY;
+   ring_ = NULL;
+   ring_mask_ = 0;
+   enqueue_pos_ = 0;
+   dequeue_pos_ = 0;
+   staging_size_ = 0;
+   merge_window_us_ = 0;
+   staging_force_ = 0;
+   writer_idle_ = 0;
+   writer_stop_ = false;
+   written_ = 0;
+   memset((void*)dropped_, 0, sizeof(dropped_));
+   blocked_ = 0;
+   sync_errors_ = false;
+   memset((void*)tag_table_, 0, sizeof(tag_table_));
+   tag_table_full_ = 0;
+   tag_limits_ = NULL;
+   limits_ = NULL;
+   report_at_ = 0;
+   suppressed_ = 0;
+   file_sink_ = new FileSink(this);
+   net_sink_ = new NetSink(this);
+   // files are opened by SetFile/SetTargets/Start
+   sinks_.push_back(new LogSinkQueue(LOG_TARGET_FILE, file_sink_, true));
+   sinks_.push_back(new LogSinkQueue(LOG_TARGET_NET, net_sink_, true));
+   sinks_.push_back(new LogSinkQueue(LOG_TARGET_CONSOLE, new ConsoleSink(this), true));
 
    init_mutex(&mutex_);
-
-   this->SetTargets(DEFAULT_TARGETS);
+   init_mutex(&level_mutex_);
 }
 
 Log::~Log() {
+    StopAsync();
     SetTargets(0);
+    // sink threads write queued lines, formats are still needed
+    for (size_t i = 0; i < sinks_.size(); i++) {
+        delete sinks_[i];
+    }
+    if (formats_) {
+        for (int i = 0; i < LOG_MAX_FORMATS; i++) {
+            delete[] formats_[i].text;
+        }
+        delete[] formats_;
+    }
+    // call sites may still hold the cells and their limits, they get them again
+    // once the cells are stale
+    for (std::map<std::string, TagLevel*>::iterator it = tag_levels_.begin();
+            it != tag_levels_.end(); ++it) {
+        it->second->level = LOG_LEVEL_STALE;
+    }
+    if (tag_limits_) {
+        for (int i = 0; i < LOG_MAX_TAG_LIMITS; i++) {
+            delete[] tag_limits_[i].tag;
+        }
+        delete[] tag_limits_;
+    }
+    uninit_mutex(&level_mutex_);
     uninit_mutex(&mutex_);
 }
 
-void Log::LogCheck() {
-    	if (file_) {
-         if ((LOG_BACKUP_ONE_FILE & log_backup_strategy_)) {
-            if (ftell(file_) > max_file_size_) {
-                std::string file_name = path_ + "/";
-                std::string backup_file_name = path_ + "/";
-                file_name += name_ + suffix_;
-                backup_file_name += name_ + "_bk";
-                backup_file_name += suffix_;
+int Log::FindFormat(const char* format) {
+    // formats are string literals, hash the address (the text is compared too)
+    uintptr_t hash = ((uintptr_t)format >> 3) * 2654435761u;
+    for (int i = 0; i < LOG_MAX_FORMATS; i++) {
+        LogFormat* entry = &formats_[(hash + i) & (LOG_MAX_FORMATS - 1)];
+        if (NULL == entry->format) {
+            if (!atomic_cas_ptr((void* volatile*)&entry->format, NULL, (void*)format)) {
+                // taken by another caller, check it again
+                i--;
+                continue;
+            }
+            entry->text = new char[strlen(format) + 1];
+            strcpy(entry->text, format);
+            // parse the format once
+            int count = 0;
+            bool ok = true;
+            LogSpec spec;
+            const char* p = format;
+            while (ok && NULL != (p = LogNextSpec(p, &spec))) {
+                if ('%' == spec.conversion) {
+                    continue;
+                }
+                ok = (0 != spec.conversion) && (count + spec.stars < LOG_MAX_FORMAT_ARGS);
+                for (int j = 0; ok && j < spec.stars; j++) {
+                    entry->kinds[count++] = LOG_ARG_INT;
+                }
+                if (ok) {
+                    entry->kinds[count++] = (unsigned char)spec.kind;
+                }
+            }
+            entry->kind_count = count;
+            atomic_cas(&entry->state, 0, ok ? 1 : -1);
+        } else if (format != entry->format) {
+            continue;
+        }
+        while (0 == entry->state) {
+            yield();
+        }
+        // another format at the address of a freed one (a buffer, an unloaded plugin)
+        if (1 != entry->state || 0 != strcmp(entry->text, format)) {
+            return -1;
+        }
+        return (int)(entry - formats_);
+    }
+    return -1;
+}
 
-                fclose(file_);
+int Log::EncodeLine(char* buf, int size, int level, const char* tag, const char* format, va_list ap) {
+    int id = FindFormat(format);
+    if (id < 0) {
+        return 0;
+    }
+    const LogFormat* entry = &formats_[id];
+    char* p = buf + LOG_RECORD_HEADER_LEN;
+    uint32_t format_id = (uint32_t)id;
+    memcpy(p, &format_id, sizeof(format_id));
+    p += sizeof(format_id);
+    int64_t now = LogClockUs();
+    memcpy(p, &now, sizeof(now));
+    p += sizeof(now);
+    size_t tag_len = strlen(tag);
+    if (tag_len > 255) {
+        tag_len = 255;
+    }
+    *p++ = (char)tag_len;
+    memcpy(p, tag, tag_len);
+    p += tag_len;
 
-                unlink(backup_file_name.c_str());
+    // bytes the values after the current one need at least
+    int reserved = 0;
+    // bytes of strings cut
+    int cut = 0;
+    for (int i = 0; i < entry->kind_count; i++) {
+        if (LOG_ARG_STRING == entry->kinds[i]) {
+            reserved += 2;
+        } else if (LOG_ARG_SKIP_POINTER != entry->kinds[i]) {
+            reserved += 8;
+        }
+    }
+    for (int i = 0; i < entry->kind_count; i++) {
+        int64_t value = 0;
+        double real = 0;
+        switch (entry->kinds[i]) {
+        case LOG_ARG_INT:     value = va_arg(ap, int); break;
+        case LOG_ARG_UINT:    value = va_arg(ap, unsigned int); break;
+        case LOG_ARG_CHAR:    value = (signed char)va_arg(ap, int); break;
+        case LOG_ARG_UCHAR:   value = (unsigned char)va_arg(ap, int); break;
+        case LOG_ARG_SHORT:   value = (short)va_arg(ap, int); break;
+        case LOG_ARG_USHORT:  value = (unsigned short)va_arg(ap, int); break;
+        case LOG_ARG_LONG:    value = va_arg(ap, long); break;
+        case LOG_ARG_ULONG:   value = va_arg(ap, unsigned long); break;
+        case LOG_ARG_LLONG:   value = va_arg(ap, long long); break;
+        case LOG_ARG_ULLONG:  value = (int64_t)va_arg(ap, unsigned long long); break;
+        case LOG_ARG_SIZE:    value = (int64_t)va_arg(ap, size_t); break;
+        case LOG_ARG_POINTER: value = (int64_t)(intptr_t)va_arg(ap, void*); break;
+        case LOG_ARG_SKIP_POINTER: va_arg(ap, void*); continue;
+        case LOG_ARG_DOUBLE:  real = va_arg(ap, double); break;
+        case LOG_ARG_LDOUBLE: real = (double)va_arg(ap, long double); break;
+        case LOG_ARG_STRING: {
+            const char* str = va_arg(ap, const char*);
+            if (NULL == str) {
+                str = "(null)";
+            }
+            reserved -= 2;
+            // truncate the string to the room left
+            size_t room = size - (p - buf) - reserved - 2;
+            size_t str_len = strlen(str);
+            if (str_len > room) {
+                cut += (int)(str_len - room);
+                str_len = room;
+            }
+            uint16_t len16 = (uint16_t)str_len;
+            memcpy(p, &len16, sizeof(len16));
+            p += sizeof(len16);
+            memcpy(p, str, str_len);
+            p += str_len;
+            continue;
+        }
+        default:
+            break;
+        }
+        reserved -= 8;
+        if (LOG_ARG_DOUBLE == entry->kinds[i] || LOG_ARG_LDOUBLE == entry->kinds[i]) {
+            memcpy(p, &real, sizeof(real));
+        } else {
+            memcpy(p, &value, sizeof(value));
+        }
+        p += 8;
+    }
 
-                rename(file_name.c_str(), backup_file_name.c_str());
+    uint16_t record_len = (uint16_t)(p - buf);
+    memcpy(buf, &record_len, sizeof(record_len));
+    buf[2] = LOG_RECORD_LINE;
+    buf[3] = (char)level;
+    return record_len + cut;
+}
 
-                file_ = fopen(file_name.c_str(), "a+");
-                if (NULL == file_) {
-                    fprintf(stderr, "open log file %s failed!\n", file_name.c_str());
+// text records of a text of len bytes
+static int TextRecords(int len) {
+    const int max_text = LOG_RECORD_MAX_LEN - LOG_RECORD_HEADER_LEN;
+    return (len > max_text) ? (len + max_text - 1) / max_text : 1;
+}
 
-                }
+int Log::EncodeText(char* buf, int size, int level, const char* text, int len) {
+    const int max_text = LOG_RECORD_MAX_LEN - LOG_RECORD_HEADER_LEN;
+    if (len + TextRecords(len) * LOG_RECORD_HEADER_LEN > size) {
+        len = size - TextRecords(len) * LOG_RECORD_HEADER_LEN;
+    }
+    int count = TextRecords(len);
+    // text may be in buf already, the last part is moved first
+    for (int i = count - 1; i >= 0; i--) {
+        int offset = i * max_text;
+        int text_len = (count - 1 == i) ? len - offset : max_text;
+        char* record = buf + offset + i * LOG_RECORD_HEADER_LEN;
+        memmove(record + LOG_RECORD_HEADER_LEN, text + offset, text_len);
+        uint16_t record_len = (uint16_t)(LOG_RECORD_HEADER_LEN + text_len);
+        memcpy(record, &record_len, sizeof(record_len));
+        record[2] = LOG_RECORD_TEXT;
+        record[3] = (char)level;
+    }
+    return len + count * LOG_RECORD_HEADER_LEN;
+}
+
+
+void Log::WriteTargets(const char* data, int len, int level) {
+    for (size_t i = 0; i < sinks_.size(); i++) {
+        if (sinks_[i]->target() & targets_) {
+            sinks_[i]->Push(data, len, level);
+        }
+    }
+    atomic_inc(&written_);
+}
+
+void Log::WriteLog(char* data, int len) {
+    char record[MAX_LOG_LEN+1];
+    if (LOG_ENCODING_BINARY == encoding_) {
+        len = EncodeText(record, MAX_LOG_LEN, LOG_LEVEL_INFO, data, len);
+        data = record;
+    }
+    if (async_) {
+        LogSlot* slot = ReserveSlot(LOG_LEVEL_INFO);
+        if (slot) {
+            memcpy(slot->data, data, len+1);
+            slot->len = len;
+            slot->level = LOG_LEVEL_INFO;
+            slot->dump = -1;
+            CommitSlot(slot, LOG_LEVEL_INFO);
+        }
+        return;
+    }
+    lock_mutex(&mutex_);
+    WriteTargets(data, len, LOG_LEVEL_INFO);
+    unlock_mutex(&mutex_);
+}
+
+int Log::FormatText(char* buf, int size, int level, const char* tag, const char* format, va_list ap) {
+    if (LOG_LINE_TEXT != LineStyle()) {
+        // the message is escaped into the line, a long one is formatted into a chunk
+        char  stack_message[MAX_LOG_LEN];
+        char* message = stack_message;
+        va_list message_ap;
+        va_copy(message_ap, ap);
+        int n = FormatV(message, sizeof(stack_message), format, ap);
+        if (n > (int)sizeof(stack_message) - 1) {
+            message = chunks_.Alloc(n + 1);
+            FormatV(message, n + 1, format, message_ap);
+        } else if (n < 0) {
+            n = 0;
+        }
+        va_end(message_ap);
+        char time[64];
+        GetTimeStr(time, sizeof(time), time_precision_);
+        int  tag_len = (int)strlen(tag);
+        bool cut = false;
+        int  len = LogFormatFieldsLine(LineStyle(), time, LogLevelName(level), tag, tag_len,
+                message, n, NULL, 0, buf, size + 1, &cut);
+        if (message != stack_message) {
+            chunks_.Free(message);
+        }
+        return cut ? LogFieldsLineBound(tag_len, n, NULL, 0) : len;
+    }
+    int len = GetTimeStr(buf, size, time_precision_);
+    int prefix = snprintf(buf + len, size - len, " %s: [%s] ", LogLevelName(level), tag);
+    int n = 0;
+    if (prefix < 0 || len + prefix > size - 1) {
+        // a tag longer than the line, only its size is wanted
+        char none[1];
+        prefix = (int)strlen(LogLevelName(level)) + (int)strlen(tag) + 6;
+        n = FormatV(none, sizeof(none), format, ap);
+    } else {
+        n = FormatV(buf + len + prefix, size - len - prefix, format, ap);
+    }
+    len += prefix;
+    if (n < 0) {
+        n = 0;
+    }
+    // cut, the line ends at size
+    if (len + n + 1 > size) {
+        buf[size - 1] = '\n';
+        buf[size] = '\0';
+        return len + n + 1;
+    }
+    len += n;
+    buf[len++] = '\n';
+    buf[len] = '\0';
+    return len;
+}
+
+int Log::FormatFields(char* buf, int size, int level, const char* tag, const char* message, const LogFields& fields) {
+    char time[64];
+    GetTimeStr(time, sizeof(time), time_precision_);
+    int  tag_len = (int)strlen(tag);
+    int  message_len = (int)strlen(message);
+    bool cut = false;
+    int  len = LogFormatFieldsLine(LineStyle(), time, LogLevelName(level), tag, tag_len,
+            message, message_len, fields.fields(), fields.count(), buf, size + 1, &cut);
+    return cut ? LogFieldsLineBound(tag_len, message_len, fields.fields(), fields.count()) : len;
+}
+
+int Log::FormatRecord(LogLineStyle style, const char* record, int len, char* out, int size) const {
+    const char* format = NULL;
+    if (LOG_RECORD_LINE == record[2]) {
+        uint32_t id;
+        memcpy(&id, record + LOG_RECORD_HEADER_LEN, sizeof(id));
+        format = GetFormat(id);
+    }
+    return LogFormatRecord(style, format, record, len, out, size);
+}
+
+char* Log::ReserveLine(int level, char* stack_buf, LogSlot** slot, LogStaging::Buffer** buffer) {
+    *slot = NULL;
+    *buffer = NULL;
+    if (!async_) {
+        return stack_buf;
+    }
+    // async: format into the staging buffer of the thread or the ring slot directly
+    *buffer = staging_.enabled() ? staging_.ThreadBuffer() : NULL;
+    if (*buffer) {
+        return ReserveStaged(*buffer, level);
+    }
+    *slot = ReserveSlot(level);
+    return *slot ? (*slot)->data : NULL;
+}
+
+char* Log::SpillLine(int size, LogSlot* slot, LogStaging::Buffer* buffer) {
+    if (buffer) {
+        return staging_.Spill(buffer, size);
+    }
+    char* chunk = chunks_.Alloc(size);
+    if (slot) {
+        slot->chunk = chunk;
+    }
+    return chunk;
+}
+
+void Log::LogV(int level, const char* tag, const char* format, va_list ap, bool output) {
+    if (level >= recorder_level_) {
+        va_list record_ap;
+        va_copy(record_ap, ap);
+        RecordLine(level, tag, format, record_ap);
+        va_end(record_ap);
+    }
+    if (!output) {
+        return;
+    }
+    if (limits_) {
+        ReportSuppressed(false);
+    }
+    char  stack_buf[MAX_LOG_LEN+1];
+    LogSlot* slot;
+    LogStaging::Buffer* buffer;
+    char* buf = ReserveLine(level, stack_buf, &slot, &buffer);
+    if (NULL == buf) {
+        return;
+    }
+
+    // the line is formatted into buf first, a longer one again into a chunk
+    bool binary = (LOG_ENCODING_BINARY == encoding_);
+    bool text_records = false;
+    char* line = buf;
+    int   len = 0;
+    va_list line_ap;
+    if (binary) {
+        va_copy(line_ap, ap);
+        len = EncodeLine(line, MAX_LOG_LEN, level, tag, format, line_ap);
+        va_end(line_ap);
+        if (len > MAX_LOG_LEN && len <= LOG_RECORD_MAX_LEN) {
+            int size = len;
+            line = SpillLine(size + 1, slot, buffer);
+            va_copy(line_ap, ap);
+            len = EncodeLine(line, size, level, tag, format, line_ap);
+            va_end(line_ap);
+        }
+        // binary encoding falls back to text records for formats it can not
+        // encode and for values longer than a record
+        text_records = (0 == len || len > LOG_RECORD_MAX_LEN);
+    }
+    if (!binary || text_records) {
+        // room for the header of a text record
+        int size = text_records ? MAX_LOG_LEN - LOG_RECORD_HEADER_LEN : MAX_LOG_LEN;
+        va_copy(line_ap, ap);
+        len = FormatText(line, size, level, tag, format, line_ap);
+        va_end(line_ap);
+        if (len > size) {
+            size = len;
+            line = SpillLine(size + 1 + (text_records ? TextRecords(size) * LOG_RECORD_HEADER_LEN : 0), slot, buffer);
+            va_copy(line_ap, ap);
+            len = FormatText(line, size, level, tag, format, line_ap);
+            va_end(line_ap);
+            if (len > size) {
+                len = size;
             }
-        } else if ((time(NULL)%DAY_OF_SECONDS) > current_log_file_day_){
-            char buf[32];
-            time_t timer = time(NULL);
-            strftime(buf, sizeof(buf), "%Y-%m-%d", localtime(&timer));
-
-            std::string new_file_name = path_ + "/";
-            new_file_name += name_;
-            new_file_name += "-";
-            new_file_name += buf;
-            new_file_name += suffix_;
-            current_log_file_day_ = timer%DAY_OF_SECONDS;
-
-            fclose(file_);
-
-            file_ = fopen(new_file_name.c_str(), "a+");
-            if (NULL == file_) {
-                fprintf(stderr, "open log file %s failed!\n", new_file_name.c_str());
+        }
+        if (text_records) {
+            len = EncodeText(line, len + TextRecords(len) * LOG_RECORD_HEADER_LEN, level, line, len);
+        }
+    }
+    CommitLine(slot, buffer, line, len, level);
+    // a chunk of a line written directly
+    if (line != buf && NULL == slot && NULL == buffer) {
+        chunks_.Free(line);
+    }
+}
+
+void Log::RecordLine(int level, const char* tag, const char* format, va_list ap) {
+    // values are copied, not formatted
+    char record[MAX_LOG_LEN+1];
+    int64_t time;
+    // long lines are cut to MAX_LOG_LEN, the rings keep more lines
+    int len = EncodeLine(record, MAX_LOG_LEN, level, tag, format, ap);
+    if (len > 0) {
+        uint16_t record_len;
+        memcpy(&record_len, record, sizeof(record_len));
+        len = record_len;
+        memcpy(&time, record + LOG_RECORD_HEADER_LEN + 4, sizeof(time));
+    } else {
+        time = LogClockUs();
+        len = FormatText(record, MAX_LOG_LEN - LOG_RECORD_HEADER_LEN, level, tag, format, ap);
+        if (len > MAX_LOG_LEN - LOG_RECORD_HEADER_LEN) {
+            len = MAX_LOG_LEN - LOG_RECORD_HEADER_LEN;
+        }
+        len = EncodeText(record, MAX_LOG_LEN, level, record, len);
+    }
+    recorder_.Record(time, record, len);
+}
+
+void Log::Dump(unsigned long thread, unsigned long mark_thread, long mark, const char* reason, bool locked) {
+    std::vector<LogRecorderEntry> entries;
+    std::vector<char> records;
+    recorder_.Collect(thread, dump_lines_, mark_thread, mark, &entries, &records);
+    if (entries.empty()) {
+        return;
+    }
+
+    // lines of the dump in the encoding of the log, each one '\0' terminated
+    bool binary = (LOG_ENCODING_BINARY == encoding_);
+    std::vector<char> data;
+    std::vector<int>  lens;
+    std::vector<int>  levels;
+    char text[MAX_LOG_LEN * 2];
+    for (size_t i = 0; i < entries.size() + 2; i++) {
+        int len = 0;
+        int level = LOG_LEVEL_INFO;
+        if (0 == i || entries.size() + 1 == i) {
+            char banner[128];
+            if (0 == i && 0 != thread) {
+                len = snprintf(banner, sizeof(banner), "---- flight recorder: %d lines of thread %lu (%s) ----",
+                        (int)entries.size(), thread, reason);
+            } else if (0 == i) {
+                len = snprintf(banner, sizeof(banner), "---- flight recorder: %d lines of all threads (%s) ----",
+                        (int)entries.size(), reason);
+            } else {
+                len = snprintf(banner, sizeof(banner), "---- end of flight recorder ----");
+            }
+            if (LOG_LINE_TEXT == LineStyle()) {
+                len = snprintf(text, MAX_LOG_LEN, "%s\n", banner);
+            } else {
+                // a whole line in JSON or logfmt
+                char time[32];
+                LogFormatTime(LogClockUs(), time, sizeof(time));
+                len = LogFormatFieldsLine(LineStyle(), time, LogLevelName(level), "recorder", 8,
+                        banner, len, NULL, 0, text, MAX_LOG_LEN);
+            }
+            if (binary) {
+                len = EncodeText(text, MAX_LOG_LEN, level, text, len);
+            }
+        } else {
+            const char* record = &records[entries[i-1].offset];
+            len = entries[i-1].len;
+            level = (unsigned char)record[3];
+            if (binary) {
+                memcpy(text, record, len);
+            } else {
+                len = FormatRecord(LineStyle(), record, len, text, sizeof(text));
             }
         }
+        data.insert(data.end(), text, text + len);
+        data.push_back('\0');
+        lens.push_back(len);
+        levels.push_back(level);
+    }
+
+    if (!locked) {
+        lock_mutex(&mutex_);
+    }
+    if (targets_ & LOG_TARGET_FILE) {
+        LogSinkQueue* queue = FindSink(LOG_TARGET_FILE);
+        queue->BeginBatch();
+        size_t offset = 0;
+        for (size_t i = 0; i < lens.size(); i++) {
+            queue->Push(&data[offset], lens[i], levels[i]);
+            offset += lens[i] + 1;
+        }
+        queue->EndBatch();
+    }
+    if (!locked) {
+        unlock_mutex(&mutex_);
     }
+}
 
+void Log::AddDump(unsigned long thread, long mark) {
+    // an error storm dumps once per thread and batch
+    for (size_t i = 0; i < dumps_.size(); i++) {
+        if (dumps_[i].thread == thread) {
+            if (mark > dumps_[i].mark) {
+                dumps_[i].mark = mark;
+            }
+            return;
+        }
+    }
+    DumpRequest request;
+    request.thread = thread;
+    request.mark = mark;
+    dumps_.push_back(request);
 }
 
-void Log::WriteLog(char* data, int len) {
+void Log::WriteDumps() {
+    for (size_t i = 0; i < dumps_.size(); i++) {
+        unsigned long thread = (LOG_DUMP_THREAD == dump_) ? dumps_[i].thread : 0;
+        Dump(thread, dumps_[i].thread, dumps_[i].mark, "Error", true);
+    }
+    dumps_.clear();
+}
+
+void Log::CommitLine(LogSlot* slot, LogStaging::Buffer* buffer, char* buf, int len, int level) {
+    // an Error dumps the flight recorder after its line: at once when the line is
+    // written directly, by the writer thread when it is queued (async)
+    bool dump = (level >= LOG_LEVEL_ERROR && LOG_DUMP_ON_DEMAND != dump_ && recorder_.enabled());
+    // the Error line is recorded before, lines recorded after it are not dumped
+    long mark = (dump && (slot || buffer)) ? recorder_.Mark() : -1;
+    if (buffer) {
+        // time of the line: the clock was read for it last
+        bool signal = staging_.Commit(buffer, time_cache.now, level, len, dump ? mark : -1);
+        if (writer_idle_ && (signal || level >= LOG_LEVEL_ERROR)) {
+            WakeWriter();
+        }
+    } else if (slot) {
+        slot->len = len;
+        slot->level = level;
+        slot->dump = dump ? mark : -1;
+        slot->thread = dump ? thread_id() : 0;
+        CommitSlot(slot, level);
+    } else {
+        lock_mutex(&mutex_);
+        WriteTargets(buf, len, level);
+        unlock_mutex(&mutex_);
+        if (dump) {
+            Dump((LOG_DUMP_THREAD == dump_) ? thread_id() : 0, 0, -1, "Error", false);
+        }
+    }
+    if (sync_errors_ && level >= LOG_LEVEL_ERROR) {
+        SyncFile();
+    }
+}
+
+Log::LogSlot* Log::ReserveSlot(int level) {
+    bool blocked = false;
+    long capacity = ring_mask_ + 1;
+    for (;;) {
+        long pos = enqueue_pos_;
+        LogSlot* slot = &ring_[pos & ring_mask_];
+        long dif = slot->sequence - pos;
+        if (0 == dif) {
+            // keep the last 1/8 of the ring for Warn/Error
+            if (LOG_OVERFLOW_DROP_LOWEST == overflow_policy_ && level < LOG_LEVEL_WARN
+                    && pos - dequeue_pos_ >= capacity - capacity / 8) {
+                break;
+            }
+            if (atomic_cas(&enqueue_pos_, pos, pos + 1)) {
+                return slot;
+            }
+        } else if (dif < 0) {
+            // ring is full
+            if (LOG_OVERFLOW_DROP == overflow_policy_
+                    || (LOG_OVERFLOW_DROP_LOWEST == overflow_policy_ && level < LOG_LEVEL_WARN)) {
+                break;
+            }
+            if (!blocked) {
+                blocked = true;
+                atomic_inc(&blocked_);
+            }
+            WakeWriter();
+            yield();
+        }
+        // else: another caller reserved pos, retry
+    }
+    atomic_inc(&dropped_[level]);
+    return NULL;
+}
+
+void Log::CommitSlot(LogSlot* slot, int level) {
+    // sequence pos -> pos + 1 (full barrier, the line is visible before the writer is checked)
+    long queued = atomic_inc(&slot->sequence) - dequeue_pos_;
+    // an idle writer wakes up by itself every LOG_WRITER_INTERVAL ms,
+    // waking it for every line costs a context switch per line
+    if (writer_idle_ && (queued >= LOG_WAKE_LINES || level >= LOG_LEVEL_ERROR)) {
+        WakeWriter();
+    }
+}
+
+char* Log::ReserveStaged(LogStaging::Buffer* buffer, int level) {
+    bool blocked = false;
+    long limit = staging_.size();
+    // keep the last 1/8 of the buffer for Warn/Error
+    if (LOG_OVERFLOW_DROP_LOWEST == overflow_policy_ && level < LOG_LEVEL_WARN) {
+        limit -= limit / 8;
+    }
+    for (;;) {
+        char* buf = staging_.Reserve(buffer, MAX_LOG_LEN, limit);
+        if (buf || LOG_OVERFLOW_DROP == overflow_policy_
+                || (LOG_OVERFLOW_DROP_LOWEST == overflow_policy_ && level < LOG_LEVEL_WARN)) {
+            if (blocked) {
+                atomic_add(&staging_force_, -1);
+            }
+            if (NULL == buf) {
+                atomic_inc(&dropped_[level]);
+            }
+            return buf;
+        }
+        // the writer frees the buffer without waiting for the merge window
+        if (!blocked) {
+            blocked = true;
+            atomic_inc(&blocked_);
+            atomic_inc(&staging_force_);
+        }
+        WakeWriter();
+        yield();
+    }
+}
+
+void Log::WakeWriter() {
+    if (atomic_cas(&writer_idle_, 1, 0)) {
+        post_semaphore(&writer_sem_);
+    }
+}
+
+int Log::DrainRing() {
+    int count = 0;
+    long capacity = ring_mask_ + 1;
+    bool more = true;
+    while (more) {
+        int batch = 0;
+        lock_mutex(&mutex_);
+        for (size_t i = 0; i < sinks_.size(); i++) {
+            sinks_[i]->BeginBatch();
+        }
+        long start = dequeue_pos_;
+        while (batch < LOG_WRITE_BATCH) {
+            LogSlot* slot = &ring_[(start + batch) & ring_mask_];
+            // atomic read, the line is read after its sequence
+            if (atomic_add(&slot->sequence, 0) != start + batch + 1) {
+                more = false;
+                break;
+            }
+            WriteTargets(slot->chunk ? slot->chunk : slot->data, slot->len, slot->level);
+            if (slot->dump >= 0) {
+                AddDump(slot->thread, slot->dump);
+            }
+            batch++;
+        }
+        // direct sinks write the batch at once
+        for (size_t i = 0; i < sinks_.size(); i++) {
+            sinks_[i]->EndBatch();
+        }
+        // dumps follow the Error lines of the batch
+        if (!dumps_.empty()) {
+            WriteDumps();
+        }
+        // free the slots for the next lap
+        for (int i = 0; i < batch; i++) {
+            LogSlot* slot = &ring_[(start + i) & ring_mask_];
+            if (slot->chunk) {
+                chunks_.Free(slot->chunk);
+                slot->chunk = NULL;
+            }
+            atomic_add(&slot->sequence, capacity - 1);
+        }
+        dequeue_pos_ = start + batch;
+        unlock_mutex(&mutex_);
+        count += batch;
+    }
+    return count;
+}
+
+int Log::DrainStaging() {
+    if (!staging_.enabled()) {
+        return 0;
+    }
+    int64_t cutoff = LogClockUs() - merge_window_us_;
+    if (staging_force_ > 0 || writer_stop_) {
+        cutoff = INT64_MAX;
+    }
+    int count = staging_.Collect(cutoff, &staged_lines_);
+    for (int start = 0; start < count; start += LOG_WRITE_BATCH) {
+        lock_mutex(&mutex_);
+        for (size_t i = 0; i < sinks_.size(); i++) {
+            sinks_[i]->BeginBatch();
+        }
+        for (int i = start; i < count && i < start + LOG_WRITE_BATCH; i++) {
+            const LogLine& line = staged_lines_[i].line;
+            WriteTargets(line.data, line.len, line.level);
+            if (staged_lines_[i].dump >= 0) {
+                AddDump(staged_lines_[i].thread, staged_lines_[i].dump);
+            }
+        }
+        for (size_t i = 0; i < sinks_.size(); i++) {
+            sinks_[i]->EndBatch();
+        }
+        // dumps follow the Error lines of the batch
+        if (!dumps_.empty()) {
+            WriteDumps();
+        }
+        unlock_mutex(&mutex_);
+    }
+    // the lines are written (or copied by sink queues)
+    staging_.Release();
+    return count;
+}
+
+void* Log::WriterThread(void* arg) {
+    Log* log = static_cast<Log*>(arg);
+    for (;;) {
+        // both: a staged line may wait for the window while the ring has lines
+        int count = log->DrainRing();
+        count += log->DrainStaging();
+        if (count > 0) {
+            continue;
+        }
+        if (log->writer_stop_ && log->dequeue_pos_ == log->enqueue_pos_
+                && 0 == log->staging_.queued()) {
+            break;
+        }
+        // wait for CommitSlot or the interval, check the ring again after idle is published
+        atomic_cas(&log->writer_idle_, 0, 1);
+        LogSlot* slot = &log->ring_[log->dequeue_pos_ & log->ring_mask_];
+        if (atomic_add(&slot->sequence, 0) != log->dequeue_pos_ + 1 && !log->writer_stop_) {
+            wait_semaphore(&log->writer_sem_, LOG_WRITER_INTERVAL);
+        }
+        atomic_cas(&log->writer_idle_, 1, 0);
+    }
+    return NULL;
+}
+
+void Log::SetTimePrecision(LogTimePrecision precision) {
+    time_precision_ = precision;
+}
+
+Log::TagLevel* Log::FindTagLevel(const char* tag) {
+    std::map<std::string, TagLevel*>::iterator it = tag_levels_.find(tag);
+    if (tag_levels_.end() != it) {
+        return it->second;
+    }
+    TagLevel* tag_level = new TagLevel;
+    tag_level->threshold = level_;
+    tag_level->level = (level_ < recorder_level_) ? level_ : recorder_level_;
+    tag_level->own = false;
+    tag_level->tag = tag_levels_.insert(std::make_pair(std::string(tag), tag_level)).first->first.c_str();
+    return tag_level;
+}
+
+void Log::UpdateLevelBounds() {
+    long min_level = level_;
+    long max_level = level_;
+    for (std::map<std::string, TagLevel*>::iterator it = tag_levels_.begin();
+            it != tag_levels_.end(); ++it) {
+        TagLevel* tag_level = it->second;
+        if (tag_level->own) {
+            if (tag_level->threshold < min_level) {
+                min_level = tag_level->threshold;
+            }
+            if (tag_level->threshold > max_level) {
+                max_level = tag_level->threshold;
+            }
+        }
+        // the flight recorder gets the lines below the threshold too
+        tag_level->level = (tag_level->threshold < recorder_level_) ? tag_level->threshold : recorder_level_;
+    }
+    min_level_ = min_level;
+    max_level_ = max_level;
+}
+
+void Log::SetLevel(LogLevel level) {
+    lock_mutex(&level_mutex_);
+    level_ = level;
+    for (std::map<std::string, TagLevel*>::iterator it = tag_levels_.begin();
+            it != tag_levels_.end(); ++it) {
+        if (!it->second->own) {
+            it->second->threshold = level;
+        }
+    }
+    UpdateLevelBounds();
+    unlock_mutex(&level_mutex_);
+}
+
+void Log::SetTagLevel(const char* tag, LogLevel level) {
+    lock_mutex(&level_mutex_);
+    TagLevel* tag_level = FindTagLevel(tag);
+    tag_level->own = true;
+    tag_level->threshold = level;
+    // published once, the threshold is set before
+    uint32_t hash = TagHash(tag);
+    bool added = false;
+    for (int i = 0; i < LOG_MAX_TAG_LEVELS && !added; i++) {
+        TagLevel* volatile* entry = &tag_table_[(hash + i) & (LOG_MAX_TAG_LEVELS - 1)];
+        added = (tag_level == *entry) || atomic_cas_ptr((void* volatile*)entry, NULL, tag_level);
+    }
+    if (!added) {
+        tag_table_full_ = 1;
+    }
+    UpdateLevelBounds();
+    unlock_mutex(&level_mutex_);
+}
+
+void Log::ClearTagLevel(const char* tag) {
+    lock_mutex(&level_mutex_);
+    TagLevel* tag_level = FindTagLevel(tag);
+    tag_level->own = false;
+    tag_level->threshold = level_;
+    UpdateLevelBounds();
+    unlock_mutex(&level_mutex_);
+}
+
+volatile long* Log::GetTagLevel(const char* tag) {
+    lock_mutex(&level_mutex_);
+    TagLevel* tag_level = FindTagLevel(tag);
+    unlock_mutex(&level_mutex_);
+    return &tag_level->level;
+}
+
+bool Log::IsLevelEnabled(LogLevel level, const char* tag) {
+    // no tag has a threshold above level (or all are above it)
+    if (level < min_level_) {
+        return false;
+    }
+    if (level >= max_level_) {
+        return true;
+    }
+    // a tag not in the table never had its own level
+    uint32_t hash = TagHash(tag);
+    for (int i = 0; i < LOG_MAX_TAG_LEVELS; i++) {
+        TagLevel* tag_level = tag_table_[(hash + i) & (LOG_MAX_TAG_LEVELS - 1)];
+        if (NULL == tag_level) {
+            break;
+        }
+        if (0 == strcmp(tag_level->tag, tag)) {
+            return level >= tag_level->threshold;
+        }
+    }
+    if (!tag_table_full_) {
+        return level >= level_;
+    }
+    lock_mutex(&level_mutex_);
+    std::map<std::string, TagLevel*>::iterator it = tag_levels_.find(tag);
+    long threshold = (tag_levels_.end() != it) ? it->second->threshold : level_;
+    unlock_mutex(&level_mutex_);
+    return level >= threshold;
+}
+
+bool Log::SetTagLimit(const char* tag, long rate, long burst, long sample) {
+    lock_mutex(&level_mutex_);
+    if (NULL == tag_limits_) {
+        LogLimit* limits = new LogLimit[LOG_MAX_TAG_LIMITS];
+        memset((void*)limits, 0, sizeof(LogLimit) * LOG_MAX_TAG_LIMITS);
+        tag_limits_ = limits;
+    }
+    // limits are never removed, a removed one passes every line
+    uint32_t hash = TagHash(tag);
+    LogLimit* limit = NULL;
+    for (int i = 0; i < LOG_MAX_TAG_LIMITS && NULL == limit; i++) {
+        LogLimit* entry = &tag_limits_[(hash + i) & (LOG_MAX_TAG_LIMITS - 1)];
+        if (NULL == entry->tag || 0 == strcmp(entry->tag, tag)) {
+            limit = entry;
+        }
+    }
+    if (limit) {
+        limit->rate = rate;
+        limit->burst = burst;
+        limit->sample = sample;
+        if (NULL == limit->tag) {
+            // the tag is published after the limit, PassTagLimit finds it by the tag
+            char* copy = new char[strlen(tag) + 1];
+            strcpy(copy, tag);
+            AddLimit(limit, copy, NULL);
+        }
+    }
+    unlock_mutex(&level_mutex_);
+    return NULL != limit;
+}
+
+LogLimit* Log::GetLimit(const void* site, const char* tag, long rate, long burst, long sample) {
+    lock_mutex(&level_mutex_);
+    LogLimit* limit;
+    std::map<const void*, LogLimit*>::iterator it = site_limits_.find(site);
+    if (site_limits_.end() != it) {
+        limit = it->second;
+    } else {
+        limit = new LogLimit;
+        memset((void*)limit, 0, sizeof(LogLimit));
+        limit->rate = rate;
+        limit->burst = burst;
+        limit->sample = sample;
+        site_limits_[site] = limit;
+        char* copy = new char[strlen(tag) + 1];
+        strcpy(copy, tag);
+        AddLimit(limit, copy, NULL);
+    }
+    unlock_mutex(&level_mutex_);
+    return limit;
+}
+
+bool Log::PassTagLimit(const char* tag) {
+    LogLimit* limits = tag_limits_;
+    if (NULL == limits) {
+        return true;
+    }
+    uint32_t hash = TagHash(tag);
+    for (int i = 0; i < LOG_MAX_TAG_LIMITS; i++) {
+        LogLimit* limit = &limits[(hash + i) & (LOG_MAX_TAG_LIMITS - 1)];
+        const char* limit_tag = limit->tag;
+        if (NULL == limit_tag) {
+            return true;
+        }
+        if (0 == strcmp(limit_tag, tag)) {
+            return PassLimit(limit);
+        }
+    }
+    return true;
+}
+
+bool Log::PassLimit(LogLimit* limit) {
+    long sample = limit->sample;
+    bool pass = (sample <= 1 || 0 == (atomic_inc(&limit->seen) - 1) % sample);
+    long rate = limit->rate;
+    if (pass && rate > 0) {
+        // token bucket as a virtual time (GCRA): a line takes interval of the
+        // bucket, the bucket holds burst lines and is full again at full_at
+        long interval = (rate < 1000000) ? 1000000 / rate : 1;
+        long burst = (limit->burst > 1) ? limit->burst : 1;
+        // at most 1000 s of lines, the time fits in a 32-bit long
+        long capacity = (burst < 1000000000 / interval) ? burst * interval : 1000000000;
+        long now = (long)clock_tick_us();
+        for (;;) {
+            long full_at = limit->full_at;
+            // time the bucket is full after now, differences of wrapping clocks.
+            // now of a preempted caller is behind, more than a second past
+            // capacity is a clock wrapped while the limit was idle
+            long ahead = (long)((unsigned long)full_at - (unsigned long)now);
+            if (ahead < 0 || ahead > capacity + 1000000) {
+                ahead = 0;
+            }
+            if (ahead + interval > capacity) {
+                pass = false;
+                break;
+            }
+            if (atomic_cas(&limit->full_at, full_at, (long)((unsigned long)now + ahead + interval))) {
+                break;
+            }
+        }
+    }
+    if (!pass) {
+        atomic_inc(&limit->suppressed);
+        atomic_inc(&suppressed_);
+    }
+    return pass;
+}
+
+void Log::AddLimit(LogLimit* limit, const char* tag, const char* format) {
+    limit->format = format;
+    if (!atomic_cas_ptr((void* volatile*)&limit->tag, NULL, (void*)tag)) {
+        // added by another caller
+        return;
+    }
+    LogLimit* next;
+    do {
+        next = limits_;
+        limit->next = next;
+    } while (!atomic_cas_ptr((void* volatile*)&limits_, next, limit));
+}
+
+void Log::ReportSuppressed(bool force) {
+    long now = (long)(clock_tick_us() / 1000);
+    long report_at = report_at_;
+    if (!force && (long)((unsigned long)report_at - (unsigned long)now) > 0) {
+        return;
+    }
+    // one caller reports
+    if (!atomic_cas(&report_at_, report_at, now + LOG_LIMIT_REPORT_MS)) {
+        return;
+    }
+    for (LogLimit* limit = limits_; limit; limit = limit->next) {
+        long suppressed = limit->suppressed;
+        if (suppressed <= 0) {
+            continue;
+        }
+        atomic_add(&limit->suppressed, -suppressed);
+        if (limit->format) {
+            WriteSummary(limit->tag, "suppressed %ld lines like \"%s\"", suppressed, limit->format);
+        } else {
+            WriteSummary(limit->tag, "suppressed %ld lines", suppressed);
+        }
+    }
+}
+
+void Log::SetEncoding(LogEncoding encoding) {
+    Flush();
     lock_mutex(&mutex_);
-    LogCheck();
+    if (LOG_ENCODING_BINARY == encoding && NULL == formats_) {
+        formats_ = new LogFormat[LOG_MAX_FORMATS];
+        memset((void*)formats_, 0, sizeof(LogFormat) * LOG_MAX_FORMATS);
+    }
+    encoding_ = encoding;
+    unlock_mutex(&mutex_);
+
+    // text and binary lines never share a file
+    file_sink_->SetSuffix((LOG_ENCODING_BINARY == encoding) ? BINARY_SUFFIX : DEFAULT_SUFFIX);
+}
 
-    if ((LOG_TARGET_FILE & targets_) && file_) {
-        fwrite(data, 1, len+1, file_);
+void Log::SetRecorder(LogLevel level, long thread_bytes, int dump_lines, LogRecorderDump dump) {
+    lock_mutex(&mutex_);
+    // lines are recorded as binary records
+    if (thread_bytes > 0 && NULL == formats_) {
+        formats_ = new LogFormat[LOG_MAX_FORMATS];
+        memset((void*)formats_, 0, sizeof(LogFormat) * LOG_MAX_FORMATS);
     }
-    if ((LOG_TARGET_NET & targets_) && (INVALID_SOCKET != log_socket_)) {
-        sendto(log_socket_, data, len+1, 0, (sockaddr*)&target_addr_, sizeof(target_addr_));
+    unlock_mutex(&mutex_);
+    recorder_.SetSize(thread_bytes);
+    dump_lines_ = dump_lines;
+    dump_ = dump;
+
+    lock_mutex(&level_mutex_);
+    recorder_level_ = (thread_bytes > 0) ? level : LOG_LEVEL_COUNT;
+    UpdateLevelBounds();
+    unlock_mutex(&level_mutex_);
+}
+
+void Log::DumpRecorder() {
+    Dump(0, 0, -1, "on demand", false);
+}
+
+// state of a crash dump
+struct CrashDump {
+    Log* log;
+    int  fd;
+    unsigned long thread;
+    // ids of the formats written to the crash file
+    unsigned char formats[LOG_MAX_FORMATS / 8];
+};
+
+// write all of data to the crash file, false on an error
+static bool WriteCrashBytes(CrashDump* dump, const char* data, int len) {
+#ifdef WIN32
+    return _write(dump->fd, data, len) == len;
+#else
+    return write(dump->fd, data, len) == len;
+#endif
+}
+
+// the records are written as they are (a binary log, see logviewer),
+// formatting them would need snprintf, localtime and heap buffers
+static void WriteCrashRecord(unsigned long thread, const char* record, int len, void* arg) {
+    CrashDump* dump = static_cast<CrashDump*>(arg);
+    char buf[LOG_RECORD_HEADER_LEN + 4 + MAX_LOG_LEN];
+    if (thread != dump->thread) {
+        dump->thread = thread;
+        // a text record "---- thread N ----\n", N without snprintf
+        char digits[24];
+        int n = 0;
+        do {
+            digits[n++] = (char)('0' + thread % 10);
+            thread /= 10;
+        } while (thread > 0);
+        char* p = buf + LOG_RECORD_HEADER_LEN;
+        memcpy(p, "---- thread ", 12);
+        p += 12;
+        while (n > 0) {
+            *p++ = digits[--n];
+        }
+        memcpy(p, " ----\n", 6);
+        p += 6;
+        uint16_t record_len = (uint16_t)(p - buf);
+        memcpy(buf, &record_len, sizeof(record_len));
+        buf[2] = LOG_RECORD_TEXT;
+        buf[3] = LOG_LEVEL_INFO;
+        if (!WriteCrashBytes(dump, buf, record_len)) {
+            return;
+        }
+    }
+    if (LOG_RECORD_LINE == record[2] && len >= LOG_RECORD_LINE_LEN) {
+        // the format of a line record goes before its first line
+        uint32_t id;
+        memcpy(&id, record + LOG_RECORD_HEADER_LEN, sizeof(id));
+        const char* format = (id < LOG_MAX_FORMATS) ? dump->log->GetFormat(id) : NULL;
+        if (NULL != format && 0 == (dump->formats[id / 8] & (1 << (id % 8)))) {
+            dump->formats[id / 8] |= (unsigned char)(1 << (id % 8));
+            if (!WriteCrashBytes(dump, buf, LogEncodeFormat(id, format, buf, sizeof(buf)))) {
+                return;
+            }
+        }
     }
-    if (LOG_TARGET_CONSOLE & targets_) {
-        printf(data);
+    WriteCrashBytes(dump, record, len);
+}
+
+void Log::DumpRecorderOnCrash() {
+    if (!recorder_.enabled()) {
+        return;
+    }
+    CrashDump dump;
+    dump.log = this;
+    dump.thread = 0;
+    memset(dump.formats, 0, sizeof(dump.formats));
+#ifdef WIN32
+    dump.fd = _open(crash_file_, _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    dump.fd = open(crash_file_, O_WRONLY | O_CREAT | O_APPEND, 0644);
+#endif
+    if (dump.fd < 0) {
+        return;
+    }
+    // a new crash file starts with the header of a binary log,
+    // the formats are written again by every dump appended to it
+#ifdef WIN32
+    bool empty = (0 == _lseek(dump.fd, 0, SEEK_END));
+#else
+    bool empty = (0 == lseek(dump.fd, 0, SEEK_END));
+#endif
+    bool written = true;
+    if (empty) {
+        char header[LOG_BINARY_HEADER_LEN];
+        uint32_t byte_order = LOG_BINARY_BYTE_ORDER;
+        memcpy(header, LOG_BINARY_MAGIC, LOG_BINARY_MAGIC_LEN);
+        memcpy(header + LOG_BINARY_MAGIC_LEN, &byte_order, sizeof(byte_order));
+        written = WriteCrashBytes(&dump, header, sizeof(header));
+    }
+    if (written) {
+        recorder_.Visit(WriteCrashRecord, &dump);
+    }
+#ifdef WIN32
+    _close(dump.fd);
+#else
+    close(dump.fd);
+#endif
+}
+
+void Log::SetFileWriter(LogFileWriter writer, long window_size) {
+    Flush();
+    file_sink_->SetWriter(writer, window_size);
+}
+
+void Log::SetFileRetention(int max_files, long max_bytes, const char* compress_command) {
+    file_sink_->SetRetention(max_files, max_bytes, compress_command);
+}
+
+void Log::SetFileDurability(LogDurability durability, int sync_interval_ms, long sync_bytes, bool sync_errors) {
+    file_sink_->SetDurability(durability, sync_interval_ms, sync_bytes, sync_errors);
+    sync_errors_ = sync_errors;
+}
+
+void Log::SetAsync(bool enable, long capacity, LogOverflowPolicy policy) {
+    StopAsync();
+    overflow_policy_ = policy;
+    async_capacity_ = capacity;
+    if (!enable) {
+        return;
+    }
+
+    long size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring_ = new LogSlot[size];
+    // touch every page now, callers should not page fault on the first lap
+    memset((void*)ring_, 0, sizeof(LogSlot) * size);
+    for (long i = 0; i < size; i++) {
+        ring_[i].sequence = i;
+    }
+    ring_mask_ = size - 1;
+    enqueue_pos_ = 0;
+    dequeue_pos_ = 0;
+    writer_idle_ = 0;
+    writer_stop_ = false;
+    staging_.SetSize(staging_size_);
+    staging_force_ = 0;
+    init_semaphore(&writer_sem_, 0);
+    if (0 != begin_thread(&writer_thread_, WriterThread, this)) {
+        fprintf(stderr, "create log writer thread failed!\n");
+        uninit_semaphore(&writer_sem_);
+        delete[] ring_;
+        ring_ = NULL;
+        return;
+    }
+    async_ = true;
+}
+
+void Log::StopAsync() {
+    if (!async_) {
+        return;
+    }
+    // new lines are written synchronously from now on
+    async_ = false;
+    writer_stop_ = true;
+    post_semaphore(&writer_sem_);
+    wait_thread(&writer_thread_);
+    uninit_semaphore(&writer_sem_);
+    delete[] ring_;
+    ring_ = NULL;
+    staging_.SetSize(0);
+}
+
+void Log::SetThreadBuffers(long thread_bytes, int merge_window_us) {
+    bool async = async_;
+    StopAsync();
+    staging_size_ = (thread_bytes > 0) ? thread_bytes : 0;
+    merge_window_us_ = (merge_window_us > 0) ? merge_window_us : 0;
+    if (async) {
+        SetAsync(true, async_capacity_, overflow_policy_);
+    }
+}
+
+void Log::WaitWriter() {
+    if (!async_) {
+        return;
+    }
+    long pos = enqueue_pos_;
+    std::vector<long> marks;
+    staging_.Mark(&marks);
+    // staged lines are written without waiting for the merge window
+    atomic_inc(&staging_force_);
+    while (dequeue_pos_ < pos || !staging_.Released(marks)) {
+        WakeWriter();
+        yield();
+    }
+    atomic_add(&staging_force_, -1);
+}
+
+void Log::Flush() {
+    if (limits_) {
+        ReportSuppressed(true);
+    }
+    WaitWriter();
+    lock_mutex(&mutex_);
+    for (size_t i = 0; i < sinks_.size(); i++) {
+        sinks_[i]->Flush();
     }
     unlock_mutex(&mutex_);
 }
 
+void Log::SyncFile() {
+    if (0 == (targets_ & LOG_TARGET_FILE)) {
+        return;
+    }
+    // the line reaches the file sink
+    WaitWriter();
+    lock_mutex(&mutex_);
+    LogSinkQueue* queue = FindSink(LOG_TARGET_FILE);
+    unlock_mutex(&mutex_);
+    queue->Flush();
+    // not under mutex_: concurrent Error calls share a sync
+    file_sink_->Sync();
+}
+
+void Log::GetStats(LogStats* stats) {
+    stats->written = written_;
+    for (int i = 0; i < LOG_LEVEL_COUNT; i++) {
+        stats->dropped[i] = dropped_[i];
+    }
+    stats->blocked = blocked_;
+    stats->queued = async_ ? enqueue_pos_ - dequeue_pos_ + staging_.queued() : 0;
+    stats->suppressed = suppressed_;
+}
+
 void Log::Start() {
     SetTargets(targets_);
 
     char str_time[64];
     char buf[MAX_LOG_LEN];
     int  len = 0;
-    GetTimeStr(str_time, sizeof(str_time));
+    GetTimeStr(str_time, sizeof(str_time), time_precision_);
 
     len = sprintf(buf, "%s START: ****************************************************\n", str_time);
     WriteLog(buf, len);
@@ -145,11 +1473,14 @@ void Log::Start() {
 }
 
 void Log::End() {
+    if (limits_) {
+        ReportSuppressed(true);
+    }
 
     char str_time[64];
     char buf[MAX_LOG_LEN];
     int  len = 0;
-    GetTimeStr(str_time, sizeof(str_time));
+    GetTimeStr(str_time, sizeof(str_time), time_precision_);
 
     len = sprintf(buf, "%s END: ******************************************************\n", str_time);
     WriteLog(buf, len);
@@ -158,132 +1489,251 @@ void Log::End() {
     len = sprintf(buf, "%s END: ******************************************************\n", str_time);
     WriteLog(buf, len);
 
+    Flush();
     SetTargets(0);
 }
 
 void Log::SetTargets(int targets) {
-    if ((LOG_TARGET_FILE & targets) && !file_) {
-        SetFile(path_.c_str(), name_.c_str(), log_backup_strategy_, max_file_size_);
-    } else if (!(LOG_TARGET_FILE & targets) && file_) {
-        lock_mutex(&mutex_);
-        fclose(file_);
-        file_ = NULL;
-        unlock_mutex(&mutex_);
+    lock_mutex(&mutex_);
+    // lines queued for a target being disabled are written first
+    for (size_t i = 0; i < sinks_.size(); i++) {
+        if ((sinks_[i]->target() & targets_) && !(sinks_[i]->target() & targets)) {
+            sinks_[i]->Flush();
+        }
     }
-    if ((LOG_TARGET_NET & targets) && (INVALID_SOCKET == log_socket_)) {
-        log_socket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    targets_ = targets;
+    unlock_mutex(&mutex_);
 
-    } else if (!(LOG_TARGET_NET & targets) && (INVALID_SOCKET != log_socket_)) {
-        closesocket(log_socket_);
-        log_socket_ = INVALID_SOCKET;
+    if (LOG_TARGET_FILE & targets) {
+        file_sink_->Open();
+    } else {
+        file_sink_->Close();
+    }
+    if (LOG_TARGET_NET & targets) {
+        net_sink_->Open();
+    } else {
+        net_sink_->Close();
     }
-
-    targets_ = targets;
 }
 
 void Log::SetFile(const char* path, const char* name, LogBackupStrategy strategy, long max_size) {
-    path_ = path;
-    name_ = name;
-    log_backup_strategy_ = strategy;
-    max_file_size_ = max_size;
-
-    std::string file_name = path_ + "/";
-    file_name += name_;
-    if (LOG_BACKUP_ONE_FILE & strategy) {
-        file_name += suffix_;
-    } else {
-        char buf[32];
-        time_t timer = time(NULL);
-        strftime(buf, sizeof(buf), "%Y-%m-%d", localtime(&timer));
-
-        file_name += "-";
-        file_name += buf;
-        file_name += suffix_;
+    file_sink_->SetFile(path, name, strategy, max_size);
+    snprintf(crash_file_, sizeof(crash_file_), "%s/%s-crash.blog", path, name);
+    if (LOG_TARGET_FILE & targets_) {
+        file_sink_->Open();
     }
+}
 
-    if (LOG_TARGET_FILE & targets_) {
-        lock_mutex(&mutex_);
-        if (file_) {
-            fclose(file_);
+void Log::SetAddr(const char* host, unsigned short port) {
+    net_sink_->SetAddr(host, port);
+}
+
+LogSinkQueue* Log::FindSink(int target) {
+    for (size_t i = 0; i < sinks_.size(); i++) {
+        if (target == sinks_[i]->target()) {
+            return sinks_[i];
         }
-        file_ = fopen(file_name.c_str(), "a+");
-        if (NULL == file_) {
-            fprintf(stderr, "open log file %s failed!\n", file_name.c_str());
+    }
+    return NULL;
+}
+
+bool Log::AddSink(int target, ILogSink* sink) {
+    // one bit of the user targets
+    if (NULL == sink || target < LOG_TARGET_USER || 0 != (target & (target - 1))) {
+        return false;
+    }
+    lock_mutex(&mutex_);
+    bool ret = (NULL == FindSink(target));
+    if (ret) {
+        sinks_.push_back(new LogSinkQueue(target, sink, false));
+    }
+    unlock_mutex(&mutex_);
+    return ret;
+}
+
+void Log::RemoveSink(int target) {
+    if (target < LOG_TARGET_USER) {
+        return;
+    }
+    LogSinkQueue* queue = NULL;
+    lock_mutex(&mutex_);
+    for (size_t i = 0; i < sinks_.size(); i++) {
+        if (target == sinks_[i]->target()) {
+            queue = sinks_[i];
+            sinks_.erase(sinks_.begin() + i);
+            break;
         }
-        unlock_mutex(&mutex_);
+    }
+    unlock_mutex(&mutex_);
+    // no more lines, the queue is drained
+    if (queue) {
+        queue->Flush();
+        delete queue;
     }
 }
 
-void Log::SetAddr(const char* host, unsigned short port) {
-    struct hostent* host_info = gethostbyname(host);
-    if (host_info && *host_info->h_addr_list) {
-        memcpy(&target_addr_.sin_addr, *host_info->h_addr_list, sizeof(target_addr_.sin_addr));
-    } else {
-        target_addr_.sin_addr.s_addr = inet_addr(host);
+void Log::SetSinkQueue(int target, long capacity, int batch, LogOverflowPolicy policy) {
+    lock_mutex(&mutex_);
+    LogSinkQueue* queue = FindSink(target);
+    if (queue) {
+        queue->SetQueue(capacity, batch, policy);
     }
-    target_addr_.sin_port = ntohs(port);
+    unlock_mutex(&mutex_);
 }
 
-void Log::Info(const char* tag, const char* format, ...) {
-    char buf[MAX_LOG_LEN+1];
-    int len = GetTimeStr(buf, MAX_LOG_LEN);
-    len += snprintf(buf + len, MAX_LOG_LEN - len, " Info: [%s] ", tag);
+bool Log::GetSinkStats(int target, LogSinkStats* stats) {
+    lock_mutex(&mutex_);
+    LogSinkQueue* queue = FindSink(target);
+    if (queue) {
+        queue->GetStats(stats);
+    }
+    unlock_mutex(&mutex_);
+    return NULL != queue;
+}
+
+void Log::WriteFields(LogLevel level, const char* tag, const char* message, const LogFields& fields) {
+    if (level < LOG_LEVEL_DEBUG || level > LOG_LEVEL_ERROR) {
+        return;
+    }
+    bool output = IsLevelEnabled(level, tag) && PassTagLimit(tag);
+    if (level >= recorder_level_) {
+        char record[MAX_LOG_LEN+1];
+        int64_t time = LogClockUs();
+        int len = LogEncodeFields(record, MAX_LOG_LEN, level, time, tag, message, fields.fields(), fields.count());
+        recorder_.Record(time, record, len);
+    }
+    if (!output) {
+        return;
+    }
+    if (limits_) {
+        ReportSuppressed(false);
+    }
+
+    char  stack_buf[MAX_LOG_LEN+1];
+    LogSlot* slot;
+    LogStaging::Buffer* buffer;
+    char* buf = ReserveLine(level, stack_buf, &slot, &buffer);
+    if (NULL == buf) {
+        return;
+    }
+    // the line is written into buf first, a longer one into a chunk
+    bool binary = (LOG_ENCODING_BINARY == encoding_);
+    bool text_records = false;
+    char* line = buf;
+    int   len = 0;
+    if (binary) {
+        int size = LogFieldsRecordLen(tag, (int)strlen(message), fields.fields(), fields.count());
+        // binary encoding falls back to text records for fields longer than a record
+        text_records = (size > LOG_RECORD_MAX_LEN);
+        if (!text_records) {
+            if (size > MAX_LOG_LEN) {
+                line = SpillLine(size + 1, slot, buffer);
+            }
+            len = LogEncodeFields(line, size > MAX_LOG_LEN ? size : MAX_LOG_LEN, level, LogClockUs(),
+                    tag, message, fields.fields(), fields.count());
+        }
+    }
+    if (!binary || text_records) {
+        int size = text_records ? MAX_LOG_LEN - LOG_RECORD_HEADER_LEN : MAX_LOG_LEN;
+        len = FormatFields(line, size, level, tag, message, fields);
+        if (len > size) {
+            size = len;
+            line = SpillLine(size + 1 + (text_records ? TextRecords(size) * LOG_RECORD_HEADER_LEN : 0), slot, buffer);
+            len = FormatFields(line, size, level, tag, message, fields);
+            if (len > size) {
+                len = size;
+            }
+        }
+        if (text_records) {
+            len = EncodeText(line, len + TextRecords(len) * LOG_RECORD_HEADER_LEN, level, line, len);
+        }
+    }
+    CommitLine(slot, buffer, line, len, level);
+    // a chunk of a line written directly
+    if (line != buf && NULL == slot && NULL == buffer) {
+        chunks_.Free(line);
+    }
+}
 
+void Log::Info(const char* tag, const char* format, ...) {
+    bool output = IsLevelEnabled(LOG_LEVEL_INFO, tag) && PassTagLimit(tag);
+    if (!output && LOG_LEVEL_INFO < recorder_level_) {
+        return;
+    }
     va_list ap;
     va_start(ap, format);
-    len += vsnprintf(buf + len, MAX_LOG_LEN - len, format, ap);
+    LogV(LOG_LEVEL_INFO, tag, format, ap, output);
     va_end(ap);
-
-    buf[len++] = '\n';
-    buf[len] = '\0';
-
-    WriteLog(buf, len);
 }
 
 void Log::Warn(const char* tag, const char* format, ...) {
-    char buf[MAX_LOG_LEN+1];
-    int len = GetTimeStr(buf, MAX_LOG_LEN);
-    len += snprintf(buf + len, MAX_LOG_LEN - len, " Warn: [%s] ", tag);
-
+    bool output = IsLevelEnabled(LOG_LEVEL_WARN, tag) && PassTagLimit(tag);
+    if (!output && LOG_LEVEL_WARN < recorder_level_) {
+        return;
+    }
     va_list ap;
     va_start(ap, format);
-    len += vsnprintf(buf + len, MAX_LOG_LEN - len, format, ap);
+    LogV(LOG_LEVEL_WARN, tag, format, ap, output);
     va_end(ap);
-
-    buf[len++] = '\n';
-    buf[len] = '\0';
-
-    WriteLog(buf, len);
 }
 
 void Log::Error(const char* tag, const char* format, ...) {
-    char buf[MAX_LOG_LEN+1];
-    int len = GetTimeStr(buf, MAX_LOG_LEN);
-    len += snprintf(buf + len, MAX_LOG_LEN - len, " Error: [%s] ", tag);
-
+    bool output = IsLevelEnabled(LOG_LEVEL_ERROR, tag) && PassTagLimit(tag);
+    if (!output && LOG_LEVEL_ERROR < recorder_level_) {
+        return;
+    }
     va_list ap;
     va_start(ap, format);
-    len += vsnprintf(buf + len, MAX_LOG_LEN - len, format, ap);
+    LogV(LOG_LEVEL_ERROR, tag, format, ap, output);
     va_end(ap);
-
-    buf[len++] = '\n';
-    buf[len] = '\0';
-
-    WriteLog(buf, len);
 }
 
 void Log::Debug(const char* tag, const char* format, ...) {
-    char buf[MAX_LOG_LEN+1];
-    int len = GetTimeStr(buf, MAX_LOG_LEN);
-    len += snprintf(buf + len, MAX_LOG_LEN - len, " Debug: [%s] ", tag);
+    bool output = IsLevelEnabled(LOG_LEVEL_DEBUG, tag) && PassTagLimit(tag);
+    if (!output && LOG_LEVEL_DEBUG < recorder_level_) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, format);
+    LogV(LOG_LEVEL_DEBUG, tag, format, ap, output);
+    va_end(ap);
+}
 
+void Log::Write(LogLevel level, const char* tag, const char* format, ...) {
+    if (level < LOG_LEVEL_DEBUG || level > LOG_LEVEL_ERROR) {
+        return;
+    }
+    // the call site cell lets lines below the threshold through for the recorder
+    bool output = ((level < recorder_level_) || IsLevelEnabled(level, tag)) && PassTagLimit(tag);
     va_list ap;
     va_start(ap, format);
-    len += vsnprintf(buf + len, MAX_LOG_LEN - len, format, ap);
+    LogV(level, tag, format, ap, output);
     va_end(ap);
+}
 
-    buf[len++] = '\n';
-    buf[len] = '\0';
+void Log::WriteLimited(LogLimit* limit, LogLevel level, const char* tag, const char* format, ...) {
+    if (level < LOG_LEVEL_DEBUG || level > LOG_LEVEL_ERROR) {
+        return;
+    }
+    // summaries quote the format of the call site
+    if (NULL == limit->format) {
+        limit->format = format;
+    }
+    // the limit is checked after the level: lines below the threshold take no tokens
+    bool output = ((level < recorder_level_) || IsLevelEnabled(level, tag))
+            && PassLimit(limit) && PassTagLimit(tag);
+    if (!output && level < recorder_level_) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, format);
+    LogV(level, tag, format, ap, output);
+    va_end(ap);
+}
 
-    WriteLog(buf, len);
+void Log::WriteSummary(const char* tag, const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    LogV(LOG_LEVEL_WARN, tag, format, ap, true);
+    va_end(ap);
 }
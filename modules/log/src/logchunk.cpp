@@ -0,0 +1,78 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#include <string.h>
+#include "logchunk.h"
+
+// bytes before the data of a chunk: int32 size class (LOG_CHUNK_CLASSES: not pooled)
+#define LOG_CHUNK_HEADER_LEN 16
+
+LogChunkPool::LogChunkPool() {
+    init_mutex(&mutex_);
+}
+
+LogChunkPool::~LogChunkPool() {
+    for (int i = 0; i < LOG_CHUNK_CLASSES; i++) {
+        for (size_t j = 0; j < free_[i].size(); j++) {
+            delete[] free_[i][j];
+        }
+    }
+    uninit_mutex(&mutex_);
+}
+
+char* LogChunkPool::Alloc(int size) {
+    int size_class = 0;
+    while (size_class < LOG_CHUNK_CLASSES && (LOG_CHUNK_MIN << size_class) < size) {
+        size_class++;
+    }
+    char* chunk = NULL;
+    if (size_class < LOG_CHUNK_CLASSES) {
+        lock_mutex(&mutex_);
+        if (!free_[size_class].empty()) {
+            chunk = free_[size_class].back();
+            free_[size_class].pop_back();
+        }
+        unlock_mutex(&mutex_);
+        if (NULL == chunk) {
+            chunk = new char[LOG_CHUNK_HEADER_LEN + (LOG_CHUNK_MIN << size_class)];
+        }
+    } else {
+        chunk = new char[LOG_CHUNK_HEADER_LEN + size];
+    }
+    int32_t class32 = size_class;
+    memcpy(chunk, &class32, sizeof(class32));
+    return chunk + LOG_CHUNK_HEADER_LEN;
+}
+
+void LogChunkPool::Free(char* chunk) {
+    if (NULL == chunk) {
+        return;
+    }
+    chunk -= LOG_CHUNK_HEADER_LEN;
+    int32_t size_class;
+    memcpy(&size_class, chunk, sizeof(size_class));
+    if (size_class < LOG_CHUNK_CLASSES) {
+        size_t keep = LOG_CHUNK_KEEP / (LOG_CHUNK_MIN << size_class);
+        lock_mutex(&mutex_);
+        if (free_[size_class].size() < keep || free_[size_class].empty()) {
+            free_[size_class].push_back(chunk);
+            chunk = NULL;
+        }
+        unlock_mutex(&mutex_);
+    }
+    delete[] chunk;
+}
@@ -0,0 +1,1010 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#include "logfile.h"
+#include "logbinary.h"
+
+#ifndef WIN32
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+// end of the whole records of a binary file (see logbinary.h)
+static long BinaryDataLength(int fd, long file_size) {
+    char buf[64 * 1024];
+    if (file_size < LOG_BINARY_HEADER_LEN
+            || pread(fd, buf, LOG_BINARY_HEADER_LEN, 0) != LOG_BINARY_HEADER_LEN) {
+        return file_size;
+    }
+    uint32_t byte_order;
+    memcpy(&byte_order, buf + LOG_BINARY_MAGIC_LEN, sizeof(byte_order));
+    if (0 != memcmp(buf, LOG_BINARY_MAGIC, LOG_BINARY_MAGIC_LEN) || LOG_BINARY_BYTE_ORDER != byte_order) {
+        // no header yet (preallocated zeros), or not a file of this writer
+        return (0 == buf[0]) ? 0 : file_size;
+    }
+    long pos = LOG_BINARY_HEADER_LEN;
+    long buf_begin = pos;
+    long buf_len = 0;
+    while (pos + LOG_RECORD_HEADER_LEN <= file_size) {
+        if (pos + LOG_RECORD_HEADER_LEN > buf_begin + buf_len) {
+            long len = file_size - pos;
+            if (len > (long)sizeof(buf)) {
+                len = sizeof(buf);
+            }
+            if (pread(fd, buf, len, pos) != len) {
+                return file_size;
+            }
+            buf_begin = pos;
+            buf_len = len;
+        }
+        // preallocated zeros are no record
+        uint16_t size;
+        memcpy(&size, buf + pos - buf_begin, sizeof(size));
+        unsigned char type = buf[pos - buf_begin + 2];
+        if (size < LOG_RECORD_HEADER_LEN || type < LOG_RECORD_FORMAT || type > LOG_RECORD_FIELDS
+                || pos + size > file_size) {
+            break;
+        }
+        pos += size;
+    }
+    return pos;
+}
+
+// end of the lines of a text file, every line ends with "\n\0"
+static long TextDataLength(int fd, long file_size) {
+    char buf[64 * 1024];
+    long end = file_size;
+    while (end > 0) {
+        long begin = (end > (long)sizeof(buf)) ? end - (long)sizeof(buf) : 0;
+        if (pread(fd, buf, end - begin, begin) != end - begin) {
+            return file_size;
+        }
+        for (long i = end - begin; i > 0; i--) {
+            if (buf[i - 1]) {
+                // zeros after a line end are preallocated, keep its '\0'
+                return ('\n' == buf[i - 1] && begin + i < file_size) ? begin + i + 1 : file_size;
+            }
+        }
+        end = begin;
+    }
+    return 0;
+}
+
+// length of the data of a file. a closed file is truncated to its data, a file
+// ending on a window boundary may end with preallocated zeros (not closed)
+static long DataLength(int fd, long file_size, long window_size, bool binary) {
+    if (0 != file_size % window_size) {
+        return file_size;
+    }
+    return binary ? BinaryDataLength(fd, file_size) : TextDataLength(fd, file_size);
+}
+
+LogFile::LogFile() {
+    window_size_ = 0;
+    archiver_ = NULL;
+    stdio_ = NULL;
+    fd_ = -1;
+    window_ = NULL;
+    window_offset_ = 0;
+    window_pos_ = 0;
+    size_ = 0;
+    next_window_.base = NULL;
+    next_file_.base = NULL;
+    next_stdio_ = NULL;
+    window_failed_ = false;
+    file_failed_ = false;
+    stalls_ = 0;
+    sync_ = false;
+    sync_interval_ = 0;
+    sync_bytes_ = 0;
+    total_ = 0;
+    committed_ = 0;
+    sync_requested_ = 0;
+    synced_ = 0;
+    sync_pending_ = false;
+    finishing_ = 0;
+    last_sync_ = 0;
+    sync_waiters_ = 0;
+    syncs_ = 0;
+    init_mutex(&mutex_);
+    init_semaphore(&sync_sem_, 0);
+}
+
+LogFile::~LogFile() {
+    Close();
+    uninit_semaphore(&sync_sem_);
+    uninit_mutex(&mutex_);
+}
+
+bool LogFile::Open(const char* file_name, const char* next_name, long window_size, bool binary,
+                   LogArchiver* archiver) {
+    Close();
+    FILE* stdio = NULL;
+    Window window;
+    window.fd = -1;
+    window.base = NULL;
+    window.offset = 0;
+    long length = 0;
+    if (window_size > 0) {
+        // windows start at page boundaries
+        long page = sysconf(_SC_PAGESIZE);
+        window_size_ = (window_size + page - 1) / page * page;
+
+        int fd = open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (-1 == fd) {
+            fprintf(stderr, "open log file %s failed!\n", file_name);
+            return false;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        length = DataLength(fd, (long)st.st_size, window_size_, binary);
+        window = MapWindow(fd, length - length % window_size_);
+        if (NULL == window.base) {
+            close(fd);
+            return false;
+        }
+    } else {
+        window_size_ = 0;
+        stdio = fopen(file_name, "a");
+        if (NULL == stdio) {
+            fprintf(stderr, "open log file %s failed!\n", file_name);
+            return false;
+        }
+        fseek(stdio, 0, SEEK_END);
+        length = ftell(stdio);
+    }
+    init_semaphore(&sem_, 0);
+    if (0 != begin_thread(&thread_, HelperThread, this)) {
+        fprintf(stderr, "create log file thread failed!\n");
+        uninit_semaphore(&sem_);
+        if (stdio) {
+            fclose(stdio);
+        } else {
+            munmap(window.base, window_size_);
+            close(window.fd);
+        }
+        return false;
+    }
+    file_name_ = file_name;
+    next_name_ = next_name;
+    archiver_ = archiver;
+    stdio_ = stdio;
+    fd_ = window.fd;
+    window_ = window.base;
+    window_offset_ = window.offset;
+    window_pos_ = length - window.offset;
+    size_ = length;
+    next_window_.base = NULL;
+    next_file_.base = NULL;
+    next_stdio_ = NULL;
+    window_failed_ = false;
+    file_failed_ = false;
+    sync_pending_ = false;
+    finishing_ = 0;
+    last_sync_ = clock_tick_us();
+
+    lock_mutex(&mutex_);
+    Job job;
+    if (window_) {
+        job.type = JOB_WINDOW;
+        job.fd = fd_;
+        job.offset = window_offset_ + window_size_;
+        PushJob(job);
+    }
+    job.type = JOB_FILE;
+    PushJob(job);
+    unlock_mutex(&mutex_);
+    return true;
+}
+
+void LogFile::Close() {
+    if (!is_open()) {
+        return;
+    }
+    // the helper thread runs the queued jobs first
+    lock_mutex(&mutex_);
+    Job job;
+    job.type = JOB_STOP;
+    PushJob(job);
+    unlock_mutex(&mutex_);
+    wait_thread(&thread_);
+    uninit_semaphore(&sem_);
+
+    if (next_window_.base) {
+        munmap(next_window_.base, window_size_);
+        next_window_.base = NULL;
+    }
+    if (next_file_.base) {
+        munmap(next_file_.base, window_size_);
+        close(next_file_.fd);
+        unlink(next_name_.c_str());
+        next_file_.base = NULL;
+    }
+    if (next_stdio_) {
+        fclose(next_stdio_);
+        unlink(next_name_.c_str());
+        next_stdio_ = NULL;
+    }
+    if (stdio_) {
+        if (sync_) {
+            fflush(stdio_);
+            fdatasync(fileno(stdio_));
+        }
+        fclose(stdio_);
+        stdio_ = NULL;
+    } else {
+        munmap(window_, window_size_);
+        window_ = NULL;
+        if (0 != ftruncate(fd_, size_)) {
+            fprintf(stderr, "truncate log file %s failed!\n", file_name_.c_str());
+        }
+        if (sync_) {
+            fdatasync(fd_);
+        }
+        close(fd_);
+        fd_ = -1;
+    }
+    // all written is in the OS (and synced if enabled)
+    committed_ = total_;
+    SyncDone(total_);
+}
+
+LogFile::Window LogFile::MapWindow(int fd, long offset) {
+    Window window;
+    window.fd = fd;
+    window.offset = offset;
+    window.base = NULL;
+    // allocate the blocks now, a write to a mapped hole may fail with SIGBUS
+    if (0 != fallocate(fd, 0, offset, window_size_)
+            && 0 != posix_fallocate(fd, offset, window_size_)) {
+        fprintf(stderr, "allocate log file failed (%d)!\n", errno);
+        return window;
+    }
+    // populate: the writer does not page fault on the window
+    void* base = mmap(NULL, window_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (MAP_FAILED == base) {
+        fprintf(stderr, "map log file failed (%d)!\n", errno);
+        return window;
+    }
+    window.base = (char*)base;
+    return window;
+}
+
+void LogFile::PushJob(const Job& job) {
+    jobs_.push_back(job);
+    post_semaphore(&sem_);
+}
+
+bool LogFile::NextFileReady() const {
+    return NULL != next_file_.base || NULL != next_stdio_;
+}
+
+void LogFile::Write(const char* data, long len) {
+    if (stdio_) {
+        fwrite(data, 1, len, stdio_);
+        size_ += len;
+        total_ += len;
+        return;
+    }
+    while (len > 0) {
+        // lines are dropped while no window can be mapped
+        if (window_pos_ == window_size_ && !NextWindow()) {
+            return;
+        }
+        long n = window_size_ - window_pos_;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(window_ + window_pos_, data, n);
+        window_pos_ += n;
+        size_ += n;
+        total_ += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void LogFile::Flush() {
+    if (stdio_) {
+        fflush(stdio_);
+    }
+}
+
+void LogFile::SetSync(int interval_ms, long bytes, bool enable) {
+    lock_mutex(&mutex_);
+    sync_ = enable;
+    sync_interval_ = enable ? interval_ms : 0;
+    sync_bytes_ = enable ? bytes : 0;
+    unlock_mutex(&mutex_);
+    // the helper thread picks up the interval
+    if (is_open()) {
+        post_semaphore(&sem_);
+    }
+}
+
+int64_t LogFile::Commit() {
+    if (!is_open()) {
+        return total_;
+    }
+    lock_mutex(&mutex_);
+    committed_ = total_;
+    if (sync_bytes_ > 0 && committed_ - sync_requested_ >= sync_bytes_) {
+        RequestSync();
+    }
+    unlock_mutex(&mutex_);
+    return total_;
+}
+
+void LogFile::WaitSynced(int64_t position) {
+    lock_mutex(&mutex_);
+    while (sync_ && synced_ < position && is_open()) {
+        RequestSync();
+        sync_waiters_++;
+        unlock_mutex(&mutex_);
+        wait_semaphore(&sync_sem_, INFINITE);
+        lock_mutex(&mutex_);
+    }
+    unlock_mutex(&mutex_);
+}
+
+void LogFile::RequestSync() {
+    if (!sync_pending_) {
+        sync_pending_ = true;
+        sync_requested_ = committed_;
+        Job job;
+        job.type = JOB_SYNC;
+        PushJob(job);
+    }
+}
+
+void LogFile::SyncDone(int64_t synced) {
+    lock_mutex(&mutex_);
+    if (synced > synced_) {
+        synced_ = synced;
+    }
+    int waiters = sync_waiters_;
+    sync_waiters_ = 0;
+    unlock_mutex(&mutex_);
+    // they check their position again
+    for (int i = 0; i < waiters; i++) {
+        post_semaphore(&sync_sem_);
+    }
+}
+
+bool LogFile::NextWindow() {
+    lock_mutex(&mutex_);
+    while (NULL == next_window_.base && !window_failed_) {
+        // the helper thread is behind
+        unlock_mutex(&mutex_);
+        atomic_inc(&stalls_);
+        msleep(1);
+        lock_mutex(&mutex_);
+    }
+    Window window = next_window_;
+    bool failed = window_failed_;
+    next_window_.base = NULL;
+    window_failed_ = false;
+    unlock_mutex(&mutex_);
+    if (failed) {
+        // try again, the disk may have room now
+        window = MapWindow(fd_, window_offset_ + window_size_);
+        if (NULL == window.base) {
+            return false;
+        }
+    }
+
+    lock_mutex(&mutex_);
+    Job job;
+    job.type = JOB_UNMAP;
+    job.base = window_;
+    PushJob(job);
+    window_ = window.base;
+    window_offset_ = window.offset;
+    window_pos_ = 0;
+    job.type = JOB_WINDOW;
+    job.fd = fd_;
+    job.offset = window_offset_ + window_size_;
+    PushJob(job);
+    unlock_mutex(&mutex_);
+    return true;
+}
+
+bool LogFile::Rotate(const char* file_name, const char* backup_name) {
+    lock_mutex(&mutex_);
+    while (!NextFileReady() && !file_failed_) {
+        unlock_mutex(&mutex_);
+        atomic_inc(&stalls_);
+        msleep(1);
+        lock_mutex(&mutex_);
+    }
+    Job job;
+    if (file_failed_) {
+        // stay in the current file, try to create the next one again
+        file_failed_ = false;
+        job.type = JOB_FILE;
+        PushJob(job);
+        unlock_mutex(&mutex_);
+        return false;
+    }
+    Job finish;
+    finish.type = JOB_FINISH;
+    finish.offset = size_;
+    finish.position = total_;
+    finish.from = file_name_;
+    finish.backup = backup_name;
+    finish.to = file_name;
+    finishing_++;
+    if (stdio_) {
+        // buffered lines are written by fclose on the helper thread
+        finish.stdio = stdio_;
+        PushJob(finish);
+        stdio_ = next_stdio_;
+        next_stdio_ = NULL;
+    } else {
+        if (next_window_.base) {
+            job.type = JOB_UNMAP;
+            job.base = next_window_.base;
+            PushJob(job);
+            next_window_.base = NULL;
+        }
+        window_failed_ = false;
+        job.type = JOB_UNMAP;
+        job.base = window_;
+        PushJob(job);
+        finish.fd = fd_;
+        PushJob(finish);
+
+        fd_ = next_file_.fd;
+        window_ = next_file_.base;
+        window_offset_ = 0;
+        window_pos_ = 0;
+        next_file_.base = NULL;
+        job.type = JOB_WINDOW;
+        job.fd = fd_;
+        job.offset = window_size_;
+        PushJob(job);
+    }
+    file_name_ = file_name;
+    size_ = 0;
+    job.type = JOB_FILE;
+    PushJob(job);
+    unlock_mutex(&mutex_);
+    return true;
+}
+
+void LogFile::RunJob(const Job& job) {
+    switch (job.type) {
+    case JOB_WINDOW: {
+        Window window = MapWindow(job.fd, job.offset);
+        lock_mutex(&mutex_);
+        // the file was rotated meanwhile
+        if (job.fd != fd_) {
+            if (window.base) {
+                munmap(window.base, window_size_);
+            }
+        } else if (window.base) {
+            next_window_ = window;
+        } else {
+            window_failed_ = true;
+        }
+        unlock_mutex(&mutex_);
+        break;
+    }
+    case JOB_FILE: {
+        FILE* stdio = NULL;
+        Window window;
+        window.base = NULL;
+        if (0 == window_size_) {
+            stdio = fopen(next_name_.c_str(), "w");
+            if (NULL == stdio) {
+                fprintf(stderr, "open log file %s failed!\n", next_name_.c_str());
+            }
+        } else {
+            int fd = open(next_name_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (-1 == fd) {
+                fprintf(stderr, "open log file %s failed!\n", next_name_.c_str());
+            } else {
+                window = MapWindow(fd, 0);
+                if (NULL == window.base) {
+                    close(fd);
+                }
+            }
+        }
+        lock_mutex(&mutex_);
+        if (stdio) {
+            next_stdio_ = stdio;
+        } else if (window.base) {
+            next_file_ = window;
+        } else {
+            file_failed_ = true;
+        }
+        unlock_mutex(&mutex_);
+        break;
+    }
+    case JOB_UNMAP:
+        munmap(job.base, window_size_);
+        break;
+    case JOB_FINISH:
+        if (job.stdio) {
+            if (sync_) {
+                fflush(job.stdio);
+                fdatasync(fileno(job.stdio));
+                atomic_inc(&syncs_);
+            }
+            fclose(job.stdio);
+        } else {
+            if (0 != ftruncate(job.fd, job.offset)) {
+                fprintf(stderr, "truncate log file %s failed!\n", job.from.c_str());
+            }
+            if (sync_) {
+                fdatasync(job.fd);
+                atomic_inc(&syncs_);
+            }
+            close(job.fd);
+        }
+        lock_mutex(&mutex_);
+        finishing_--;
+        unlock_mutex(&mutex_);
+        // lines of the rotated file are synced
+        SyncDone(sync_ ? job.position : -1);
+        if (!job.backup.empty()) {
+            unlink(job.backup.c_str());
+            rename(job.from.c_str(), job.backup.c_str());
+        }
+        rename(next_name_.c_str(), job.to.c_str());
+        if (archiver_) {
+            archiver_->Archive(job.backup.empty() ? job.from : job.backup);
+        }
+        break;
+    case JOB_SYNC: {
+        // a file rotated before the sync is synced by its JOB_FINISH
+        lock_mutex(&mutex_);
+        int64_t position = committed_;
+        int fd = stdio_ ? fileno(stdio_) : fd_;
+        bool finishing = finishing_ > 0;
+        sync_pending_ = false;
+        unlock_mutex(&mutex_);
+        if (0 != fdatasync(fd)) {
+            fprintf(stderr, "sync log file failed (%d)!\n", errno);
+        }
+        atomic_inc(&syncs_);
+        last_sync_ = clock_tick_us();
+        SyncDone(finishing ? -1 : position);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void* LogFile::HelperThread(void* arg) {
+    LogFile* file = static_cast<LogFile*>(arg);
+    for (;;) {
+        // committed lines are synced within sync_interval_
+        unsigned long wait = INFINITE;
+        lock_mutex(&file->mutex_);
+        if (file->sync_interval_ > 0 && file->committed_ > file->synced_ && !file->sync_pending_) {
+            uint64_t elapsed = (clock_tick_us() - file->last_sync_) / 1000;
+            if (elapsed >= (uint64_t)file->sync_interval_) {
+                file->RequestSync();
+            } else {
+                wait = (unsigned long)(file->sync_interval_ - elapsed);
+            }
+        }
+        unlock_mutex(&file->mutex_);
+        wait_semaphore(&file->sem_, wait);
+        lock_mutex(&file->mutex_);
+        if (file->jobs_.empty()) {
+            unlock_mutex(&file->mutex_);
+            continue;
+        }
+        Job job = file->jobs_.front();
+        file->jobs_.pop_front();
+        unlock_mutex(&file->mutex_);
+        if (JOB_STOP == job.type) {
+            break;
+        }
+        file->RunJob(job);
+    }
+    return NULL;
+}
+
+#else
+
+// no mmap on WIN32 and an open file can not be renamed:
+// stdio only, rotated and synced on the writer thread
+LogFile::LogFile() {
+    window_size_ = 0;
+    archiver_ = NULL;
+    stdio_ = NULL;
+    window_ = NULL;
+    size_ = 0;
+    stalls_ = 0;
+    sync_ = false;
+    total_ = 0;
+    syncs_ = 0;
+}
+
+LogFile::~LogFile() {
+    Close();
+}
+
+bool LogFile::Open(const char* file_name, const char* next_name, long window_size, bool binary,
+                   LogArchiver* archiver) {
+    Close();
+    if (window_size > 0) {
+        return false;
+    }
+    stdio_ = fopen(file_name, "a");
+    if (NULL == stdio_) {
+        fprintf(stderr, "open log file %s failed!\n", file_name);
+        return false;
+    }
+    fseek(stdio_, 0, SEEK_END);
+    size_ = ftell(stdio_);
+    file_name_ = file_name;
+    archiver_ = archiver;
+    return true;
+}
+
+void LogFile::Close() {
+    if (stdio_) {
+        fclose(stdio_);
+        stdio_ = NULL;
+    }
+}
+
+void LogFile::Write(const char* data, long len) {
+    if (stdio_) {
+        fwrite(data, 1, len, stdio_);
+        size_ += len;
+        total_ += len;
+    }
+}
+
+void LogFile::SetSync(int interval_ms, long bytes, bool enable) {
+    sync_ = enable;
+}
+
+int64_t LogFile::Commit() {
+    if (stdio_ && sync_) {
+        _commit(_fileno(stdio_));
+        syncs_++;
+    }
+    return total_;
+}
+
+void LogFile::WaitSynced(int64_t position) {
+}
+
+void LogFile::Flush() {
+    if (stdio_) {
+        fflush(stdio_);
+    }
+}
+
+bool LogFile::Rotate(const char* file_name, const char* backup_name) {
+    std::string from = file_name_;
+    Close();
+    if (backup_name[0]) {
+        unlink(backup_name);
+        rename(from.c_str(), backup_name);
+    }
+    if (archiver_) {
+        archiver_->Archive(backup_name[0] ? backup_name : from);
+    }
+    return Open(file_name, "", 0, archiver_);
+}
+
+#endif
+
+// a rotated file of the archiver
+struct ArchivedFile {
+    std::string name;
+    time_t modified;
+    long size;
+};
+
+// oldest first
+static bool ArchivedFileOlder(const ArchivedFile& a, const ArchivedFile& b) {
+    if (a.modified != b.modified) {
+        return a.modified < b.modified;
+    }
+    return a.name < b.name;
+}
+
+// name without path
+static std::string BaseName(const std::string& file_name) {
+    std::string::size_type pos = file_name.find_last_of("/\\");
+    return (std::string::npos == pos) ? file_name : file_name.substr(pos + 1);
+}
+
+// is file a rotated file of log name: name_bk{suffix} or name-YYYY-MM-DD{suffix},
+// followed by an extension of the compressor or not
+// (not {name}-crash.blog or the files of a log named {name}-*)
+static bool IsArchivedFile(const std::string& file, const std::string& name, const std::string& suffix,
+                           const std::string& current) {
+    if (file == current || 0 != file.compare(0, name.size(), name)) {
+        return false;
+    }
+    std::string rest = file.substr(name.size());
+    if (0 == rest.compare(0, 3, "_bk")) {
+        rest.erase(0, 3);
+    } else {
+        const char* date = "-0000-00-00";
+        size_t date_len = strlen(date);
+        if (rest.size() < date_len) {
+            return false;
+        }
+        for (size_t i = 0; i < date_len; i++) {
+            bool digit = (rest[i] >= '0' && rest[i] <= '9');
+            if (('0' == date[i]) != digit || (!digit && rest[i] != date[i])) {
+                return false;
+            }
+        }
+        rest.erase(0, date_len);
+    }
+    if (0 != rest.compare(0, suffix.size(), suffix)) {
+        return false;
+    }
+    rest.erase(0, suffix.size());
+    if (rest.empty()) {
+        return true;
+    }
+    // .gz, .bz2, .xz, ...
+    if (rest.size() < 2 || '.' != rest[0]) {
+        return false;
+    }
+    for (size_t i = 1; i < rest.size(); i++) {
+        char c = rest[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+LogArchiver::LogArchiver() {
+    max_files_ = 0;
+    max_bytes_ = 0;
+    running_ = false;
+    stop_ = false;
+    init_mutex(&mutex_);
+}
+
+LogArchiver::~LogArchiver() {
+    Stop();
+    uninit_mutex(&mutex_);
+}
+
+void LogArchiver::SetFiles(const char* path, const char* name, const char* suffix) {
+    lock_mutex(&mutex_);
+    path_ = path;
+    name_ = name;
+    suffix_ = suffix;
+    unlock_mutex(&mutex_);
+}
+
+void LogArchiver::SetCurrent(const std::string& file_name) {
+    lock_mutex(&mutex_);
+    current_ = BaseName(file_name);
+    unlock_mutex(&mutex_);
+}
+
+void LogArchiver::SetRetention(int max_files, long max_bytes, const char* compress_command) {
+    lock_mutex(&mutex_);
+    max_files_ = max_files;
+    max_bytes_ = max_bytes;
+    command_ = compress_command ? compress_command : "";
+    unlock_mutex(&mutex_);
+}
+
+void LogArchiver::Archive(const std::string& file_name) {
+    PushJob(file_name);
+}
+
+void LogArchiver::Clean() {
+    PushJob("");
+}
+
+void LogArchiver::PushJob(const std::string& file_name) {
+    lock_mutex(&mutex_);
+    // nothing to do
+    if (0 == max_files_ && 0 == max_bytes_ && command_.empty()) {
+        unlock_mutex(&mutex_);
+        return;
+    }
+    if (!running_) {
+        init_semaphore(&sem_, 0);
+        stop_ = false;
+        if (0 != begin_thread(&thread_, ArchiverThread, this)) {
+            fprintf(stderr, "create log archiver thread failed!\n");
+            uninit_semaphore(&sem_);
+            unlock_mutex(&mutex_);
+            return;
+        }
+        running_ = true;
+    }
+    jobs_.push_back(file_name);
+    post_semaphore(&sem_);
+    unlock_mutex(&mutex_);
+}
+
+void LogArchiver::Stop() {
+    lock_mutex(&mutex_);
+    if (!running_) {
+        unlock_mutex(&mutex_);
+        return;
+    }
+    // the archiver thread runs the queued jobs first
+    stop_ = true;
+    post_semaphore(&sem_);
+    unlock_mutex(&mutex_);
+    wait_thread(&thread_);
+    uninit_semaphore(&sem_);
+    running_ = false;
+}
+
+void LogArchiver::Compress(const std::string& command, const std::string& file_name) {
+    struct stat st;
+    if (0 != stat(file_name.c_str(), &st)) {
+        return;
+    }
+#ifdef WIN32
+    std::string cmd = command + " \"" + file_name + "\"";
+    FILE* pipe = _popen(cmd.c_str(), "r");
+#else
+    // quote the file name for the shell
+    std::string cmd = command + " '";
+    for (size_t i = 0; i < file_name.size(); i++) {
+        if ('\'' == file_name[i]) {
+            cmd += "'\\''";
+        } else {
+            cmd += file_name[i];
+        }
+    }
+    cmd += "'";
+    // not system(): it ignores SIGINT of the whole process while the command runs
+    FILE* pipe = popen(cmd.c_str(), "r");
+#endif
+    int status = -1;
+    if (pipe) {
+        char buf[256];
+        while (fgets(buf, sizeof(buf), pipe)) {
+        }
+#ifdef WIN32
+        status = _pclose(pipe);
+#else
+        status = pclose(pipe);
+#endif
+    }
+    if (0 != status) {
+        fprintf(stderr, "compress log file %s failed (%d)!\n", file_name.c_str(), status);
+    }
+}
+
+void LogArchiver::Retain(const std::string& path, const std::string& name, const std::string& suffix,
+                         const std::string& current, int max_files, long max_bytes) {
+    if (0 == max_files && 0 == max_bytes) {
+        return;
+    }
+    std::vector<ArchivedFile> files;
+#ifdef WIN32
+    WIN32_FIND_DATAA find_data;
+    HANDLE hfind = FindFirstFileA((path + "\\" + name + "*").c_str(), &find_data);
+    if (INVALID_HANDLE_VALUE != hfind) {
+        do {
+            if (!IsArchivedFile(find_data.cFileName, name, suffix, current)) {
+                continue;
+            }
+            ArchivedFile file;
+            file.name = path + "\\" + find_data.cFileName;
+            // 100ns since 1601-01-01, only the order matters
+            file.modified = (time_t)((((int64_t)find_data.ftLastWriteTime.dwHighDateTime << 32)
+                    | find_data.ftLastWriteTime.dwLowDateTime) / 10000000);
+            file.size = (long)find_data.nFileSizeLow;
+            files.push_back(file);
+        } while (FindNextFileA(hfind, &find_data));
+        FindClose(hfind);
+    }
+#else
+    DIR* pdir = opendir(path.c_str());
+    if (pdir) {
+        struct dirent* entry;
+        while (NULL != (entry = readdir(pdir))) {
+            if (!IsArchivedFile(entry->d_name, name, suffix, current)) {
+                continue;
+            }
+            ArchivedFile file;
+            file.name = path + "/" + entry->d_name;
+            struct stat st;
+            if (0 != stat(file.name.c_str(), &st) || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            file.modified = st.st_mtime;
+            file.size = (long)st.st_size;
+            files.push_back(file);
+        }
+        closedir(pdir);
+    }
+#endif
+    std::sort(files.begin(), files.end(), ArchivedFileOlder);
+    long bytes = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        bytes += files[i].size;
+    }
+    long count = (long)files.size();
+    for (size_t i = 0; i < files.size(); i++) {
+        if ((0 == max_files || count <= max_files) && (0 == max_bytes || bytes <= max_bytes)) {
+            break;
+        }
+        if (0 != unlink(files[i].name.c_str())) {
+            fprintf(stderr, "remove log file %s failed!\n", files[i].name.c_str());
+        }
+        count--;
+        bytes -= files[i].size;
+    }
+}
+
+void* LogArchiver::ArchiverThread(void* arg) {
+    LogArchiver* archiver = static_cast<LogArchiver*>(arg);
+    for (;;) {
+        wait_semaphore(&archiver->sem_, INFINITE);
+        lock_mutex(&archiver->mutex_);
+        if (archiver->jobs_.empty()) {
+            bool stop = archiver->stop_;
+            unlock_mutex(&archiver->mutex_);
+            if (stop) {
+                break;
+            }
+            continue;
+        }
+        std::string file_name = archiver->jobs_.front();
+        archiver->jobs_.pop_front();
+        std::string command = archiver->command_;
+        std::string path = archiver->path_;
+        std::string name = archiver->name_;
+        std::string suffix = archiver->suffix_;
+        std::string current = archiver->current_;
+        int  max_files = archiver->max_files_;
+        long max_bytes = archiver->max_bytes_;
+        unlock_mutex(&archiver->mutex_);
+
+        if (!file_name.empty() && !command.empty()) {
+            archiver->Compress(command, file_name);
+        }
+        archiver->Retain(path, name, suffix, current, max_files, max_bytes);
+    }
+    return NULL;
+}
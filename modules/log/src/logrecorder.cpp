@@ -0,0 +1,237 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#include <string.h>
+#include <algorithm>
+#include "logrecorder.h"
+
+// bytes of the time of an entry
+#define LOG_ENTRY_TIME_LEN 8
+
+// generations of all recorders, a recorder at the address of a deleted
+// one never matches the stale cache of a thread
+static volatile long recorder_generations = 0;
+
+// ring of the calling thread (cache)
+static APF_THREAD_LOCAL LogRecorder* thread_recorder = NULL;
+static APF_THREAD_LOCAL long  thread_generation = 0;
+static APF_THREAD_LOCAL void* thread_ring = NULL;
+
+// older first, then by thread
+static bool EntryOlder(const LogRecorderEntry& a, const LogRecorderEntry& b) {
+    return a.time < b.time;
+}
+
+LogRecorder::LogRecorder() {
+    ring_size_ = 0;
+    generation_ = atomic_inc(&recorder_generations);
+    ring_count_ = 0;
+    crash_buf_ = NULL;
+    init_mutex(&mutex_);
+}
+
+LogRecorder::~LogRecorder() {
+    SetSize(0);
+    for (size_t i = 0; i < retired_.size(); i++) {
+        delete[] retired_[i]->data;
+        delete retired_[i];
+    }
+    uninit_mutex(&mutex_);
+}
+
+void LogRecorder::SetSize(long thread_bytes) {
+    lock_mutex(&mutex_);
+    // threads may still write them, they drop their cache on the next record
+    for (long i = 0; i < ring_count_; i++) {
+        retired_.push_back(rings_[i]);
+    }
+    ring_count_ = 0;
+    delete[] crash_buf_;
+    crash_buf_ = NULL;
+    ring_size_ = (thread_bytes > 0) ? thread_bytes : 0;
+    if (ring_size_ > 0) {
+        crash_buf_ = new char[ring_size_];
+    }
+    generation_ = atomic_inc(&recorder_generations);
+    unlock_mutex(&mutex_);
+}
+
+LogRecorder::Ring* LogRecorder::ThreadRing() {
+    if (this == thread_recorder && generation_ == thread_generation) {
+        return static_cast<Ring*>(thread_ring);
+    }
+    Ring* ring = NULL;
+    unsigned long thread = thread_id();
+    lock_mutex(&mutex_);
+    for (long i = 0; i < ring_count_; i++) {
+        if (thread == rings_[i]->thread) {
+            ring = rings_[i];
+            break;
+        }
+    }
+    if (NULL == ring && ring_size_ > 0 && ring_count_ < LOG_RECORDER_MAX_THREADS) {
+        ring = new Ring;
+        ring->data = new char[ring_size_];
+        ring->thread = thread;
+        ring->head = 0;
+        ring->tail = 0;
+        ring->collected = 0;
+        rings_[ring_count_] = ring;
+        // the ring is visible to Visit after it is set up
+        atomic_inc(&ring_count_);
+    }
+    thread_recorder = this;
+    thread_generation = generation_;
+    thread_ring = ring;
+    unlock_mutex(&mutex_);
+    return ring;
+}
+
+void LogRecorder::ReadRing(const char* data, long pos, void* out, long len) {
+    long offset = pos % ring_size_;
+    long first = ring_size_ - offset;
+    if (first >= len) {
+        memcpy(out, data + offset, len);
+    } else {
+        memcpy(out, data + offset, first);
+        memcpy((char*)out + first, data, len - first);
+    }
+}
+
+void LogRecorder::Record(int64_t time, const char* record, int len) {
+    Ring* ring = ThreadRing();
+    long need = LOG_ENTRY_TIME_LEN + len;
+    if (NULL == ring || len > LOG_RECORDER_MAX_RECORD || need > ring_size_) {
+        return;
+    }
+    // drop the oldest entries, tail passes them before they are overwritten
+    long head = ring->head;
+    long tail = ring->tail;
+    while (head + need - tail > ring_size_) {
+        uint16_t old_len;
+        ReadRing(ring->data, tail + LOG_ENTRY_TIME_LEN, &old_len, sizeof(old_len));
+        tail += LOG_ENTRY_TIME_LEN + old_len;
+    }
+    if (tail != ring->tail) {
+        atomic_add(&ring->tail, tail - ring->tail);
+    }
+    long offset = head % ring_size_;
+    long first = ring_size_ - offset;
+    char entry_time[LOG_ENTRY_TIME_LEN];
+    memcpy(entry_time, &time, sizeof(entry_time));
+    const char* parts[2] = {entry_time, record};
+    long lens[2] = {LOG_ENTRY_TIME_LEN, len};
+    for (int i = 0; i < 2; i++) {
+        long n = (lens[i] < first) ? lens[i] : first;
+        memcpy(ring->data + offset, parts[i], n);
+        if (n < lens[i]) {
+            memcpy(ring->data, parts[i] + n, lens[i] - n);
+        }
+        offset = (offset + lens[i]) % ring_size_;
+        first = ring_size_ - offset;
+    }
+    // publish the entry
+    atomic_add(&ring->head, need);
+}
+
+void LogRecorder::Snapshot(Ring* ring, char* buf, long* begin, long* end) {
+    // atomic reads: the entries before head are written, bytes overwritten
+    // during the copy are before tail after it
+    *end = atomic_add(&ring->head, 0);
+    memcpy(buf, ring->data, ring_size_);
+    *begin = atomic_add(&ring->tail, 0);
+    if (*begin > *end) {
+        *begin = *end;
+    }
+}
+
+long LogRecorder::Mark() {
+    Ring* ring = ThreadRing();
+    return ring ? ring->head : 0;
+}
+
+void LogRecorder::Collect(unsigned long thread, int max_records, unsigned long mark_thread, long mark,
+                          std::vector<LogRecorderEntry>* entries, std::vector<char>* data) {
+    lock_mutex(&mutex_);
+    if (0 == ring_size_) {
+        unlock_mutex(&mutex_);
+        return;
+    }
+    std::vector<char> buf(ring_size_);
+    for (long i = 0; i < ring_count_; i++) {
+        Ring* ring = rings_[i];
+        if (0 != thread && thread != ring->thread) {
+            continue;
+        }
+        long begin;
+        long end;
+        Snapshot(ring, &buf[0], &begin, &end);
+        if (mark_thread == ring->thread && mark >= 0 && mark < end) {
+            end = mark;
+        }
+        if (begin < ring->collected) {
+            begin = ring->collected;
+        }
+        if (end > ring->collected) {
+            ring->collected = end;
+        }
+        for (long pos = begin; pos < end; ) {
+            LogRecorderEntry entry;
+            uint16_t len;
+            ReadRing(&buf[0], pos, &entry.time, sizeof(entry.time));
+            ReadRing(&buf[0], pos + LOG_ENTRY_TIME_LEN, &len, sizeof(len));
+            entry.thread = ring->thread;
+            entry.offset = data->size();
+            entry.len = len;
+            data->resize(entry.offset + len);
+            ReadRing(&buf[0], pos + LOG_ENTRY_TIME_LEN, &(*data)[entry.offset], len);
+            entries->push_back(entry);
+            pos += LOG_ENTRY_TIME_LEN + len;
+        }
+    }
+    unlock_mutex(&mutex_);
+
+    std::stable_sort(entries->begin(), entries->end(), EntryOlder);
+    if (max_records > 0 && entries->size() > (size_t)max_records) {
+        entries->erase(entries->begin(), entries->end() - max_records);
+    }
+}
+
+int LogRecorder::Visit(void (*visit)(unsigned long thread, const char* record, int len, void* arg), void* arg) {
+    int count = 0;
+    char* buf = crash_buf_;
+    if (NULL == buf) {
+        return 0;
+    }
+    long rings = atomic_add(&ring_count_, 0);
+    for (long i = 0; i < rings; i++) {
+        Ring* ring = rings_[i];
+        long begin;
+        long end;
+        Snapshot(ring, buf, &begin, &end);
+        for (long pos = begin; pos < end; ) {
+            char record[LOG_RECORDER_MAX_RECORD];
+            uint16_t len;
+            ReadRing(buf, pos + LOG_ENTRY_TIME_LEN, &len, sizeof(len));
+            ReadRing(buf, pos + LOG_ENTRY_TIME_LEN, record, len);
+            visit(ring->thread, record, len, arg);
+            count++;
+            pos += LOG_ENTRY_TIME_LEN + len;
+        }
+    }
+    return count;
+}
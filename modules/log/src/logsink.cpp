@@ -0,0 +1,731 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <string.h>
+#ifndef WIN32
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#endif
+#include "log.h"
+
+// local time of t
+static void LocalTime(time_t t, struct tm* tm) {
+#ifdef WIN32
+    localtime_s(tm, &t);
+#else
+    localtime_r(&t, tm);
+#endif
+}
+
+// first second of the local day after t
+static time_t NextDay(time_t t) {
+    struct tm tm;
+    LocalTime(t, &tm);
+    tm.tm_mday++;
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+LogSinkQueue::LogSinkQueue(int target, ILogSink* sink, bool own) {
+    target_ = target;
+    sink_ = sink;
+    own_ = own;
+    slots_ = NULL;
+    mask_ = 0;
+    batch_ = DEFAULT_SINK_BATCH;
+    policy_ = LOG_OVERFLOW_BLOCK;
+    head_ = 0;
+    tail_ = 0;
+    batching_ = false;
+    running_ = false;
+    idle_ = 0;
+    stop_ = false;
+    written_ = 0;
+    dropped_ = 0;
+    blocked_ = 0;
+    batches_ = 0;
+    write_us_ = 0;
+    max_write_us_ = 0;
+}
+
+LogSinkQueue::~LogSinkQueue() {
+    StopQueue();
+    if (own_) {
+        delete sink_;
+    }
+}
+
+void LogSinkQueue::SetQueue(long capacity, int batch, LogOverflowPolicy policy) {
+    StopQueue();
+    policy_ = policy;
+    batch_ = (batch > 0) ? batch : DEFAULT_SINK_BATCH;
+    if (capacity <= 0) {
+        return;
+    }
+
+    long size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    slots_ = new Slot[size];
+    // touch every page now, the logging thread should not page fault on the first lap
+    memset((void*)slots_, 0, sizeof(Slot) * size);
+    mask_ = size - 1;
+    head_ = 0;
+    tail_ = 0;
+    lines_.resize(batch_);
+    idle_ = 0;
+    stop_ = false;
+    init_semaphore(&sem_, 0);
+    if (0 != begin_thread(&thread_, SinkThread, this)) {
+        fprintf(stderr, "create log sink thread failed!\n");
+        uninit_semaphore(&sem_);
+        delete[] slots_;
+        slots_ = NULL;
+        return;
+    }
+    running_ = true;
+}
+
+void LogSinkQueue::StopQueue() {
+    if (!running_) {
+        return;
+    }
+    stop_ = true;
+    post_semaphore(&sem_);
+    wait_thread(&thread_);
+    uninit_semaphore(&sem_);
+    running_ = false;
+    delete[] slots_;
+    slots_ = NULL;
+}
+
+void LogSinkQueue::BeginBatch() {
+    batch_lines_.clear();
+    batching_ = (NULL == slots_);
+}
+
+void LogSinkQueue::Push(const char* data, int len, int level) {
+    if (NULL == slots_) {
+        LogLine line = {data, len, level};
+        if (batching_) {
+            batch_lines_.push_back(line);
+        } else {
+            WriteLines(&line, 1, false);
+        }
+        return;
+    }
+
+    bool blocked = false;
+    long capacity = mask_ + 1;
+    for (;;) {
+        long used = head_ - tail_;
+        // keep the last 1/8 of the queue for Warn/Error
+        if (LOG_OVERFLOW_DROP_LOWEST == policy_ && level < LOG_LEVEL_WARN
+                && used >= capacity - capacity / 8) {
+            atomic_inc(&dropped_);
+            return;
+        }
+        if (used < capacity) {
+            break;
+        }
+        // queue is full
+        if (LOG_OVERFLOW_DROP == policy_ || LOG_OVERFLOW_DROP_LOWEST == policy_) {
+            atomic_inc(&dropped_);
+            return;
+        }
+        if (!blocked) {
+            blocked = true;
+            atomic_inc(&blocked_);
+        }
+        Wake();
+        yield();
+    }
+
+    Slot* slot = &slots_[head_ & mask_];
+    slot->chunk = (len > MAX_LOG_LEN) ? chunks_.Alloc(len + 1) : NULL;
+    memcpy(slot->chunk ? slot->chunk : slot->data, data, len+1);
+    slot->len = len;
+    slot->level = level;
+    // full barrier, the line is visible before head_ and idle_ is checked
+    long queued = atomic_inc(&head_) - tail_;
+    if (idle_ && (queued >= LOG_WAKE_LINES || level >= LOG_LEVEL_ERROR)) {
+        Wake();
+    }
+}
+
+void LogSinkQueue::EndBatch() {
+    if (batching_ && !batch_lines_.empty()) {
+        WriteLines(&batch_lines_[0], (int)batch_lines_.size(), true);
+    }
+    batch_lines_.clear();
+    batching_ = false;
+}
+
+void LogSinkQueue::Flush() {
+    if (NULL == slots_) {
+        sink_->Flush();
+        return;
+    }
+    // lines are flushed by the sink thread before tail_ passes them
+    long head = head_;
+    while (tail_ < head) {
+        Wake();
+        yield();
+    }
+}
+
+void LogSinkQueue::GetStats(LogSinkStats* stats) {
+    stats->queued = slots_ ? head_ - tail_ : 0;
+    stats->written = written_;
+    stats->dropped = dropped_;
+    stats->blocked = blocked_;
+    stats->batches = batches_;
+    stats->write_us = write_us_;
+    stats->max_write_us = max_write_us_;
+}
+
+void LogSinkQueue::WriteLines(const LogLine* lines, int count, bool flush) {
+    uint64_t begin = clock_tick_us();
+    sink_->Write(lines, count);
+    if (flush) {
+        sink_->Flush();
+    }
+    uint64_t used = clock_tick_us() - begin;
+    // written by one thread at a time
+    write_us_ += used;
+    if (used > max_write_us_) {
+        max_write_us_ = used;
+    }
+    atomic_inc(&batches_);
+    atomic_add(&written_, count);
+}
+
+int LogSinkQueue::Drain() {
+    // atomic read, lines are read after head_
+    long count = atomic_add(&head_, 0) - tail_;
+    if (count <= 0) {
+        return 0;
+    }
+    if (count > batch_) {
+        count = batch_;
+    }
+    for (long i = 0; i < count; i++) {
+        Slot* slot = &slots_[(tail_ + i) & mask_];
+        lines_[i].data = slot->chunk ? slot->chunk : slot->data;
+        lines_[i].len = slot->len;
+        lines_[i].level = slot->level;
+    }
+    WriteLines(&lines_[0], (int)count, true);
+    for (long i = 0; i < count; i++) {
+        Slot* slot = &slots_[(tail_ + i) & mask_];
+        chunks_.Free(slot->chunk);
+        slot->chunk = NULL;
+    }
+    // free the slots
+    atomic_add(&tail_, count);
+    return (int)count;
+}
+
+void LogSinkQueue::Wake() {
+    if (atomic_cas(&idle_, 1, 0)) {
+        post_semaphore(&sem_);
+    }
+}
+
+void* LogSinkQueue::SinkThread(void* arg) {
+    LogSinkQueue* queue = static_cast<LogSinkQueue*>(arg);
+    for (;;) {
+        if (queue->Drain() > 0) {
+            continue;
+        }
+        if (queue->stop_ && queue->tail_ == queue->head_) {
+            break;
+        }
+        // wait for Push or the interval, check the queue again after idle is published
+        atomic_cas(&queue->idle_, 0, 1);
+        if (atomic_add(&queue->head_, 0) == queue->tail_ && !queue->stop_) {
+            wait_semaphore(&queue->sem_, LOG_WRITER_INTERVAL);
+        }
+        atomic_cas(&queue->idle_, 1, 0);
+    }
+    return NULL;
+}
+
+FileSink::FileSink(Log* log) {
+    log_ = log;
+    suffix_ = DEFAULT_SUFFIX;
+    max_file_size_ = DEFAULT_FILE_SIZE;
+    log_backup_strategy_ = DEFAULT_BACKUP_STRATEGY;
+    rotate_time_ = 0;
+    durability_ = LOG_DURABILITY_NONE;
+    mmap_window_ = 0;
+    init_mutex(&mutex_);
+}
+
+FileSink::~FileSink() {
+    Close();
+    uninit_mutex(&mutex_);
+}
+
+void FileSink::LogCheck() {
+    if (!is_open()) {
+        return;
+    }
+    if (LOG_BACKUP_ONE_FILE == log_backup_strategy_) {
+        if (FileSize() > max_file_size_) {
+            std::string file_name = path_ + "/";
+            std::string backup_file_name = path_ + "/";
+            file_name += name_ + suffix_;
+            backup_file_name += name_ + "_bk";
+            backup_file_name += suffix_;
+
+            SwitchFile(file_name, backup_file_name);
+        }
+    } else if (time(NULL) >= rotate_time_) {
+        SwitchFile(FileName(), "");
+    }
+}
+
+long FileSink::FileSize() {
+    return file_.size();
+}
+
+void FileSink::SwitchFile(const std::string& file_name, const std::string& backup_file_name) {
+    if (LOG_BACKUP_DATE_FILE == log_backup_strategy_) {
+        rotate_time_ = NextDay(time(NULL));
+    }
+    // same file, nothing to switch
+    if (backup_file_name.empty() && file_name == file_.file_name()) {
+        return;
+    }
+    archiver_.SetCurrent(file_name);
+    // the next file was created already, renamed by the helper thread
+    if (file_.Rotate(file_name.c_str(), backup_file_name.c_str())) {
+        FileOpened();
+    }
+}
+
+void FileSink::OpenFile(const char* file_name) {
+    std::string next_name = path_ + "/";
+    next_name += name_ + suffix_ + ".next";
+    if (LOG_BACKUP_DATE_FILE == log_backup_strategy_) {
+        rotate_time_ = NextDay(time(NULL));
+    }
+    archiver_.SetCurrent(file_name);
+    // rotated files left by an earlier run
+    archiver_.Clean();
+    bool binary = (LOG_ENCODING_BINARY == log_->encoding());
+    if (mmap_window_ > 0) {
+        if (file_.Open(file_name, next_name.c_str(), mmap_window_, binary, &archiver_)) {
+            FileOpened();
+            return;
+        }
+        fprintf(stderr, "map log file %s failed, using stdio\n", file_name);
+    }
+    if (file_.Open(file_name, next_name.c_str(), 0, binary, &archiver_)) {
+        FileOpened();
+    }
+}
+
+void FileSink::FileOpened() {
+    // formats are written again to every file
+    formats_written_.assign(LOG_MAX_FORMATS, false);
+    if (LOG_ENCODING_BINARY == log_->encoding() && 0 == FileSize()) {
+        char header[LOG_BINARY_HEADER_LEN];
+        uint32_t byte_order = LOG_BINARY_BYTE_ORDER;
+        memcpy(header, LOG_BINARY_MAGIC, LOG_BINARY_MAGIC_LEN);
+        memcpy(header + LOG_BINARY_MAGIC_LEN, &byte_order, sizeof(byte_order));
+        WriteBytes(header, sizeof(header));
+    }
+}
+
+void FileSink::CloseFile() {
+    file_.Close();
+}
+
+void FileSink::WriteBytes(const char* data, int len) {
+    file_.Write(data, len);
+}
+
+std::string FileSink::FileName() {
+    std::string file_name = path_ + "/";
+    file_name += name_;
+    if (LOG_BACKUP_DATE_FILE == log_backup_strategy_) {
+        char buf[32];
+        struct tm tm;
+        LocalTime(time(NULL), &tm);
+        strftime(buf, sizeof(buf), "%Y-%m-%d", &tm);
+
+        file_name += "-";
+        file_name += buf;
+    }
+    file_name += suffix_;
+    return file_name;
+}
+
+void FileSink::SetFile(const char* path, const char* name, LogBackupStrategy strategy, long max_size) {
+    lock_mutex(&mutex_);
+    path_ = path;
+    name_ = name;
+    log_backup_strategy_ = strategy;
+    max_file_size_ = max_size;
+    archiver_.SetFiles(path, name, suffix_.c_str());
+    if (is_open()) {
+        CloseFile();
+        OpenFile(FileName().c_str());
+    }
+    unlock_mutex(&mutex_);
+}
+
+void FileSink::SetSuffix(const char* suffix) {
+    lock_mutex(&mutex_);
+    suffix_ = suffix;
+    archiver_.SetFiles(path_.c_str(), name_.c_str(), suffix);
+    if (is_open()) {
+        CloseFile();
+        OpenFile(FileName().c_str());
+    }
+    unlock_mutex(&mutex_);
+}
+
+void FileSink::SetWriter(LogFileWriter writer, long window_size) {
+    lock_mutex(&mutex_);
+    mmap_window_ = 0;
+    if (LOG_FILE_MMAP == writer) {
+        mmap_window_ = (window_size > 0) ? window_size : LOG_MMAP_WINDOW;
+    }
+    if (is_open()) {
+        CloseFile();
+        OpenFile(FileName().c_str());
+    }
+    unlock_mutex(&mutex_);
+}
+
+void FileSink::SetRetention(int max_files, long max_bytes, const char* compress_command) {
+    lock_mutex(&mutex_);
+    archiver_.SetRetention(max_files, max_bytes, compress_command);
+    archiver_.Clean();
+    unlock_mutex(&mutex_);
+}
+
+void FileSink::SetDurability(LogDurability durability, int sync_interval_ms, long sync_bytes, bool sync_errors) {
+    lock_mutex(&mutex_);
+    durability_ = durability;
+    if (LOG_DURABILITY_SYNC == durability) {
+        file_.SetSync(sync_interval_ms, sync_bytes, true);
+    } else {
+        file_.SetSync(0, 0, sync_errors);
+    }
+    unlock_mutex(&mutex_);
+}
+
+void FileSink::Sync() {
+    lock_mutex(&mutex_);
+    file_.Flush();
+    int64_t position = file_.Commit();
+    unlock_mutex(&mutex_);
+    // outside mutex_: lines written meanwhile are synced by the same sync
+    file_.WaitSynced(position);
+}
+
+void FileSink::Open() {
+    lock_mutex(&mutex_);
+    if (!is_open()) {
+        OpenFile(FileName().c_str());
+    }
+    unlock_mutex(&mutex_);
+}
+
+void FileSink::Close() {
+    lock_mutex(&mutex_);
+    CloseFile();
+    unlock_mutex(&mutex_);
+}
+
+bool FileSink::is_open() {
+    return file_.is_open();
+}
+
+void FileSink::Write(const LogLine* lines, int count) {
+    bool binary = (LOG_ENCODING_BINARY == log_->encoding());
+    lock_mutex(&mutex_);
+    LogCheck();
+    for (int i = 0; is_open() && i < count; i++) {
+        const char* data = lines[i].data;
+        if (!binary) {
+            WriteBytes(data, lines[i].len+1);
+            continue;
+        }
+        // FORMAT record before the first LINE record of a format in the file
+        if (LOG_RECORD_LINE == data[2]) {
+            uint32_t id;
+            memcpy(&id, data + LOG_RECORD_HEADER_LEN, sizeof(id));
+            if (!formats_written_[id]) {
+                char record[LOG_RECORD_HEADER_LEN + 4 + MAX_LOG_LEN];
+                int  len = LogEncodeFormat(id, log_->GetFormat(id), record, sizeof(record));
+                WriteBytes(record, len);
+                formats_written_[id] = true;
+            }
+        }
+        WriteBytes(data, lines[i].len);
+    }
+    if (LOG_DURABILITY_NONE != durability_) {
+        file_.Flush();
+    }
+    if (LOG_DURABILITY_SYNC == durability_) {
+        file_.Commit();
+    }
+    unlock_mutex(&mutex_);
+}
+
+void FileSink::Flush() {
+    lock_mutex(&mutex_);
+    file_.Flush();
+    unlock_mutex(&mutex_);
+}
+
+NetSink::NetSink(Log* log) {
+    log_ = log;
+    log_socket_ = INVALID_SOCKET;
+    memset(&target_addr_, 0, sizeof(target_addr_));
+    target_addr_.sin_family = AF_INET;
+    target_addr_.sin_addr.s_addr = inet_addr("127.0.1");
+    target_addr_.sin_port = ntohs(DEFAULT_PORT);
+    // tells logs of different processes (and restarts) apart
+    sender_ = (uint32_t)getpid() * 2654435761u ^ (uint32_t)clock_tick_us() ^ (uint32_t)time(NULL);
+    sequence_ = 0;
+    datagrams_.resize(LOG_NET_MAX_DATAGRAMS * LOG_NET_DATAGRAM_SIZE);
+    count_ = 0;
+    formats_sent_.assign(LOG_MAX_FORMATS, 0);
+    init_mutex(&mutex_);
+}
+
+NetSink::~NetSink() {
+    Close();
+    uninit_mutex(&mutex_);
+}
+
+void NetSink::SetAddr(const char* host, unsigned short port) {
+    lock_mutex(&mutex_);
+    struct hostent* host_info = gethostbyname(host);
+    if (host_info && *host_info->h_addr_list) {
+        memcpy(&target_addr_.sin_addr, *host_info->h_addr_list, sizeof(target_addr_.sin_addr));
+    } else {
+        target_addr_.sin_addr.s_addr = inet_addr(host);
+    }
+    target_addr_.sin_port = ntohs(port);
+    unlock_mutex(&mutex_);
+}
+
+void NetSink::Open() {
+    lock_mutex(&mutex_);
+    if (INVALID_SOCKET == log_socket_) {
+        log_socket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    }
+    unlock_mutex(&mutex_);
+}
+
+void NetSink::Close() {
+    lock_mutex(&mutex_);
+    if (INVALID_SOCKET != log_socket_) {
+        closesocket(log_socket_);
+        log_socket_ = INVALID_SOCKET;
+    }
+    unlock_mutex(&mutex_);
+}
+
+char* NetSink::Reserve(int len) {
+    if (0 == count_ || lens_[count_ - 1] + len > LOG_NET_DATAGRAM_SIZE) {
+        if (LOG_NET_MAX_DATAGRAMS == count_) {
+            Send();
+        }
+        char* datagram = &datagrams_[count_ * LOG_NET_DATAGRAM_SIZE];
+        memcpy(datagram, LOG_NET_MAGIC, LOG_NET_MAGIC_LEN);
+        memcpy(datagram + LOG_NET_MAGIC_LEN, &sender_, sizeof(sender_));
+        memcpy(datagram + LOG_NET_MAGIC_LEN + 4, &sequence_, sizeof(sequence_));
+        sequence_++;
+        lens_[count_++] = LOG_NET_HEADER_LEN;
+    }
+    char* p = &datagrams_[(count_ - 1) * LOG_NET_DATAGRAM_SIZE + lens_[count_ - 1]];
+    lens_[count_ - 1] += len;
+    return p;
+}
+
+void NetSink::Send() {
+#ifdef __linux__
+    struct mmsghdr msgs[LOG_NET_MAX_DATAGRAMS];
+    struct iovec iovs[LOG_NET_MAX_DATAGRAMS];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < count_; i++) {
+        iovs[i].iov_base = &datagrams_[i * LOG_NET_DATAGRAM_SIZE];
+        iovs[i].iov_len = lens_[i];
+        msgs[i].msg_hdr.msg_name = &target_addr_;
+        msgs[i].msg_hdr.msg_namelen = sizeof(target_addr_);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    // a datagram that can not be sent is lost, the receiver sees the gap
+    int sent = 0;
+    while (sent < count_) {
+        int n = sendmmsg(log_socket_, msgs + sent, count_ - sent, 0);
+        if (n <= 0) {
+            if (n < 0 && EINTR == errno) {
+                continue;
+            }
+            sent++;
+        } else {
+            sent += n;
+        }
+    }
+#else
+    for (int i = 0; i < count_; i++) {
+        sendto(log_socket_, &datagrams_[i * LOG_NET_DATAGRAM_SIZE], lens_[i], 0,
+               (sockaddr*)&target_addr_, sizeof(target_addr_));
+    }
+#endif
+    count_ = 0;
+}
+
+void NetSink::Write(const LogLine* lines, int count) {
+    bool binary = (LOG_ENCODING_BINARY == log_->encoding());
+    lock_mutex(&mutex_);
+    if (INVALID_SOCKET == log_socket_) {
+        unlock_mutex(&mutex_);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        const char* data = lines[i].data;
+        int len = lines[i].len;
+        if (!binary) {
+            AddText(data, len, lines[i].level);
+            continue;
+        }
+        // a long text is in several records
+        int pos = 0;
+        while (pos + LOG_RECORD_HEADER_LEN <= len) {
+            uint16_t record_len;
+            memcpy(&record_len, data + pos, sizeof(record_len));
+            if (record_len < LOG_RECORD_HEADER_LEN || pos + record_len > len) {
+                break;
+            }
+            AddRecord(data + pos, record_len, lines[i].level);
+            pos += record_len;
+        }
+    }
+    Send();
+    unlock_mutex(&mutex_);
+}
+
+void NetSink::AddText(const char* text, int len, int level) {
+    const int max_text = LOG_NET_DATAGRAM_SIZE - LOG_NET_HEADER_LEN - LOG_RECORD_HEADER_LEN;
+    // TEXT records, without the '\0'
+    do {
+        int text_len = (len < max_text) ? len : max_text;
+        char* p = Reserve(LOG_RECORD_HEADER_LEN + text_len);
+        uint16_t record_len = (uint16_t)(LOG_RECORD_HEADER_LEN + text_len);
+        memcpy(p, &record_len, sizeof(record_len));
+        p[2] = LOG_RECORD_TEXT;
+        p[3] = (char)level;
+        memcpy(p + LOG_RECORD_HEADER_LEN, text, text_len);
+        text += text_len;
+        len -= text_len;
+    } while (len > 0);
+}
+
+void NetSink::AddRecord(const char* record, int len, int level) {
+    const int max_len = LOG_NET_DATAGRAM_SIZE - LOG_NET_HEADER_LEN;
+    if (LOG_RECORD_TEXT == record[2]) {
+        AddText(record + LOG_RECORD_HEADER_LEN, len - LOG_RECORD_HEADER_LEN, level);
+        return;
+    }
+    if (len > max_len) {
+        std::vector<char> text(2 * len + MAX_LOG_LEN);
+        int text_len = log_->FormatRecord(LOG_LINE_TEXT, record, len, &text[0], (int)text.size());
+        AddText(&text[0], text_len, level);
+        return;
+    }
+    // formats are resent for viewers started later, a format is
+    // in the datagram of its line if both fit
+    char format_record[LOG_RECORD_HEADER_LEN + 4 + MAX_LOG_LEN];
+    int  format_len = 0;
+    if (LOG_RECORD_LINE == record[2]) {
+        uint32_t id;
+        memcpy(&id, record + LOG_RECORD_HEADER_LEN, sizeof(id));
+        time_t now = time(NULL);
+        if (now - formats_sent_[id] >= LOG_FORMAT_RESEND_INTERVAL) {
+            format_len = LogEncodeFormat(id, log_->GetFormat(id), format_record, sizeof(format_record));
+            formats_sent_[id] = now;
+        }
+    }
+    if (format_len + len > max_len) {
+        memcpy(Reserve(format_len), format_record, format_len);
+        format_len = 0;
+    }
+    char* p = Reserve(format_len + len);
+    memcpy(p, format_record, format_len);
+    memcpy(p + format_len, record, len);
+}
+
+void ConsoleSink::Write(const LogLine* lines, int count) {
+    bool binary = (LOG_ENCODING_BINARY == log_->encoding());
+    for (int i = 0; i < count; i++) {
+        const char* data = lines[i].data;
+        int len = lines[i].len;
+        if (!binary) {
+            fwrite(data, 1, len, stdout);
+            continue;
+        }
+        // binary lines are formatted only here and by recorder dumps
+        // a long text is in several records
+        int pos = 0;
+        while (pos + LOG_RECORD_HEADER_LEN <= len) {
+            const char* record = data + pos;
+            uint16_t record_len;
+            memcpy(&record_len, record, sizeof(record_len));
+            if (record_len < LOG_RECORD_HEADER_LEN || pos + record_len > len) {
+                break;
+            }
+            pos += record_len;
+            if (LOG_RECORD_TEXT == record[2]) {
+                fwrite(record + LOG_RECORD_HEADER_LEN, 1, record_len - LOG_RECORD_HEADER_LEN, stdout);
+                continue;
+            }
+            char text[MAX_LOG_LEN * 2];
+            if (record_len <= MAX_LOG_LEN) {
+                int text_len = log_->FormatRecord(LOG_LINE_TEXT, record, record_len, text, sizeof(text));
+                fwrite(text, 1, text_len, stdout);
+            } else {
+                std::vector<char> long_text(2 * record_len + MAX_LOG_LEN);
+                int text_len = log_->FormatRecord(LOG_LINE_TEXT, record, record_len, &long_text[0], (int)long_text.size());
+                fwrite(&long_text[0], 1, text_len, stdout);
+            }
+        }
+    }
+}
+
+void ConsoleSink::Flush() {
+    fflush(stdout);
+}
@@ -0,0 +1,306 @@
+/***************************************************************************
+ *
+ *  Project
+ *
+ * Copyright (C) 2013 - 2013, Paul Zhou, <qianlong.zhou@gmail.com>.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+#include <string.h>
+#include <algorithm>
+#include "logstaging.h"
+
+// bytes of the header of an entry: time, level, len
+#define LOG_STAGED_HEADER_LEN 16
+// len of an entry marking the end of the buffer, the next entry is at its start
+#define LOG_STAGED_WRAP (-1)
+// level flag of an entry holding the address of a chunk
+#define LOG_STAGED_CHUNK 0x100
+// level flag of an Error line dumping the flight recorder, its recorder
+// position follows the line
+#define LOG_STAGED_DUMP  0x200
+#define LOG_STAGED_MARK_LEN 8
+
+struct LogStaging::Buffer {
+    char* data;
+    unsigned long thread;
+    // written by the thread
+    // bytes published (end of the newest entry)
+    volatile long head;
+    // lines published
+    volatile long lines;
+    // bytes skipped at the end of the buffer by the line reserved
+    long skip;
+    // chunk of the line reserved, NULL: in the entry
+    char* chunk;
+    // bytes published since the writer was signalled
+    long unsignaled;
+    char pad[64];
+    // written by the writer thread
+    // start of the oldest entry not released
+    volatile long tail;
+    // lines released
+    volatile long released;
+    // end of the entries collected and their lines
+    long collected;
+    long collected_lines;
+};
+
+// generations of all staging buffers, buffers at the address of freed
+// ones never match the stale cache of a thread
+static volatile long staging_generations = 0;
+
+// buffer of the calling thread (cache)
+static APF_THREAD_LOCAL LogStaging* thread_staging = NULL;
+static APF_THREAD_LOCAL long  thread_generation = 0;
+static APF_THREAD_LOCAL void* thread_buffer = NULL;
+
+static long EntrySize(int len) {
+    return (LOG_STAGED_HEADER_LEN + len + 1 + 7) & ~7L;
+}
+
+// bytes of an entry in the buffer
+static long EntryBytes(int level, int len) {
+    long bytes = EntrySize((level & LOG_STAGED_CHUNK) ? (int)sizeof(char*) : len);
+    return (level & LOG_STAGED_DUMP) ? bytes + LOG_STAGED_MARK_LEN : bytes;
+}
+
+static bool LineOlder(const LogStagedLine& a, const LogStagedLine& b) {
+    return a.time < b.time;
+}
+
+LogStaging::LogStaging() {
+    size_ = 0;
+    generation_ = atomic_inc(&staging_generations);
+    buffer_count_ = 0;
+    collected_count_ = 0;
+    init_mutex(&mutex_);
+}
+
+LogStaging::~LogStaging() {
+    SetSize(0);
+    uninit_mutex(&mutex_);
+}
+
+void LogStaging::SetSize(long thread_bytes) {
+    lock_mutex(&mutex_);
+    for (long i = 0; i < buffer_count_; i++) {
+        delete[] buffers_[i]->data;
+        delete buffers_[i];
+    }
+    buffer_count_ = 0;
+    collected_count_ = 0;
+    size_ = 0;
+    if (thread_bytes > 0) {
+        // a few chunks at least
+        size_ = (thread_bytes + 7) & ~7L;
+        if (size_ < 4 * LOG_STAGING_CHUNK) {
+            size_ = 4 * LOG_STAGING_CHUNK;
+        }
+    }
+    generation_ = atomic_inc(&staging_generations);
+    unlock_mutex(&mutex_);
+}
+
+LogStaging::Buffer* LogStaging::ThreadBuffer() {
+    if (this == thread_staging && generation_ == thread_generation) {
+        return static_cast<Buffer*>(thread_buffer);
+    }
+    Buffer* buffer = NULL;
+    unsigned long thread = thread_id();
+    lock_mutex(&mutex_);
+    for (long i = 0; i < buffer_count_; i++) {
+        if (thread == buffers_[i]->thread) {
+            buffer = buffers_[i];
+            break;
+        }
+    }
+    if (NULL == buffer && size_ > 0 && buffer_count_ < LOG_STAGING_MAX_THREADS) {
+        buffer = new Buffer;
+        buffer->data = new char[size_];
+        // touch every page now, the thread should not page fault on the first lap
+        memset(buffer->data, 0, size_);
+        buffer->thread = thread;
+        buffer->head = 0;
+        buffer->lines = 0;
+        buffer->skip = 0;
+        buffer->chunk = NULL;
+        buffer->unsignaled = 0;
+        buffer->tail = 0;
+        buffer->released = 0;
+        buffer->collected = 0;
+        buffer->collected_lines = 0;
+        buffers_[buffer_count_] = buffer;
+        // the buffer is visible to the writer after it is set up
+        atomic_inc(&buffer_count_);
+    }
+    thread_staging = this;
+    thread_generation = generation_;
+    thread_buffer = buffer;
+    unlock_mutex(&mutex_);
+    return buffer;
+}
+
+char* LogStaging::Reserve(Buffer* buffer, int max_len, long limit) {
+    long need = EntrySize(max_len) + LOG_STAGED_MARK_LEN;
+    long head = buffer->head;
+    long offset = head % size_;
+    // an entry is never split, the rest of the buffer is skipped
+    long skip = (size_ - offset < need) ? size_ - offset : 0;
+    if (head + skip + need - buffer->tail > limit) {
+        return NULL;
+    }
+    buffer->skip = skip;
+    buffer->chunk = NULL;
+    return buffer->data + (skip > 0 ? 0 : offset) + LOG_STAGED_HEADER_LEN;
+}
+
+char* LogStaging::Spill(Buffer* buffer, int size) {
+    buffer->chunk = chunks_.Alloc(size);
+    return buffer->chunk;
+}
+
+bool LogStaging::Commit(Buffer* buffer, int64_t time, int level, int len, long dump) {
+    long head = buffer->head;
+    long offset = head % size_;
+    if (buffer->skip > 0) {
+        if (buffer->skip >= LOG_STAGED_HEADER_LEN) {
+            int32_t wrap = LOG_STAGED_WRAP;
+            memcpy(buffer->data + offset + 12, &wrap, sizeof(wrap));
+        }
+        head += buffer->skip;
+        offset = 0;
+    }
+    char* entry = buffer->data + offset;
+    if (buffer->chunk) {
+        memcpy(entry + LOG_STAGED_HEADER_LEN, &buffer->chunk, sizeof(buffer->chunk));
+        level |= LOG_STAGED_CHUNK;
+        buffer->chunk = NULL;
+    }
+    if (dump >= 0) {
+        level |= LOG_STAGED_DUMP;
+        int64_t mark = dump;
+        memcpy(entry + EntryBytes(level, len) - LOG_STAGED_MARK_LEN, &mark, sizeof(mark));
+    }
+    int32_t level32 = level;
+    int32_t len32 = len;
+    memcpy(entry, &time, sizeof(time));
+    memcpy(entry + 8, &level32, sizeof(level32));
+    memcpy(entry + 12, &len32, sizeof(len32));
+    long size = buffer->skip + EntryBytes(level, len);
+    buffer->lines++;
+    // publish the entry (full barrier, the entry is written before)
+    atomic_add(&buffer->head, head + EntryBytes(level, len) - buffer->head);
+
+    buffer->unsignaled += size;
+    if (buffer->unsignaled >= LOG_STAGING_CHUNK) {
+        buffer->unsignaled = 0;
+        return true;
+    }
+    return false;
+}
+
+int LogStaging::Collect(int64_t cutoff, std::vector<LogStagedLine>* lines) {
+    lines->clear();
+    collected_count_ = atomic_add(&buffer_count_, 0);
+    for (long i = 0; i < collected_count_; i++) {
+        Buffer* buffer = buffers_[i];
+        // atomic read, the entries before head are written
+        long head = atomic_add(&buffer->head, 0);
+        long pos = buffer->tail;
+        size_t first = lines->size();
+        buffer->collected_lines = 0;
+        while (pos < head) {
+            long offset = pos % size_;
+            long room = size_ - offset;
+            const char* entry = buffer->data + offset;
+            int32_t len = LOG_STAGED_WRAP;
+            if (room >= LOG_STAGED_HEADER_LEN) {
+                memcpy(&len, entry + 12, sizeof(len));
+            }
+            if (LOG_STAGED_WRAP == len) {
+                pos += room;
+                continue;
+            }
+            LogStagedLine line;
+            memcpy(&line.time, entry, sizeof(line.time));
+            // lines of a thread are in time order
+            if (line.time > cutoff) {
+                break;
+            }
+            int32_t level;
+            memcpy(&level, entry + 8, sizeof(level));
+            line.line.data = entry + LOG_STAGED_HEADER_LEN;
+            if (level & LOG_STAGED_CHUNK) {
+                char* chunk;
+                memcpy(&chunk, entry + LOG_STAGED_HEADER_LEN, sizeof(chunk));
+                line.line.data = chunk;
+                collected_chunks_.push_back(chunk);
+            }
+            line.line.len = len;
+            line.line.level = level & ~(LOG_STAGED_CHUNK | LOG_STAGED_DUMP);
+            line.dump = -1;
+            if (level & LOG_STAGED_DUMP) {
+                int64_t mark;
+                memcpy(&mark, entry + EntryBytes(level, len) - LOG_STAGED_MARK_LEN, sizeof(mark));
+                line.dump = (long)mark;
+            }
+            line.thread = buffer->thread;
+            lines->push_back(line);
+            buffer->collected_lines++;
+            pos += EntryBytes(level, len);
+        }
+        buffer->collected = pos;
+        // merge the lines of the thread with the lines of the threads before
+        std::inplace_merge(lines->begin(), lines->begin() + first, lines->end(), LineOlder);
+    }
+    return (int)lines->size();
+}
+
+void LogStaging::Release() {
+    for (long i = 0; i < collected_count_; i++) {
+        Buffer* buffer = buffers_[i];
+        buffer->released += buffer->collected_lines;
+        buffer->collected_lines = 0;
+        // full barrier, the entries are read before they are freed
+        atomic_add(&buffer->tail, buffer->collected - buffer->tail);
+    }
+    for (size_t i = 0; i < collected_chunks_.size(); i++) {
+        chunks_.Free(collected_chunks_[i]);
+    }
+    collected_chunks_.clear();
+}
+
+long LogStaging::queued() {
+    long queued = 0;
+    long count = atomic_add(&buffer_count_, 0);
+    for (long i = 0; i < count; i++) {
+        queued += buffers_[i]->lines - buffers_[i]->released;
+    }
+    return queued;
+}
+
+void LogStaging::Mark(std::vector<long>* marks) {
+    long count = atomic_add(&buffer_count_, 0);
+    for (long i = 0; i < count; i++) {
+        marks->push_back(atomic_add(&buffers_[i]->head, 0));
+    }
+}
+
+bool LogStaging::Released(const std::vector<long>& marks) {
+    for (size_t i = 0; i < marks.size(); i++) {
+        if (buffers_[i]->tail < marks[i]) {
+            return false;
+        }
+    }
+    return true;
+}
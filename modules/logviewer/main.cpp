@@ -1,6 +1,11 @@
 #include <iostream>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "../log/logbinary.h"
 #ifdef WIN32
 #include <winsock2.h>
 #ifdef WINCE
@@ -53,7 +58,7 @@ LogType GetLogType(const char* log) {
     const char* ptype = log;
     ptype = strchr(ptype, ' ');
     if (ptype) {
-        ptype = strchr(ptype, ' ');
+        ptype = strchr(ptype + 1, ' ');
     }
     if (ptype) {
         ptype++;
@@ -69,8 +74,277 @@ LogType GetLogType(const char* log) {
     return type;
 }
 
-int main()
+// print a log line in the color of its type
+void PrintLog(const char* log, LogType type) {
+    switch(type) {
+    case LOG_INFO:
+        GREEN_PRINT("%s", log);
+        break;
+    case LOG_DEBUG:
+        BLUE_PRINT("%s", log);
+        break;
+    case LOG_WARN:
+        printf("%s", log);
+        break;
+    case LOG_ERROR:
+        RED_PRINT("%s", log);
+        break;
+    default:
+        break;
+    }
+}
+
+// binary formats <id, format>
+typedef std::map<uint32_t, std::string> FormatMap;
+
+// a filter on a field of structured lines: key=value, key!=value, key>N or key<N
+struct FieldFilter {
+    std::string key;
+    // '=', '!', '>' or '<'
+    char op;
+    std::string value;
+    double number;
+};
+// only structured lines matching all filters are printed (if any)
+std::vector<FieldFilter> field_filters;
+
+// parse a filter, return false if arg is not one
+bool ParseFilter(const char* arg, FieldFilter* filter) {
+    const char* op = strpbrk(arg, "=!<>");
+    if (NULL == op || op == arg) {
+        return false;
+    }
+    filter->key.assign(arg, op - arg);
+    filter->op = *op;
+    const char* value = op + 1;
+    if ('!' == *op) {
+        if ('=' != op[1]) {
+            return false;
+        }
+        value++;
+    }
+    filter->value = value;
+    filter->number = atof(value);
+    return true;
+}
+
+// does a field match a filter
+bool FieldMatch(const LogField& field, const FieldFilter& filter) {
+    char text[64];
+    std::string value;
+    double number = 0;
+    switch (field.type) {
+    case LOG_FIELD_INT:
+        snprintf(text, sizeof(text), "%lld", (long long)field.int_value);
+        value = text;
+        number = (double)field.int_value;
+        break;
+    case LOG_FIELD_DOUBLE:
+        snprintf(text, sizeof(text), "%.15g", field.double_value);
+        value = text;
+        number = field.double_value;
+        break;
+    case LOG_FIELD_BOOL:
+        value = field.int_value ? "true" : "false";
+        number = (double)field.int_value;
+        break;
+    default:
+        value.assign(field.str, field.str_len);
+        number = atof(value.c_str());
+        break;
+    }
+    if ('=' == filter.op) {
+        return value == filter.value;
+    } else if ('!' == filter.op) {
+        return value != filter.value;
+    } else if ('>' == filter.op) {
+        return number > filter.number;
+    }
+    return number < filter.number;
+}
+
+// does a fields record match all filters, a missing field only matches key!=value
+bool RecordMatch(const char* record, int len) {
+    LogFieldsRecord fields;
+    if (!LogDecodeFields(record, len, &fields)) {
+        return false;
+    }
+    for (size_t i = 0; i < field_filters.size(); i++) {
+        const FieldFilter& filter = field_filters[i];
+        const LogField* field = NULL;
+        for (int j = 0; j < fields.count && NULL == field; j++) {
+            if (filter.key.size() == (size_t)fields.fields[j].key_len
+                    && 0 == memcmp(filter.key.data(), fields.fields[j].key, filter.key.size())) {
+                field = &fields.fields[j];
+            }
+        }
+        if (NULL == field ? '!' != filter.op : !FieldMatch(*field, filter)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// print binary records (see logbinary.h), return bytes of complete records
+int PrintRecords(const char* data, int len, FormatMap* formats) {
+    static const LogType types[] = {LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR};
+    // text of the longest record
+    static std::vector<char> line(LOG_RECORD_MAX_LEN * 2);
+    int pos = 0;
+    while (pos + LOG_RECORD_HEADER_LEN <= len) {
+        const char* record = data + pos;
+        uint16_t size;
+        memcpy(&size, record, sizeof(size));
+        if (size < LOG_RECORD_HEADER_LEN) {
+            RED_PRINT("Error: bad record at %d\n", pos);
+            return len;
+        }
+        if (pos + size > len) {
+            break;
+        }
+        pos += size;
+
+        int level = (unsigned char)record[3];
+        LogType type = (level < 4) ? types[level] : LOG_INFO;
+        // with filters only matching structured lines are printed
+        if (!field_filters.empty() && LOG_RECORD_FORMAT != record[2]
+                && (LOG_RECORD_FIELDS != record[2] || !RecordMatch(record, size))) {
+            continue;
+        }
+        if (LOG_RECORD_FORMAT == record[2] && size >= LOG_RECORD_HEADER_LEN + 4) {
+            uint32_t id;
+            memcpy(&id, record + LOG_RECORD_HEADER_LEN, sizeof(id));
+            (*formats)[id].assign(record + LOG_RECORD_HEADER_LEN + 4, size - LOG_RECORD_HEADER_LEN - 4);
+        } else if (LOG_RECORD_LINE == record[2] && size >= LOG_RECORD_LINE_LEN) {
+            uint32_t id;
+            memcpy(&id, record + LOG_RECORD_HEADER_LEN, sizeof(id));
+            FormatMap::iterator it = formats->find(id);
+            if (formats->end() == it) {
+                // viewer started after the format was sent, it is sent again later
+                printf("[unknown format %u]\n", id);
+                continue;
+            }
+            if (LogFormatLine(it->second.c_str(), record, size, &line[0], (int)line.size()) > 0) {
+                PrintLog(&line[0], type);
+            }
+        } else if (LOG_RECORD_TEXT == record[2]) {
+            // a long line is in several records, the level tells their color
+            int text_len = size - LOG_RECORD_HEADER_LEN;
+            memcpy(&line[0], record + LOG_RECORD_HEADER_LEN, text_len);
+            line[text_len] = '\0';
+            PrintLog(&line[0], type);
+        } else if (LOG_RECORD_FIELDS == record[2]) {
+            if (LogFormatRecord(LOG_LINE_TEXT, NULL, record, size, &line[0], (int)line.size()) > 0) {
+                PrintLog(&line[0], type);
+            }
+        }
+    }
+    return pos;
+}
+
+// datagrams of a sender (see LOG_NET_MAGIC)
+struct Sender {
+    // sequence of the next datagram
+    uint32_t next;
+    uint64_t received;
+    uint64_t lost;
+    FormatMap formats;
+};
+typedef std::map<uint32_t, Sender> SenderMap;
+
+// print a datagram of LOG_TARGET_NET, report lost datagrams
+void PrintDatagram(const char* data, int len, const sockaddr_in& from, SenderMap* senders) {
+    uint32_t id;
+    uint32_t sequence;
+    memcpy(&id, data + LOG_NET_MAGIC_LEN, sizeof(id));
+    memcpy(&sequence, data + LOG_NET_MAGIC_LEN + 4, sizeof(sequence));
+    SenderMap::iterator it = senders->find(id);
+    if (senders->end() == it) {
+        it = senders->insert(std::make_pair(id, Sender())).first;
+        it->second.next = sequence;
+        it->second.received = 0;
+        it->second.lost = 0;
+    }
+    Sender* sender = &it->second;
+    int32_t gap = (int32_t)(sequence - sender->next);
+    if (gap > 0) {
+        sender->lost += gap;
+        RED_PRINT("Lost %d datagrams from %s:%d [%08x], %llu of %llu lost\n", gap,
+                  inet_ntoa(from.sin_addr), ntohs(from.sin_port), id,
+                  (unsigned long long)sender->lost,
+                  (unsigned long long)(sender->lost + sender->received + 1));
+    } else if (gap < 0) {
+        // late (reordered) datagram, it was counted as lost
+        RED_PRINT("Late datagram %u from %s:%d [%08x]\n", sequence,
+                  inet_ntoa(from.sin_addr), ntohs(from.sin_port), id);
+        if (sender->lost > 0) {
+            sender->lost--;
+        }
+    }
+    if (gap >= 0) {
+        sender->next = sequence + 1;
+    }
+    sender->received++;
+    PrintRecords(data + LOG_NET_HEADER_LEN, len - LOG_NET_HEADER_LEN, &sender->formats);
+}
+
+// print a binary log file
+int PrintFile(const char* file_name) {
+    FILE* file = fopen(file_name, "rb");
+    if (NULL == file) {
+        RED_PRINT("Error: cannot open %s\n", file_name);
+        return 1;
+    }
+    char header[LOG_BINARY_HEADER_LEN];
+    uint32_t byte_order = 0;
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)
+            || 0 != memcmp(header, LOG_BINARY_MAGIC, LOG_BINARY_MAGIC_LEN)) {
+        RED_PRINT("Error: %s is not a binary log\n", file_name);
+        fclose(file);
+        return 1;
+    }
+    memcpy(&byte_order, header + LOG_BINARY_MAGIC_LEN, sizeof(byte_order));
+    if (LOG_BINARY_BYTE_ORDER != byte_order) {
+        RED_PRINT("Error: %s was written with another byte order\n", file_name);
+        fclose(file);
+        return 1;
+    }
+
+    FormatMap formats;
+    std::vector<char> buf(64 * 1024 * 2);
+    int len = 0;
+    size_t n;
+    while ((n = fread(&buf[len], 1, buf.size() - len, file)) > 0) {
+        len += (int)n;
+        int used = PrintRecords(&buf[0], len, &formats);
+        // keep the incomplete record
+        memmove(&buf[0], &buf[used], len - used);
+        len -= used;
+    }
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char* argv[])
 {
+    // logviewer [{file}.blog] [key=value|key!=value|key>N|key<N ...]
+    // print a binary log file or listen for net lines, filters select structured lines
+    const char* file_name = NULL;
+    for (int i = 1; i < argc; i++) {
+        FieldFilter filter;
+        if (ParseFilter(argv[i], &filter)) {
+            field_filters.push_back(filter);
+        } else if (1 == i) {
+            file_name = argv[i];
+        } else {
+            RED_PRINT("Error: bad filter %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (file_name) {
+        return PrintFile(file_name);
+    }
+
     sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
@@ -99,6 +373,10 @@ int main()
         return 0;
     }
 
+    // bursts of a busy sender are not dropped by a small socket buffer
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&rcvbuf, sizeof(rcvbuf));
+
     GREEN_PRINT("Listened and watting for log on port %d ...\n", DEFAULT_PORT);
 
     sockaddr_in addr_client;
@@ -107,24 +385,20 @@ int main()
 #else
     unsigned int len = sizeof(addr_client);
 #endif
-    char buf[MAX_BUF];
-    while (recvfrom(sock, buf, MAX_BUF, 0, (sockaddr*)&addr_client, &len) >= 0) {
-        switch(GetLogType(buf)) {
-        case LOG_INFO:
-            GREEN_PRINT("%s", buf);
-            break;
-        case LOG_DEBUG:
-            BLUE_PRINT("%s", buf);
-            break;
-        case LOG_WARN:
-            printf(buf);
-            break;
-        case LOG_ERROR:
-            RED_PRINT("%s", buf);
-            break;
-        default:
-            break;
+    char buf[MAX_BUF * 2];
+    SenderMap senders;
+    int size;
+    while ((size = recvfrom(sock, buf, sizeof(buf) - 1, 0, (sockaddr*)&addr_client, &len)) >= 0) {
+        if (size >= LOG_NET_HEADER_LEN && 0 == memcmp(buf, LOG_NET_MAGIC, LOG_NET_MAGIC_LEN)) {
+            PrintDatagram(buf, size, addr_client, &senders);
+            continue;
+        }
+        if (!field_filters.empty()) {
+            continue;
         }
+        // a line of an older log
+        buf[size] = '\0';
+        PrintLog(buf, GetLogType(buf));
     }
 
 #ifdef WIN32
@@ -113,6 +113,753 @@ void TestConfig() {
     config->Save("./config1.conf");
 }
 
+#include <string.h>
+#include <arpa/inet.h>
+#include "../../include/oscore.h"
+#include "../../modules/eventloop/ieventloop.h"
+// echo server: send every datagram back to its sender
+class EchoHandler : public IEventHandler {
+public:
+    void OnEvent(int fd, int events) {
+        char buf[64];
+        sockaddr_in from;
+        socklen_t len = sizeof(from);
+        int n;
+        // edge triggered, read until EAGAIN
+        while ((n = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr*)&from, &len)) > 0) {
+            sendto(fd, buf, n, 0, (sockaddr*)&from, len);
+            len = sizeof(from);
+        }
+    }
+};
+void TestEventLoop() {
+    apf::PluginManager::instance()->Load("../../modules/eventloop/bin/Debug/libeventloop.so");
+    apf::Interface<IEventLoop> loop(CLSID_EventLoop);
+    if (!loop || !loop->Init()) {
+        printf("instance IEventLoop failed\n");
+        return;
+    }
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = 0;
+    int server = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    bind(server, (sockaddr*)&addr, sizeof(addr));
+    socklen_t addr_len = sizeof(addr);
+    getsockname(server, (sockaddr*)&addr, &addr_len);
+    fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+
+    EchoHandler echo;
+    loop->AddWatcher(server, EVENT_READ, &echo);
+    loop->Start(0);
+
+    // ping-pong over loopback
+    int client = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    connect(client, (sockaddr*)&addr, sizeof(addr));
+    const int requests = 100000;
+    char buf[64] = "echo";
+    unsigned long begin = clock_tick();
+    for (int i = 0; i < requests; i++) {
+        send(client, buf, 32, 0);
+        recv(client, buf, sizeof(buf), 0);
+    }
+    unsigned long used = clock_tick() - begin;
+    printf("echo %d requests in %lu ms, %.0f req/s\n", requests, used,
+           used ? requests * 1000.0 / used : 0.0);
+
+    loop->Stop();
+    loop->RemoveWatcher(server);
+    close(client);
+    close(server);
+}
+
+// create objects continuously while the plugin is reloaded
+static volatile bool reload_running = false;
+static long reload_creations = 0;
+static long reload_failures = 0;
+void* ReloadCreateThread(void*) {
+    while (reload_running) {
+        apf::Interface<ISimplePlugin> simple_plugin(CLSID_SimplePlugin);
+        if (simple_plugin) {
+            reload_creations++;
+        } else {
+            reload_failures++;
+        }
+    }
+    return NULL;
+}
+void TestReload() {
+    const char* path = "../simpleplugin/bin/Debug/libsimpleplugin.so";
+    apf::PluginManager::instance()->Load(path);
+
+    pthread_t thread;
+    reload_running = true;
+    begin_thread(&thread, ReloadCreateThread, NULL);
+    for (int i = 0; i < 10; i++) {
+        msleep(20);
+        if (!apf::PluginManager::instance()->Reload(path, NULL, 1000)) {
+            printf("reload failed\n");
+        }
+    }
+    reload_running = false;
+    wait_thread(&thread);
+    printf("reload: %ld creations, %ld failures, %d retired modules in use\n",
+           reload_creations, reload_failures, apf::PluginManager::instance()->ReleaseRetired());
+}
+
+void TestModuleStats() {
+    apf::PluginManager::instance()->Load("../simpleplugin/bin/Debug/libsimpleplugin.so");
+    apf::Interface<ISimplePlugin> p1(CLSID_SimplePlugin);
+    apf::Interface<ISimplePlugin> p2(CLSID_SimplePlugin);
+    p2.Release();
+
+    std::vector<apf::PluginManager::ModuleStats> stats;
+    apf::PluginManager::instance()->GetModuleStats(&stats);
+    for (size_t i = 0; i < stats.size(); i++) {
+        printf("%s%s: live %ld, created %ld, %lu bytes\n", stats[i].path.c_str(), stats[i].retired ? " (retired)" : "",
+               stats[i].live, stats[i].creations, (unsigned long)stats[i].bytes);
+        for (size_t j = 0; j < stats[i].classes.size(); j++) {
+            printf("    %s: live %ld, created %ld, %lu bytes\n", stats[i].classes[j].class_id.c_str(),
+                   stats[i].classes[j].live, stats[i].classes[j].creations, (unsigned long)stats[i].classes[j].bytes);
+        }
+    }
+}
+
+static volatile long load_start = 0;
+static void* ConcurrentLoadThread(void* arg) {
+    while (0 == load_start) {
+        yield();
+    }
+    apf::PluginManager::instance()->Load((const char*)arg);
+    return NULL;
+}
+
+// threads loading the same path share one module image, the objects
+// of its classes are counted by the module that was added
+void TestConcurrentLoad() {
+    const char* path = "../simpleplugin/bin/Debug/libsimpleplugin.so";
+    int failed = 0;
+    for (int round = 0; round < 100; round++) {
+        load_start = 0;
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+            begin_thread(&threads[i], ConcurrentLoadThread, (void*)path);
+        }
+        load_start = 1;
+        for (int i = 0; i < 4; i++) {
+            wait_thread(&threads[i]);
+        }
+        apf::Interface<ISimplePlugin> p(CLSID_SimplePlugin);
+        apf::PluginManager::ModuleStats stats;
+        if (!apf::PluginManager::instance()->GetModuleStats(path, &stats) || 1 != stats.live) {
+            failed++;
+        }
+        p.Release();
+        apf::PluginManager::instance()->UnLoad(path);
+    }
+    printf("concurrent load: %d of 100 rounds miscounted\n", failed);
+}
+
+// resident memory (KB)
+long ResidentKB() {
+    long size = 0, resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (2 != fscanf(fp, "%ld %ld", &size, &resident)) {
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+// run once with eager=1 to generate the manifest, then compare with eager=0
+void TestManifest(bool eager) {
+    long rss = ResidentKB();
+    uint64_t begin = clock_tick_us();
+    if (eager) {
+        apf::PluginManager::instance()->LoadDirectory("../../modules/plugins");
+        apf::PluginManager::instance()->SaveManifest("../../modules/plugins.manifest");
+    } else {
+        apf::PluginManager::instance()->LoadManifest("../../modules/plugins.manifest");
+    }
+    printf("%s startup: %lu us, rss: +%ld KB\n", eager ? "eager" : "manifest",
+           (unsigned long)(clock_tick_us() - begin), ResidentKB() - rss);
+}
+
+void TestLoadAsync() {
+    uint64_t begin = clock_tick_us();
+#ifdef WIN32
+    apf::PluginManager::LoadFuture* log_future = apf::PluginManager::instance()->LoadAsync("../../modules/log/bin/Debug/log.dll");
+    apf::PluginManager::LoadFuture* plugin_future = apf::PluginManager::instance()->LoadAsync("../simpleplugin/bin/Debug/simpleplugin.dll");
+#else
+    apf::PluginManager::LoadFuture* log_future = apf::PluginManager::instance()->LoadAsync("../../modules/log/bin/Debug/liblog.so");
+    apf::PluginManager::LoadFuture* plugin_future = apf::PluginManager::instance()->LoadAsync("../simpleplugin/bin/Debug/libsimpleplugin.so");
+#endif
+    // serve as soon as the critical class is up
+    if (apf::PluginManager::instance()->WaitForClass(CLSID_SimplePlugin, 5000)) {
+        printf("SimplePlugin ready after %lu us\n", (unsigned long)(clock_tick_us() - begin));
+        apf::Interface<ISimplePlugin> simple_plugin(CLSID_SimplePlugin);
+        simple_plugin->test();
+    }
+    log_future->Wait();
+    printf("log %s after %lu us\n", log_future->result().loaded ? "loaded" : "load failed",
+           (unsigned long)(clock_tick_us() - begin));
+    log_future->Release();
+    plugin_future->Release();
+}
+
+void TestStartupProfile() {
+    apf::PluginManager::instance()->EnableProfiler(true);
+    apf::PluginManager::instance()->LoadDirectory("../../modules/plugins");
+    apf::PluginManager::instance()->EnableProfiler(false);
+    // open startup.json in chrome://tracing
+    apf::PluginManager::instance()->SaveProfile("startup.tsv");
+    apf::PluginManager::instance()->SaveProfileTrace("startup.json");
+}
+
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#define LATENCY_THREADS 4
+#define LATENCY_LINES   20000
+struct LatencyTask {
+    ILog* log;
+    std::vector<uint64_t> ns;
+};
+static uint64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static void* LatencyThread(void* arg) {
+    LatencyTask* task = static_cast<LatencyTask*>(arg);
+    for (int i = 0; i < LATENCY_LINES; i++) {
+        uint64_t begin = NowNs();
+        task->log->Info("bench", "line %d of thread %lu", i, thread_id());
+        task->ns.push_back(NowNs() - begin);
+    }
+    return NULL;
+}
+static void RunLogLatency(ILog* log, const char* name) {
+    LatencyTask tasks[LATENCY_THREADS];
+    pthread_t threads[LATENCY_THREADS];
+    uint64_t begin = NowNs();
+    for (int i = 0; i < LATENCY_THREADS; i++) {
+        tasks[i].log = log;
+        begin_thread(&threads[i], LatencyThread, &tasks[i]);
+    }
+    std::vector<uint64_t> ns;
+    for (int i = 0; i < LATENCY_THREADS; i++) {
+        wait_thread(&threads[i]);
+        ns.insert(ns.end(), tasks[i].ns.begin(), tasks[i].ns.end());
+    }
+    log->Flush();
+    uint64_t total = NowNs() - begin;
+    std::sort(ns.begin(), ns.end());
+    size_t n = ns.size();
+    LogStats stats;
+    log->GetStats(&stats);
+    printf("%-18s p50 %6lu ns  p90 %6lu ns  p99 %7lu ns  p99.9 %8lu ns  max %9lu ns  total %lu ms  dropped %ld\n",
+           name, (unsigned long)ns[n / 2], (unsigned long)ns[n * 9 / 10], (unsigned long)ns[n * 99 / 100],
+           (unsigned long)ns[n * 999 / 1000], (unsigned long)ns[n - 1], (unsigned long)(total / 1000000),
+           stats.dropped[LOG_LEVEL_INFO]);
+}
+// caller side latency of sync and async logging to a file
+void TestLogLatency() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const LogOverflowPolicy policies[] = {LOG_OVERFLOW_BLOCK, LOG_OVERFLOW_DROP, LOG_OVERFLOW_DROP_LOWEST};
+    const char* names[] = {"async block", "async drop", "async drop lowest"};
+    for (int i = -1; i < 3; i++) {
+        apf::Interface<ILog> log(CLSID_Log);
+        log->SetFile(".", "latency", LOG_BACKUP_ONE_FILE, 1024*1024*1024);
+        log->SetTargets(LOG_TARGET_FILE);
+        if (i >= 0) {
+            log->SetAsync(true, 65536, policies[i]);
+        }
+        RunLogLatency(log.P(), i < 0 ? "sync" : names[i]);
+    }
+}
+
+// caller side cost of formatting a line (no targets)
+void TestLogFormat() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const LogTimePrecision precisions[] = {LOG_TIME_SECOND, LOG_TIME_MILLISECOND, LOG_TIME_MICROSECOND};
+    const char* names[] = {"second", "millisecond", "microsecond"};
+    const int lines = 1000000;
+    apf::Interface<ILog> log(CLSID_Log);
+    log->SetTargets(0);
+    for (int i = 0; i < 3; i++) {
+        log->SetTimePrecision(precisions[i]);
+        uint64_t begin = NowNs();
+        for (int j = 0; j < lines; j++) {
+            log->Info("bench", "line %d", j);
+        }
+        printf("%-12s %lu ns/line\n", names[i], (unsigned long)((NowNs() - begin) / lines));
+    }
+}
+
+// text vs binary lines written to a file by the writer thread
+// print log/binary.blog with: logviewer log/binary.blog
+void TestLogBinary() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const LogEncoding encodings[] = {LOG_ENCODING_TEXT, LOG_ENCODING_BINARY};
+    const char* names[] = {"text", "binary"};
+    const int lines = 1000000;
+    for (int i = 0; i < 2; i++) {
+        apf::Interface<ILog> log(CLSID_Log);
+        log->SetEncoding(encodings[i]);
+        log->SetFile(".", names[i], LOG_BACKUP_ONE_FILE, 1024*1024*1024);
+        log->SetTargets(LOG_TARGET_FILE);
+        log->SetAsync(true, 65536, LOG_OVERFLOW_BLOCK);
+        uint64_t begin = NowNs();
+        for (int j = 0; j < lines; j++) {
+            log->Info("bench", "request %d from %s done in %.3f ms, status %u", j, "10.0.0.1", j * 0.001, 200u);
+        }
+        uint64_t caller = NowNs() - begin;
+        log->Flush();
+        uint64_t total = NowNs() - begin;
+        printf("%-8s caller %lu ns/line  total %lu ns/line\n", names[i],
+               (unsigned long)(caller / lines), (unsigned long)(total / lines));
+    }
+}
+
+// global Warn, Debug for tag "net" only
+void TestLogLevel() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    apf::Interface<ILog> log(CLSID_Log);
+    log->SetTargets(LOG_TARGET_CONSOLE);
+    log->SetLevel(LOG_LEVEL_WARN);
+    log->SetTagLevel("net", LOG_LEVEL_DEBUG);
+
+    APF_LOG_DEBUG(log, "net", "shown: debug of net");
+    APF_LOG_DEBUG(log, "disk", "hidden: debug of disk");
+    APF_LOG_WARN(log, "disk", "shown: warning of disk");
+    log->Info("disk", "hidden: info of disk");
+
+    // cost of a filtered line
+    const int lines = 10000000;
+    uint64_t begin = NowNs();
+    for (int i = 0; i < lines; i++) {
+        APF_LOG_DEBUG(log, "disk", "line %d", i);
+    }
+    printf("filtered APF_LOG_DEBUG %.2f ns/line\n", (double)(NowNs() - begin) / lines);
+    begin = NowNs();
+    for (int i = 0; i < lines; i++) {
+        log->Debug("disk", "line %d", i);
+    }
+    printf("filtered Debug() %.2f ns/line\n", (double)(NowNs() - begin) / lines);
+
+    log->ClearTagLevel("net");
+    APF_LOG_DEBUG(log, "net", "hidden: debug of net after ClearTagLevel");
+}
+
+// call sites used by logs created one after another
+static void LogAtCallSite(apf::Interface<ILog>& log, int round) {
+    APF_LOG_DEBUG(log, "net", "round %d: debug of net", round);
+    // bursts of 2 lines in every log, the others are suppressed
+    for (int i = 0; i < 10; i++) {
+        APF_LOG_LIMIT_AT(log, LOG_LEVEL_WARN, "rpc", 1, 2, 0, "round %d: call %d timed out", round, i);
+    }
+}
+
+// a call site resolves its cell and limit again after the log is destroyed
+void TestLogCallSites() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    for (int round = 0; round < 3; round++) {
+        apf::Interface<ILog> log(CLSID_Log);
+        log->SetTargets(LOG_TARGET_CONSOLE);
+        // shown in round 1 only
+        log->SetLevel((1 == round) ? LOG_LEVEL_DEBUG : LOG_LEVEL_WARN);
+        LogAtCallSite(log, round);
+        // "suppressed 8 lines" in every round
+        log->Flush();
+    }
+}
+
+// a sink slower than the file, e.g. a remote collector
+class SlowSink : public ILogSink {
+public:
+    SlowSink() : lines_(0) {}
+    virtual void Write(const LogLine* lines, int count) {
+        (void)lines;
+        lines_ += count;
+    }
+    virtual void Flush() {
+        msleep(5);
+    }
+    long lines_;
+};
+// file target is not stalled by a slow sink with its own queue
+void TestLogSinks() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const int lines = 100000;
+    const int slow_target = LOG_TARGET_USER;
+    SlowSink sink;
+    {
+        apf::Interface<ILog> log(CLSID_Log);
+        log->SetFile(".", "sinks", LOG_BACKUP_ONE_FILE, 1024*1024*1024);
+        log->AddSink(slow_target, &sink);
+        log->SetSinkQueue(slow_target, 8192, 1024, LOG_OVERFLOW_DROP_LOWEST);
+        log->SetTargets(LOG_TARGET_FILE | slow_target);
+        log->SetAsync(true, 65536, LOG_OVERFLOW_BLOCK);
+        uint64_t begin = NowNs();
+        for (int i = 0; i < lines; i++) {
+            log->Info("bench", "line %d", i);
+        }
+        log->Warn("bench", "last line");
+        log->Flush();
+        printf("total %lu ns/line\n", (unsigned long)((NowNs() - begin) / lines));
+
+        const int targets[] = {LOG_TARGET_FILE, slow_target};
+        const char* names[] = {"file", "slow"};
+        for (int i = 0; i < 2; i++) {
+            LogSinkStats stats;
+            log->GetSinkStats(targets[i], &stats);
+            printf("%-5s written %ld  dropped %ld  blocked %ld  batches %ld  write %lu us  max %lu us\n",
+                   names[i], stats.written, stats.dropped, stats.blocked, stats.batches,
+                   (unsigned long)stats.write_us, (unsigned long)stats.max_write_us);
+        }
+        log->RemoveSink(slow_target);
+    }
+    printf("slow sink got %ld lines\n", sink.lines_);
+}
+
+// lines shipped to logviewer over UDP, start logviewer first,
+// it reports lost datagrams
+void TestLogNet() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const int lines = 200000;
+    apf::Interface<ILog> log(CLSID_Log);
+    log->SetTargets(LOG_TARGET_NET);
+    log->SetAddr("127.0.0.1", 4096);
+    // lines of a writer batch share datagrams
+    log->SetAsync(true, 65536, LOG_OVERFLOW_BLOCK);
+    uint64_t begin = NowNs();
+    for (int i = 0; i < lines; i++) {
+        log->Info("bench", "request %d from %s done, status %u", i, "10.0.0.1", 200u);
+    }
+    log->Flush();
+    printf("%d lines in %lu ms\n", lines, (unsigned long)((NowNs() - begin) / 1000000));
+}
+
+// sustained MB/s and write latency of the stdio and mmap file writers
+// (time spent in the file sink, lines are formatted by the callers)
+void TestLogFileWriter() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const LogFileWriter writers[] = {LOG_FILE_STDIO, LOG_FILE_MMAP};
+    const char* names[] = {"stdio", "mmap"};
+    const int lines = 2000000;
+    // "YYYY-MM-DD HH:MI:SS Info: [bench] " + message + "\n\0"
+    char message[128];
+    int  line_len = 34 + snprintf(message, sizeof(message), "line %08d of the file writer benchmark, %s", 0, "padding") + 2;
+    for (int i = 0; i < 2; i++) {
+        apf::Interface<ILog> log(CLSID_Log);
+        log->SetFileWriter(writers[i], 0);
+        log->SetFile(".", names[i], LOG_BACKUP_ONE_FILE, 1024*1024*1024);
+        log->SetTargets(LOG_TARGET_FILE);
+        log->SetAsync(true, 65536, LOG_OVERFLOW_BLOCK);
+        std::vector<uint64_t> ns;
+        ns.reserve(lines);
+        for (int j = 0; j < lines; j++) {
+            uint64_t line_begin = NowNs();
+            log->Info("bench", "line %08d of the file writer benchmark, %s", j, "padding");
+            ns.push_back(NowNs() - line_begin);
+        }
+        log->Flush();
+        std::sort(ns.begin(), ns.end());
+        LogSinkStats stats;
+        log->GetSinkStats(LOG_TARGET_FILE, &stats);
+        // a short run may write in no measurable time
+        double mb_per_s = (stats.write_us > 0) ? (double)lines * line_len / stats.write_us : 0;
+        unsigned long batch_us = (stats.batches > 0) ? (unsigned long)(stats.write_us / stats.batches) : 0;
+        printf("%-6s %.0f MB/s  batch avg %lu us  max %lu us  caller p99 %lu ns  p99.99 %lu ns\n", names[i],
+               mb_per_s, batch_us, (unsigned long)stats.max_write_us, (unsigned long)ns[lines * 99 / 100],
+               (unsigned long)ns[lines / 10000 * 9999]);
+    }
+}
+
+// the file is rotated every 8MB and the backup is compressed by gzip,
+// both in the background: the file sink never renames, opens or compresses
+void TestLogRotation() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const int lines = 500000;
+    apf::Interface<ILog> log(CLSID_Log);
+    log->SetFile(".", "rotation", LOG_BACKUP_ONE_FILE, 8*1024*1024);
+    log->SetFileRetention(2, 0, "gzip -f");
+    log->SetTargets(LOG_TARGET_FILE);
+    log->SetAsync(true, 65536, LOG_OVERFLOW_BLOCK);
+    for (int i = 0; i < lines; i++) {
+        log->Info("bench", "line %08d of the rotation benchmark", i);
+    }
+    log->Flush();
+    LogSinkStats stats;
+    log->GetSinkStats(LOG_TARGET_FILE, &stats);
+    printf("written %ld  batches %ld  write %lu us  max %lu us\n", stats.written, stats.batches,
+           (unsigned long)stats.write_us, (unsigned long)stats.max_write_us);
+}
+
+#define DURABILITY_THREADS 4
+#define DURABILITY_LINES   20000
+struct DurabilityTask {
+    ILog* log;
+    // every errors-th line is an Error (0: none)
+    int errors;
+};
+static void* DurabilityThread(void* arg) {
+    DurabilityTask* task = static_cast<DurabilityTask*>(arg);
+    for (int i = 1; i <= DURABILITY_LINES; i++) {
+        if (task->errors > 0 && 0 == i % task->errors) {
+            task->log->Error("bench", "line %d of thread %lu failed", i, thread_id());
+        } else {
+            task->log->Info("bench", "line %d of thread %lu", i, thread_id());
+        }
+    }
+    return NULL;
+}
+// throughput of the durability levels of the file target, sync logging
+// from DURABILITY_THREADS threads: Error calls waiting for a sync at the
+// same time share it
+void TestLogDurability() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const LogDurability levels[] = {LOG_DURABILITY_NONE, LOG_DURABILITY_FLUSH, LOG_DURABILITY_SYNC,
+                                    LOG_DURABILITY_NONE, LOG_DURABILITY_NONE};
+    const bool sync_errors[] = {false, false, false, true, true};
+    const int  errors[] = {0, 0, 0, 1000, 100};
+    const char* names[] = {"none", "flush", "sync 10ms/1MB", "sync 0.1% errors", "sync 1% errors"};
+    for (int i = 0; i < 5; i++) {
+        apf::Interface<ILog> log(CLSID_Log);
+        log->SetFile(".", "durability", LOG_BACKUP_ONE_FILE, 1024*1024*1024);
+        log->SetFileDurability(levels[i], 10, 1024*1024, sync_errors[i]);
+        log->SetTargets(LOG_TARGET_FILE);
+        DurabilityTask tasks[DURABILITY_THREADS];
+        pthread_t threads[DURABILITY_THREADS];
+        uint64_t begin = NowNs();
+        for (int j = 0; j < DURABILITY_THREADS; j++) {
+            tasks[j].log = log.P();
+            tasks[j].errors = errors[i];
+            begin_thread(&threads[j], DurabilityThread, &tasks[j]);
+        }
+        for (int j = 0; j < DURABILITY_THREADS; j++) {
+            wait_thread(&threads[j]);
+        }
+        log->Flush();
+        uint64_t total = NowNs() - begin;
+        int lines = DURABILITY_THREADS * DURABILITY_LINES;
+        printf("%-18s %8.0f lines/s  total %lu ms\n", names[i],
+               (double)lines * 1000000000 / total, (unsigned long)(total / 1000000));
+    }
+}
+
+// Debug lines are not logged but kept by the flight recorder, an Error
+// dumps the recent lines of its thread to the file
+void TestLogRecorder() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    apf::Interface<ILog> log(CLSID_Log);
+    log->SetFile(".", "recorder", LOG_BACKUP_ONE_FILE, 1024*1024*1024);
+    log->SetTargets(LOG_TARGET_FILE);
+    log->SetLevel(LOG_LEVEL_INFO);
+
+    // cost of a filtered line without and with the recorder
+    const int lines = 1000000;
+    uint64_t begin = NowNs();
+    for (int i = 0; i < lines; i++) {
+        APF_LOG_DEBUG(log, "disk", "read block %d", i);
+    }
+    printf("filtered APF_LOG_DEBUG %.2f ns/line\n", (double)(NowNs() - begin) / lines);
+    log->SetRecorder(LOG_LEVEL_DEBUG, 64*1024, 20, LOG_DUMP_THREAD);
+    begin = NowNs();
+    for (int i = 0; i < lines; i++) {
+        APF_LOG_DEBUG(log, "disk", "read block %d", i);
+    }
+    printf("recorded APF_LOG_DEBUG %.2f ns/line\n", (double)(NowNs() - begin) / lines);
+
+    APF_LOG_INFO(log, "disk", "shown: info of disk");
+    for (int i = 0; i < 100; i++) {
+        APF_LOG_DEBUG(log, "disk", "hidden until the error: step %d of %s", i, "recovery");
+    }
+    // the last 20 lines recorded are dumped after it
+    APF_LOG_ERROR(log, "disk", "recovery failed");
+
+    APF_LOG_DEBUG(log, "disk", "dumped on demand");
+    log->DumpRecorder();
+    // the crash file gets all lines still in the rings
+    log->DumpRecorderOnCrash();
+    log->Flush();
+}
+
+#define CONTENTION_LINES 200000
+struct ContentionTask {
+    ILog* log;
+    // lines logged by the thread
+    int lines;
+};
+static void* ContentionThread(void* arg) {
+    ContentionTask* task = static_cast<ContentionTask*>(arg);
+    for (int i = 0; i < task->lines; i++) {
+        task->log->Info("bench", "line %d of thread %lu", i, thread_id());
+    }
+    return NULL;
+}
+// throughput of CONTENTION_LINES lines logged by 1 to 64 threads: sync logging
+// (Log::mutex_), async logging with the shared ring, and with a buffer per thread
+void TestLogThreadBuffers() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const int  counts[] = {1, 8, 32, 64};
+    const char* names[] = {"mutex", "ring", "thread buffers"};
+    for (int mode = 0; mode < 3; mode++) {
+        for (int i = 0; i < 4; i++) {
+            apf::Interface<ILog> log(CLSID_Log);
+            log->SetFile(".", "contention", LOG_BACKUP_ONE_FILE, 1024*1024*1024);
+            log->SetTargets(LOG_TARGET_FILE);
+            if (mode > 0) {
+                log->SetAsync(true, 64*1024, LOG_OVERFLOW_BLOCK);
+            }
+            if (2 == mode) {
+                log->SetThreadBuffers(1024*1024, 1000);
+            }
+            ContentionTask tasks[64];
+            pthread_t threads[64];
+            uint64_t begin = NowNs();
+            for (int j = 0; j < counts[i]; j++) {
+                tasks[j].log = log.P();
+                tasks[j].lines = CONTENTION_LINES / counts[i];
+                begin_thread(&threads[j], ContentionThread, &tasks[j]);
+            }
+            for (int j = 0; j < counts[i]; j++) {
+                wait_thread(&threads[j]);
+            }
+            uint64_t caller = NowNs() - begin;
+            log->Flush();
+            uint64_t total = NowNs() - begin;
+            printf("%-15s %2d threads  callers %8.0f lines/s  total %8.0f lines/s\n", names[mode], counts[i],
+                   (double)CONTENTION_LINES * 1000000000 / caller, (double)CONTENTION_LINES * 1000000000 / total);
+        }
+    }
+}
+
+// structured lines in every encoding, e.g. select the slow requests of the
+// binary file with: logviewer fields-binary.blog "ms>100" status!=200
+void TestLogFields() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    const LogEncoding encodings[] = {LOG_ENCODING_TEXT, LOG_ENCODING_JSON, LOG_ENCODING_LOGFMT, LOG_ENCODING_BINARY};
+    const char* names[] = {"fields-text", "fields-json", "fields-logfmt", "fields-binary"};
+    const int lines = 1000000;
+    for (int i = 0; i < 4; i++) {
+        apf::Interface<ILog> log(CLSID_Log);
+        log->SetEncoding(encodings[i]);
+        log->SetFile(".", names[i], LOG_BACKUP_ONE_FILE, 1024*1024*1024);
+        log->SetTargets(LOG_TARGET_FILE | LOG_TARGET_CONSOLE);
+
+        LogFields fields;
+        fields.Str("peer", "10.0.0.1").Int("status", 404).Double("ms", 120.5).Bool("retry", true);
+        log->WriteFields(LOG_LEVEL_WARN, "http", "request \"GET /\" failed", fields);
+        // printf lines are written in the same encoding
+        log->Info("http", "%d requests", 2);
+
+        log->SetTargets(LOG_TARGET_FILE);
+        log->SetAsync(true, 65536, LOG_OVERFLOW_BLOCK);
+        uint64_t begin = NowNs();
+        for (int j = 0; j < lines; j++) {
+            LogFields request;
+            request.Int("id", j).Str("peer", "10.0.0.1").Double("ms", j * 0.001).Int("status", 200);
+            log->WriteFields(LOG_LEVEL_INFO, "bench", "request done", request);
+        }
+        uint64_t fields_ns = NowNs() - begin;
+        begin = NowNs();
+        for (int j = 0; j < lines; j++) {
+            log->Info("bench", "request %d from %s done in %.3f ms, status %u", j, "10.0.0.1", j * 0.001, 200u);
+        }
+        uint64_t printf_ns = NowNs() - begin;
+        log->Flush();
+        printf("%-14s WriteFields %lu ns/line  Info %lu ns/line\n", names[i],
+               (unsigned long)(fields_ns / lines), (unsigned long)(printf_ns / lines));
+    }
+}
+
+// lines longer than MAX_LOG_LEN (e.g. request dumps) are written whole,
+// short lines still use no heap
+void TestLogLongLines() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+
+    std::vector<char> body(256 * 1024, 'x');
+    body.back() = '\0';
+    const char* names[] = {"long-sync", "long-async", "long-binary"};
+    const int lines = 100000;
+    for (int i = 0; i < 3; i++) {
+        apf::Interface<ILog> log(CLSID_Log);
+        if (2 == i) {
+            log->SetEncoding(LOG_ENCODING_BINARY);
+        }
+        log->SetFile(".", names[i], LOG_BACKUP_ONE_FILE, 1024*1024*1024);
+        log->SetTargets(LOG_TARGET_FILE);
+        if (i > 0) {
+            log->SetAsync(true, 65536, LOG_OVERFLOW_BLOCK);
+        }
+        log->Info("http", "request body (%d bytes): %s", (int)strlen(&body[0]), &body[0]);
+        LogFields fields;
+        fields.Int("status", 200).Str("body", &body[0]);
+        log->WriteFields(LOG_LEVEL_INFO, "http", "response", fields);
+
+        uint64_t begin = NowNs();
+        for (int j = 0; j < lines; j++) {
+            log->Info("bench", "request %d from %s done in %.3f ms, status %u", j, "10.0.0.1", j * 0.001, 200u);
+        }
+        uint64_t short_ns = NowNs() - begin;
+        begin = NowNs();
+        for (int j = 0; j < lines / 100; j++) {
+            log->Info("bench", "request %d body %.4000s", j, &body[0]);
+        }
+        uint64_t long_ns = NowNs() - begin;
+        log->Flush();
+        printf("%-12s short %lu ns/line  4 KB %lu ns/line\n", names[i],
+               (unsigned long)(short_ns / lines), (unsigned long)(long_ns / (lines / 100)));
+    }
+}
+
+// an error storm: a tag limit and a call site limit keep a few lines per second,
+// the rest is dropped before it is formatted and reported as "suppressed N lines"
+void TestLogLimits() {
+    apf::PluginManager::instance()->Load("../../modules/log/bin/Debug/liblog.so");
+    apf::Interface<ILog> log(CLSID_Log);
+    log->SetFile(".", "limits", LOG_BACKUP_ONE_FILE, 100*1024*1024);
+    log->SetTargets(LOG_TARGET_FILE | LOG_TARGET_CONSOLE);
+    // 5 lines per second of "db", bursts of 10
+    log->SetTagLimit("db", 5, 10, 0);
+
+    uint64_t begin = NowNs();
+    uint64_t end = begin + 3000000000ull;
+    int i = 0;
+    while (NowNs() < end) {
+        for (int j = 0; j < 1000; j++, i++) {
+            log->Error("db", "query %d failed: %s", i, "connection refused");
+            // 1 in 100000 lines of the call site, at most 2 per second
+            APF_LOG_LIMIT_AT(log, LOG_LEVEL_ERROR, "rpc", 2, 2, 100000, "call %d timed out", i);
+        }
+    }
+    uint64_t ns = NowNs() - begin;
+    log->Flush();
+    LogStats stats;
+    log->GetStats(&stats);
+    printf("%d lines in %lu ms, %ld written, %ld suppressed, %lu ns per suppressed line\n",
+           i * 2, (unsigned long)(ns / 1000000), stats.written, stats.suppressed,
+           (unsigned long)(ns / (i * 2)));
+}
+
 int main() {
 	apf::PluginManager::instance()->SetVersion(1, 0);
 
@@ -126,6 +873,50 @@ int main() {
 
     //TestConfig();
 
+    //TestEventLoop();
+
+    //TestManifest(true);
+
+    //TestReload();
+
+    //TestModuleStats();
+
+    //TestConcurrentLoad();
+
+    //TestLoadAsync();
+
+    //TestStartupProfile();
+
+    //TestLogLatency();
+
+    //TestLogFormat();
+
+    //TestLogBinary();
+
+    //TestLogLevel();
+
+    //TestLogCallSites();
+
+    //TestLogSinks();
+
+    //TestLogNet();
+
+    //TestLogFileWriter();
+
+    //TestLogRotation();
+
+    //TestLogDurability();
+
+    //TestLogRecorder();
+
+    //TestLogThreadBuffers();
+
+    //TestLogFields();
+
+    //TestLogLongLines();
+
+    //TestLogLimits();
+
 	int d;
 	scanf("%d", &d);
 
@@ -16,14 +16,47 @@
  *
  ***************************************************************************/
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
 #include "class.h"
 #include "oscore.h"
+#include "objectcounter.h"
 
 namespace apf {
 static pthread_mutex_t global_mutex;
 static int init_global_mutex_ret = init_mutex(&global_mutex);
 // class entry map
 std::map<const APFClassID, ClassEntry> Class::class_map_;
+// stub class loader
+ClassLoaderFunc Class::class_loader_ = NULL;
+// sorted static classes
+std::vector<const StaticClassEntry*> Class::static_classes_;
+bool Class::static_classes_sorted_ = false;
+
+#if defined(__GNUC__) && !defined(WIN32)
+// APF_STATIC_CLASSES_SECTION bounds defined by the linker, NULL without static modules
+extern "C" const StaticClassEntry __start_apf_static_classes[] __attribute__((weak));
+extern "C" const StaticClassEntry __stop_apf_static_classes[] __attribute__((weak));
+#endif
+
+// order static classes by class id
+static bool StaticClassLess(const StaticClassEntry* left, const StaticClassEntry* right) {
+    return strcmp(left->clsid, right->clsid) < 0;
+}
+
+static bool StaticClassIdLess(const StaticClassEntry* entry, const char* class_id) {
+    return strcmp(entry->clsid, class_id) < 0;
+}
+
+// create object of a static class
+static void* CreateStaticObject(const StaticClassEntry* entry, ClassEntry* class_info) {
+    void* p_interface = entry->create_object();
+    if (p_interface) {
+        *class_info = ClassEntry(entry->class_name, entry->clsid, entry->create_object,
+                                 entry->destroy_object, entry->query_interface, entry->object_size);
+    }
+    return p_interface;
+}
 
 // register class entry
 bool Class::RegisterClass(const ClassEntry& class_entry, bool replace) {
@@ -45,6 +78,45 @@ bool Class::RegisterClass(const ClassEntry& class_entry, bool replace) {
     return ret;
 }
 
+// register class tables in one registry update
+int Class::RegisterClasses(const std::vector<const ClassEntry*>& class_tables, bool replace) {
+    assert(0 == init_global_mutex_ret);
+
+    int register_size = 0;
+    const ClassEntry empty_class;
+
+    lock_mutex(&global_mutex);
+    for (size_t i = 0; i < class_tables.size(); i++) {
+        const ClassEntry* classes = class_tables[i];
+        while (classes && (!classes->equals(empty_class))) {
+            std::map<const APFClassID, ClassEntry>::iterator it = class_map_.find(classes->clsid);
+            if (class_map_.end() == it) {
+                class_map_.insert(std::map<const APFClassID, ClassEntry>::value_type(classes->clsid, *classes));
+                register_size++;
+            } else if (replace) {
+                it->second = *classes;
+                register_size++;
+            }
+            classes++;
+        }
+    }
+    unlock_mutex(&global_mutex);
+
+    return register_size;
+}
+
+// register a stub class
+bool Class::RegisterStubClass(const APFClassID& class_id) {
+    return RegisterClass(ClassEntry("Stub", class_id, NULL, NULL, NULL), false);
+}
+
+// set stub class loader
+void Class::SetClassLoader(ClassLoaderFunc loader) {
+    lock_mutex(&global_mutex);
+    class_loader_ = loader;
+    unlock_mutex(&global_mutex);
+}
+
 // unregister class
 void Class::UnRegisterClass(const ClassEntry& class_entry) {
     lock_mutex(&global_mutex);
@@ -68,16 +140,46 @@ void Class::UnRegisterClass(const APFClassID& class_id) {
 // create an object with class id and interface id
 void* Class::CreateObject(const APFClassID& class_id, ClassEntry* class_info) {
     void* p_interface = NULL;
+    ClassLoaderFunc loader = NULL;
     lock_mutex(&global_mutex);
     std::map<const APFClassID, ClassEntry>::iterator it = class_map_.find(class_id);
     if (class_map_.end() != it) {
-        p_interface = it->second.create_object();
-        if (p_interface) {
-            *class_info = it->second;
+        if (NULL != it->second.create_object) {
+            p_interface = it->second.create_object();
+            if (p_interface) {
+                *class_info = it->second;
+                if (class_info->counter) {
+                    class_info->counter->Created();
+                }
+            }
+        } else {
+            // stub class
+            loader = class_loader_;
+        }
+    } else {
+        const StaticClassEntry* static_class = FindStaticClass(class_id);
+        if (NULL != static_class) {
+            p_interface = CreateStaticObject(static_class, class_info);
         }
     }
     unlock_mutex(&global_mutex);
 
+    // load the real class outside the lock, the loader registers classes
+    if (NULL != loader && loader(class_id)) {
+        lock_mutex(&global_mutex);
+        it = class_map_.find(class_id);
+        if (class_map_.end() != it && NULL != it->second.create_object) {
+            p_interface = it->second.create_object();
+            if (p_interface) {
+                *class_info = it->second;
+                if (class_info->counter) {
+                    class_info->counter->Created();
+                }
+            }
+        }
+        unlock_mutex(&global_mutex);
+    }
+
     return p_interface;
 }
 
@@ -85,6 +187,9 @@ void* Class::CreateObject(const APFClassID& class_id, ClassEntry* class_info) {
 void Class::DestroyObject(void* object, ClassEntry* class_info) {
     if (NULL != class_info->destroy_object) {
         class_info->destroy_object(object);
+        if (class_info->counter) {
+            class_info->counter->Destroyed();
+        }
     }
 }
 
@@ -93,7 +198,7 @@ bool Class::HasClass(const APFClassID& class_id) {
     bool ret = false;
 
     lock_mutex(&global_mutex);
-    if (class_map_.end() != class_map_.find(class_id)) {
+    if (class_map_.end() != class_map_.find(class_id) || NULL != FindStaticClass(class_id)) {
         ret = true;
     }
     unlock_mutex(&global_mutex);
@@ -101,4 +206,50 @@ bool Class::HasClass(const APFClassID& class_id) {
     return ret;
 }
 
+bool Class::IsClassLoaded(const APFClassID& class_id) {
+    bool ret = false;
+
+    lock_mutex(&global_mutex);
+    std::map<const APFClassID, ClassEntry>::iterator it = class_map_.find(class_id);
+    if (class_map_.end() != it) {
+        ret = (NULL != it->second.create_object);
+    } else {
+        ret = (NULL != FindStaticClass(class_id));
+    }
+    unlock_mutex(&global_mutex);
+
+    return ret;
+}
+
+int Class::StaticClassCount() {
+#if defined(__GNUC__) && !defined(WIN32)
+    if (NULL != __start_apf_static_classes) {
+        return (int)(__stop_apf_static_classes - __start_apf_static_classes);
+    }
+#endif
+    return 0;
+}
+
+const StaticClassEntry* Class::FindStaticClass(const APFClassID& class_id) {
+#if defined(__GNUC__) && !defined(WIN32)
+    if (NULL == __start_apf_static_classes) {
+        return NULL;
+    }
+    if (!static_classes_sorted_) {
+        // merged by the linker in link order, sort once
+        for (const StaticClassEntry* entry = __start_apf_static_classes; entry < __stop_apf_static_classes; entry++) {
+            static_classes_.push_back(entry);
+        }
+        std::sort(static_classes_.begin(), static_classes_.end(), StaticClassLess);
+        static_classes_sorted_ = true;
+    }
+    std::vector<const StaticClassEntry*>::const_iterator it = std::lower_bound(
+        static_classes_.begin(), static_classes_.end(), class_id.c_str(), StaticClassIdLess);
+    if (static_classes_.end() != it && 0 == strcmp((*it)->clsid, class_id.c_str())) {
+        return *it;
+    }
+#endif
+    return NULL;
+}
+
 } // namespace
@@ -27,6 +27,9 @@
 #ifndef WIN32
 //#include <sys/wait.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 
 UEndianTest g_endianTest={(long)1};
@@ -93,6 +96,23 @@ unsigned long clock_tick() {
     return GetTickCount();
 }
 
+uint64_t clock_tick_us() {
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart * 1000000.0 / freq.QuadPart);
+}
+
+int cpu_count() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+unsigned long thread_id() {
+    return (unsigned long)GetCurrentThreadId();
+}
+
 void yield() {
     // zero sleep is bad if we have high priority threads, they
     //  won't relinquish the timeslice for lower priority ones
@@ -153,6 +173,37 @@ unsigned long clock_tick() {
     return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
 }
 
+uint64_t clock_tick_us() {
+    struct timespec ts;
+
+    #ifdef __MACH__
+        clock_serv_t cclock;
+        mach_timespec_t mts;
+        host_get_clock_service(mach_host_self(), SYSTEM_CLOCK, &cclock);
+        clock_get_time(cclock, &mts);
+        mach_port_deallocate(mach_task_self(), cclock);
+        ts.tv_sec = mts.tv_sec;
+        ts.tv_nsec = mts.tv_nsec;
+    #else
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    #endif
+
+    return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+int cpu_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+unsigned long thread_id() {
+#ifdef __linux__
+    return (unsigned long)syscall(SYS_gettid);
+#else
+    return (unsigned long)pthread_self();
+#endif
+}
+
 int init_semaphore(sem_t *psem, unsigned int initcount) {
     memset(psem, 0, sizeof(sem_t));
 #ifdef __APPLE__
@@ -202,8 +253,12 @@ int wait_semaphore(sem_t	*psem, unsigned long waittime) {
         clock_gettime(CLOCK_REALTIME, &ts);
     #endif
 
-    ts.tv_sec = time(NULL) + waittime /1000;
-    ts.tv_nsec += (waittime % 1000 ) * 1000;
+    ts.tv_sec += waittime /1000;
+    ts.tv_nsec += (waittime % 1000 ) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
 
 #ifdef __APPLE__
     /*
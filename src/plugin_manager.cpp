@@ -16,10 +16,16 @@
  *
  ***************************************************************************/
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #ifdef WIN32
 //#include <windows.h>
 #else
 #include <dlfcn.h>
+#include <link.h>
+#include <dirent.h>
+#include <elf.h>
+#include <sys/mman.h>
 #endif
 
 #include "plugin_manager.h"
@@ -27,6 +33,8 @@
 #include "classentry.h"
 #include "class.h"
 #include "module.h"
+#include "oscore.h"
+#include "objectcounter.h"
 
 namespace apf {
 
@@ -34,116 +42,1415 @@ namespace apf {
 #define MAX_PATH 256
 #endif
 
-PluginManager* PluginManager::instance_ = NULL;
+#ifdef WIN32
+#define getpid GetCurrentProcessId
+#define snprintf _snprintf
+#endif
+
+PluginManager* volatile PluginManager::instance_ = NULL;
+
+#ifndef WIN32
+namespace {
+// relocations of the shared object at base, see dl_iterate_phdr()
+struct RelocationCount {
+    ElfW(Addr) base;
+    long relocations;
+    long relative_relocations;
+};
+
+int CountRelocations(struct dl_phdr_info* info, size_t size, void* data) {
+    RelocationCount* count = static_cast<RelocationCount*>(data);
+    if (info->dlpi_addr != count->base) {
+        return 0;
+    }
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        if (PT_DYNAMIC != info->dlpi_phdr[i].p_type) {
+            continue;
+        }
+        ElfW(Addr) rela_size = 0, rela_entry = sizeof(ElfW(Rela));
+        ElfW(Addr) rel_size = 0, rel_entry = sizeof(ElfW(Rel));
+        ElfW(Addr) plt_size = 0, plt_type = DT_RELA;
+        const ElfW(Dyn)* dyn = (const ElfW(Dyn)*)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+        for (; DT_NULL != dyn->d_tag; dyn++) {
+            switch (dyn->d_tag) {
+            case DT_RELASZ:   rela_size = dyn->d_un.d_val; break;
+            case DT_RELAENT:  rela_entry = dyn->d_un.d_val; break;
+            case DT_RELSZ:    rel_size = dyn->d_un.d_val; break;
+            case DT_RELENT:   rel_entry = dyn->d_un.d_val; break;
+            case DT_PLTRELSZ: plt_size = dyn->d_un.d_val; break;
+            case DT_PLTREL:   plt_type = dyn->d_un.d_val; break;
+            case DT_RELACOUNT:
+            case DT_RELCOUNT: count->relative_relocations += (long)dyn->d_un.d_val; break;
+            }
+        }
+        count->relocations += (long)(rela_size / rela_entry + rel_size / rel_entry);
+        count->relocations += (long)(plt_size / (DT_RELA == plt_type ? sizeof(ElfW(Rela)) : sizeof(ElfW(Rel))));
+    }
+    return 1;
+}
+
+// shared objects loaded by the process so far
+int CountLoads(struct dl_phdr_info* info, size_t size, void* data) {
+    *static_cast<unsigned long long*>(data) = info->dlpi_adds;
+    return 1;
+}
+} // namespace
+#endif
 
 PluginManager::PluginManager()
 {
     major_version_ = 0;
     sub_version_ = 0;
+    async_idle_ = 0;
+    async_stop_ = false;
+    profiling_ = false;
+    profile_begin_ = 0;
+    init_mutex(&mutex_);
+    init_semaphore(&async_sem_, 0);
 }
 
 PluginManager::~PluginManager()
 {
-    //dtor
+    // loader threads finish the queued loads first
+    lock_mutex(&mutex_);
+    async_stop_ = true;
+    unlock_mutex(&mutex_);
+    for (size_t i = 0; i < async_threads_.size(); i++) {
+        post_semaphore(&async_sem_);
+    }
+    for (size_t i = 0; i < async_threads_.size(); i++) {
+        wait_thread(&async_threads_[i]);
+    }
+    uninit_semaphore(&async_sem_);
+    uninit_mutex(&mutex_);
 }
 
 void PluginManager::SetVersion(unsigned short major, unsigned short sub) {
+    lock_mutex(&mutex_);
     major_version_ = major;
     sub_version_ = sub;
+    unlock_mutex(&mutex_);
 }
 
 bool PluginManager::Load(const char* path) {
+    return LoadModule(path, NULL);
+}
+
+bool PluginManager::LoadModule(const char* path, LoadResult* result) {
+    if (NULL != result) {
+        result->path = path;
+        result->loaded = false;
+        result->open_time = 0;
+        result->init_time = 0;
+        result->class_count = 0;
+    }
     APF_DEBUG("loading module %s\n", path);
-    if (modules_.end() != modules_.find(path)) {
+    if (IsLoaded(path)) {
         APF_DEBUG("load module failed (alread loaded)\n");
         return false;
     }
 
+    // open outside the lock, dlopen and module initialization may be slow
+    ModuleItem item;
+    if (!OpenModule(path, &item, result) || !AddModule(path, item)) {
+        return false;
+    }
+
+    if (NULL != result) {
+        result->loaded = true;
+    }
+    APF_DEBUG("loaded module %s\n", path);
+
+    return true;
+}
+
+PluginManager::LoadFuture::LoadFuture(const char* path, LoadCallback* callback) {
+    // released by the caller and the loader thread
+    ref_ = 2;
+    done_ = false;
+    callback_ = callback;
+    result_.path = path;
+    result_.loaded = false;
+    result_.open_time = 0;
+    result_.init_time = 0;
+    result_.class_count = 0;
+    init_semaphore(&sem_, 0);
+}
+
+PluginManager::LoadFuture::~LoadFuture() {
+    uninit_semaphore(&sem_);
+}
+
+bool PluginManager::LoadFuture::Wait(unsigned long wait_time) {
+    if (done_) {
+        return true;
+    }
+    if (0 == wait_semaphore(&sem_, wait_time)) {
+        // keep it signaled for other waiters
+        post_semaphore(&sem_);
+    }
+    return done_;
+}
+
+void PluginManager::LoadFuture::AddRef() {
+    atomic_inc(&ref_);
+}
+
+void PluginManager::LoadFuture::Release() {
+    if (0 == atomic_dec(&ref_)) {
+        delete this;
+    }
+}
+
+void PluginManager::LoadFuture::Complete(const LoadResult& result) {
+    result_ = result;
+    if (NULL != callback_) {
+        callback_->OnLoaded(result_);
+    }
+    done_ = true;
+    post_semaphore(&sem_);
+}
+
+PluginManager::LoadFuture* PluginManager::LoadAsync(const char* path, LoadCallback* callback) {
+    LoadFuture* future = new LoadFuture(path, callback);
+
+    lock_mutex(&mutex_);
+    async_queue_.push_back(future);
+    // one loader thread per pending load, at most one per cpu
+    if (async_idle_ < (int)async_queue_.size() && (int)async_threads_.size() < cpu_count()) {
+        pthread_t thread;
+        if (0 == begin_thread(&thread, AsyncLoadThread, this)) {
+            async_threads_.push_back(thread);
+        }
+    }
+    if (async_threads_.empty()) {
+        // no loader thread, load on the calling thread
+        async_queue_.pop_back();
+        unlock_mutex(&mutex_);
+        LoadResult result;
+        LoadModule(path, &result);
+        future->Complete(result);
+        future->Release();
+        return future;
+    }
+    unlock_mutex(&mutex_);
+    post_semaphore(&async_sem_);
+
+    return future;
+}
+
+void* PluginManager::AsyncLoadThread(void* arg) {
+    PluginManager* manager = static_cast<PluginManager*>(arg);
+    while (true) {
+        lock_mutex(&manager->mutex_);
+        manager->async_idle_++;
+        unlock_mutex(&manager->mutex_);
+
+        wait_semaphore(&manager->async_sem_, INFINITE);
+
+        lock_mutex(&manager->mutex_);
+        manager->async_idle_--;
+        if (manager->async_queue_.empty()) {
+            bool stop = manager->async_stop_;
+            unlock_mutex(&manager->mutex_);
+            if (stop) {
+                break;
+            }
+            continue;
+        }
+        LoadFuture* future = manager->async_queue_.front();
+        manager->async_queue_.pop_front();
+        unlock_mutex(&manager->mutex_);
+
+        LoadResult result;
+        manager->LoadModule(future->result_.path.c_str(), &result);
+        future->Complete(result);
+        future->Release();
+    }
+    return NULL;
+}
+
+bool PluginManager::WaitForClass(const std::string& class_id, unsigned long wait_time) {
+    sem_t sem;
+    lock_mutex(&mutex_);
+    if (Class::IsClassLoaded(class_id)) {
+        unlock_mutex(&mutex_);
+        return true;
+    }
+    init_semaphore(&sem, 0);
+    class_waiters_.push_back(std::make_pair(class_id, &sem));
+    unlock_mutex(&mutex_);
+
+    wait_semaphore(&sem, wait_time);
+
+    // posted and removed by NotifyClassWaiters() unless timed out
+    lock_mutex(&mutex_);
+    for (size_t i = 0; i < class_waiters_.size(); i++) {
+        if (class_waiters_[i].second == &sem) {
+            class_waiters_.erase(class_waiters_.begin() + i);
+            break;
+        }
+    }
+    unlock_mutex(&mutex_);
+    uninit_semaphore(&sem);
+
+    return Class::IsClassLoaded(class_id);
+}
+
+void PluginManager::NotifyClassWaiters() {
+    std::vector<std::pair<std::string, sem_t*> >::iterator it = class_waiters_.begin();
+    while (class_waiters_.end() != it) {
+        if (Class::IsClassLoaded(it->first)) {
+            post_semaphore(it->second);
+            it = class_waiters_.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+bool PluginManager::AddModule(const std::string& path, const ModuleItem& item) {
+    lock_mutex(&mutex_);
+    bool loaded = modules_.insert(std::map<std::string, ModuleItem>::value_type(path, item)).second;
+    if (loaded) {
+        AttachCounters(item);
+        uint64_t register_begin = profiling_ ? clock_tick_us() : 0;
+        RegisterClasses(item.classes);
+        if (profiling_) {
+            ProfileEvent event;
+            event.name = "register";
+            event.path = path;
+            event.classes = item.class_count;
+            AddProfileEvent(event, register_begin, clock_tick_us());
+        }
+        NotifyClassWaiters();
+    }
+    unlock_mutex(&mutex_);
+
+    if (!loaded) {
+        // loaded by another thread meanwhile
+        APF_DEBUG("load module %s failed (alread loaded)\n", path.c_str());
+        delete[] item.counters;
+        CloseModule(item.hmodule);
+    }
+    return loaded;
+}
+
+bool PluginManager::IsLoaded(const char* path) const {
+    lock_mutex(&mutex_);
+    bool loaded = (modules_.end() != modules_.find(path));
+    unlock_mutex(&mutex_);
+    return loaded;
+}
+
+bool PluginManager::OpenModule(const char* path, ModuleItem* item, LoadResult* result) {
     HMODULE hmodule = NULL;
     ClassEntry* classes = NULL;
     unsigned long  version = 0;
     APF_GET_MODULE_INFO module_func = NULL;
     APF_SET_OBJECT_CREATOR set_object_creator_func = NULL;
+    APF_GET_MODULE_REQUIRES module_requires_func = NULL;
+    // read once, the profiler may be switched while loading
+    const bool profiling = profiling_;
+    ProfileEvent open_event;
+    open_event.name = "dlopen";
+    open_event.path = path;
+    uint64_t begin_time = clock_tick_us();
     #ifdef WIN32
     hmodule = ::LoadLibraryExA(path, NULL, LOAD_WITH_ALTERED_SEARCH_PATH);
+    uint64_t open_time = clock_tick_us();
 	if (NULL != hmodule) {
         module_func = (APF_GET_MODULE_INFO)GetProcAddress(hmodule, APF_GET_MODULE_INFO_NAME);
         set_object_creator_func = (APF_SET_OBJECT_CREATOR)GetProcAddress(hmodule, APF_SET_OBJECT_CREATOR_NAME);
+        module_requires_func = (APF_GET_MODULE_REQUIRES)GetProcAddress(hmodule, APF_GET_MODULE_REQUIRES_NAME);
     }
     #else
+    unsigned long long loads = 0;
+    if (profiling) {
+        dl_iterate_phdr(CountLoads, &loads);
+        begin_time = clock_tick_us();
+    }
     hmodule = dlopen(path, RTLD_LAZY);
+    uint64_t open_time = clock_tick_us();
     if (NULL != hmodule) {
         module_func = (APF_GET_MODULE_INFO)dlsym(hmodule, APF_GET_MODULE_INFO_NAME);
         set_object_creator_func = (APF_SET_OBJECT_CREATOR)dlsym(hmodule, APF_SET_OBJECT_CREATOR_NAME);
+        module_requires_func = (APF_GET_MODULE_REQUIRES)dlsym(hmodule, APF_GET_MODULE_REQUIRES_NAME);
+    }
+    if (profiling && NULL != hmodule) {
+        unsigned long long loads_after = 0;
+        dl_iterate_phdr(CountLoads, &loads_after);
+        open_event.objects = (int)(loads_after - loads);
+        struct link_map* link = NULL;
+        if (0 == dlinfo(hmodule, RTLD_DI_LINKMAP, &link) && NULL != link) {
+            RelocationCount count = {link->l_addr, 0, 0};
+            dl_iterate_phdr(CountRelocations, &count);
+            open_event.relocations = count.relocations;
+            open_event.relative_relocations = count.relative_relocations;
+        }
+        // split dlopen at the first static constructor of the module
+        APF_GET_MODULE_CTOR_BEGIN ctor_begin_func = (APF_GET_MODULE_CTOR_BEGIN)dlsym(hmodule, APF_GET_MODULE_CTOR_BEGIN_NAME);
+        uint64_t ctor_begin = (NULL != ctor_begin_func) ? ctor_begin_func() : 0;
+        if (ctor_begin >= begin_time && ctor_begin <= open_time) {
+            ProfileEvent event;
+            event.path = path;
+            event.name = "map_relocate";
+            AddProfileEvent(event, begin_time, ctor_begin);
+            event.name = "static_ctors";
+            AddProfileEvent(event, ctor_begin, open_time);
+        }
     }
     #endif
     if (NULL == hmodule) {
         APF_DEBUG("open module file failed\n");
         return false;
     }
+    if (profiling) {
+        AddProfileEvent(open_event, begin_time, open_time);
+    }
     if (NULL == module_func) {
         APF_DEBUG("can't find module interface : %s\n", APF_GET_MODULE_INFO_NAME);
+        CloseModule(hmodule);
         return false;
     }
     // get module info
+    uint64_t info_begin = clock_tick_us();
     version = module_func(APF_VERSION(major_version_, sub_version_), &classes);
+    uint64_t info_end = clock_tick_us();
+    if (profiling) {
+        ProfileEvent event;
+        event.name = "get_module_info";
+        event.path = path;
+        AddProfileEvent(event, info_begin, info_end);
+    }
     if (0 == version) {
         APF_DEBUG("incompatible module\n");
+        CloseModule(hmodule);
         return false;
     }
     if (NULL == classes) {
         APF_DEBUG("no classes found\n");
+        CloseModule(hmodule);
         return false;
     }
 
     if (NULL != set_object_creator_func) {
         set_object_creator_func(apf::APFCreateObject);
+        if (profiling) {
+            ProfileEvent event;
+            event.name = "set_object_creator";
+            event.path = path;
+            AddProfileEvent(event, info_end, clock_tick_us());
+        }
     }
 
-    RegisterClasses(classes);
+    item->hmodule = hmodule;
+    item->classes = classes;
+    item->version = version;
+    item->required_class_ids.clear();
+    if (NULL != module_requires_func) {
+        const char* const* required_classes = module_requires_func();
+        while (NULL != required_classes && NULL != *required_classes) {
+            item->required_class_ids.push_back(*required_classes++);
+        }
+    }
+    // count objects of every class, the classes point at the counters
+    // once the module is added (AttachCounters)
+    const ClassEntry empty_class;
+    item->class_count = 0;
+    while (!classes[item->class_count].equals(empty_class)) {
+        item->class_count++;
+    }
+    item->counters = new ObjectCounter[item->class_count];
 
-    ModuleItem item;
-    item.hmodule = hmodule;
-    item.classes = classes;
-    item.version = version;
+    if (NULL != result) {
+        result->open_time = (unsigned long)(open_time - begin_time);
+        result->init_time = (unsigned long)(clock_tick_us() - open_time);
+        result->class_count = item->class_count;
+    }
 
-    modules_.insert(std::map<std::string, ModuleItem>::value_type(path, item));
+    return true;
+}
 
-    APF_DEBUG("loaded module %s\n", path);
+void PluginManager::CloseModule(HMODULE hmodule) {
+    #ifdef WIN32
+    FreeLibrary(hmodule);
+    #else
+    dlclose(hmodule);
+    #endif
+}
 
+void PluginManager::DiscardModule(ModuleItem* item, LoadResult* result) {
+    if (result->loaded) {
+        delete[] item->counters;
+        CloseModule(item->hmodule);
+    }
+    result->loaded = false;
+}
+
+namespace {
+// shared by the LoadAll() worker threads
+struct LoadTask {
+    PluginManager* manager;
+    const std::vector<std::string>* paths;
+    std::vector<PluginManager::ModuleItem>* items;
+    std::vector<PluginManager::LoadResult>* results;
+    // indexes of the paths to load
+    const std::vector<size_t>* order;
+    // next of order to load
+    size_t next;
+    pthread_mutex_t mutex;
+};
+
+// shared by the LoadGraph() worker threads
+struct GraphTask {
+    PluginManager* manager;
+    const std::vector<std::string>* paths;
+    std::vector<PluginManager::ModuleItem>* items;
+    std::vector<PluginManager::LoadResult>* results;
+    const std::vector<std::vector<size_t> >* dependents;
+    // modules opened before the graph was built (no index)
+    const std::vector<bool>* opened;
+    // modules each module still waits for
+    std::vector<int> waiting;
+    // a required module which failed to load, paths->size(): none
+    std::vector<size_t> failed_provider;
+    // modules ready to load
+    std::deque<size_t> ready;
+    // modules not finished yet
+    size_t remaining;
+    pthread_mutex_t mutex;
+    // posted for every ready module, and once when all finished
+    sem_t sem;
+};
+} // namespace
+
+void* PluginManager::LoadThread(void* arg) {
+    LoadTask* task = static_cast<LoadTask*>(arg);
+    while (true) {
+        lock_mutex(&task->mutex);
+        size_t next = task->next++;
+        unlock_mutex(&task->mutex);
+        if (next >= task->order->size()) {
+            break;
+        }
+        size_t index = (*task->order)[next];
+        PluginManager::LoadResult& result = (*task->results)[index];
+        result.loaded = task->manager->OpenModule((*task->paths)[index].c_str(), &(*task->items)[index], &result);
+    }
+    return NULL;
+}
+
+void* PluginManager::GraphLoadThread(void* arg) {
+    GraphTask* task = static_cast<GraphTask*>(arg);
+    while (true) {
+        if (0 != wait_semaphore(&task->sem, INFINITE)) {
+            continue;
+        }
+        lock_mutex(&task->mutex);
+        if (task->ready.empty()) {
+            // all finished, wake up the next worker
+            unlock_mutex(&task->mutex);
+            post_semaphore(&task->sem);
+            break;
+        }
+        size_t index = task->ready.front();
+        task->ready.pop_front();
+        unlock_mutex(&task->mutex);
+
+        // registered before its dependents are opened
+        const std::string& path = (*task->paths)[index];
+        PluginManager::LoadResult& result = (*task->results)[index];
+        PluginManager::ModuleItem& item = (*task->items)[index];
+        if (!(*task->opened)[index]) {
+            result.loaded = task->manager->OpenModule(path.c_str(), &item, &result);
+        }
+        result.loaded = result.loaded && task->manager->AddModule(path, item);
+
+        // a module fails when a module it requires failed, it is not loaded
+        // and fails its own dependents
+        std::vector<size_t> skipped;
+        lock_mutex(&task->mutex);
+        std::vector<size_t> finished(1, index);
+        while (!finished.empty()) {
+            size_t done = finished.back();
+            finished.pop_back();
+            task->remaining--;
+            // a skipped module is discarded after the loop
+            bool failed = !(*task->results)[done].loaded || task->paths->size() != task->failed_provider[done];
+            const std::vector<size_t>& dependents = (*task->dependents)[done];
+            for (size_t i = 0; i < dependents.size(); i++) {
+                size_t dependent = dependents[i];
+                if (failed && task->paths->size() == task->failed_provider[dependent]) {
+                    task->failed_provider[dependent] = done;
+                }
+                if (0 != --task->waiting[dependent]) {
+                    continue;
+                }
+                if (task->paths->size() == task->failed_provider[dependent]) {
+                    task->ready.push_back(dependent);
+                    post_semaphore(&task->sem);
+                } else {
+                    skipped.push_back(dependent);
+                    finished.push_back(dependent);
+                }
+            }
+        }
+        bool all_finished = (0 == task->remaining);
+        unlock_mutex(&task->mutex);
+
+        for (size_t i = 0; i < skipped.size(); i++) {
+            size_t dependent = skipped[i];
+            APF_DEBUG("load module %s failed (required module %s failed)\n", (*task->paths)[dependent].c_str(),
+                      (*task->paths)[task->failed_provider[dependent]].c_str());
+            task->manager->DiscardModule(&(*task->items)[dependent], &(*task->results)[dependent]);
+        }
+        if (all_finished) {
+            post_semaphore(&task->sem);
+        }
+    }
+    return NULL;
+}
+
+bool PluginManager::BuildLoadGraph(const std::vector<std::string>& paths, const std::vector<ModuleIndex>& indexes,
+                                   std::vector<std::vector<size_t> >* dependents, std::vector<int>* waiting) {
+    dependents->assign(paths.size(), std::vector<size_t>());
+    waiting->assign(paths.size(), 0);
+
+    std::map<std::string, size_t> providers;
+    bool has_requires = false;
+    for (size_t i = 0; i < paths.size(); i++) {
+        for (size_t j = 0; j < indexes[i].class_ids.size(); j++) {
+            providers.insert(std::make_pair(indexes[i].class_ids[j], i));
+        }
+        has_requires = has_requires || !indexes[i].required_class_ids.empty();
+    }
+    if (!has_requires) {
+        return false;
+    }
+
+    for (size_t i = 0; i < paths.size(); i++) {
+        const std::vector<std::string>& required = indexes[i].required_class_ids;
+        for (size_t j = 0; j < required.size(); j++) {
+            std::map<std::string, size_t>::iterator it = providers.find(required[j]);
+            if (providers.end() != it && it->second != i) {
+                (*dependents)[it->second].push_back(i);
+                (*waiting)[i]++;
+            } else if (providers.end() == it && !Class::IsClassLoaded(required[j])) {
+                APF_DEBUG("module %s requires unknown class %s\n", paths[i].c_str(), required[j].c_str());
+            }
+        }
+    }
+
+    // modules never ready are in or behind a dependency cycle
+    std::vector<int> count(*waiting);
+    std::vector<size_t> sorted;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (0 == count[i]) {
+            sorted.push_back(i);
+        }
+    }
+    for (size_t i = 0; i < sorted.size(); i++) {
+        const std::vector<size_t>& next = (*dependents)[sorted[i]];
+        for (size_t j = 0; j < next.size(); j++) {
+            if (0 == --count[next[j]]) {
+                sorted.push_back(next[j]);
+            }
+        }
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (count[i] > 0) {
+            (*waiting)[i] = -1;
+        }
+    }
     return true;
 }
 
+int PluginManager::LoadGraph(const std::vector<std::string>& paths, const std::vector<std::vector<size_t> >& dependents,
+                             const std::vector<int>& waiting, const std::vector<bool>& opened,
+                             std::vector<ModuleItem>* items, std::vector<LoadResult>* results) {
+    GraphTask task;
+    task.manager = this;
+    task.paths = &paths;
+    task.items = items;
+    task.results = results;
+    task.dependents = &dependents;
+    task.opened = &opened;
+    task.waiting = waiting;
+    task.failed_provider.assign(paths.size(), paths.size());
+    task.remaining = 0;
+    init_mutex(&task.mutex);
+    init_semaphore(&task.sem, 0);
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (waiting[i] < 0) {
+            APF_DEBUG("load module %s failed (dependency cycle)\n", paths[i].c_str());
+            DiscardModule(&(*items)[i], &(*results)[i]);
+            continue;
+        }
+        task.remaining++;
+        if (0 == waiting[i]) {
+            task.ready.push_back(i);
+            post_semaphore(&task.sem);
+        }
+    }
+    if (0 == task.remaining) {
+        post_semaphore(&task.sem);
+    }
+
+    size_t thread_count = cpu_count();
+    if (thread_count > task.remaining) {
+        thread_count = task.remaining;
+    }
+    std::vector<pthread_t> threads;
+    for (size_t i = 1; i < thread_count; i++) {
+        pthread_t thread;
+        if (0 == begin_thread(&thread, GraphLoadThread, &task)) {
+            threads.push_back(thread);
+        }
+    }
+    // the calling thread works too
+    GraphLoadThread(&task);
+    for (size_t i = 0; i < threads.size(); i++) {
+        wait_thread(&threads[i]);
+    }
+    uninit_semaphore(&task.sem);
+    uninit_mutex(&task.mutex);
+
+    int loaded = 0;
+    for (size_t i = 0; i < results->size(); i++) {
+        if ((*results)[i].loaded) {
+            loaded++;
+        }
+    }
+    return loaded;
+}
+
+void PluginManager::OpenModules(const std::vector<std::string>& paths, const std::vector<size_t>& order,
+                                std::vector<ModuleItem>* items, std::vector<LoadResult>* results) {
+    if (order.empty()) {
+        return;
+    }
+    LoadTask task;
+    task.manager = this;
+    task.paths = &paths;
+    task.items = items;
+    task.results = results;
+    task.order = &order;
+    task.next = 0;
+    init_mutex(&task.mutex);
+
+    size_t thread_count = cpu_count();
+    if (thread_count > order.size()) {
+        thread_count = order.size();
+    }
+    std::vector<pthread_t> threads;
+    for (size_t i = 1; i < thread_count; i++) {
+        pthread_t thread;
+        if (0 == begin_thread(&thread, LoadThread, &task)) {
+            threads.push_back(thread);
+        }
+    }
+    // the calling thread works too
+    LoadThread(&task);
+    for (size_t i = 0; i < threads.size(); i++) {
+        wait_thread(&threads[i]);
+    }
+    uninit_mutex(&task.mutex);
+}
+
+int PluginManager::LoadAll(const std::vector<std::string>& paths, std::vector<LoadResult>* results) {
+    uint64_t begin_time = clock_tick_us();
+    // skip loaded and duplicate paths
+    std::vector<std::string> load_paths;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (IsLoaded(paths[i].c_str())) {
+            APF_DEBUG("load module %s failed (alread loaded)\n", paths[i].c_str());
+            continue;
+        }
+        bool duplicate = false;
+        for (size_t j = 0; j < load_paths.size() && !duplicate; j++) {
+            duplicate = (load_paths[j] == paths[i]);
+        }
+        if (!duplicate) {
+            load_paths.push_back(paths[i]);
+        }
+    }
+
+    LoadResult empty_result;
+    empty_result.loaded = false;
+    empty_result.open_time = 0;
+    empty_result.init_time = 0;
+    empty_result.class_count = 0;
+    std::vector<LoadResult> load_results(load_paths.size(), empty_result);
+    std::vector<ModuleItem> items(load_paths.size());
+    for (size_t i = 0; i < load_paths.size(); i++) {
+        load_results[i].path = load_paths[i];
+    }
+
+    // required classes are read from the index before any module is opened,
+    // modules without one (WIN32, stripped modules) are opened first
+    // to read them from APFGetModuleRequires
+    std::vector<ModuleIndex> indexes(load_paths.size());
+    std::vector<bool> opened(load_paths.size(), false);
+    std::vector<size_t> no_index;
+    std::vector<size_t> indexed;
+    for (size_t i = 0; i < load_paths.size(); i++) {
+        if (ReadModuleIndex(load_paths[i].c_str(), &indexes[i])) {
+            indexed.push_back(i);
+        } else {
+            no_index.push_back(i);
+            opened[i] = true;
+        }
+    }
+    OpenModules(load_paths, no_index, &items, &load_results);
+    const ClassEntry empty_class;
+    for (size_t i = 0; i < no_index.size(); i++) {
+        size_t index = no_index[i];
+        if (!load_results[index].loaded) {
+            continue;
+        }
+        for (const ClassEntry* classes = items[index].classes; !classes->equals(empty_class); classes++) {
+            indexes[index].class_ids.push_back(classes->clsid);
+        }
+        indexes[index].required_class_ids = items[index].required_class_ids;
+    }
+
+    std::vector<std::vector<size_t> > dependents;
+    std::vector<int> waiting;
+    if (BuildLoadGraph(load_paths, indexes, &dependents, &waiting)) {
+        int loaded = LoadGraph(load_paths, dependents, waiting, opened, &items, &load_results);
+        uint64_t end_time = clock_tick_us();
+        for (size_t i = 0; i < load_results.size(); i++) {
+            APF_DEBUG("%s module %s [open:%luus, init:%luus, classes:%d]\n",
+                      load_results[i].loaded ? "loaded" : "load failed", load_results[i].path.c_str(),
+                      load_results[i].open_time, load_results[i].init_time, load_results[i].class_count);
+        }
+        APF_DEBUG("loaded %d/%d modules in dependency order in %luus\n",
+                  loaded, (int)load_paths.size(), (unsigned long)(end_time - begin_time));
+        if (profiling_) {
+            ProfileEvent event;
+            event.name = "load_all";
+            AddProfileEvent(event, begin_time, end_time);
+        }
+        if (NULL != results) {
+            results->insert(results->end(), load_results.begin(), load_results.end());
+        }
+        return loaded;
+    }
+
+    // open and initialize the other modules on a thread pool
+    OpenModules(load_paths, indexed, &items, &load_results);
+
+    // register all class tables in one registry update
+    std::vector<const ClassEntry*> class_tables;
+    int loaded = 0;
+    lock_mutex(&mutex_);
+    for (size_t i = 0; i < load_paths.size(); i++) {
+        if (!load_results[i].loaded) {
+            continue;
+        }
+        if (!modules_.insert(std::map<std::string, ModuleItem>::value_type(load_paths[i], items[i])).second) {
+            // loaded by another thread meanwhile
+            load_results[i].loaded = false;
+            delete[] items[i].counters;
+            CloseModule(items[i].hmodule);
+            continue;
+        }
+        AttachCounters(items[i]);
+        class_tables.push_back(items[i].classes);
+        loaded++;
+    }
+    uint64_t register_begin = clock_tick_us();
+    int class_count = Class::RegisterClasses(class_tables);
+    uint64_t register_end = clock_tick_us();
+    unsigned long register_time = (unsigned long)(register_end - register_begin);
+    if (profiling_) {
+        ProfileEvent event;
+        event.name = "register";
+        event.classes = class_count;
+        AddProfileEvent(event, register_begin, register_end);
+    }
+    NotifyClassWaiters();
+    unlock_mutex(&mutex_);
+
+    for (size_t i = 0; i < load_results.size(); i++) {
+        APF_DEBUG("%s module %s [open:%luus, init:%luus, classes:%d]\n",
+                  load_results[i].loaded ? "loaded" : "load failed", load_results[i].path.c_str(),
+                  load_results[i].open_time, load_results[i].init_time, load_results[i].class_count);
+    }
+    uint64_t end_time = clock_tick_us();
+    APF_DEBUG("loaded %d/%d modules in %luus, registered %d classes in %luus\n",
+              loaded, (int)load_paths.size(), (unsigned long)(end_time - begin_time), class_count, register_time);
+    if (profiling_) {
+        ProfileEvent event;
+        event.name = "load_all";
+        AddProfileEvent(event, begin_time, end_time);
+    }
+
+    if (NULL != results) {
+        results->insert(results->end(), load_results.begin(), load_results.end());
+    }
+
+    return loaded;
+}
+
+int PluginManager::LoadDirectory(const char* dir, std::vector<LoadResult>* results) {
+    std::vector<std::string> paths;
+    ListModules(dir, &paths);
+    if (paths.empty()) {
+        APF_DEBUG("no module found in %s\n", dir);
+        return 0;
+    }
+
+    return LoadAll(paths, results);
+}
+
+void PluginManager::ListModules(const char* dir, std::vector<std::string>* paths) {
+    std::string dir_path = dir;
+    #ifdef WIN32
+    WIN32_FIND_DATAA find_data;
+    HANDLE hfind = FindFirstFileA((dir_path + "\\*.dll").c_str(), &find_data);
+    if (INVALID_HANDLE_VALUE != hfind) {
+        do {
+            paths->push_back(dir_path + "\\" + find_data.cFileName);
+        } while (FindNextFileA(hfind, &find_data));
+        FindClose(hfind);
+    }
+    #else
+    DIR* pdir = opendir(dir);
+    if (NULL != pdir) {
+        struct dirent* entry;
+        while (NULL != (entry = readdir(pdir))) {
+            size_t len = strlen(entry->d_name);
+            if (len > 3 && 0 == strcmp(entry->d_name + len - 3, ".so")) {
+                paths->push_back(dir_path + "/" + entry->d_name);
+            }
+        }
+        closedir(pdir);
+    }
+    #endif
+    // load order (and class replacement) must not depend on the file system
+    std::sort(paths->begin(), paths->end());
+}
+
+int PluginManager::LoadManifest(const char* file) {
+    FILE* fp = fopen(file, "r");
+    if (NULL == fp) {
+        APF_DEBUG("open manifest %s failed\n", file);
+        return 0;
+    }
+
+    int stub_count = 0;
+    char line[MAX_PATH * 2];
+    while (NULL != fgets(line, sizeof(line), fp)) {
+        // <class id>\t<module path>
+        line[strcspn(line, "\r\n")] = '\0';
+        char* tab = strchr(line, '\t');
+        if ('#' == line[0] || NULL == tab) {
+            continue;
+        }
+        *tab = '\0';
+        if (AddLazyClass(line, tab + 1)) {
+            stub_count++;
+        }
+    }
+    fclose(fp);
+
+    Class::SetClassLoader(&PluginManager::LoadClass);
+    APF_DEBUG("registered %d stub classes from manifest %s\n", stub_count, file);
+
+    return stub_count;
+}
+
+bool PluginManager::SaveManifest(const char* file) {
+    FILE* fp = fopen(file, "w");
+    if (NULL == fp) {
+        APF_DEBUG("open manifest %s failed\n", file);
+        return false;
+    }
+
+    fprintf(fp, "# APF class manifest: <class id>\\t<module path>\n");
+    const ClassEntry empty_class;
+    lock_mutex(&mutex_);
+    std::map<std::string, ModuleItem>::iterator it = modules_.begin();
+    for (; modules_.end() != it; it++) {
+        const ClassEntry* classes = it->second.classes;
+        while (classes && (!classes->equals(empty_class))) {
+            fprintf(fp, "%s\t%s\n", classes->clsid.c_str(), it->first.c_str());
+            classes++;
+        }
+    }
+    unlock_mutex(&mutex_);
+    fclose(fp);
+
+    return true;
+}
+
+int PluginManager::IndexDirectory(const char* dir) {
+    std::vector<std::string> paths;
+    ListModules(dir, &paths);
+
+    int stub_count = 0;
+    lock_mutex(&mutex_);
+    const unsigned long app_version = APF_VERSION(major_version_, sub_version_);
+    unlock_mutex(&mutex_);
+    for (size_t i = 0; i < paths.size(); i++) {
+        ModuleIndex index;
+        if (!ReadModuleIndex(paths[i].c_str(), &index)) {
+            APF_DEBUG("no module index in %s\n", paths[i].c_str());
+            continue;
+        }
+        if (app_version < index.min_support || app_version > index.max_support) {
+            APF_DEBUG("incompatible module %s\n", paths[i].c_str());
+            continue;
+        }
+        for (size_t j = 0; j < index.class_ids.size(); j++) {
+            if (AddLazyClass(index.class_ids[j], paths[i])) {
+                stub_count++;
+            }
+        }
+    }
+
+    Class::SetClassLoader(&PluginManager::LoadClass);
+    APF_DEBUG("registered %d stub classes from %d modules in %s\n", stub_count, (int)paths.size(), dir);
+
+    return stub_count;
+}
+
+bool PluginManager::AddLazyClass(const std::string& class_id, const std::string& path) {
+    lock_mutex(&mutex_);
+    lazy_classes_[class_id] = path;
+    unlock_mutex(&mutex_);
+    return Class::RegisterStubClass(class_id);
+}
+
+bool PluginManager::LoadClass(const APFClassID& class_id) {
+    PluginManager* manager = instance();
+    std::string path;
+    lock_mutex(&manager->mutex_);
+    std::map<std::string, std::string>::iterator it = manager->lazy_classes_.find(class_id);
+    if (manager->lazy_classes_.end() != it) {
+        path = it->second;
+    }
+    unlock_mutex(&manager->mutex_);
+    if (path.empty()) {
+        return false;
+    }
+    // loaded by another class of the same module or another thread
+    return manager->Load(path.c_str()) || manager->IsLoaded(path.c_str());
+}
+
+#ifndef WIN32
+namespace {
+// <section name, <data, size>>
+typedef std::map<std::string, std::pair<const char*, size_t> > SectionMap;
+
+// collect the sections of a mapped ELF file
+template <class Ehdr, class Shdr>
+bool ReadElfSections(const char* data, size_t size, SectionMap* sections) {
+    if (size < sizeof(Ehdr)) {
+        return false;
+    }
+    const Ehdr* ehdr = reinterpret_cast<const Ehdr*>(data);
+    if (0 == ehdr->e_shoff || ehdr->e_shentsize != sizeof(Shdr) || ehdr->e_shstrndx >= ehdr->e_shnum ||
+        ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof(Shdr) > size) {
+        return false;
+    }
+    const Shdr* shdrs = reinterpret_cast<const Shdr*>(data + ehdr->e_shoff);
+    const Shdr& strtab = shdrs[ehdr->e_shstrndx];
+    if (strtab.sh_offset + strtab.sh_size > size) {
+        return false;
+    }
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        if (SHT_NOBITS == shdrs[i].sh_type || shdrs[i].sh_name >= strtab.sh_size ||
+            shdrs[i].sh_offset + shdrs[i].sh_size > size) {
+            continue;
+        }
+        const char* name = data + strtab.sh_offset + shdrs[i].sh_name;
+        (*sections)[std::string(name, strnlen(name, strtab.sh_size - shdrs[i].sh_name))] =
+            std::make_pair(data + shdrs[i].sh_offset, (size_t)shdrs[i].sh_size);
+    }
+    return true;
+}
+
+// split NUL separated records (skip alignment padding)
+void SplitRecords(const std::pair<const char*, size_t>& section, std::vector<std::string>* records) {
+    const char* p = section.first;
+    const char* end = section.first + section.second;
+    while (p < end) {
+        size_t len = strnlen(p, end - p);
+        if (len > 0) {
+            records->push_back(std::string(p, len));
+        }
+        p += len + 1;
+    }
+}
+
+// resolve class id expressions (a string literal or a CLSID_Name) of a section
+void ResolveClassIds(const SectionMap& sections, const char* section_name,
+                     const std::map<std::string, std::string>& class_id_names,
+                     const char* path, std::vector<std::string>* class_ids) {
+    class_ids->clear();
+    SectionMap::const_iterator section = sections.find(section_name);
+    if (sections.end() == section) {
+        return;
+    }
+    std::vector<std::string> records;
+    SplitRecords(section->second, &records);
+    for (size_t i = 0; i < records.size(); i++) {
+        const std::string& record = records[i];
+        if (record.size() >= 2 && '"' == record[0] && '"' == record[record.size() - 1]) {
+            class_ids->push_back(record.substr(1, record.size() - 2));
+            continue;
+        }
+        size_t pos = record.rfind("::");
+        std::string name = (std::string::npos == pos) ? record : record.substr(pos + 2);
+        std::map<std::string, std::string>::const_iterator it = class_id_names.find(name);
+        if (class_id_names.end() != it) {
+            class_ids->push_back(it->second);
+        } else {
+            APF_DEBUG("unknown class id %s in %s\n", record.c_str(), path);
+        }
+    }
+}
+} // namespace
+#endif
+
+bool PluginManager::ReadModuleIndex(const char* path, ModuleIndex* index) {
+    #ifdef WIN32
+    return false;
+    #else
+    int fd = open(path, O_RDONLY);
+    if (-1 == fd) {
+        return false;
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (0 == fstat(fd, &st) && st.st_size > EI_NIDENT) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == data) {
+        return false;
+    }
+
+    const char* elf = static_cast<const char*>(data);
+    size_t size = st.st_size;
+    SectionMap sections;
+    bool ret = false;
+    if (0 == memcmp(elf, ELFMAG, SELFMAG)) {
+        if (ELFCLASS64 == elf[EI_CLASS]) {
+            ret = ReadElfSections<Elf64_Ehdr, Elf64_Shdr>(elf, size, &sections);
+        } else if (ELFCLASS32 == elf[EI_CLASS]) {
+            ret = ReadElfSections<Elf32_Ehdr, Elf32_Shdr>(elf, size, &sections);
+        }
+    }
+
+    SectionMap::iterator module_section = sections.find(APF_MODULE_SECTION);
+    SectionMap::iterator classes_section = sections.find(APF_CLASSES_SECTION);
+    if (!ret || sections.end() == module_section || sections.end() == classes_section ||
+        module_section->second.second < 4 * sizeof(unsigned int)) {
+        munmap(data, size);
+        return false;
+    }
+
+    // {APF_MODULE_MAGIC, version, min support, max support}
+    unsigned int module_record[4];
+    memcpy(module_record, module_section->second.first, sizeof(module_record));
+    if (APF_MODULE_MAGIC != module_record[0]) {
+        munmap(data, size);
+        return false;
+    }
+    index->version = module_record[1];
+    index->min_support = module_record[2];
+    index->max_support = module_record[3];
+
+    // "CLSID_Name=class id"
+    std::map<std::string, std::string> class_id_names;
+    std::vector<std::string> records;
+    SectionMap::iterator clsid_section = sections.find(APF_CLASSID_SECTION);
+    if (sections.end() != clsid_section) {
+        SplitRecords(clsid_section->second, &records);
+    }
+    for (size_t i = 0; i < records.size(); i++) {
+        size_t pos = records[i].find('=');
+        if (std::string::npos != pos) {
+            class_id_names[records[i].substr(0, pos)] = records[i].substr(pos + 1);
+        }
+    }
+
+    // class id expressions of APF_CLASSMAP_ENTRY and APF_REQUIRE_CLASS
+    ResolveClassIds(sections, APF_CLASSES_SECTION, class_id_names, path, &index->class_ids);
+    ResolveClassIds(sections, APF_REQUIRES_SECTION, class_id_names, path, &index->required_class_ids);
+    munmap(data, size);
+
+    return true;
+    #endif
+}
+
 bool PluginManager::UnLoad(const char* path) {
+    lock_mutex(&mutex_);
     std::map<std::string, ModuleItem>::iterator it = modules_.find(path);
     if (modules_.end() == modules_.find(path)) {
+        unlock_mutex(&mutex_);
         APF_DEBUG("no module found %s\n", path);
         return false;
     }
 
     UnRegisterClasses(it->second.classes);
-    #ifdef WIN32
-	FreeLibrary(it->second.hmodule);
-    #else
-    dlclose(it->second.hmodule);
-    #endif
+    RetireModule(it->first, it->second);
     modules_.erase(it);
+    unlock_mutex(&mutex_);
 
     return true;
 }
 
 void PluginManager::UnLoadAll() {
-    std::map<std::string, ModuleItem>::iterator it = modules_.begin();
-    while (modules_.end() != it) {
+    uint64_t begin_time = clock_tick_us();
+    lock_mutex(&mutex_);
+    std::vector<std::string> paths;
+    GetUnloadOrder(&paths);
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::map<std::string, ModuleItem>::iterator it = modules_.find(paths[i]);
         UnRegisterClasses(it->second.classes);
-        #ifdef WIN32
-        FreeLibrary(it->second.hmodule);
-        #else
-        dlclose(it->second.hmodule);
-        #endif
-        it++;
+        RetireModule(it->first, it->second);
+        modules_.erase(it);
+    }
+    uint64_t end_time = clock_tick_us();
+    if (profiling_) {
+        ProfileEvent event;
+        event.name = "unload_all";
+        AddProfileEvent(event, begin_time, end_time);
+    }
+    unlock_mutex(&mutex_);
+    APF_DEBUG("unloaded %d modules in %luus\n", (int)paths.size(), (unsigned long)(end_time - begin_time));
+}
+
+void PluginManager::GetUnloadOrder(std::vector<std::string>* paths) const {
+    // <class id, module path>
+    std::map<std::string, std::string> providers;
+    const ClassEntry empty_class;
+    std::map<std::string, ModuleItem>::const_iterator it = modules_.begin();
+    for (; modules_.end() != it; it++) {
+        const ClassEntry* classes = it->second.classes;
+        while (classes && (!classes->equals(empty_class))) {
+            providers.insert(std::make_pair(classes->clsid, it->first));
+            classes++;
+        }
+    }
+
+    // <module path, modules it requires>, <module path, loaded dependents>
+    std::map<std::string, std::vector<std::string> > required_modules;
+    std::map<std::string, int> dependent_count;
+    for (it = modules_.begin(); modules_.end() != it; it++) {
+        dependent_count[it->first];
+        const std::vector<std::string>& required = it->second.required_class_ids;
+        for (size_t i = 0; i < required.size(); i++) {
+            std::map<std::string, std::string>::iterator provider = providers.find(required[i]);
+            if (providers.end() != provider && provider->second != it->first) {
+                required_modules[it->first].push_back(provider->second);
+                dependent_count[provider->second]++;
+            }
+        }
+    }
+
+    // modules nothing depends on first
+    paths->clear();
+    std::map<std::string, int>::iterator count = dependent_count.begin();
+    for (; dependent_count.end() != count; count++) {
+        if (0 == count->second) {
+            paths->push_back(count->first);
+        }
+    }
+    for (size_t i = 0; i < paths->size(); i++) {
+        const std::vector<std::string>& required = required_modules[(*paths)[i]];
+        for (size_t j = 0; j < required.size(); j++) {
+            if (0 == --dependent_count[required[j]]) {
+                paths->push_back(required[j]);
+            }
+        }
+    }
+    // dependency cycles, unload them last
+    for (count = dependent_count.begin(); dependent_count.end() != count; count++) {
+        if (count->second > 0) {
+            APF_DEBUG("unload module %s in dependency cycle\n", count->first.c_str());
+            paths->push_back(count->first);
+        }
+    }
+}
+
+bool PluginManager::Reload(const char* path, const char* new_path, unsigned long wait_time) {
+    if (!IsLoaded(path)) {
+        APF_DEBUG("no module found %s\n", path);
+        return false;
+    }
+    if (NULL == new_path) {
+        new_path = path;
+    }
+    APF_DEBUG("reloading module %s from %s\n", path, new_path);
+
+    // dlopen/LoadLibrary return the loaded image for a known path,
+    // open the new version from a private copy
+    static volatile long reload_count = 0;
+    char copy_path[MAX_PATH * 2];
+    snprintf(copy_path, sizeof(copy_path), "%s.%d-%ld.reload", new_path, (int)getpid(), atomic_inc(&reload_count));
+    if (!CopyModuleFile(new_path, copy_path)) {
+        APF_DEBUG("copy module file %s failed\n", new_path);
+        return false;
+    }
+    ModuleItem item;
+    bool opened = OpenModule(copy_path, &item);
+    #ifdef WIN32
+    if (!opened) {
+        DeleteFileA(copy_path);
     }
-    modules_.clear();
+    #else
+    // the mapped image stays valid
+    unlink(copy_path);
+    #endif
+    if (!opened) {
+        return false;
+    }
+
+    lock_mutex(&mutex_);
+    // unloaded by another thread meanwhile
+    std::map<std::string, ModuleItem>::iterator it = modules_.find(path);
+    if (modules_.end() == it || item.hmodule == it->second.hmodule) {
+        unlock_mutex(&mutex_);
+        APF_DEBUG("reload module failed (%s)\n", modules_.end() == it ? "unloaded" : "same image");
+        delete[] item.counters;
+        CloseModule(item.hmodule);
+        return false;
+    }
+
+    // switch all classes in one registry update, creations never see a gap
+    AttachCounters(item);
+    std::vector<const ClassEntry*> class_tables(1, item.classes);
+    uint64_t register_begin = profiling_ ? clock_tick_us() : 0;
+    int class_count = Class::RegisterClasses(class_tables);
+    if (profiling_) {
+        ProfileEvent event;
+        event.name = "register";
+        event.path = path;
+        event.classes = class_count;
+        AddProfileEvent(event, register_begin, clock_tick_us());
+    }
+    // classes dropped by the new version
+    UnRegisterClasses(it->second.classes);
+
+    ModuleItem old_item = it->second;
+    it->second = item;
+    RetireModule(path, old_item);
+    NotifyClassWaiters();
+    unlock_mutex(&mutex_);
+
+    // wait outside the lock, other threads keep creating objects
+    unsigned long waited = 0;
+    while (ReleaseRetired() > 0 && waited < wait_time) {
+        msleep(10);
+        waited += 10;
+    }
+
+    APF_DEBUG("reloaded module %s (%d retired modules in use)\n", path, ReleaseRetired());
+
+    return true;
+}
+
+bool PluginManager::CopyModuleFile(const char* src, const char* dst) {
+    FILE* src_file = fopen(src, "rb");
+    if (NULL == src_file) {
+        return false;
+    }
+    FILE* dst_file = fopen(dst, "wb");
+    if (NULL == dst_file) {
+        fclose(src_file);
+        return false;
+    }
+    bool ret = true;
+    char buf[64 * 1024];
+    size_t len;
+    while (ret && (len = fread(buf, 1, sizeof(buf), src_file)) > 0) {
+        ret = (fwrite(buf, 1, len, dst_file) == len);
+    }
+    fclose(src_file);
+    ret = (0 == fclose(dst_file)) && ret;
+    return ret;
+}
+
+void PluginManager::RetireModule(const std::string& path, const ModuleItem& item) {
+    retired_modules_.push_back(std::make_pair(path, item));
+    ReleaseRetired();
+}
+
+int PluginManager::ReleaseRetired() {
+    lock_mutex(&mutex_);
+    std::vector<std::pair<std::string, ModuleItem> >::iterator it = retired_modules_.begin();
+    while (retired_modules_.end() != it) {
+        if (LiveObjects(it->second) > 0) {
+            it++;
+            continue;
+        }
+        CloseModule(it->second.hmodule);
+        delete[] it->second.counters;
+        it = retired_modules_.erase(it);
+    }
+    int count = (int)retired_modules_.size();
+    unlock_mutex(&mutex_);
+    return count;
+}
+
+long PluginManager::LiveObjects(const ModuleItem& item) {
+    long live = 0;
+    for (int i = 0; i < item.class_count; i++) {
+        live += item.counters[i].live();
+    }
+    return live;
+}
+
+void PluginManager::MergeModuleStats(const std::string& path, const ModuleItem& item, bool retired, ModuleStats* stats) {
+    stats->path = path;
+    stats->retired = retired;
+    stats->live = 0;
+    stats->creations = 0;
+    stats->bytes = 0;
+    stats->classes.resize(item.class_count);
+    for (int i = 0; i < item.class_count; i++) {
+        ClassStats& class_stats = stats->classes[i];
+        class_stats.class_id = item.classes[i].clsid;
+        class_stats.class_name = item.classes[i].class_name;
+        class_stats.live = item.counters[i].live();
+        class_stats.creations = item.counters[i].creations();
+        class_stats.bytes = class_stats.live > 0 ? class_stats.live * item.classes[i].object_size : 0;
+
+        stats->live += class_stats.live;
+        stats->creations += class_stats.creations;
+        stats->bytes += class_stats.bytes;
+    }
+}
+
+bool PluginManager::GetModuleStats(const char* path, ModuleStats* stats) const {
+    lock_mutex(&mutex_);
+    std::map<std::string, ModuleItem>::const_iterator it = modules_.find(path);
+    bool found = (modules_.end() != it);
+    if (found) {
+        MergeModuleStats(it->first, it->second, false, stats);
+    }
+    unlock_mutex(&mutex_);
+    return found;
+}
+
+void PluginManager::GetModuleStats(std::vector<ModuleStats>* stats) const {
+    lock_mutex(&mutex_);
+    stats->resize(modules_.size() + retired_modules_.size());
+    size_t index = 0;
+    std::map<std::string, ModuleItem>::const_iterator it = modules_.begin();
+    for (; modules_.end() != it; it++) {
+        MergeModuleStats(it->first, it->second, false, &(*stats)[index++]);
+    }
+    for (size_t i = 0; i < retired_modules_.size(); i++) {
+        MergeModuleStats(retired_modules_[i].first, retired_modules_[i].second, true, &(*stats)[index++]);
+    }
+    unlock_mutex(&mutex_);
 }
 
 void PluginManager::RegisterClasses(const ClassEntry* classes) {
@@ -159,6 +1466,14 @@ void PluginManager::RegisterClasses(const ClassEntry* classes) {
     }
 }
 
+void PluginManager::AttachCounters(const ModuleItem& item) {
+    // the class table is in the module image, shared by every thread that opened it
+    ClassEntry* classes = const_cast<ClassEntry*>(item.classes);
+    for (int i = 0; i < item.class_count; i++) {
+        classes[i].counter = &item.counters[i];
+    }
+}
+
 void PluginManager::UnRegisterClasses(const ClassEntry* classes) {
     const ClassEntry empty_class;
     while (NULL != classes && !(classes->equals(empty_class))) {
@@ -168,15 +1483,130 @@ void PluginManager::UnRegisterClasses(const ClassEntry* classes) {
 }
 
 const std::map<std::string, PluginManager::ModuleItem> PluginManager::modules() const {
-    return modules_;
+    lock_mutex(&mutex_);
+    std::map<std::string, ModuleItem> modules = modules_;
+    unlock_mutex(&mutex_);
+    return modules;
+}
+
+int PluginManager::VisitModules(ModuleVisitor* visitor) const {
+    int count = 0;
+    lock_mutex(&mutex_);
+    std::map<std::string, ModuleItem>::const_iterator it = modules_.begin();
+    for (; modules_.end() != it; it++) {
+        count++;
+        if (!visitor->Visit(it->first, it->second)) {
+            break;
+        }
+    }
+    unlock_mutex(&mutex_);
+    return count;
+}
+
+int PluginManager::module_count() const {
+    lock_mutex(&mutex_);
+    int count = (int)modules_.size();
+    unlock_mutex(&mutex_);
+    return count;
+}
+
+void PluginManager::EnableProfiler(bool enable) {
+    lock_mutex(&mutex_);
+    if (enable && !profiling_) {
+        profile_events_.clear();
+        profile_begin_ = clock_tick_us();
+    }
+    profiling_ = enable;
+    unlock_mutex(&mutex_);
+}
+
+void PluginManager::AddProfileEvent(ProfileEvent event, uint64_t begin, uint64_t end) {
+    event.thread_id = thread_id();
+    lock_mutex(&mutex_);
+    // events of a load started before the profiler was enabled
+    if (begin >= profile_begin_) {
+        event.begin = (unsigned long)(begin - profile_begin_);
+        event.duration = (unsigned long)(end > begin ? end - begin : 0);
+        profile_events_.push_back(event);
+    }
+    unlock_mutex(&mutex_);
+}
+
+void PluginManager::GetProfile(std::vector<ProfileEvent>* events) const {
+    lock_mutex(&mutex_);
+    *events = profile_events_;
+    unlock_mutex(&mutex_);
+}
+
+bool PluginManager::SaveProfile(const char* path) const {
+    FILE* fp = fopen(path, "w");
+    if (NULL == fp) {
+        APF_DEBUG("open profile file %s failed\n", path);
+        return false;
+    }
+    fprintf(fp, "# APF startup profile: <phase>\\t<module path>\\t<thread>\\t<begin us>\\t<duration us>"
+                "\\t<relocations>\\t<relative relocations>\\t<objects>\\t<classes>\n");
+    lock_mutex(&mutex_);
+    for (size_t i = 0; i < profile_events_.size(); i++) {
+        const ProfileEvent& event = profile_events_[i];
+        fprintf(fp, "%s\t%s\t%lu\t%lu\t%lu\t%ld\t%ld\t%d\t%d\n", event.name, event.path.c_str(),
+                event.thread_id, event.begin, event.duration,
+                event.relocations, event.relative_relocations, event.objects, event.classes);
+    }
+    unlock_mutex(&mutex_);
+    return 0 == fclose(fp);
+}
+
+bool PluginManager::SaveProfileTrace(const char* path) const {
+    FILE* fp = fopen(path, "w");
+    if (NULL == fp) {
+        APF_DEBUG("open profile file %s failed\n", path);
+        return false;
+    }
+    fprintf(fp, "{\"traceEvents\":[");
+    lock_mutex(&mutex_);
+    for (size_t i = 0; i < profile_events_.size(); i++) {
+        const ProfileEvent& event = profile_events_[i];
+        // complete events, nested by time on the same thread
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"apf\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,\"ts\":%lu,\"dur\":%lu,\"args\":{\"module\":\"",
+                i > 0 ? "," : "", event.name, (int)getpid(), event.thread_id, event.begin, event.duration);
+        for (size_t j = 0; j < event.path.size(); j++) {
+            unsigned char c = (unsigned char)event.path[j];
+            if ('"' == c || '\\' == c) {
+                fprintf(fp, "\\%c", c);
+            } else if (c < 0x20) {
+                fprintf(fp, "\\u%04x", c);
+            } else {
+                fputc(c, fp);
+            }
+        }
+        fprintf(fp, "\"");
+        if (0 == strcmp(event.name, "dlopen")) {
+            fprintf(fp, ",\"relocations\":%ld,\"relative_relocations\":%ld,\"objects\":%d",
+                    event.relocations, event.relative_relocations, event.objects);
+        } else if (0 == strcmp(event.name, "register")) {
+            fprintf(fp, ",\"classes\":%d", event.classes);
+        }
+        fprintf(fp, "}}");
+    }
+    unlock_mutex(&mutex_);
+    fprintf(fp, "\n]}\n");
+    return 0 == fclose(fp);
 }
 
 PluginManager* PluginManager::instance() {
-    if (NULL == instance_) {
-        instance_ = new PluginManager();
+    PluginManager* manager = (PluginManager*)instance_;
+    if (NULL != manager) {
+        return manager;
+    }
+    // first call may come from several threads, only one manager is installed
+    manager = new PluginManager();
+    if (!atomic_cas_ptr((void* volatile*)&instance_, NULL, manager)) {
+        delete manager;
+        manager = (PluginManager*)instance_;
     }
 
-    return instance_;
+    return manager;
 }
 
 